@@ -41,6 +41,7 @@
 #include "htslib/thread_pool.h"
 #include "htslib/hts_endian.h"
 #include "cram/pooled_alloc.h"
+#include "hts_internal.h"
 
 #define BGZF_CACHE
 #define BGZF_MT
@@ -86,8 +87,16 @@ typedef struct bgzf_job {
     int errcode;
     int64_t block_address;
     int hit_eof;
+    uint64_t block_number; // sequence number of a block being written
 } bgzf_job;
 
+// An index entry awaiting the compressed address of the block it ends in
+typedef struct {
+    int tid, beg, end, is_mapped;
+    uint64_t block_number;
+    int block_offset;
+} bgzf_idx_entry_t;
+
 enum mtaux_cmd {
     NONE = 0,
     SEEK,
@@ -118,11 +127,17 @@ typedef struct bgzf_mtaux_t {
 
     // Message passing to the reader thread; eg seek requests
     int errcode;
-    uint64_t block_address;
+    uint64_t block_address; // when writing, address of the next block
     int eof;
     pthread_mutex_t command_m; // Set whenever fp is being updated
     pthread_cond_t command_c;
     enum mtaux_cmd command;
+
+    // Index entries pushed while writing, resolved by the writer thread
+    uint64_t block_number;  // number of blocks queued so far
+    bgzf_idx_entry_t *idx_cache;
+    int idx_n, idx_m, idx_err;
+    pthread_mutex_t idx_m_lock;
 } mtaux_t;
 #endif
 
@@ -877,6 +892,38 @@ ssize_t bgzf_read(BGZF *fp, void *data, size_t length)
     return bytes_read;
 }
 
+ssize_t bgzf_skip(BGZF *fp, size_t length)
+{
+    ssize_t bytes_skipped = 0;
+    if (length <= 0) return 0;
+    assert(fp->is_write == 0);
+    while (bytes_skipped < length) {
+        int skip_length, available = fp->block_length - fp->block_offset;
+        if (available <= 0) {
+            int ret = bgzf_read_block(fp);
+            if (ret != 0) {
+                hts_log_error("Read block operation failed with error %d after %zd of %zu bytes", ret, bytes_skipped, length);
+                fp->errcode |= BGZF_ERR_ZLIB;
+                return -1;
+            }
+            available = fp->block_length - fp->block_offset;
+            if (available <= 0) break;
+        }
+        skip_length = length - bytes_skipped < available? length - bytes_skipped : available;
+        fp->block_offset += skip_length;
+        bytes_skipped += skip_length;
+
+        if (fp->block_offset == fp->block_length) {
+            fp->block_address = bgzf_htell(fp);
+            fp->block_offset = fp->block_length = 0;
+        }
+    }
+
+    fp->uncompressed_address += bytes_skipped;
+
+    return bytes_skipped;
+}
+
 ssize_t bgzf_raw_read(BGZF *fp, void *data, size_t length)
 {
     ssize_t ret = hread(fp->fp, data, length);
@@ -920,6 +967,35 @@ void *bgzf_decode_func(void *arg) {
  */
 void *bgzf_nul_func(void *arg) { return arg; }
 
+/*
+ * Pushes the cached index entries that end in blocks up to and including
+ * block_number, the compressed data of which starts at block_address.
+ * Called by the writer thread as each block is written, and by the main
+ * thread once the queue has been flushed.
+ */
+static void mt_idx_resolve(BGZF *fp, uint64_t block_number,
+                           uint64_t block_address) {
+    mtaux_t *mt = fp->mt;
+    int i;
+
+    pthread_mutex_lock(&mt->idx_m_lock);
+    for (i = 0; i < mt->idx_n; i++) {
+        bgzf_idx_entry_t *e = &mt->idx_cache[i];
+        if (e->block_number > block_number) break;
+        if (!mt->idx_err
+            && hts_idx_push(fp->hidx, e->tid, e->beg, e->end,
+                            block_address << 16 | e->block_offset,
+                            e->is_mapped) < 0)
+            mt->idx_err = 1;
+    }
+    if (i > 0) {
+        memmove(mt->idx_cache, mt->idx_cache + i,
+                (mt->idx_n - i) * sizeof(*mt->idx_cache));
+        mt->idx_n -= i;
+    }
+    pthread_mutex_unlock(&mt->idx_m_lock);
+}
+
 /*
  * Takes compressed blocks off the results queue and calls hwrite to
  * punt them to the output stream.
@@ -940,6 +1016,8 @@ static void *bgzf_mt_writer(void *vp) {
             fp->errcode |= BGZF_ERR_IO;
             goto err;
         }
+        mt_idx_resolve(fp, j->block_number, mt->block_address);
+        mt->block_address += j->comp_len;
 
         /*
          * Periodically call hflush (which calls fsync when on a file).
@@ -1220,8 +1298,10 @@ int bgzf_thread_pool(BGZF *fp, hts_tpool *pool, int qsize) {
 
     pthread_mutex_init(&mt->job_pool_m, NULL);
     pthread_mutex_init(&mt->command_m, NULL);
+    pthread_mutex_init(&mt->idx_m_lock, NULL);
     pthread_cond_init(&mt->command_c, NULL);
     mt->flush_pending = 0;
+    if (fp->is_write) mt->block_address = fp->block_address;
     mt->jobs_pending = 0;
     mt->free_block = fp->uncompressed_block; // currently in-use block
     pthread_create(&mt->io_task, NULL,
@@ -1265,7 +1345,9 @@ static void mt_destroy(mtaux_t *mt)
 
     pthread_mutex_destroy(&mt->job_pool_m);
     pthread_mutex_destroy(&mt->command_m);
+    pthread_mutex_destroy(&mt->idx_m_lock);
     pthread_cond_destroy(&mt->command_c);
+    free(mt->idx_cache);
     if (mt->curr_job)
         pool_free(mt->job_pool, mt->curr_job);
 
@@ -1290,6 +1372,20 @@ static int mt_queue(BGZF *fp)
 
     j->fp = fp;
     j->errcode = 0;
+
+    // A record ending exactly at the end of this block is recorded as
+    // starting the next one, as bgzf_tell() would report when reading
+    pthread_mutex_lock(&mt->idx_m_lock);
+    if (mt->idx_n > 0) {
+        bgzf_idx_entry_t *e = &mt->idx_cache[mt->idx_n - 1];
+        if (e->block_number == mt->block_number
+            && e->block_offset == fp->block_offset) {
+            e->block_number++;
+            e->block_offset = 0;
+        }
+    }
+    pthread_mutex_unlock(&mt->idx_m_lock);
+    j->block_number = mt->block_number++;
     j->uncomp_len  = fp->block_offset;
     memcpy(j->uncomp_data, fp->uncompressed_block, j->uncomp_len);
 
@@ -1348,14 +1444,25 @@ static inline int lazy_flush(BGZF *fp)
 
 int bgzf_flush(BGZF *fp)
 {
+    uint64_t end_off;
+
     if (!fp->is_write) return 0;
 #ifdef BGZF_MT
     if (fp->mt) {
         int ret = 0;
         if (fp->block_offset) ret = mt_queue(fp);
-        return ret ? ret : mt_flush_queue(fp);
+        if (ret == 0) ret = mt_flush_queue(fp);
+        if (ret == 0) {
+            // The writer is now idle, so its address can be used for
+            // bgzf_tell() and any entries ending at this point resolved
+            fp->block_address = fp->mt->block_address;
+            mt_idx_resolve(fp, fp->mt->block_number, fp->block_address);
+            if (fp->mt->idx_err) ret = -1;
+        }
+        return ret;
     }
 #endif
+    end_off = bgzf_tell(fp);
     while (fp->block_offset > 0) {
         int block_length;
         if ( fp->idx_build_otf )
@@ -1375,6 +1482,10 @@ int bgzf_flush(BGZF *fp)
         }
         fp->block_address += block_length;
     }
+    // A record ending at the end of the flushed data is recorded as
+    // starting the next block, as bgzf_tell() would report when reading
+    if (fp->hidx && end_off != bgzf_tell(fp))
+        hts_idx_amend_last(fp->hidx, end_off, bgzf_tell(fp));
     return 0;
 }
 
@@ -1384,6 +1495,52 @@ int bgzf_flush_try(BGZF *fp, ssize_t size)
     return 0;
 }
 
+int bgzf_idx_push(BGZF *fp, hts_idx_t *hidx, int tid, int beg, int end, int is_mapped)
+{
+#ifdef BGZF_MT
+    if (fp->mt) {
+        mtaux_t *mt = fp->mt;
+        bgzf_idx_entry_t *e;
+        int ret = 0;
+
+        pthread_mutex_lock(&mt->idx_m_lock);
+        if (mt->idx_err) {
+            ret = -1;
+        } else if (fp->hidx && fp->hidx != hidx) {
+            hts_log_error("Only one index can be built for a file");
+            ret = -1;
+        } else if (mt->idx_n == mt->idx_m) {
+            int new_m = mt->idx_m ? mt->idx_m * 2 : 1024;
+            e = realloc(mt->idx_cache, new_m * sizeof(*e));
+            if (e) {
+                mt->idx_cache = e;
+                mt->idx_m = new_m;
+            } else {
+                ret = -1;
+            }
+        }
+        if (ret == 0) {
+            fp->hidx = hidx;
+            e = &mt->idx_cache[mt->idx_n++];
+            e->tid = tid;
+            e->beg = beg;
+            e->end = end;
+            e->is_mapped = is_mapped;
+            e->block_number = mt->block_number;
+            e->block_offset = fp->block_offset;
+        }
+        pthread_mutex_unlock(&mt->idx_m_lock);
+        return ret;
+    }
+#endif
+    if (fp->hidx && fp->hidx != hidx) {
+        hts_log_error("Only one index can be built for a file");
+        return -1;
+    }
+    fp->hidx = hidx;
+    return hts_idx_push(hidx, tid, beg, end, bgzf_tell(fp), is_mapped);
+}
+
 ssize_t bgzf_write(BGZF *fp, const void *data, size_t length)
 {
     if ( !fp->is_compressed )
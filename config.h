@@ -0,0 +1,5 @@
+/* Default config.h generated by Makefile */
+#define HAVE_LIBBZ2 1
+#define HAVE_LIBLZMA 1
+#define HAVE_FSEEKO 1
+#define HAVE_DRAND48 1
@@ -307,14 +307,15 @@ static char *cram_extract_block(cram_block *b, int size) {
     return cp;
 }
 
+/*
+ * Decoders hold no per-slice state, so have nothing to reset.
+ */
+void cram_nop_decode_reset(cram_codec *c) {}
+
 /*
  * ---------------------------------------------------------------------------
  * EXTERNAL
  */
-static void cram_external_decode_reset(cram_codec *c) {
-    c->external.b = NULL;
-}
-
 int cram_external_decode_int(cram_slice *slice, cram_codec *c,
 			     cram_block *in, char *out, int *out_size) {
     int l;
@@ -322,10 +323,7 @@ int cram_external_decode_int(cram_slice *slice, cram_codec *c,
     cram_block *b;
 
     /* Find the external block */
-    if (!(b = c->external.b)){
-	b = cram_get_block_by_id(slice, c->external.content_id);
-	c->external.b = b;
-    }
+    b = cram_get_block_by_id(slice, c->external.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -345,10 +343,7 @@ int cram_external_decode_char(cram_slice *slice, cram_codec *c,
     cram_block *b;
 
     /* Find the external block */
-    if (!(b = c->external.b)){
-	b = cram_get_block_by_id(slice, c->external.content_id);
-	c->external.b = b;
-    }
+    b = cram_get_block_by_id(slice, c->external.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -369,10 +364,7 @@ static int cram_external_decode_block(cram_slice *slice, cram_codec *c,
     cram_block *b = NULL;
 
     /* Find the external block */
-    if (!(b = c->external.b)){
-	b = cram_get_block_by_id(slice, c->external.content_id);
-	c->external.b = b;
-    }
+    b = cram_get_block_by_id(slice, c->external.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -416,8 +408,7 @@ cram_codec *cram_external_decode_init(char *data, int size,
         goto malformed;
 
     c->external.type = option;
-    c->external.b = NULL;
-    c->reset = cram_external_decode_reset;
+    c->reset = cram_nop_decode_reset;
 
     return c;
 
@@ -495,8 +486,6 @@ cram_codec *cram_external_encode_init(cram_stats *st,
  * ---------------------------------------------------------------------------
  * BETA
  */
-void cram_nop_decode_reset(cram_codec *c) {}
-
 int cram_beta_decode_int(cram_slice *slice, cram_codec *c, cram_block *in, char *out, int *out_size) {
     int32_t *out_i = (int32_t *)out;
     int i, n = *out_size;
@@ -1606,20 +1595,13 @@ cram_codec *cram_byte_array_len_encode_init(cram_stats *st,
  * ---------------------------------------------------------------------------
  * BYTE_ARRAY_STOP
  */
-static void cram_byte_array_stop_decode_reset(cram_codec *c) {
-    c->byte_array_stop.b = NULL;
-}
-
 static int cram_byte_array_stop_decode_char(cram_slice *slice, cram_codec *c,
 					    cram_block *in, char *out,
 					    int *out_size) {
     char *cp, ch;
     cram_block *b = NULL;
 
-    if (!(b = c->byte_array_stop.b)){
-	b = cram_get_block_by_id(slice, c->byte_array_stop.content_id);
-	c->byte_array_stop.b = b;
-    }
+    b = cram_get_block_by_id(slice, c->byte_array_stop.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -1657,10 +1639,7 @@ int cram_byte_array_stop_decode_block(cram_slice *slice, cram_codec *c,
     char *cp, *out_cp, *cp_end;
     char stop;
 
-    if (!(b = c->byte_array_stop.b)){
-	b = cram_get_block_by_id(slice, c->byte_array_stop.content_id);
-	c->byte_array_stop.b = b;
-    }
+    b = cram_get_block_by_id(slice, c->byte_array_stop.content_id);
     if (!b)
         return *out_size?-1:0;
 
@@ -1735,8 +1714,7 @@ cram_codec *cram_byte_array_stop_decode_init(char *data, int size,
     if ((char *)cp - data != size)
         goto malformed;
 
-    c->byte_array_stop.b = NULL;
-    c->reset = cram_byte_array_stop_decode_reset;
+    c->reset = cram_nop_decode_reset;
 
     return c;
 
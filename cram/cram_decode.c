@@ -665,6 +665,114 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
 }
 
 /*
+ * Adds id to an unsorted set of external block content ids.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_ds_add_id(int **ids, int *nids, int *alloc, int id) {
+    int i;
+
+    for (i = 0; i < *nids; i++)
+	if ((*ids)[i] == id)
+	    return 0;
+
+    if (*nids == *alloc) {
+	int new_alloc = *alloc ? *alloc*2 : 16;
+	int *n = realloc(*ids, new_alloc * sizeof(int));
+	if (!n)
+	    return -1;
+	*ids = n;
+	*alloc = new_alloc;
+    }
+    (*ids)[(*nids)++] = id;
+
+    return 0;
+}
+
+/*
+ * Records the blocks used by codec c in the id set, and notes use of the
+ * CORE block in *core_used.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_ds_mark_codec(cram_codec *c, int **ids, int *nids, int *alloc,
+			      int *core_used) {
+    int bnum1, bnum2;
+
+    bnum1 = cram_codec_to_id(c, &bnum2);
+
+    for (;;) {
+	switch (bnum1) {
+	case -2:
+	    break;
+
+	case -1:
+	    *core_used = 1;
+	    break;
+
+	default:
+	    if (cram_ds_add_id(ids, nids, alloc, bnum1) < 0)
+		return -1;
+	    break;
+	}
+
+	if (bnum2 == -2 || bnum1 == bnum2)
+	    break;
+
+	bnum1 = bnum2; // 2nd pass
+    }
+
+    return 0;
+}
+
+/*
+ * Returns whether codec c reads from any block in the id set, or from
+ * CORE when core_used is set.
+ */
+static int cram_ds_codec_used(cram_codec *c, int *ids, int nids,
+			      int core_used) {
+    int bnum1, bnum2, i;
+
+    bnum1 = cram_codec_to_id(c, &bnum2);
+
+    for (;;) {
+	switch (bnum1) {
+	case -2:
+	    break;
+
+	case -1:
+	    if (core_used)
+		return 1;
+	    break;
+
+	default:
+	    for (i = 0; i < nids; i++)
+		if (ids[i] == bnum1)
+		    return 1;
+	    break;
+	}
+
+	if (bnum2 == -2 || bnum1 == bnum2)
+	    break;
+
+	bnum1 = bnum2; // 2nd pass
+    }
+
+    return 0;
+}
+
+static int int_cmp(const void *a, const void *b) {
+    int ia = *(const int *)a, ib = *(const int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+ * Works out which data series, and so which external blocks, need to be
+ * decoded to satisfy fd->required_fields.  The result is stored in hdr
+ * (data_series, ds_ids and nds_ids) as it depends only on the container
+ * compression header, letting the slice reader skip unwanted blocks
+ * without reading or uncompressing them.
+ *
  * Note we also need to scan through the record encoding map to
  * see which data series share the same block, either external or
  * CORE. For example if we need the BF data series but MQ and CF
@@ -675,9 +783,8 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
  *        -1 on failure
  */
 int cram_dependent_data_series(cram_fd *fd,
-			       cram_block_compression_hdr *hdr,
-			       cram_slice *s) {
-    int *block_used;
+			       cram_block_compression_hdr *hdr) {
+    int *ids = NULL, nids = 0, ids_alloc = 0;
     int core_used = 0;
     int i;
     static int i_to_id[] = {
@@ -686,77 +793,65 @@ int cram_dependent_data_series(cram_fd *fd,
 	DS_NS, DS_NP, DS_TS, DS_MF, DS_CF, DS_RI, DS_RS, DS_PD,
 	DS_HC, DS_SC, DS_BB, DS_QQ,
     };
-    uint32_t orig_ds;
+    uint32_t orig_ds, ds;
 
     /*
      * Set the data_series bit field based on fd->required_fields
      * contents.
      */
     if (fd->required_fields && fd->required_fields != INT_MAX) {
-	hdr->data_series = 0;
+	ds = 0;
 
 	if (fd->required_fields & SAM_QNAME)
-	    hdr->data_series |= CRAM_RN;
+	    ds |= CRAM_RN;
 
 	if (fd->required_fields & SAM_FLAG)
-	    hdr->data_series |= CRAM_BF;
+	    ds |= CRAM_BF;
 
 	if (fd->required_fields & SAM_RNAME)
-	    hdr->data_series |= CRAM_RI | CRAM_BF;
+	    ds |= CRAM_RI | CRAM_BF;
 
 	if (fd->required_fields & SAM_POS)
-	    hdr->data_series |= CRAM_AP | CRAM_BF;
+	    ds |= CRAM_AP | CRAM_BF;
 
 	if (fd->required_fields & SAM_MAPQ)
-	    hdr->data_series |= CRAM_MQ;
+	    ds |= CRAM_MQ;
 
 	if (fd->required_fields & SAM_CIGAR)
-	    hdr->data_series |= CRAM_CIGAR;
+	    ds |= CRAM_CIGAR;
 
 	if (fd->required_fields & SAM_RNEXT)
-	    hdr->data_series |= CRAM_CF | CRAM_NF | CRAM_RI | CRAM_NS |CRAM_BF;
+	    ds |= CRAM_CF | CRAM_NF | CRAM_RI | CRAM_NS |CRAM_BF;
 
 	if (fd->required_fields & SAM_PNEXT)
-	    hdr->data_series |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_NP | CRAM_BF;
+	    ds |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_NP | CRAM_BF;
 
 	if (fd->required_fields & SAM_TLEN)
-	    hdr->data_series |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_TS |
+	    ds |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_TS |
 		CRAM_BF | CRAM_MF | CRAM_RI | CRAM_CIGAR;
 
 	if (fd->required_fields & SAM_SEQ)
-	    hdr->data_series |= CRAM_SEQ;
+	    ds |= CRAM_SEQ;
 
 	if (!(fd->required_fields & SAM_AUX))
 	    // No easy way to get MD/NM without other tags at present
 	    fd->decode_md = 0;
 
 	if (fd->required_fields & SAM_QUAL)
-	    hdr->data_series |= CRAM_QUAL;
+	    ds |= CRAM_QUAL;
 
 	if (fd->required_fields & SAM_AUX)
-	    hdr->data_series |= CRAM_RG | CRAM_TL | CRAM_aux;
+	    ds |= CRAM_RG | CRAM_TL | CRAM_aux;
 
 	if (fd->required_fields & SAM_RGAUX)
-	    hdr->data_series |= CRAM_RG | CRAM_BF;
-
-	// Always uncompress CORE block
-	if (cram_uncompress_block(s->block[0]))
-	    return -1;
+	    ds |= CRAM_RG | CRAM_BF;
     } else {
 	hdr->data_series = CRAM_ALL;
-
-	for (i = 0; i < s->hdr->num_blocks; i++) {
-	    if (cram_uncompress_block(s->block[i]))
-		return -1;
-	}
-
+	hdr->nds_ids = -1;
+	hdr->ds_ready = 1;
 	return 0;
     }
 
-    block_used = calloc(s->hdr->num_blocks+1, sizeof(int));
-    if (!block_used)
-	return -1;
-
     do {
 	/*
 	 * Also set data_series based on code prerequisites. Eg if we need
@@ -766,125 +861,56 @@ int cram_dependent_data_series(cram_fd *fd,
 	 * It's not reciprocal though. We may be needing to decode FN
 	 * but have no need to decode FC, FP and cigar ops.
 	 */
-	if (hdr->data_series & CRAM_RS)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_PD)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_HC)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_QS)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_IN)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_SC)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_BS)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_DL)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_BA)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_BB)    hdr->data_series |= CRAM_FC|CRAM_FP;
-	if (hdr->data_series & CRAM_QQ)    hdr->data_series |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_RS)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_PD)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_HC)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_QS)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_IN)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_SC)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_BS)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_DL)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_BA)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_BB)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_QQ)    ds |= CRAM_FC|CRAM_FP;
 
 	// cram_decode_seq() needs seq[] array
-	if (hdr->data_series & (CRAM_SEQ|CRAM_CIGAR)) hdr->data_series |= CRAM_RL;
-
-	if (hdr->data_series & CRAM_FP)    hdr->data_series |= CRAM_FC;
-	if (hdr->data_series & CRAM_FC)    hdr->data_series |= CRAM_FN;
-	if (hdr->data_series & CRAM_aux)   hdr->data_series |= CRAM_TL;
-	if (hdr->data_series & CRAM_MF)    hdr->data_series |= CRAM_CF;
-	if (hdr->data_series & CRAM_MQ)    hdr->data_series |= CRAM_BF;
-	if (hdr->data_series & CRAM_BS)    hdr->data_series |= CRAM_RI;
-	if (hdr->data_series & (CRAM_MF |CRAM_NS |CRAM_NP |CRAM_TS |CRAM_NF))
-	    hdr->data_series |= CRAM_CF;
-	if (!hdr->read_names_included && hdr->data_series & CRAM_RN)
-	    hdr->data_series |= CRAM_CF | CRAM_NF;
-	if (hdr->data_series & (CRAM_BA | CRAM_QS | CRAM_BB | CRAM_QQ))
-	    hdr->data_series |= CRAM_BF | CRAM_CF | CRAM_RL;
-
-	orig_ds = hdr->data_series;
+	if (ds & (CRAM_SEQ|CRAM_CIGAR)) ds |= CRAM_RL;
+
+	if (ds & CRAM_FP)    ds |= CRAM_FC;
+	if (ds & CRAM_FC)    ds |= CRAM_FN;
+	if (ds & CRAM_aux)   ds |= CRAM_TL;
+	if (ds & CRAM_MF)    ds |= CRAM_CF;
+	if (ds & CRAM_MQ)    ds |= CRAM_BF;
+	if (ds & CRAM_BS)    ds |= CRAM_RI;
+	if (ds & (CRAM_MF |CRAM_NS |CRAM_NP |CRAM_TS |CRAM_NF))
+	    ds |= CRAM_CF;
+	if (!hdr->read_names_included && ds & CRAM_RN)
+	    ds |= CRAM_CF | CRAM_NF;
+	if (ds & (CRAM_BA | CRAM_QS | CRAM_BB | CRAM_QQ))
+	    ds |= CRAM_BF | CRAM_CF | CRAM_RL;
+
+	orig_ds = ds;
 
 	// Find which blocks are in use.
 	for (i = 0; i < sizeof(i_to_id)/sizeof(*i_to_id); i++) {
-	    int bnum1, bnum2, j;
 	    cram_codec *c = hdr->codecs[i_to_id[i]];
 
-	    if (!(hdr->data_series & (1<<i)))
-		continue;
-
-	    if (!c)
+	    if (!(ds & (1<<i)) || !c)
 		continue;
 
-	    bnum1 = cram_codec_to_id(c, &bnum2);
-
-	    for (;;) {
-		switch (bnum1) {
-		case -2:
-		    break;
-
-		case -1:
-		    core_used = 1;
-		    break;
-
-		default:
-		    for (j = 0; j < s->hdr->num_blocks; j++) {
-			if (s->block[j]->content_type == EXTERNAL &&
-			    s->block[j]->content_id == bnum1) {
-			    block_used[j] = 1;
-			    if (cram_uncompress_block(s->block[j])) {
-				free(block_used);
-				return -1;
-			    }
-			}
-		    }
-		    break;
-		}
-
-		if (bnum2 == -2 || bnum1 == bnum2)
-		    break;
-
-		bnum1 = bnum2; // 2nd pass
-	    }
+	    if (cram_ds_mark_codec(c, &ids, &nids, &ids_alloc, &core_used) < 0)
+		goto err;
 	}
 
 	// Tags too
-	if ((fd->required_fields & SAM_AUX) ||
-	    (hdr->data_series & CRAM_aux)) {
+	if ((fd->required_fields & SAM_AUX) || (ds & CRAM_aux)) {
 	    for (i = 0; i < CRAM_MAP_HASH; i++) {
-		int bnum1, bnum2, j;
-		cram_map *m = hdr->tag_encoding_map[i];
-
-		while (m) {
-		    cram_codec *c = m->codec;
-		    if (!c) {
-			m = m->next;
-			continue;
-		    }
-
-		    bnum1 = cram_codec_to_id(c, &bnum2);
-
-		    for (;;) {
-			switch (bnum1) {
-			case -2:
-			    break;
-
-			case -1:
-			    core_used = 1;
-			    break;
-
-			default:
-			    for (j = 0; j < s->hdr->num_blocks; j++) {
-				if (s->block[j]->content_type == EXTERNAL &&
-				    s->block[j]->content_id == bnum1) {
-				    block_used[j] = 1;
-				    if (cram_uncompress_block(s->block[j])) {
-					free(block_used);
-					return -1;
-				    }
-				}
-			    }
-			    break;
-			}
-
-			if (bnum2 == -2 || bnum1 == bnum2)
-			    break;
-
-			bnum1 = bnum2; // 2nd pass
-		    }
-
-		    m = m->next;
+		cram_map *m;
+		for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+		    if (m->codec &&
+			cram_ds_mark_codec(m->codec, &ids, &nids, &ids_alloc,
+					   &core_used) < 0)
+			goto err;
 		}
 	    }
 	}
@@ -892,97 +918,90 @@ int cram_dependent_data_series(cram_fd *fd,
 	// We now know which blocks are in used, so repeat and find
 	// which other data series need to be added.
 	for (i = 0; i < sizeof(i_to_id)/sizeof(*i_to_id); i++) {
-	    int bnum1, bnum2, j;
 	    cram_codec *c = hdr->codecs[i_to_id[i]];
 
-	    if (!c)
-		continue;
-
-	    bnum1 = cram_codec_to_id(c, &bnum2);
-
-	    for (;;) {
-		switch (bnum1) {
-		case -2:
-		    break;
-
-		case -1:
-		    if (core_used) {
-			//printf(" + data series %08x:\n", 1<<i);
-			hdr->data_series |= 1<<i;
-		    }
-		    break;
-
-		default:
-		    for (j = 0; j < s->hdr->num_blocks; j++) {
-			if (s->block[j]->content_type == EXTERNAL &&
-			    s->block[j]->content_id == bnum1) {
-			    if (block_used[j]) {
-				//printf(" + data series %08x:\n", 1<<i);
-				hdr->data_series |= 1<<i;
-			    }
-			}
-		    }
-		    break;
-		}
-
-		if (bnum2 == -2 || bnum1 == bnum2)
-		    break;
+	    if (c && cram_ds_codec_used(c, ids, nids, core_used))
+		ds |= 1<<i;
+	}
 
-		bnum1 = bnum2; // 2nd pass
+	// Tags too.  Unlike data series, aux tags on CORE always count.
+	for (i = 0; i < CRAM_MAP_HASH; i++) {
+	    cram_map *m;
+	    for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+		if (m->codec && cram_ds_codec_used(m->codec, ids, nids, 1))
+		    ds |= CRAM_aux;
 	    }
 	}
+    } while (orig_ds != ds);
 
-	// Tags too
-	for (i = 0; i < CRAM_MAP_HASH; i++) {
-	    int bnum1, bnum2, j;
-	    cram_map *m = hdr->tag_encoding_map[i];
+    if (nids)
+	qsort(ids, nids, sizeof(*ids), int_cmp);
 
-	    while (m) {
-		cram_codec *c = m->codec;
-		if (!c) {
-		    m = m->next;
-		    continue;
-		}
+    free(hdr->ds_ids);
+    hdr->ds_ids = ids;
+    hdr->nds_ids = nids;
+    hdr->data_series = ds;
+    hdr->ds_ready = 1;
 
-		bnum1 = cram_codec_to_id(c, &bnum2);
-		
-		for (;;) {
-		    switch (bnum1) {
-		    case -2:
-			break;
+    return 0;
 
-		    case -1:
-			//printf(" + data series %08x:\n", CRAM_aux);
-			hdr->data_series |= CRAM_aux;
-			break;
+ err:
+    free(ids);
+    return -1;
+}
 
-		    default:
-			for (j = 0; j < s->hdr->num_blocks; j++) {
-			    if (s->block[j]->content_type == EXTERNAL &&
-				s->block[j]->content_id == bnum1) {
-				if (block_used[j]) {
-				    //printf(" + data series %08x:\n",
-				    //       CRAM_aux);
-				    hdr->data_series |= CRAM_aux;
-				}
-			    }
-			}
-			break;
-		    }
+/*
+ * Returns whether the external block with content id "id" is needed to
+ * decode the data series selected by cram_dependent_data_series.
+ */
+int cram_ds_block_needed(cram_block_compression_hdr *hdr, int id) {
+    int lo = 0, hi = hdr->nds_ids;
+
+    if (hdr->nds_ids < 0)
+	return 1;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (hdr->ds_ids[mid] == id)
+	    return 1;
+	if (hdr->ds_ids[mid] < id)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
 
-		    if (bnum2 == -2 || bnum1 == bnum2)
-			break;
+    return 0;
+}
 
-		    bnum1 = bnum2; // 2nd pass
-		}
+/*
+ * Uncompresses the blocks of slice s needed for the data series chosen by
+ * cram_dependent_data_series, all at once so they can be done in
+ * parallel.  The CORE block is always needed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_uncompress_slice_blocks(cram_fd *fd,
+					cram_block_compression_hdr *hdr,
+					cram_slice *s) {
+    cram_block **b;
+    int i, nb = 0, r;
 
-		m = m->next;
-	    }
-	}
-    } while (orig_ds != hdr->data_series);
+    s->data_series = hdr->data_series;
 
-    free(block_used);
-    return 0;
+    if (!(b = malloc(s->hdr->num_blocks * sizeof(*b))))
+	return -1;
+
+    for (i = 0; i < s->hdr->num_blocks; i++) {
+	cram_block *blk = s->block[i];
+	if (i == 0 || blk->content_type != EXTERNAL ||
+	    cram_ds_block_needed(hdr, blk->content_id))
+	    b[nb++] = blk;
+    }
+    r = cram_uncompress_blocks(fd, b, nb);
+
+    free(b);
+    return r;
 }
 
 /*
@@ -1021,6 +1040,20 @@ static int cram_ds_unique(cram_block_compression_hdr *hdr, cram_codec *c,
     return n_id == 1 ? e_type : 0;
 }
 
+/*
+ * As cram_get_block_by_id, but also returns blocks that were skipped
+ * when reading the slice.  Only their sizes are meaningful.
+ */
+static cram_block *cram_slice_block_by_id(cram_slice *s, int id) {
+    int i;
+    for (i = 0; i < s->hdr->num_blocks; i++) {
+	cram_block *b = s->block[i];
+	if (b->content_type == EXTERNAL && b->content_id == id)
+	    return b;
+    }
+    return NULL;
+}
+
 /*
  * Attempts to estimate the size of some blocks so we can preallocate them
  * before decoding.  Although decoding will automatically grow the blocks,
@@ -1041,7 +1074,7 @@ void cram_decode_estimate_sizes(cram_block_compression_hdr *hdr, cram_slice *s,
     bnum1 = cram_codec_to_id(cd, &bnum2);
     if (bnum1 < 0 && bnum2 >= 0) bnum1 = bnum2;
     if (cram_ds_unique(hdr, cd, bnum1)) {
-	cram_block *b = cram_get_block_by_id(s, bnum1);
+	cram_block *b = cram_slice_block_by_id(s, bnum1);
 	if (b) *qual_size = b->uncomp_size;
 	if (q_id && cd->codec == E_EXTERNAL)
 	    *q_id = bnum1;
@@ -1053,7 +1086,7 @@ void cram_decode_estimate_sizes(cram_block_compression_hdr *hdr, cram_slice *s,
     bnum1 = cram_codec_to_id(cd, &bnum2);
     if (bnum1 < 0 && bnum2 >= 0) bnum1 = bnum2;
     if (cram_ds_unique(hdr, cd, bnum1)) {
-	cram_block *b = cram_get_block_by_id(s, bnum1);
+	cram_block *b = cram_slice_block_by_id(s, bnum1);
 	if (b) *name_size = b->uncomp_size;
     }
 }
@@ -1213,7 +1246,7 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
     int orig_aux = 0;
     int decode_md = fd->decode_md && s->ref && !has_MD && cr->ref_id >= 0;
     int decode_nm = fd->decode_md && s->ref && !has_NM && cr->ref_id >= 0;
-    uint32_t ds = c->comp_hdr->data_series;
+    uint32_t ds = s->data_series;
 
     if ((ds & CRAM_QS) && !(cf & CRAM_FLAG_PRESERVE_QUAL_SCORES)) {
 	memset(qual, 255, cr->len);
@@ -1960,7 +1993,7 @@ static int cram_decode_aux(cram_container *c, cram_slice *s,
     int i, r = 0, out_sz = 1;
     int32_t TL = 0;
     unsigned char *TN;
-    uint32_t ds = c->comp_hdr->data_series;
+    uint32_t ds = s->data_series;
 	    
     if (!(ds & (CRAM_TL|CRAM_aux))) {
 	cr->aux = 0;
@@ -2174,27 +2207,6 @@ static char *md5_print(unsigned char *md5, char *out) {
     return out;
 }
 
-static void reset_all_codecs(cram_block_compression_hdr *hdr) {
-    int i;
-
-    for (i = 0; i < DS_END; i++) {
-	if (hdr->codecs[i] && hdr->codecs[i]->reset)
-	    hdr->codecs[i]->reset(hdr->codecs[i]);
-    }
-
-    for (i = 0; i < CRAM_MAP_HASH; i++) {
-	cram_map *m;
-	for (m = hdr->rec_encoding_map[i]; m; m = m->next)
-	    if (m->codec) m->codec->reset(m->codec);
-    }
-
-    for (i = 0; i < CRAM_MAP_HASH; i++) {
-	cram_map *m;
-	for (m = hdr->tag_encoding_map[i]; m; m = m->next)
-	    if (m->codec) m->codec->reset(m->codec);
-    }
-}
-
 /*
  * Decode an entire slice from container blocks. Fills out s->crecs[] array.
  * Returns 0 on success
@@ -2213,13 +2225,14 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     char **refs = NULL;
     uint32_t ds;
 
-    /* Clear any cached blocks in the external / B.A.S. codecs */
-    reset_all_codecs(c->comp_hdr);
+    if (!c->comp_hdr->ds_ready &&
+	cram_dependent_data_series(fd, c->comp_hdr) != 0)
+	return -1;
 
-    if (cram_dependent_data_series(fd, c->comp_hdr, s) != 0)
+    if (cram_uncompress_slice_blocks(fd, c->comp_hdr, s) != 0)
 	return -1;
 
-    ds = c->comp_hdr->data_series;
+    ds = s->data_series;
 
     blk->bit = 7; // MSB first
 
@@ -2285,11 +2298,16 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    //s->ref = cram_get_ref(fd, s->hdr->ref_seq_id, 1, 0);
 	    //s->ref_start = 1;
 
-	    if (fd->required_fields & SAM_SEQ)
-		s->ref =
-		cram_get_ref(fd, s->hdr->ref_seq_id,
-			     s->hdr->ref_seq_start,
-			     s->hdr->ref_seq_start + s->hdr->ref_seq_span -1);
+	    if (fd->required_fields & SAM_SEQ) {
+		int start = s->hdr->ref_seq_start;
+		int end = s->hdr->ref_seq_start + s->hdr->ref_seq_span -1;
+
+		if ((s->ref_free = cram_get_ref_portion(fd, s->hdr->ref_seq_id,
+							start, end)))
+		    s->ref = s->ref_free;
+		else
+		    s->ref = cram_get_ref(fd, s->hdr->ref_seq_id, start, end);
+	    }
 	    s->ref_start = s->hdr->ref_seq_start;
 	    s->ref_end   = s->hdr->ref_seq_start + s->hdr->ref_seq_span-1;
 
@@ -2719,7 +2737,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		cram_ref_decr(fd->refs, i);
 	}
 	free(refs);
-    } else if (ref_id >= 0 && s->ref != fd->ref_free && !embed_ref) {
+    } else if (ref_id >= 0 && s->ref != fd->ref_free && !s->ref_free &&
+	       !embed_ref) {
 	cram_ref_decr(fd->refs, ref_id);
     }
     pthread_mutex_unlock(&fd->ref_lock);
@@ -2917,72 +2936,91 @@ static int cram_to_bam(SAM_hdr *bfd, cram_fd *fd, cram_slice *s,
 }
 
 /*
- * Here be dragons! The multi-threading code in this is crufty beyond belief.
+ * Releases a slice once the reader has finished with it, along with its
+ * container if no other slices of that container are still in flight and
+ * it is no longer being read ahead from.
  */
-static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
-    cram_container *c;
-    cram_slice *s = NULL;
+static void cram_release_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
+    if (c->slice == s)
+	c->slice = NULL;
+    cram_free_slice(s);
 
-    if (!(c = fd->ctr)) {
-	// Load first container.
-	do {
-	    if (!(c = fd->ctr = cram_read_container(fd)))
-		return NULL;
-	} while (c->length == 0);
+    if (--c->slices_in_use == 0 && c != fd->ctr_mt) {
+	if (fd->ctr == c)
+	    fd->ctr = NULL;
+	cram_free_container(c);
+    }
+}
 
-	/*
-	 * The first container may be a result of a sub-range query.
-	 * In which case it may still not be the optimal starting point
-	 * due to skipped containers/slices in the index. 
-	 */
-	if (fd->range.refid != -2) {
-	    while (c->ref_seq_id != -2 &&
-		   (c->ref_seq_id < fd->range.refid ||
-		    c->ref_seq_start + c->ref_seq_span-1 < fd->range.start)) {
-		if (0 != cram_seek(fd, c->length, SEEK_CUR))
-		    return NULL;
-		cram_free_container(fd->ctr);
-		do {
-		    if (!(c = fd->ctr = cram_read_container(fd)))
-			return NULL;
-		} while (c->length == 0);
-	    }
+/*
+ * Moves the decoder read-ahead on to container c (which may be NULL),
+ * freeing the previous one unless it still has slices in flight.
+ */
+static void cram_set_ctr_mt(cram_fd *fd, cram_container *c) {
+    cram_container *old = fd->ctr_mt;
 
-	    if (c->ref_seq_id != -2 && c->ref_seq_id != fd->range.refid)
-		return NULL;
-	}
+    fd->ctr_mt = c;
+    if (old && old != c && old->slices_in_use == 0) {
+	if (fd->ctr == old)
+	    fd->ctr = NULL;
+	cram_free_container(old);
+    }
+}
 
-	if (!(c->comp_hdr_block = cram_read_block(fd)))
-	    return NULL;
-	if (c->comp_hdr_block->content_type != COMPRESSION_HEADER)
-	    return NULL;
+/*
+ * Discards all slices read ahead of the current one, whether queued for
+ * decoding or already decoded, along with the current slice and any
+ * containers no longer needed.  Used when seeking and closing.
+ */
+void cram_decode_reset(cram_fd *fd) {
+    if (fd->job_pending) {
+	cram_decode_job *j = (cram_decode_job *)fd->job_pending;
+	cram_release_slice(fd, j->c, j->s);
+	free(j);
+	fd->job_pending = NULL;
+    }
 
-	c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
-	if (!c->comp_hdr)
-	    return NULL;
-	if (!c->comp_hdr->AP_delta &&
-	    sam_hdr_sort_order(fd->header) != ORDER_COORD) {
-	    pthread_mutex_lock(&fd->ref_lock);
-	    fd->unsorted = 1;
-	    pthread_mutex_unlock(&fd->ref_lock);
+    if (fd->pool && fd->rqueue) {
+	hts_tpool_result *res;
+
+	hts_tpool_process_flush(fd->rqueue);
+	while ((res = hts_tpool_next_result(fd->rqueue))) {
+	    cram_decode_job *j = (cram_decode_job *)hts_tpool_result_data(res);
+	    if (j)
+		cram_release_slice(fd, j->c, j->s);
+	    hts_tpool_delete_result(res, 1);
 	}
     }
 
-    if ((s = c->slice)) {
-	c->slice = NULL;
-	cram_free_slice(s);
-	s = NULL;
-    }
+    if (fd->ctr && fd->ctr->slice)
+	cram_release_slice(fd, fd->ctr, fd->ctr->slice);
+    cram_set_ctr_mt(fd, NULL);
 
-    if (c->curr_slice == c->max_slice) {
-	if (fd->ctr == c)
-	    fd->ctr = NULL;
-	cram_free_container(c);
-	c = NULL;
-    }
+    fd->ooc = 0;
+}
+
+/*
+ * Returns the next decoded slice, along with its container in *cp.
+ *
+ * Slices are read in order by the calling thread, which keeps going
+ * until the decode queue is full when we have a thread pool.  So that
+ * many slices of one container can be decoded at once, the read-ahead
+ * tracks its own container (fd->ctr_mt) separately from the one being
+ * consumed (fd->ctr); a container is freed once it has been read in full
+ * and every slice read from it has been released.
+ */
+static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
+    cram_container *c;
+    cram_slice *s = NULL;
+
+    // Done with the current slice, and perhaps its container too
+    if ((c = fd->ctr) && c->slice)
+	cram_release_slice(fd, c, c->slice);
 
-    /* Sorry this is so contorted! */
     for (;;) {
+	c = fd->ctr_mt;
+	s = NULL;
+
 	if (fd->job_pending) {
 	    cram_decode_job *j = (cram_decode_job *)fd->job_pending;
 	    c = j->c;
@@ -2990,11 +3028,11 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 	    free(fd->job_pending);
 	    fd->job_pending = NULL;
 	} else if (!fd->ooc) {
-	empty_container:
-	    if (!c || c->curr_slice == c->max_slice) {
+	    if (!c || c->curr_slice_mt >= c->max_slice) {
 		// new container
 		do {
-		    if (!(c = fd->ctr = cram_read_container(fd))) {
+		    if (!(c = cram_read_container(fd))) {
+			cram_set_ctr_mt(fd, NULL);
 			if (fd->pool) {
 			    fd->ooc = 1;
 			    break;
@@ -3002,7 +3040,11 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 
 			return NULL;
 		    }
-		} while (c->length == 0);
+		    if (c->length == 0) {
+			cram_free_container(c);
+			c = NULL;
+		    }
+		} while (!c);
 		if (fd->ooc)
 		    break;
 
@@ -3010,17 +3052,10 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 		if (fd->range.refid != -2 && c->ref_seq_id != -2) {
 		    fd->required_fields |= SAM_POS;
 
-		    if (c->ref_seq_id != fd->range.refid) {
-			cram_free_container(c);
-			fd->ctr = NULL;
-			fd->ooc = 1;
-			fd->eof = 1;
-			break;
-		    }
-
-		    if (c->ref_seq_start > fd->range.end) {
+		    if (c->ref_seq_id != fd->range.refid ||
+			c->ref_seq_start > fd->range.end) {
 			cram_free_container(c);
-			fd->ctr = NULL;
+			cram_set_ctr_mt(fd, NULL);
 			fd->ooc = 1;
 			fd->eof = 1;
 			break;
@@ -3028,15 +3063,16 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 
 		    if (c->ref_seq_start + c->ref_seq_span-1 <
 			fd->range.start) {
-			c->curr_rec = c->max_rec;
-			c->curr_slice = c->max_slice;
-			cram_seek(fd, c->length, SEEK_CUR);
+			int r = cram_seek(fd, c->length, SEEK_CUR);
 			cram_free_container(c);
-			c = NULL;
+			if (r != 0)
+			    return NULL;
 			continue;
 		    }
 		}
 
+		cram_set_ctr_mt(fd, c);
+
 		if (!(c->comp_hdr_block = cram_read_block(fd)))
 		    return NULL;
 		if (c->comp_hdr_block->content_type != COMPRESSION_HEADER)
@@ -3053,58 +3089,50 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 		    fd->unsorted = 1;
 		    pthread_mutex_unlock(&fd->ref_lock);
 		}
+
+		// Before reading any slices, so unwanted blocks can be skipped
+		if (cram_dependent_data_series(fd, c->comp_hdr) != 0)
+		    return NULL;
 	    }
 
 	    if (c->num_records == 0) {
-		cram_free_container(c); c = NULL;
-		goto empty_container;
+		// Nothing to decode, so move straight on to the next one
+		c->curr_slice_mt = c->max_slice;
+		continue;
 	    }
 
-
-	    if (!(s = c->slice = cram_read_slice(fd)))
+	    if (!(s = cram_read_slice2(fd, c->comp_hdr)))
 		return NULL;
-	    c->curr_slice++;
-	    c->curr_rec = 0;
-	    c->max_rec = s->hdr->num_records;
+	    c->curr_slice_mt++;
+	    c->slices_in_use++;
 
 	    s->last_apos = s->hdr->ref_seq_start;
 	    
 	    /* Skip slices not yet spanning our range */
 	    if (fd->range.refid != -2 && s->hdr->ref_seq_id != -2) {
-		if (s->hdr->ref_seq_id != fd->range.refid) {
-		    fd->eof = 1;
-		    cram_free_slice(s);
-		    c->slice = NULL;
-		    return NULL;
-		}
-
-		if (s->hdr->ref_seq_start > fd->range.end) {
+		if (s->hdr->ref_seq_id != fd->range.refid ||
+		    s->hdr->ref_seq_start > fd->range.end) {
+		    cram_release_slice(fd, c, s);
+		    s = NULL;
+		    fd->ooc = 1;
 		    fd->eof = 1;
-		    cram_free_slice(s);
-		    c->slice = NULL;
-		    return NULL;
+		    break;
 		}
 
 		if (s->hdr->ref_seq_start + s->hdr->ref_seq_span-1 <
 		    fd->range.start) {
-		    cram_free_slice(s);
-		    c->slice = NULL;
-		    cram_free_container(c);
-		    c = NULL;
+		    cram_release_slice(fd, c, s);
 		    continue;
 		}
 	    }
 	}
 
-	/* Test decoding of 1st seq */
 	if (!c || !s)
 	    break;
 
 	if (cram_decode_slice_mt(fd, c, s, fd->header) != 0) {
-	    //	if (cram_decode_slice(fd, c, s, fd->header) != 0) {
 	    hts_log_error("Failure to decode slice");
-	    cram_free_slice(s);
-	    c->slice = NULL;
+	    cram_release_slice(fd, c, s);
 	    return NULL;
 	}
 
@@ -3121,10 +3149,6 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 	hts_tpool_result *res;
 	cram_decode_job *j;
 	
-	//fprintf(stderr, "Thread pool len = %d, %d\n",
-	//	hts_tpool_results_queue_len(fd->rqueue),
-	//	hts_tpool_results_queue_sz(fd->rqueue));
-
 	if (fd->ooc && hts_tpool_process_empty(fd->rqueue))
 	    return NULL;
 
@@ -3142,15 +3166,23 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 	if (j->exit_code != 0) {
 	    hts_log_error("Slice decode failure");
 	    fd->eof = 0;
+	    cram_release_slice(fd, c, s);
 	    hts_tpool_delete_result(res, 1);
 	    return NULL;
 	}
 
-	fd->ctr = c;
-
 	hts_tpool_delete_result(res, 1);
     }
 
+    if (!s)
+	return NULL;
+
+    fd->ctr = c;
+    c->slice = s;
+    c->curr_slice++;
+    c->curr_rec = 0;
+    c->max_rec = s->hdr->num_records;
+
     *cp = c;
     return s;
 }
@@ -3196,15 +3228,13 @@ cram_record *cram_get_seq(cram_fd *fd) {
 
 	    if (s->crecs[c->curr_rec].ref_id != fd->range.refid) {
 		fd->eof = 1;
-		cram_free_slice(s);
-		c->slice = NULL;
+		cram_release_slice(fd, c, s);
 		return NULL;
 	    }
 
 	    if (fd->range.refid != -1 && s->crecs[c->curr_rec].apos > fd->range.end) {
 		fd->eof = 1;
-		cram_free_slice(s);
-		c->slice = NULL;
+		cram_release_slice(fd, c, s);
 		return NULL;
 	    }
 
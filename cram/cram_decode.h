@@ -94,6 +94,23 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
 cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b);
 
 
+/*! INTERNAL:
+ * Works out which data series and external blocks are needed to satisfy
+ * fd->required_fields, storing the result in the compression header.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_dependent_data_series(cram_fd *fd,
+			       cram_block_compression_hdr *hdr);
+
+/*! INTERNAL:
+ * Returns whether the external block with content id "id" is needed,
+ * according to a prior cram_dependent_data_series call on hdr.
+ */
+int cram_ds_block_needed(cram_block_compression_hdr *hdr, int id);
+
 /*! INTERNAL:
  * Decode an entire slice from container blocks. Fills out s->crecs[] array.
  *
@@ -104,6 +121,13 @@ cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b);
 int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		      SAM_hdr *hdr);
 
+/*! INTERNAL:
+ * Discards the current slice and everything read ahead of it, including
+ * slices queued for decoding in the thread pool.  Used when seeking and
+ * closing.
+ */
+void cram_decode_reset(cram_fd *fd);
+
 
 #ifdef __cplusplus
 }
@@ -844,12 +844,20 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 	}
     }
 
-    // NAME: best is generally xz, bzip2, zlib then rans1
+    // NAME: the name tokeniser, if enabled, beats the general purpose
+    // methods on all but unstructured names, so it competes with them.
+    // Of those, best is generally xz, bzip2, zlib then rans1.
     // It benefits well from a little bit extra compression level.
-    if (cram_compress_block(fd, s->block[DS_RN], fd->m[DS_RN],
-			    method & ~(1<<RANS0 | 1<<GZIP_RLE),
-			    MIN(9,level)))
+    if (fd->use_tok) {
+	if (cram_compress_names(fd, s->block[DS_RN], fd->m[DS_RN],
+				method & ~(1<<RANS0 | 1<<GZIP_RLE),
+				MIN(9,level)))
+	    return -1;
+    } else if (cram_compress_block(fd, s->block[DS_RN], fd->m[DS_RN],
+				   method & ~(1<<RANS0 | 1<<GZIP_RLE),
+				   MIN(9,level))) {
 	return -1;
+    }
 
     // NS shows strong local correlation as rearrangements are localised
     if (s->block[DS_NS] != s->block[0])
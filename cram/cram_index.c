@@ -130,9 +130,156 @@ static int kget_int64(kstring_t *k, size_t *pos, int64_t *val_p) {
     return 0;
 }
 
+static void cram_index_free_recurse(cram_index *e) {
+    if (e->e) {
+	int i;
+	for (i = 0; i < e->nslice; i++) {
+	    cram_index_free_recurse(&e->e[i]);
+	}
+	free(e->e);
+    }
+}
+
+/*
+ * Parses the index lines held in kstr->s from pos up to kstr->l, adding
+ * them to fd->index.  This must already have an entry for every refid
+ * listed.  A reference's slices are appended to any already parsed.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+static int cram_index_parse(cram_fd *fd, kstring_t *kstr, size_t pos) {
+    cram_index *idx = NULL;
+    cram_index **idx_stack = NULL, *ep, e;
+    int idx_stack_alloc = 0, idx_stack_ptr = 0;
+
+    idx_stack = calloc(++idx_stack_alloc, sizeof(*idx_stack));
+    if (!idx_stack)
+        return -1;
+
+    // Parse it line at a time
+    while (pos < kstr->l) {
+	/* 1.1 layout */
+	if (kget_int32(kstr, &pos, &e.refid) == -1)
+            goto fail;
+
+	if (kget_int32(kstr, &pos, &e.start) == -1)
+            goto fail;
+
+	if (kget_int32(kstr, &pos, &e.end) == -1)
+            goto fail;
+
+	if (kget_int64(kstr, &pos, &e.offset) == -1)
+            goto fail;
+
+	if (kget_int32(kstr, &pos, &e.slice) == -1)
+            goto fail;
+
+	if (kget_int32(kstr, &pos, &e.len) == -1)
+            goto fail;
+
+	e.end += e.start-1;
+	//printf("%d/%d..%d\n", e.refid, e.start, e.end);
+
+	if (e.refid < -1 || e.refid+1 >= fd->index_sz) {
+	    hts_log_error("Malformed index file, refid %d", e.refid);
+            goto fail;
+	}
+
+	if (!idx || e.refid != idx->refid) {
+	    idx = &fd->index[e.refid+1];
+	    idx_stack[(idx_stack_ptr = 0)] = idx;
+	}
+
+	// Identical ranges are kept side by side rather than nested, so a
+	// run of unmapped slices doesn't turn into one long chain.
+	while (idx_stack_ptr > 0
+	       && (!(e.start >= idx->start && e.end <= idx->end) || idx->end == 0
+		   || (e.start == idx->start && e.end == idx->end))) {
+	    idx = idx_stack[--idx_stack_ptr];
+	}
+
+	// Now contains, so append
+	if (idx->nslice+1 >= idx->nalloc) {
+            cram_index *new_e;
+	    idx->nalloc = idx->nalloc ? idx->nalloc*2 : 16;
+	    new_e = realloc(idx->e, idx->nalloc * sizeof(*idx->e));
+            if (!new_e)
+                goto fail;
+
+            idx->e = new_e;
+	}
+
+	e.nalloc = e.nslice = 0; e.e = NULL;
+	*(ep = &idx->e[idx->nslice++]) = e;
+	idx = ep;
+
+	if (++idx_stack_ptr >= idx_stack_alloc) {
+            cram_index **new_stack;
+	    idx_stack_alloc *= 2;
+	    new_stack = realloc(idx_stack, idx_stack_alloc*sizeof(*idx_stack));
+            if (!new_stack)
+                goto fail;
+            idx_stack = new_stack;
+	}
+	idx_stack[idx_stack_ptr] = idx;
+
+	while (pos < kstr->l && kstr->s[pos] != '\n')
+	    pos++;
+	pos++;
+    }
+
+    free(idx_stack);
+    return 0;
+
+ fail:
+    free(idx_stack);
+    return -1;
+}
+
+/*
+ * Parses the slices of refid, if this hasn't been done already.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+static int cram_index_parse_ref(cram_fd *fd, int refid) {
+    size_t *p;
+    kstring_t kstr = { 0, 0, NULL };
+    cram_index *idx;
+
+    if (refid+1 < 0 || refid+1 >= fd->index_sz)
+	return 0;
+    p = &fd->index_txt_pos[2*(refid+1)];
+    idx = &fd->index[refid+1];
+
+    if (!fd->index_txt || p[0] == p[1])
+	return 0;
+
+    kstr.s = fd->index_txt;
+    kstr.l = p[1];
+    if (cram_index_parse(fd, &kstr, p[0]) < 0) {
+	hts_log_error("Failed to load index entries for reference %d", refid);
+	cram_index_free_recurse(idx);
+	idx->nslice = idx->nalloc = 0;
+	idx->e = NULL;
+	p[0] = p[1];
+	return -1;
+    }
+
+    p[0] = p[1];
+    return 0;
+}
+
 /*
  * Loads a CRAM .crai index into memory.
  *
+ * At this point we only check each line and note its reference id, to
+ * find which lines belong to each reference.  The slices themselves are
+ * built by the first query on that reference, so a region lookup on a
+ * large index only pays for the reference it uses.  If a reference's
+ * lines aren't contiguous we fall back to parsing the whole file up front.
+ *
  * Returns 0 for success
  *        -1 for failure
  */
@@ -142,10 +289,9 @@ int cram_index_load(cram_fd *fd, const char *fn, const char *fn_idx) {
     ssize_t len;
     kstring_t kstr = {0};
     hFILE *fp;
-    cram_index *idx;
-    cram_index **idx_stack = NULL, *ep, e;
-    int idx_stack_alloc = 0, idx_stack_ptr = 0;
     size_t pos = 0;
+    int32_t refid, last_refid = -2;
+    int contiguous = 1;
 
     /* Check if already loaded */
     if (fd->index)
@@ -155,16 +301,13 @@ int cram_index_load(cram_fd *fd, const char *fn, const char *fn_idx) {
     if (!fd->index)
 	return -1;
 
-    idx = &fd->index[0];
-    idx->refid = -1;
-    idx->start = INT_MIN;
-    idx->end   = INT_MAX;
-
-    idx_stack = calloc(++idx_stack_alloc, sizeof(*idx_stack));
-    if (!idx_stack)
+    fd->index_txt_pos = calloc(2, sizeof(*fd->index_txt_pos));
+    if (!fd->index_txt_pos)
         goto fail;
 
-    idx_stack[idx_stack_ptr] = idx;
+    fd->index[0].refid = -1;
+    fd->index[0].start = INT_MIN;
+    fd->index[0].end   = INT_MAX;
 
     if (!fn_idx) {
 	fn2 = hts_idx_getfn(fn, ".crai");
@@ -206,97 +349,78 @@ int cram_index_load(cram_fd *fd, const char *fn, const char *fn_idx) {
             goto fail;
     }
 
-
-    // Parse it line at a time
+    // Find the lines for each reference
     while (pos < kstr.l) {
-	/* 1.1 layout */
-	if (kget_int32(&kstr, &pos, &e.refid) == -1)
-            goto fail;
-
-	if (kget_int32(&kstr, &pos, &e.start) == -1)
-            goto fail;
-
-	if (kget_int32(&kstr, &pos, &e.end) == -1)
-            goto fail;
-
-	if (kget_int64(&kstr, &pos, &e.offset) == -1)
-            goto fail;
-
-	if (kget_int32(&kstr, &pos, &e.slice) == -1)
-            goto fail;
-
-	if (kget_int32(&kstr, &pos, &e.len) == -1)
-            goto fail;
-
-	e.end += e.start-1;
-	//printf("%d/%d..%d\n", e.refid, e.start, e.end);
-
-	if (e.refid < -1) {
-	    hts_log_error("Malformed index file, refid %d", e.refid);
+	size_t line = pos, *p;
+	int32_t val32;
+	int64_t val64;
+	char *eol;
+
+	if (kget_int32(&kstr, &pos, &refid) == -1 || refid < -1
+	    || kget_int32(&kstr, &pos, &val32) == -1  // start
+	    || kget_int32(&kstr, &pos, &val32) == -1  // span
+	    || kget_int64(&kstr, &pos, &val64) == -1  // container offset
+	    || kget_int32(&kstr, &pos, &val32) == -1  // slice offset
+	    || kget_int32(&kstr, &pos, &val32) == -1) { // slice size
+	    hts_log_error("Malformed index file");
             goto fail;
 	}
 
-	if (e.refid != idx->refid) {
-	    if (fd->index_sz < e.refid+2) {
-                cram_index *new_idx;
-                int new_sz = e.refid+2;
-		size_t index_end = fd->index_sz * sizeof(*fd->index);
-                new_idx = realloc(fd->index,
-                                  new_sz * sizeof(*fd->index));
-                if (!new_idx)
-                    goto fail;
-
-                fd->index = new_idx;
-                fd->index_sz = new_sz;
-		memset(((char *)fd->index) + index_end, 0,
-		       fd->index_sz * sizeof(*fd->index) - index_end);
+	if (fd->index_sz < refid+2) {
+	    cram_index *new_idx;
+	    size_t *new_pos;
+	    int i, new_sz = refid+2;
+
+	    new_idx = realloc(fd->index, new_sz * sizeof(*fd->index));
+	    if (!new_idx)
+		goto fail;
+	    fd->index = new_idx;
+
+	    new_pos = realloc(fd->index_txt_pos,
+			      2 * new_sz * sizeof(*fd->index_txt_pos));
+	    if (!new_pos)
+		goto fail;
+	    fd->index_txt_pos = new_pos;
+
+	    memset(&fd->index[fd->index_sz], 0,
+		   (new_sz - fd->index_sz) * sizeof(*fd->index));
+	    memset(&fd->index_txt_pos[2*fd->index_sz], 0,
+		   2 * (new_sz - fd->index_sz) * sizeof(*fd->index_txt_pos));
+	    for (i = fd->index_sz; i < new_sz; i++) {
+		fd->index[i].refid = i-1;
+		fd->index[i].start = INT_MIN;
+		fd->index[i].end   = INT_MAX;
 	    }
-	    idx = &fd->index[e.refid+1];
-	    idx->refid = e.refid;
-	    idx->start = INT_MIN;
-	    idx->end   = INT_MAX;
-	    idx->nslice = idx->nalloc = 0;
-	    idx->e = NULL;
-	    idx_stack[(idx_stack_ptr = 0)] = idx;
-	}
-
-	while (!(e.start >= idx->start && e.end <= idx->end) || idx->end == 0) {
-	    idx = idx_stack[--idx_stack_ptr];
+	    fd->index_sz = new_sz;
 	}
 
-	// Now contains, so append
-	if (idx->nslice+1 >= idx->nalloc) {
-            cram_index *new_e;
-	    idx->nalloc = idx->nalloc ? idx->nalloc*2 : 16;
-	    new_e = realloc(idx->e, idx->nalloc * sizeof(*idx->e));
-            if (!new_e)
-                goto fail;
-
-            idx->e = new_e;
+	p = &fd->index_txt_pos[2*(refid+1)];
+	if (refid != last_refid) {
+	    if (p[1])
+		contiguous = 0;
+	    else
+		p[0] = line;
+	    last_refid = refid;
 	}
 
-	e.nalloc = e.nslice = 0; e.e = NULL;
-	*(ep = &idx->e[idx->nslice++]) = e;
-	idx = ep;
+	eol = memchr(kstr.s + pos, '\n', kstr.l - pos);
+	pos = eol ? eol - kstr.s + 1 : kstr.l;
+	p[1] = pos;
+    }
 
-	if (++idx_stack_ptr >= idx_stack_alloc) {
-            cram_index **new_stack;
-	    idx_stack_alloc *= 2;
-	    new_stack = realloc(idx_stack, idx_stack_alloc*sizeof(*idx_stack));
-            if (!new_stack)
-                goto fail;
-            idx_stack = new_stack;
-	}
-	idx_stack[idx_stack_ptr] = idx;
+    free(fn2);
+    fn2 = NULL;
 
-	while (pos < kstr.l && kstr.s[pos] != '\n')
-	    pos++;
-	pos++;
+    if (contiguous) {
+	fd->index_txt = kstr.s;
+	return 0;
     }
 
-    free(idx_stack);
+    memset(fd->index_txt_pos, 0, 2 * fd->index_sz * sizeof(*fd->index_txt_pos));
+    if (cram_index_parse(fd, &kstr, 0) < 0)
+	goto fail;
+
     free(kstr.s);
-    free(fn2);
 
     // dump_index(fd);
 
@@ -304,22 +428,11 @@ int cram_index_load(cram_fd *fd, const char *fn, const char *fn_idx) {
 
  fail:
     free(kstr.s);
-    free(idx_stack);
     free(fn2);
     cram_index_free(fd); // Also sets fd->index = NULL
     return -1;
 }
 
-static void cram_index_free_recurse(cram_index *e) {
-    if (e->e) {
-	int i;
-	for (i = 0; i < e->nslice; i++) {
-	    cram_index_free_recurse(&e->e[i]);
-	}
-	free(e->e);
-    }
-}
-
 void cram_index_free(cram_fd *fd) {
     int i;
 
@@ -330,8 +443,27 @@ void cram_index_free(cram_fd *fd) {
 	cram_index_free_recurse(&fd->index[i]);
     }
     free(fd->index);
+    free(fd->index_txt);
+    free(fd->index_txt_pos);
 
     fd->index = NULL;
+    fd->index_txt = NULL;
+    fd->index_txt_pos = NULL;
+    fd->index_sz = 0;
+}
+
+/*
+ * Reports whether the index lists any slices for refid, without the
+ * cost of parsing them.
+ */
+int cram_index_has_slices(cram_fd *fd, int refid) {
+    size_t *p;
+
+    if (!fd->index || refid+1 < 0 || refid+1 >= fd->index_sz)
+	return 0;
+
+    p = &fd->index_txt_pos[2*(refid+1)];
+    return fd->index[refid+1].nslice > 0 || (fd->index_txt && p[0] < p[1]);
 }
 
 /*
@@ -351,59 +483,38 @@ void cram_index_free(cram_fd *fd) {
 cram_index *cram_index_query(cram_fd *fd, int refid, int pos, 
 			     cram_index *from) {
     int i, j, k;
-    cram_index *e;
 
     if (refid+1 < 0 || refid+1 >= fd->index_sz)
 	return NULL;
 
-    if (!from)
+    if (!from) {
+	if (cram_index_parse_ref(fd, refid) < 0)
+	    return NULL;
 	from = &fd->index[refid+1];
+    }
 
     // Ref with nothing aligned against it.
-    if (!from->e)
+    if (!from->e || from->nslice == 0)
 	return NULL;
 
-    // This sequence is covered by the index, so binary search to find
-    // the optimal starting block.
-    i = 0, j = fd->index[refid+1].nslice-1;
-    for (k = j/2; k != i; k = (j-i)/2 + i) {
-	if (from->e[k].refid > refid) {
-	    j = k;
-	    continue;
-	}
-
-	if (from->e[k].refid < refid) {
-	    i = k;
-	    continue;
-	}
-
-	if (from->e[k].start >= pos) {
+    /*
+     * No slice in the list contains another, so as they're sorted by
+     * start they are also sorted by end.  Binary search for the first
+     * one ending at or after pos, or failing that the first of those
+     * reaching furthest (eg a run of unmapped slices).
+     */
+    i = 0, j = from->nslice-1;
+    if (from->e[j].end < pos)
+	pos = from->e[j].end;
+    while (i < j) {
+	k = i + (j-i)/2;
+	if (from->e[k].end < pos)
+	    i = k+1;
+	else
 	    j = k;
-	    continue;
-	}
-
-	if (from->e[k].start < pos) {
-	    i = k;
-	    continue;
-	}
     }
-    // i==j or i==j-1. Check if j is better.
-    if (j >= 0 && from->e[j].start < pos && from->e[j].refid == refid)
-	i = j;
-
-    /* The above found *a* bin overlapping, but not necessarily the first */
-    while (i > 0 && from->e[i-1].end >= pos)
-	i--;
 
-    /* We may be one bin before the optimum, so check */
-    while (i+1 < from->nslice &&
-	   (from->e[i].refid < refid ||
-	    from->e[i].end < pos))
-	i++;
-
-    e = &from->e[i];
-
-    return e;
+    return &from->e[i];
 }
 
 
@@ -424,6 +535,13 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
 int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
     cram_index *e;
 
+    // Drop anything already read ahead from the old position.
+    cram_decode_reset(fd);
+
+    // An index that can't be parsed is an error, not a lack of data
+    if (cram_index_parse_ref(fd, r->refid) < 0)
+	return -1;
+
     // Ideally use an index, so see if we have one.
     if ((e = cram_index_query(fd, r->refid, r->start, NULL))) {
 	if (0 != cram_seek(fd, e->offset, SEEK_SET))
@@ -434,12 +552,6 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
 	return -2;
     }
 
-    if (fd->ctr) {
-	cram_free_container(fd->ctr);
-	fd->ctr = NULL;
-	fd->ooc = 0;
-    }
-
     return 0;
 }
 
@@ -451,17 +563,15 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
  *
  * Returns 0 on success
  *        -1 on read failure
- *        -4 on write failure
  */
 static int cram_index_build_multiref(cram_fd *fd,
 				     cram_container *c,
 				     cram_slice *s,
-				     BGZF *fp,
+				     kstring_t *out,
 				     off_t cpos,
 				     int32_t landmark,
 				     int sz) {
     int i, ref = -2, ref_start = 0, ref_end;
-    char buf[1024];
 
     if (0 != cram_decode_slice(fd, c, s, fd->header))
 	return -1;
@@ -475,11 +585,10 @@ static int cram_index_build_multiref(cram_fd *fd,
 	}
 
 	if (ref != -2) {
-	    sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		    ref, ref_start, ref_end - ref_start + 1,
-		    (int64_t)cpos, landmark, sz);
-	    if (bgzf_write(fp, buf, strlen(buf)) < 0)
-		return -4;
+	    if (ksprintf(out, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+			 ref, ref_start, ref_end - ref_start + 1,
+			 (int64_t)cpos, landmark, sz) < 0)
+		return -1;
 	}
 
 	ref = s->crecs[i].ref_id;
@@ -488,16 +597,141 @@ static int cram_index_build_multiref(cram_fd *fd,
     }
 
     if (ref != -2) {
-	sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		ref, ref_start, ref_end - ref_start + 1,
-		(int64_t)cpos, landmark, sz);
-	if (bgzf_write(fp, buf, strlen(buf)) < 0)
-	    return -4;
+	if (ksprintf(out, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+		     ref, ref_start, ref_end - ref_start + 1,
+		     (int64_t)cpos, landmark, sz) < 0)
+	    return -1;
     }
 
     return 0;
 }
 
+/*
+ * One container's worth of index building.  The main thread reads the
+ * container and its slices; decoding the compression header and any
+ * multi-reference slices, and formatting the index lines, is done here
+ * so it can run on the thread pool.
+ */
+typedef struct {
+    cram_fd *fd;
+    cram_container *c;
+    off_t cpos;
+    int *sz;          // size of each slice
+    kstring_t out;    // index lines for this container
+    int ret;
+} cram_index_job;
+
+static void *cram_index_build_container(void *arg) {
+    cram_index_job *j = (cram_index_job *)arg;
+    cram_container *c = j->c;
+    int i;
+
+    j->ret = -1;
+    if (!(c->comp_hdr = cram_decode_compression_header(j->fd,
+						       c->comp_hdr_block)))
+	goto done;
+
+    for (i = 0; i < c->max_slice; i++) {
+	cram_slice *s = c->slices[i];
+
+	if (s->hdr->ref_seq_id == -2) {
+	    if (cram_index_build_multiref(j->fd, c, s, &j->out, j->cpos,
+					  c->landmark[i], j->sz[i]) < 0)
+		goto done;
+	} else {
+	    if (ksprintf(&j->out, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+			 s->hdr->ref_seq_id, s->hdr->ref_seq_start,
+			 s->hdr->ref_seq_span, (int64_t)j->cpos,
+			 c->landmark[i], j->sz[i]) < 0)
+		goto done;
+	}
+    }
+    j->ret = 0;
+
+ done:
+    // Decoded slices can be large, so release them as early as possible.
+    cram_free_container(c);
+    j->c = NULL;
+    return j;
+}
+
+/*
+ * Writes out and frees a finished job.  A failed job is still freed, but
+ * nothing more is written.
+ *
+ * Returns 0 on success, -1 if the job failed or -4 on write failure.
+ */
+static int cram_index_build_write(BGZF *fp, cram_index_job *j, int ret) {
+    if (ret == 0) {
+	ret = j->ret;
+	if (ret == 0 && j->out.l && bgzf_write(fp, j->out.s, j->out.l) < 0)
+	    ret = -4;
+    }
+
+    free(j->out.s);
+    free(j->sz);
+    free(j);
+    return ret;
+}
+
+/*
+ * Collects the finished jobs from the thread pool, in the order they were
+ * dispatched.  If wait is 1 this blocks for at least one result; if wait
+ * is 2 it blocks until the queue is empty.  ret is the status so far;
+ * once it is non-zero results are discarded rather than written.
+ *
+ * Returns the updated status.
+ */
+static int cram_index_build_collect(cram_fd *fd, BGZF *fp, int wait,
+				    int ret) {
+    hts_tpool_result *r;
+
+    for (;;) {
+	if (wait && !hts_tpool_process_empty(fd->rqueue))
+	    r = hts_tpool_next_result_wait(fd->rqueue);
+	else
+	    r = hts_tpool_next_result(fd->rqueue);
+	if (!r)
+	    break;
+
+	ret = cram_index_build_write(fp, hts_tpool_result_data(r), ret);
+	hts_tpool_delete_result(r, 0);
+	if (wait == 1)
+	    wait = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Hands a container to the thread pool, or processes it immediately if
+ * there is none.
+ *
+ * Returns 0 on success, negative on failure as for cram_index_build().
+ */
+static int cram_index_build_dispatch(cram_fd *fd, BGZF *fp,
+				     cram_index_job *j) {
+    int ret = 0;
+
+    if (!fd->pool)
+	return cram_index_build_write(fp, cram_index_build_container(j), 0);
+
+    while (hts_tpool_dispatch2(fd->pool, fd->rqueue,
+			       cram_index_build_container, j, 1) < 0) {
+	if (errno != EAGAIN) {
+	    cram_free_container(j->c);
+	    return cram_index_build_write(fp, j, -1);
+	}
+	// Queue full, so make room by writing out what has finished.
+	if ((ret = cram_index_build_collect(fd, fp, 1, ret)) < 0) {
+	    cram_free_container(j->c);
+	    return cram_index_build_write(fp, j, ret);
+	}
+    }
+
+    return cram_index_build_collect(fd, fp, 0, ret);
+}
+
 /*
  * Builds an index file.
  *
@@ -506,6 +740,9 @@ static int cram_index_build_multiref(cram_fd *fd,
  * fn_idx is the filename of the index file to be written;
  * if NULL, we add ".crai" to fn_base to get the index filename.
  *
+ * If fd has a thread pool, the containers are processed in parallel
+ * while the main thread carries on reading the file.
+ *
  * Returns 0 on success,
  *         negative on failure (-1 for read failure, -4 for write failure)
  */
@@ -514,6 +751,7 @@ int cram_index_build(cram_fd *fd, const char *fn_base, const char *fn_idx) {
     off_t cpos, spos, hpos;
     BGZF *fp;
     kstring_t fn_idx_str = {0};
+    int ret = 0;
 
     if (! fn_idx) {
         kputs(fn_base, &fn_idx_str);
@@ -530,68 +768,71 @@ int cram_index_build(cram_fd *fd, const char *fn_base, const char *fn_idx) {
     free(fn_idx_str.s);
 
     cpos = htell(fd->fp);
-    while ((c = cram_read_container(fd))) {
+    while (ret == 0 && (c = cram_read_container(fd))) {
+        cram_index_job *job;
         int j;
 
         if (fd->err) {
             perror("Cram container read");
-            return -1;
+            cram_free_container(c);
+            ret = -1;
+            break;
         }
 
         hpos = htell(fd->fp);
 
-        if (!(c->comp_hdr_block = cram_read_block(fd)))
-            return -1;
+        if (!(c->comp_hdr_block = cram_read_block(fd)) ||
+            !(job = calloc(1, sizeof(*job)))) {
+            cram_free_container(c);
+            ret = -1;
+            break;
+        }
         assert(c->comp_hdr_block->content_type == COMPRESSION_HEADER);
 
-        c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
-        if (!c->comp_hdr)
-            return -1;
+        job->fd = fd;
+        job->c = c;
+        job->cpos = cpos;
+        job->sz = malloc((c->num_landmarks ? c->num_landmarks : 1)
+                         * sizeof(*job->sz));
+        c->slices = calloc(c->num_landmarks ? c->num_landmarks : 1,
+                           sizeof(*c->slices));
+        if (!job->sz || !c->slices) {
+            cram_free_container(c);
+            ret = cram_index_build_write(fp, job, -1);
+            break;
+        }
 
         // 2.0 format
         for (j = 0; j < c->num_landmarks; j++) {
-            char buf[1024];
-            cram_slice *s;
-            int sz, ret;
-
             spos = htell(fd->fp);
             assert(spos - cpos - c->offset == c->landmark[j]);
 
-            if (!(s = cram_read_slice(fd))) {
-		bgzf_close(fp);
-		return -1;
-	    }
+            if (!(c->slices[j] = cram_read_slice(fd)))
+                break;
+            c->max_slice = j+1;
 
-            sz = (int)(htell(fd->fp) - spos);
-
-	    if (s->hdr->ref_seq_id == -2) {
-		ret = cram_index_build_multiref(fd, c, s, fp,
-						cpos, c->landmark[j], sz);
-	    } else {
-		sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-			s->hdr->ref_seq_id, s->hdr->ref_seq_start,
-			s->hdr->ref_seq_span, (int64_t)cpos,
-			c->landmark[j], sz);
-		ret = (bgzf_write(fp, buf, strlen(buf)) >= 0)? 0 : -4;
-	    }
-
-            cram_free_slice(s);
+            job->sz[j] = (int)(htell(fd->fp) - spos);
+        }
 
-	    if (ret < 0) {
-		bgzf_close(fp);
-		return ret;
-	    }
+        if (j < c->num_landmarks) {
+            cram_free_container(c);
+            ret = cram_index_build_write(fp, job, -1);
+            break;
         }
 
         cpos = htell(fd->fp);
         assert(cpos == hpos + c->length);
 
-        cram_free_container(c);
-    }
-    if (fd->err) {
-	bgzf_close(fp);
-	return -1;
+        ret = cram_index_build_dispatch(fd, fp, job);
     }
+    if (ret == 0 && fd->err)
+	ret = -1;
+
+    if (fd->pool)
+	ret = cram_index_build_collect(fd, fp, 2, ret);
+
+    if (bgzf_close(fp) < 0 && ret == 0)
+	ret = -4;
 
-    return (bgzf_close(fp) >= 0)? 0 : -4;
+    return ret;
 }
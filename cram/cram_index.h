@@ -53,6 +53,11 @@ void cram_index_free(cram_fd *fd);
  */
 cram_index *cram_index_query(cram_fd *fd, int refid, int pos, cram_index *frm);
 
+/*
+ * Returns whether the index has any slices for a reference ID.
+ */
+int cram_index_has_slices(cram_fd *fd, int refid);
+
 /*
  * Skips to a container overlapping the start coordinate listed in
  * cram_range.
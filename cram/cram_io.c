@@ -70,6 +70,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "htslib/hts.h"
 #include "cram/open_trace_file.h"
 #include "cram/rANS_static.h"
+#include "cram/rANS_static32x16.h"
+#include "cram/tokenise_name.h"
 
 //#define REF_DEBUG
 
@@ -765,11 +767,14 @@ cram_block *cram_new_block(enum cram_content_type content_type,
 }
 
 /*
- * Reads a block from a cram file.
- * Returns cram_block pointer on success.
- *         NULL on failure
+ * Reads a block from a cram file.  External blocks not needed according
+ * to hdr (see cram_dependent_data_series) are seeked past instead of
+ * read, and are returned as RAW blocks without data.  A block with
+ * content id keep_id is always read.
  */
-cram_block *cram_read_block(cram_fd *fd) {
+static cram_block *cram_read_block2(cram_fd *fd,
+				    cram_block_compression_hdr *hdr,
+				    int keep_id) {
     cram_block *b = malloc(sizeof(*b));
     unsigned char c;
     uint32_t crc = 0;
@@ -789,6 +794,28 @@ cram_block *cram_read_block(cram_fd *fd) {
     //fprintf(stderr, "  method %d, ctype %d, cid %d, csize %d, ucsize %d\n",
     //	    b->method, b->content_type, b->content_id, b->comp_size, b->uncomp_size);
 
+    if (hdr && b->content_type == EXTERNAL && b->content_id != keep_id &&
+	b->uncomp_size > 0 && !cram_ds_block_needed(hdr, b->content_id)) {
+	int32_t sz = b->method == RAW ? b->uncomp_size : b->comp_size;
+	if (sz < 0 || cram_seek(fd, sz, SEEK_CUR) != 0) { free(b); return NULL; }
+	// The CRC covers the data we skipped, so cannot be checked.
+	if (CRAM_MAJOR_VERS(fd->version) >= 3 &&
+	    -1 == int32_decode(fd, (int32_t *)&b->crc32)) {
+	    free(b);
+	    return NULL;
+	}
+	// Sizes are kept as a hint for cram_decode_estimate_sizes, but
+	// cram_get_block_by_id will not return a block without data.
+	b->orig_method = b->method;
+	b->method = RAW;
+	b->data = NULL;
+	b->alloc = 0;
+	b->idx = 0;
+	b->byte = 0;
+	b->bit = 7; // MSB
+	return b;
+    }
+
     if (b->method == RAW) {
         if (b->uncomp_size < 0) { free(b); return NULL; }
 	b->alloc = b->uncomp_size;
@@ -832,6 +859,15 @@ cram_block *cram_read_block(cram_fd *fd) {
     return b;
 }
 
+/*
+ * Reads a block from a cram file.
+ * Returns cram_block pointer on success.
+ *         NULL on failure
+ */
+cram_block *cram_read_block(cram_fd *fd) {
+    return cram_read_block2(fd, NULL, -1);
+}
+
 
 /*
  * Computes the size of a cram block, including the block
@@ -915,6 +951,108 @@ void cram_free_block(cram_block *b) {
     free(b);
 }
 
+/*
+ * A set of independent tasks sharing the thread pool.  Idle workers help
+ * run the tasks, but the thread that owns the set runs any not yet started
+ * itself, so it never waits for a job stuck in the queue; this matters as
+ * the owner is often a pool worker itself.  Helpers that start after all
+ * tasks are taken just drop their reference.
+ */
+typedef struct {
+    void (*func)(void *arg, int i);
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cv;
+    int n, next, done, refs;
+} cram_tasks;
+
+static void cram_tasks_release(cram_tasks *ts) {
+    int refs;
+
+    pthread_mutex_lock(&ts->lock);
+    refs = --ts->refs;
+    pthread_mutex_unlock(&ts->lock);
+
+    if (refs == 0) {
+	pthread_mutex_destroy(&ts->lock);
+	pthread_cond_destroy(&ts->done_cv);
+	free(ts);
+    }
+}
+
+// Runs tasks until there are none left to start.
+static void cram_tasks_work(cram_tasks *ts) {
+    for (;;) {
+	int i;
+
+	pthread_mutex_lock(&ts->lock);
+	if (ts->next >= ts->n) {
+	    pthread_mutex_unlock(&ts->lock);
+	    return;
+	}
+	i = ts->next++;
+	pthread_mutex_unlock(&ts->lock);
+
+	ts->func(ts->arg, i);
+
+	pthread_mutex_lock(&ts->lock);
+	if (++ts->done == ts->n)
+	    pthread_cond_signal(&ts->done_cv);
+	pthread_mutex_unlock(&ts->lock);
+    }
+}
+
+static void *cram_tasks_thread(void *arg) {
+    cram_tasks_work((cram_tasks *)arg);
+    cram_tasks_release((cram_tasks *)arg);
+    return NULL;
+}
+
+/*
+ * Calls func(arg, i) for i from 0 to n-1, returning once all have
+ * finished.  If parallel is set and fd has a thread pool the calls may
+ * be spread over the pool's threads.
+ */
+void cram_run_tasks(cram_fd *fd, void (*func)(void *arg, int i), void *arg,
+		    int n, int parallel) {
+    cram_tasks *ts;
+    int i;
+
+    if (!fd->pool || !fd->tqueue || !parallel || n < 2
+	|| !(ts = calloc(1, sizeof(*ts)))) {
+	for (i = 0; i < n; i++)
+	    func(arg, i);
+	return;
+    }
+
+    ts->func = func;
+    ts->arg = arg;
+    ts->n = n;
+    ts->refs = 1;
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->done_cv, NULL);
+
+    for (i = 1; i < n; i++) {
+	pthread_mutex_lock(&ts->lock);
+	ts->refs++;
+	pthread_mutex_unlock(&ts->lock);
+	if (hts_tpool_dispatch2(fd->pool, fd->tqueue,
+				cram_tasks_thread, ts, 1) < 0) {
+	    cram_tasks_release(ts);
+	    break;
+	}
+    }
+
+    cram_tasks_work(ts);
+
+    pthread_mutex_lock(&ts->lock);
+    while (ts->done < ts->n)
+	pthread_cond_wait(&ts->done_cv, &ts->lock);
+    pthread_mutex_unlock(&ts->lock);
+
+    cram_tasks_release(ts);
+}
+
 /*
  * Uncompresses a CRAM block, if compressed.
  */
@@ -1003,6 +1141,36 @@ int cram_uncompress_block(cram_block *b) {
 	break;
     }
 
+    case RANS32: {
+	unsigned int usize = b->uncomp_size, usize2;
+	uncomp = (char *)rans_uncompress_32x16(b->data, b->comp_size, &usize2);
+	if (!uncomp || usize != usize2) {
+	    free(uncomp);
+	    return -1;
+	}
+	free(b->data);
+	b->data = (unsigned char *)uncomp;
+	b->alloc = usize2;
+	b->method = RAW;
+	b->uncomp_size = usize2;
+	break;
+    }
+
+    case NAME_TOK: {
+	unsigned int usize = b->uncomp_size, usize2;
+	uncomp = (char *)tok_decode_names(b->data, b->comp_size, &usize2);
+	if (!uncomp || usize != usize2) {
+	    free(uncomp);
+	    return -1;
+	}
+	free(b->data);
+	b->data = (unsigned char *)uncomp;
+	b->alloc = usize2;
+	b->method = RAW;
+	b->uncomp_size = usize2;
+	break;
+    }
+
     default:
 	return -1;
     }
@@ -1010,6 +1178,49 @@ int cram_uncompress_block(cram_block *b) {
     return 0;
 }
 
+static void cram_uncompress_task(void *arg, int i) {
+    cram_uncompress_block(((cram_block **)arg)[i]);
+}
+
+static int cram_block_size_cmp(const void *a, const void *b) {
+    const cram_block *b1 = *(const cram_block **)a;
+    const cram_block *b2 = *(const cram_block **)b;
+    return (b2->uncomp_size > b1->uncomp_size)
+	- (b2->uncomp_size < b1->uncomp_size);
+}
+
+// Less than this in total is not worth handing to other threads
+#define UNCOMP_PAR_MIN 65536
+
+/*
+ * Uncompresses an array of blocks, spread over the thread pool if there
+ * is one and they are large enough to be worth it.  The largest blocks
+ * are started first so the smaller ones can fill in around them.
+ * Note the array is reordered.
+ */
+int cram_uncompress_blocks(cram_fd *fd, cram_block **b, int nb) {
+    size_t total = 0;
+    int i, n = 0, parallel;
+
+    for (i = 0; i < nb; i++) {
+	if (b[i]->method == RAW)
+	    continue;
+	total += b[i]->uncomp_size;
+	b[n++] = b[i];
+    }
+
+    parallel = fd->pool && n > 1 && total >= UNCOMP_PAR_MIN;
+    if (parallel)
+	qsort(b, n, sizeof(*b), cram_block_size_cmp);
+    cram_run_tasks(fd, cram_uncompress_task, b, n, parallel);
+
+    for (i = 0; i < n; i++)
+	if (b[i]->method != RAW)
+	    return -1;
+
+    return 0;
+}
+
 static char *cram_compress_by_method(char *in, size_t in_size,
 				     size_t *out_size,
 				     enum cram_block_method method,
@@ -1062,6 +1273,26 @@ static char *cram_compress_by_method(char *in, size_t in_size,
 	return (char *)cp;
     }
 
+    case RANS32_0:
+    case RANS32_1: {
+	unsigned int out_size_i;
+	unsigned char *cp;
+
+	cp = rans_compress_32x16((unsigned char *)in, in_size, &out_size_i,
+				 method == RANS32_1);
+	*out_size = out_size_i;
+	return (char *)cp;
+    }
+
+    case NAME_TOK: {
+	unsigned int out_size_i;
+	unsigned char *cp;
+
+	cp = tok_encode_names((unsigned char *)in, in_size, &out_size_i);
+	*out_size = out_size_i;
+	return (char *)cp;
+    }
+
     case RAW:
 	break;
 
@@ -1073,6 +1304,61 @@ static char *cram_compress_by_method(char *in, size_t in_size,
 }
 
 
+/*
+ * When the 32-way rANS codec is enabled it stands in for the 4-way one.
+ * Both share the RANS0 / RANS1 method bits and metrics, so the mapping is
+ * applied only when a block is actually compressed.
+ */
+static enum cram_block_method cram_rans_method(cram_fd *fd,
+					       enum cram_block_method m) {
+    if (fd->use_rans32) {
+	if (m == RANS0) return RANS32_0;
+	if (m == RANS1) return RANS32_1;
+    }
+    return m;
+}
+
+/*
+ * The set of compression trials on one block, run as cram_run_tasks()
+ * tasks.
+ */
+#define MAX_TRIALS 8
+typedef struct {
+    char *in;
+    size_t in_size;
+    int n;
+    struct {
+	int id;                        // GZIP_RLE or the method bit tried
+	enum cram_block_method method; // for cram_compress_by_method
+	int level, strat;
+	size_t *sz;                    // where the caller wants the size
+	char *out;
+	size_t size;
+    } t[MAX_TRIALS];
+} cram_trials;
+
+static void cram_trials_add(cram_trials *ts, int id,
+			    enum cram_block_method method, int level,
+			    int strat, size_t *sz) {
+    ts->t[ts->n].id = id;
+    ts->t[ts->n].method = method;
+    ts->t[ts->n].level = level;
+    ts->t[ts->n].strat = strat;
+    ts->t[ts->n].sz = sz;
+    ts->n++;
+}
+
+static void cram_trial_task(void *arg, int i) {
+    cram_trials *ts = (cram_trials *)arg;
+
+    ts->t[i].out = cram_compress_by_method(ts->in, ts->in_size,
+					   &ts->t[i].size, ts->t[i].method,
+					   ts->t[i].level, ts->t[i].strat);
+}
+
+// Smaller blocks are not worth handing to other threads
+#define TRIAL_PAR_MIN 16384
+
 /*
  * Compresses a block using one of two different zlib strategies. If we only
  * want one choice set strat2 to be -1.
@@ -1120,7 +1406,7 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
     }
 
     if (metrics) {
-	pthread_mutex_lock(&fd->metrics_lock);
+	pthread_mutex_lock(&metrics->lock);
 	if (metrics->trial > 0 || --metrics->next_trial <= 0) {
 	    size_t sz_best = INT_MAX;
 	    size_t sz_gz_rle = 0;
@@ -1129,8 +1415,9 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 	    size_t sz_rans1 = 0;
 	    size_t sz_bzip2 = 0;
 	    size_t sz_lzma = 0;
-	    int method_best = 0;
+	    int method_best = 0, i;
 	    char *c_best = NULL, *c = NULL;
+	    cram_trials ts;
 
 	    if (metrics->revised_method)
 		method = metrics->revised_method;
@@ -1146,109 +1433,43 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		metrics->sz_rans1  /= 2;
 		metrics->sz_bzip2  /= 2;
 		metrics->sz_lzma   /= 2;
+		metrics->sz_raw    /= 2;
 	    }
 
-	    pthread_mutex_unlock(&fd->metrics_lock);
-	    
-	    if (method & (1<<GZIP_RLE)) {
-		c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-					    &sz_gz_rle, GZIP, 1, Z_RLE);
-		if (c && sz_best > sz_gz_rle) {
-		    sz_best = sz_gz_rle;
-		    method_best = GZIP_RLE;
-		    if (c_best)
-			free(c_best);
-		    c_best = c;
-		} else if (c) {
-		    free(c);
-		} else {
-		    sz_gz_rle = b->uncomp_size*2+1000;
-		}
-
-		//fprintf(stderr, "Block %d; %d->%d\n", b->content_id, b->uncomp_size, sz_gz_rle);
-	    }
-
-	    if (method & (1<<GZIP)) {
-		c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-					    &sz_gz_def, GZIP, level,
-					    Z_FILTERED);
-		if (c && sz_best > sz_gz_def) {
-		    sz_best = sz_gz_def;
-		    method_best = GZIP;
-		    if (c_best)
-			free(c_best);
-		    c_best = c;
-		} else if (c) {
-		    free(c);
-		} else {
-		    sz_gz_def = b->uncomp_size*2+1000;
-		}
-
-		//fprintf(stderr, "Block %d; %d->%d\n", b->content_id, b->uncomp_size, sz_gz_def);
-	    }
-
-	    if (method & (1<<RANS0)) {
-		c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-					    &sz_rans0, RANS0, 0, 0);
-		if (c && sz_best > sz_rans0) {
-		    sz_best = sz_rans0;
-		    method_best = RANS0;
-		    if (c_best)
-			free(c_best);
-		    c_best = c;
-		} else if (c) {
-		    free(c);
-		} else {
-		    sz_rans0 = b->uncomp_size*2+1000;
-		}
-	    }
-
-	    if (method & (1<<RANS1)) {
-		c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-					    &sz_rans1, RANS1, 0, 0);
-		if (c && sz_best > sz_rans1) {
-		    sz_best = sz_rans1;
-		    method_best = RANS1;
-		    if (c_best)
-			free(c_best);
-		    c_best = c;
-		} else if (c) {
-		    free(c);
-		} else {
-		    sz_rans1 = b->uncomp_size*2+1000;
-		}
-	    }
-
-	    if (method & (1<<BZIP2)) {
-		c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-					    &sz_bzip2, BZIP2, level, 0);
-		if (c && sz_best > sz_bzip2) {
-		    sz_best = sz_bzip2;
-		    method_best = BZIP2;
-		    if (c_best)
-			free(c_best);
-		    c_best = c;
-		} else if (c) {
-		    free(c);
-		} else {
-		    sz_bzip2 = b->uncomp_size*2+1000;
-		}
-	    }
-
-	    if (method & (1<<LZMA)) {
-		c = cram_compress_by_method((char *)b->data, b->uncomp_size,
-					    &sz_lzma, LZMA, level, 0);
-		if (c && sz_best > sz_lzma) {
-		    sz_best = sz_lzma;
-		    method_best = LZMA;
+	    pthread_mutex_unlock(&metrics->lock);
+	    ts.in = (char *)b->data;
+	    ts.in_size = b->uncomp_size;
+	    ts.n = 0;
+	    if (method & (1<<GZIP_RLE))
+		cram_trials_add(&ts, GZIP_RLE, GZIP, 1, Z_RLE, &sz_gz_rle);
+	    if (method & (1<<GZIP))
+		cram_trials_add(&ts, GZIP, GZIP, level, Z_FILTERED, &sz_gz_def);
+	    if (method & (1<<RANS0))
+		cram_trials_add(&ts, RANS0, cram_rans_method(fd, RANS0), 0, 0,
+				&sz_rans0);
+	    if (method & (1<<RANS1))
+		cram_trials_add(&ts, RANS1, cram_rans_method(fd, RANS1), 0, 0,
+				&sz_rans1);
+	    if (method & (1<<BZIP2))
+		cram_trials_add(&ts, BZIP2, BZIP2, level, 0, &sz_bzip2);
+	    if (method & (1<<LZMA))
+		cram_trials_add(&ts, LZMA, LZMA, level, 0, &sz_lzma);
+
+	    cram_run_tasks(fd, cram_trial_task, &ts, ts.n,
+			   ts.in_size >= TRIAL_PAR_MIN);
+
+	    for (i = 0; i < ts.n; i++) {
+		c = ts.t[i].out;
+		if (c && sz_best > ts.t[i].size) {
+		    sz_best = ts.t[i].size;
+		    method_best = ts.t[i].id;
 		    if (c_best)
 			free(c_best);
 		    c_best = c;
 		} else if (c) {
 		    free(c);
-		} else {
-		    sz_lzma = b->uncomp_size*2+1000;
 		}
+		*ts.t[i].sz = c ? ts.t[i].size : b->uncomp_size*2+1000;
 	    }
 
 	    //fprintf(stderr, "sz_best = %d\n", sz_best);
@@ -1256,19 +1477,22 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 	    free(b->data);
 	    b->data = (unsigned char *)c_best;
 	    //printf("method_best = %s\n", cram_block_method2str(method_best));
-	    b->method = method_best == GZIP_RLE ? GZIP : method_best;
+	    b->method = method_best == GZIP_RLE
+		? GZIP : cram_rans_method(fd, method_best);
 	    b->comp_size = sz_best;
 
-	    pthread_mutex_lock(&fd->metrics_lock);
+	    pthread_mutex_lock(&metrics->lock);
 	    metrics->sz_gz_rle += sz_gz_rle;
 	    metrics->sz_gz_def += sz_gz_def;
 	    metrics->sz_rans0  += sz_rans0;
 	    metrics->sz_rans1  += sz_rans1;
 	    metrics->sz_bzip2  += sz_bzip2;
 	    metrics->sz_lzma   += sz_lzma;
+	    metrics->sz_raw    += b->uncomp_size;
 	    if (--metrics->trial == 0) {
 		int best_method = RAW;
 		int best_sz = INT_MAX;
+		int c_gz_rle, c_gz_def, c_rans0, c_rans1, c_bzip2, c_lzma;
 
 		// Scale methods by cost
 		if (fd->level <= 3) {
@@ -1283,23 +1507,48 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		    metrics->sz_lzma   *= 1.05;
 		}
 
-		if (method & (1<<GZIP_RLE) && best_sz > metrics->sz_gz_rle)
-		    best_sz = metrics->sz_gz_rle, best_method = GZIP_RLE;
+		// When favouring read speed, also charge each method for
+		// the decode time it takes over rANS order-0, at one byte
+		// per 200ns, ie 1% of the uncompressed size for each extra
+		// 2ns per byte.  test/test_cram_method -b measures roughly
+		// +2ns/byte for gzip, +4 for rANS order-1, +10 to +15 for
+		// lzma and +24 to +28 for bzip2 on quality and base data.
+		// At this rate rANS order-1 and gzip still win when they are
+		// smaller by a few percent, but bzip2 and lzma have to beat
+		// rANS order-0 by 12% and 5% of the input to be chosen.
+		// This only affects the choice, so isn't kept in the running
+		// totals.
+		c_gz_rle = metrics->sz_gz_rle;
+		c_gz_def = metrics->sz_gz_def;
+		c_rans0  = metrics->sz_rans0;
+		c_rans1  = metrics->sz_rans1;
+		c_bzip2  = metrics->sz_bzip2;
+		c_lzma   = metrics->sz_lzma;
+		if (fd->favour_read_speed) {
+		    c_rans1  += metrics->sz_raw * 0.02;
+		    c_gz_rle += metrics->sz_raw * 0.01;
+		    c_gz_def += metrics->sz_raw * 0.01;
+		    c_bzip2  += metrics->sz_raw * 0.12;
+		    c_lzma   += metrics->sz_raw * 0.05;
+		}
+
+		if (method & (1<<GZIP_RLE) && best_sz > c_gz_rle)
+		    best_sz = c_gz_rle, best_method = GZIP_RLE;
 
-		if (method & (1<<GZIP) && best_sz > metrics->sz_gz_def)
-		    best_sz = metrics->sz_gz_def, best_method = GZIP;
+		if (method & (1<<GZIP) && best_sz > c_gz_def)
+		    best_sz = c_gz_def, best_method = GZIP;
 
-		if (method & (1<<RANS0) && best_sz > metrics->sz_rans0)
-		    best_sz = metrics->sz_rans0, best_method = RANS0;
+		if (method & (1<<RANS0) && best_sz > c_rans0)
+		    best_sz = c_rans0, best_method = RANS0;
 
-		if (method & (1<<RANS1) && best_sz > metrics->sz_rans1)
-		    best_sz = metrics->sz_rans1, best_method = RANS1;
+		if (method & (1<<RANS1) && best_sz > c_rans1)
+		    best_sz = c_rans1, best_method = RANS1;
 
-		if (method & (1<<BZIP2) && best_sz > metrics->sz_bzip2)
-		    best_sz = metrics->sz_bzip2, best_method = BZIP2;
+		if (method & (1<<BZIP2) && best_sz > c_bzip2)
+		    best_sz = c_bzip2, best_method = BZIP2;
 
-		if (method & (1<<LZMA) && best_sz > metrics->sz_lzma)
-		    best_sz = metrics->sz_lzma, best_method = LZMA;
+		if (method & (1<<LZMA) && best_sz > c_lzma)
+		    best_sz = c_lzma, best_method = LZMA;
 
 		if (best_method == GZIP_RLE) {
 		    metrics->method = GZIP;
@@ -1318,8 +1567,8 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		if (best_method == GZIP_RLE) {
 		    metrics->gz_rle_cnt = 0;
 		    metrics->gz_rle_extra = 0;
-		} else if (best_sz < metrics->sz_gz_rle) {
-		    double r = (double)metrics->sz_gz_rle / best_sz - 1;
+		} else if (best_sz < c_gz_rle) {
+		    double r = (double)c_gz_rle / best_sz - 1;
 		    if (++metrics->gz_rle_cnt >= MAXFAILS && 
 			(metrics->gz_rle_extra += r) >= MAXDELTA)
 			method &= ~(1<<GZIP_RLE);
@@ -1328,8 +1577,8 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		if (best_method == GZIP) {
 		    metrics->gz_def_cnt = 0;
 		    metrics->gz_def_extra = 0;
-		} else if (best_sz < metrics->sz_gz_def) {
-		    double r = (double)metrics->sz_gz_def / best_sz - 1;
+		} else if (best_sz < c_gz_def) {
+		    double r = (double)c_gz_def / best_sz - 1;
 		    if (++metrics->gz_def_cnt >= MAXFAILS &&
 			(metrics->gz_def_extra += r) >= MAXDELTA)
 			method &= ~(1<<GZIP);
@@ -1338,8 +1587,8 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		if (best_method == RANS0) {
 		    metrics->rans0_cnt = 0;
 		    metrics->rans0_extra = 0;
-		} else if (best_sz < metrics->sz_rans0) {
-		    double r = (double)metrics->sz_rans0 / best_sz - 1;
+		} else if (best_sz < c_rans0) {
+		    double r = (double)c_rans0 / best_sz - 1;
 		    if (++metrics->rans0_cnt >= MAXFAILS &&
 			(metrics->rans0_extra += r) >= MAXDELTA)
 			method &= ~(1<<RANS0);
@@ -1348,8 +1597,8 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		if (best_method == RANS1) {
 		    metrics->rans1_cnt = 0;
 		    metrics->rans1_extra = 0;
-		} else if (best_sz < metrics->sz_rans1) {
-		    double r = (double)metrics->sz_rans1 / best_sz - 1;
+		} else if (best_sz < c_rans1) {
+		    double r = (double)c_rans1 / best_sz - 1;
 		    if (++metrics->rans1_cnt >= MAXFAILS &&
 			(metrics->rans1_extra += r) >= MAXDELTA)
 			method &= ~(1<<RANS1);
@@ -1358,8 +1607,8 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		if (best_method == BZIP2) {
 		    metrics->bzip2_cnt = 0;
 		    metrics->bzip2_extra = 0;
-		} else if (best_sz < metrics->sz_bzip2) {
-		    double r = (double)metrics->sz_bzip2 / best_sz - 1;
+		} else if (best_sz < c_bzip2) {
+		    double r = (double)c_bzip2 / best_sz - 1;
 		    if (++metrics->bzip2_cnt >= MAXFAILS &&
 			(metrics->bzip2_extra += r) >= MAXDELTA)
 			method &= ~(1<<BZIP2);
@@ -1368,8 +1617,8 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		if (best_method == LZMA) {
 		    metrics->lzma_cnt = 0;
 		    metrics->lzma_extra = 0;
-		} else if (best_sz < metrics->sz_lzma) {
-		    double r = (double)metrics->sz_lzma / best_sz - 1;
+		} else if (best_sz < c_lzma) {
+		    double r = (double)c_lzma / best_sz - 1;
 		    if (++metrics->lzma_cnt >= MAXFAILS &&
 			(metrics->lzma_extra += r) >= MAXDELTA)
 			method &= ~(1<<LZMA);
@@ -1380,12 +1629,12 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 		//	    b->content_id, metrics->revised_method, method);
 		metrics->revised_method = method;
 	    }
-	    pthread_mutex_unlock(&fd->metrics_lock);
+	    pthread_mutex_unlock(&metrics->lock);
 	} else {
 	    strat = metrics->strat;
-	    method = metrics->method;
+	    method = cram_rans_method(fd, metrics->method);
 
-	    pthread_mutex_unlock(&fd->metrics_lock);
+	    pthread_mutex_unlock(&metrics->lock);
 	    comp = cram_compress_by_method((char *)b->data, b->uncomp_size,
 					   &comp_size, method,
 					   level, strat);
@@ -1417,6 +1666,51 @@ int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 
     if (b->method == RANS1)
 	b->method = RANS0; // Spec just has RANS (not 0/1) with auto-sensing
+    else if (b->method == RANS32_1)
+	b->method = RANS32_0;
+
+    return 0;
+}
+
+/*
+ * Compresses a block of NUL-terminated read names.  The name tokeniser is
+ * tried alongside the methods cram_compress_block() would pick from, and
+ * whichever gives the smallest block is kept.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_compress_names(cram_fd *fd, cram_block *b, cram_metrics *metrics,
+			int method, int level) {
+    char *tok = NULL;
+    size_t tok_size = 0;
+
+    if (b->method != RAW)
+	return 0;
+
+    // Tokenise first, as cram_compress_block() replaces the raw data.
+    if (fd->level > 0 && b->uncomp_size > 0)
+	tok = cram_compress_by_method((char *)b->data, b->uncomp_size,
+				      &tok_size, NAME_TOK, fd->level, 0);
+
+    if (cram_compress_block(fd, b, metrics, method, level) != 0) {
+	free(tok);
+	return -1;
+    }
+
+    if (!tok || tok_size >= b->comp_size) {
+	free(tok);
+	return 0;
+    }
+
+    free(b->data);
+    b->data = (unsigned char *)tok;
+    b->comp_size = tok_size;
+    b->method = NAME_TOK;
+
+    hts_log_info("Compressed block ID %d from %d to %d by method %s",
+		 b->content_id, b->uncomp_size, b->comp_size,
+		 cram_block_method2str(b->method));
 
     return 0;
 }
@@ -1425,6 +1719,7 @@ cram_metrics *cram_new_metrics(void) {
     cram_metrics *m = calloc(1, sizeof(*m));
     if (!m)
 	return NULL;
+    pthread_mutex_init(&m->lock, NULL);
     m->trial = NTRIALS-1;
     m->next_trial = TRIAL_SPAN;
     m->method = RAW;
@@ -1434,6 +1729,13 @@ cram_metrics *cram_new_metrics(void) {
     return m;
 }
 
+void cram_free_metrics(cram_metrics *m) {
+    if (!m)
+	return;
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
 char *cram_block_method2str(enum cram_block_method m) {
     switch(m) {
     case RAW:	   return "RAW";
@@ -1442,6 +1744,9 @@ char *cram_block_method2str(enum cram_block_method m) {
     case LZMA:     return "LZMA";
     case RANS0:    return "RANS0";
     case RANS1:    return "RANS1";
+    case RANS32_0: return "RANS32_0";
+    case RANS32_1: return "RANS32_1";
+    case NAME_TOK: return "NAME_TOK";
     case GZIP_RLE: return "GZIP_RLE";
     case BM_ERROR: break;
     }
@@ -1533,6 +1838,7 @@ void refs_free(refs_t *r) {
 	bgzf_close(r->fp);
 
     pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->loaded);
 
     free(r);
 }
@@ -1552,11 +1858,13 @@ static refs_t *refs_create(void) {
     r->count = 1;
     r->last = NULL;
     r->last_id = -1;
+    r->prefetch_id = -1;
 
     if (!(r->h_meta = kh_init(refs)))
 	goto err;
 
     pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->loaded, NULL);
 
     return r;
 
@@ -1699,6 +2007,7 @@ static refs_t *refs_load_fai(refs_t *r_orig, char *fn, int is_err) {
 	e->seq = NULL;
 	e->mf = NULL;
 	e->is_md5 = 0;
+	e->loading = 0;
 
 	k = kh_put(refs, r->h_meta, e->name, &n);
 	if (-1 == n)  {
@@ -2003,6 +2312,68 @@ static unsigned get_int_threadid() {
     return h;
 }
 
+/*
+ * Writes a reference sequence to the local cache file "path", named by
+ * its MD5 sum.  The file is written under a temporary name and renamed
+ * into place, so concurrent readers never see a partial file.
+ *
+ * Returns 0 on success or if the cache could not be written;
+ *        -1 if the sequence does not match md5_str.
+ */
+static int cram_ref_cache_write(char *path, const char *md5_str,
+				const char *seq, int64_t len) {
+    int pid = (int) getpid();
+    unsigned thrid = get_int_threadid();
+    char path_tmp[PATH_MAX];
+    hts_md5_context *md5;
+    char unsigned md5_buf1[16];
+    char md5_buf2[33];
+    hFILE *fp;
+
+    // Check md5sum
+    if (!(md5 = hts_md5_init()))
+	return -1;
+    hts_md5_update(md5, seq, len);
+    hts_md5_final(md5_buf1, md5);
+    hts_md5_destroy(md5);
+    hts_md5_hex(md5_buf2, md5_buf1);
+
+    if (strncmp(md5_str, md5_buf2, 32) != 0)
+	return -1;
+
+    hts_log_info("Writing cache file '%s'", path);
+    mkdir_prefix(path, 01777);
+
+    do {
+	// Attempt to further uniquify the temporary filename
+	unsigned t = ((unsigned) time(NULL)) ^ ((unsigned) clock());
+	thrid++; // Ensure filename changes even if time/clock haven't
+
+	sprintf(path_tmp, "%s.tmp_%d_%u_%u", path, pid, thrid, t);
+	fp = hopen(path_tmp, "wx");
+    } while (fp == NULL && errno == EEXIST);
+    if (!fp) {
+	perror(path_tmp);
+
+	// Not fatal - we have the data already so keep going.
+	return 0;
+    }
+
+    if (hwrite(fp, seq, len) != len) {
+	perror(path);
+    }
+    if (hclose(fp) < 0) {
+	unlink(path_tmp);
+    } else {
+	if (0 == chmod(path_tmp, 0444))
+	    rename(path_tmp, path);
+	else
+	    unlink(path_tmp);
+    }
+
+    return 0;
+}
+
 /*
  * Queries the M5 string from the header and attempts to populate the
  * reference from this using the REF_PATH environment.
@@ -2014,7 +2385,7 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
     char *ref_path = getenv("REF_PATH");
     SAM_hdr_type *ty;
     SAM_hdr_tag *tag;
-    char path[PATH_MAX], path_tmp[PATH_MAX];
+    char path[PATH_MAX];
     char cache[PATH_MAX], cache_root[PATH_MAX];
     char *local_cache = getenv("REF_CACHE");
     mFILE *mf;
@@ -2149,10 +2520,6 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
 
     /* Populate the local disk cache if required */
     if (local_cache && *local_cache) {
-        int pid = (int) getpid();
-        unsigned thrid = get_int_threadid();
-        hFILE *fp;
-
         if (*cache_root && !is_directory(cache_root)) {
             hts_log_warning("Creating reference cache directory %s\n"
                 "This may become large; see the samtools(1) manual page REF_CACHE discussion",
@@ -2160,57 +2527,10 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
         }
 
 	expand_cache_path(path, local_cache, tag->str+3);
-	hts_log_info("Writing cache file '%s'", path);
-	mkdir_prefix(path, 01777);
-
-	do {
-	    // Attempt to further uniquify the temporary filename
-	    unsigned t = ((unsigned) time(NULL)) ^ ((unsigned) clock());
-	    thrid++; // Ensure filename changes even if time/clock haven't
-
-	    sprintf(path_tmp, "%s.tmp_%d_%u_%u", path, pid, thrid, t);
-	    fp = hopen(path_tmp, "wx");
-	} while (fp == NULL && errno == EEXIST);
-	if (!fp) {
-	    perror(path_tmp);
-
-	    // Not fatal - we have the data already so keep going.
-	    return 0;
-	}
-
-	// Check md5sum
-	hts_md5_context *md5;
-	char unsigned md5_buf1[16];
-	char md5_buf2[33];
-
-	if (!(md5 = hts_md5_init())) {
-	    hclose_abruptly(fp);
-	    unlink(path_tmp);
-	    return -1;
-	}
-	hts_md5_update(md5, r->seq, r->length);
-	hts_md5_final(md5_buf1, md5);
-	hts_md5_destroy(md5);
-	hts_md5_hex(md5_buf2, md5_buf1);
-
-	if (strncmp(tag->str+3, md5_buf2, 32) != 0) {
+	if (cram_ref_cache_write(path, tag->str+3, r->seq, r->length) < 0) {
 	    hts_log_error("Mismatching md5sum for downloaded reference");
-	    hclose_abruptly(fp);
-	    unlink(path_tmp);
 	    return -1;
 	}
-
-	if (hwrite(fp, r->seq, r->length) != r->length) {
-	    perror(path);
-	}
-	if (hclose(fp) < 0) {
-	    unlink(path_tmp);
-	} else {
-	    if (0 == chmod(path_tmp, 0444))
-		rename(path_tmp, path);
-	    else
-		unlink(path_tmp);
-	}
     }
 
     return 0;
@@ -2335,6 +2655,125 @@ static char *load_ref_portion(BGZF *fp, ref_entry *e, int start, int end) {
     return seq;
 }
 
+#ifdef HAVE_MMAP
+/*
+ * Maps a raw uncompressed MD5 reference file, as held in REF_CACHE or
+ * REF_PATH, read-only.  These files are already upper case with no line
+ * breaks, so the mapping can be used directly and its pages are shared
+ * by every handle and process using the same sequence.
+ *
+ * Returns 0 on success;
+ *        -1 on failure, leaving e unchanged.
+ */
+static int cram_ref_mmap(ref_entry *e) {
+    mFILE *mf = mfopen(e->fn, "rbm");
+
+    if (!mf)
+	return -1;
+
+    if (!(mf->mode & MF_MMAP) || mf->size != e->length) {
+	mfclose(mf);
+	return -1;
+    }
+
+    e->seq = mf->data;
+    e->mf = mf;
+    return 0;
+}
+#endif
+
+/*
+ * Finds where the REF_CACHE copy of a reference would be, based on the
+ * @SQ M5 tag.
+ *
+ * Returns 0 on success, filling out path and *md5;
+ *        -1 if there is no REF_CACHE or M5 tag.
+ */
+static int cram_ref_cache_path(cram_fd *fd, ref_entry *r, char *path,
+			       char **md5) {
+    char *local_cache = getenv("REF_CACHE");
+    SAM_hdr_type *ty;
+    SAM_hdr_tag *tag;
+
+    if (!local_cache || !*local_cache || !fd->header || !r->name)
+	return -1;
+
+    if (!(ty = sam_hdr_find(fd->header, "SQ", "SN", r->name)))
+	return -1;
+
+    if (!(tag = sam_hdr_find_key(fd->header, ty, "M5", NULL)) ||
+	strlen(tag->str+3) != 32)
+	return -1;
+
+    expand_cache_path(path, local_cache, tag->str+3);
+    *md5 = tag->str+3;
+
+    return 0;
+}
+
+/*
+ * Switches a reference read from FASTA over to its REF_CACHE copy, if
+ * that exists, so later loads can map or read it instead.
+ */
+static void cram_ref_use_cache(cram_fd *fd, ref_entry *r, char *path) {
+    struct stat sb;
+    char *fn;
+
+    if (stat(path, &sb) != 0 || sb.st_size != r->length)
+	return;
+
+    if (!(fn = string_dup(fd->refs->pool, path)))
+	return;
+
+    r->fn = fn;
+    r->offset = r->line_length = r->bases_per_line = 0;
+    r->is_md5 = 1;
+}
+
+/*
+ * Reads all of reference e from fp into e->seq, mapping it instead where
+ * possible.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+static int cram_ref_read(BGZF *fp, ref_entry *e) {
+#ifdef HAVE_MMAP
+    if (e->is_md5 && !fp->is_compressed && cram_ref_mmap(e) == 0)
+	return 0;
+#endif
+
+    if (!(e->seq = load_ref_portion(fp, e, 1, e->length)))
+	return -1;
+    e->mf = NULL;
+
+    return 0;
+}
+
+/*
+ * Drops the count held on the last loaded reference, freeing it if that
+ * was the final one.  Called with r->lock held.
+ */
+static void cram_ref_drop_last(refs_t *r) {
+    if (!r->last)
+	return;
+
+#ifdef REF_DEBUG
+    int idx = 0;
+    for (idx = 0; idx < r->nref; idx++)
+	if (r->last == r->ref_id[idx])
+	    break;
+    RP("%d cram_ref_load DECR %d\n", gettid(), idx);
+#endif
+    assert(r->last->count > 0);
+    if (--r->last->count <= 0) {
+	RP("%d FREE REF %p\n", gettid(), r->last->seq);
+	if (r->last->seq)
+	    ref_entry_free_seq(r->last);
+    }
+    r->last = NULL;
+}
+
 /*
  * Load the entire reference 'id'.
  * This also increments the reference count by 1.
@@ -2344,8 +2783,6 @@ static char *load_ref_portion(BGZF *fp, ref_entry *e, int start, int end) {
  */
 ref_entry *cram_ref_load(refs_t *r, int id, int is_md5) {
     ref_entry *e = r->ref_id[id];
-    int start = 1, end = e->length;
-    char *seq;
 
     if (e->seq) {
 	return e;
@@ -2353,21 +2790,7 @@ ref_entry *cram_ref_load(refs_t *r, int id, int is_md5) {
 
     assert(e->count == 0);
 
-    if (r->last) {
-#ifdef REF_DEBUG
-	int idx = 0;
-	for (idx = 0; idx < r->nref; idx++)
-	    if (r->last == r->ref_id[idx])
-		break;
-	RP("%d cram_ref_load DECR %d\n", gettid(), idx);
-#endif
-	assert(r->last->count > 0);
-	if (--r->last->count <= 0) {
-	    RP("%d FREE REF %d (%p)\n", gettid(), id, r->ref_id[id]->seq);
-	    if (r->last->seq)
-		ref_entry_free_seq(r->last);
-	}
-    }
+    cram_ref_drop_last(r);
 
     /* Open file if it's not already the current open reference */
     if (strcmp(r->fn, e->fn) || r->fp == NULL) {
@@ -2379,17 +2802,14 @@ ref_entry *cram_ref_load(refs_t *r, int id, int is_md5) {
 	    return NULL;
     }
 
-    RP("%d Loading ref %d (%d..%d)\n", gettid(), id, start, end);
+    RP("%d Loading ref %d (1..%d)\n", gettid(), id, (int)e->length);
 
-    if (!(seq = load_ref_portion(r->fp, e, start, end))) {
+    if (cram_ref_read(r->fp, e) != 0)
 	return NULL;
-    }
 
-    RP("%d Loaded ref %d (%d..%d) = %p\n", gettid(), id, start, end, seq);
+    RP("%d Loaded ref %d (1..%d) = %p\n", gettid(), id, (int)e->length, e->seq);
 
     RP("%d INC REF %d, %d\n", gettid(), id, (int)(e->count+1));
-    e->seq = seq;
-    e->mf = NULL;
     e->count++;
 
     /*
@@ -2403,6 +2823,115 @@ ref_entry *cram_ref_load(refs_t *r, int id, int is_md5) {
     return e;
 }
 
+/*
+ * Reading a whole reference from a FASTA file can take long enough to
+ * stall the pipeline each time coordinate sorted data moves on to the
+ * next sequence.  So when we start on one sequence, a job on the thread
+ * pool reads in the next one, using its own file handle so the lock is
+ * only held briefly.  cram_get_ref() waits for a job that is part way
+ * through, rather than loading the same sequence twice.
+ *
+ * The loaded sequence holds one count, recorded in refs->prefetch_id.
+ * On first use this becomes the count held by refs->last, just as if
+ * cram_ref_load() had been called.  An unused prefetch is released when
+ * the next one completes.
+ */
+typedef struct {
+    cram_fd *fd;
+    int id;
+} cram_ref_prefetch_job;
+
+static void *cram_ref_prefetch_thread(void *arg) {
+    cram_ref_prefetch_job *j = (cram_ref_prefetch_job *)arg;
+    cram_fd *fd = j->fd;
+    refs_t *refs = fd->refs;
+    int id = j->id, ok = 0;
+    ref_entry *e, tmp;
+    BGZF *fp;
+    char path[PATH_MAX], *md5 = NULL;
+    int cached = 0;
+
+    free(j);
+
+    pthread_mutex_lock(&refs->lock);
+    e = refs->ref_id[id];
+    if (e->seq || e->loading) {
+	pthread_mutex_unlock(&refs->lock);
+	return NULL;
+    }
+    if (!e->is_md5 && cram_ref_cache_path(fd, e, path, &md5) == 0)
+	cram_ref_use_cache(fd, e, path);
+    e->loading = 1;
+    tmp = *e;
+    pthread_mutex_unlock(&refs->lock);
+
+    RP("%d Prefetching ref %d\n", gettid(), id);
+
+    if ((fp = bgzf_open_ref(tmp.fn, "r", tmp.is_md5))) {
+	ok = cram_ref_read(fp, &tmp) == 0;
+	bgzf_close(fp);
+    }
+
+    if (ok && md5 && !tmp.is_md5)
+	cached = cram_ref_cache_write(path, md5, tmp.seq, tmp.length) == 0;
+
+    pthread_mutex_lock(&refs->lock);
+    e->loading = 0;
+    if (ok) {
+	e->seq = tmp.seq;
+	e->mf = tmp.mf;
+	e->count++;
+
+	if (refs->prefetch_id >= 0)
+	    cram_ref_decr_locked(refs, refs->prefetch_id);
+	refs->prefetch_id = id;
+
+	if (cached)
+	    cram_ref_use_cache(fd, e, path);
+    }
+    pthread_cond_broadcast(&refs->loaded);
+    pthread_mutex_unlock(&refs->lock);
+
+    return NULL;
+}
+
+/*
+ * Queues a prefetch of the sequence following 'id', in header order and
+ * skipping any the index shows to have no data.  Only sequences whose
+ * location is already known are prefetched, so this never triggers a
+ * download.  Called with fd->ref_lock and fd->refs->lock held.
+ */
+static void cram_ref_prefetch(cram_fd *fd, int id) {
+    cram_ref_prefetch_job *j;
+    ref_entry *e;
+    int next = id + 1;
+
+    if (!fd->pool || !fd->tqueue || fd->unsorted || fd->range.refid != -2)
+	return;
+
+    while (fd->index && next+1 < fd->index_sz &&
+	   !cram_index_has_slices(fd, next))
+	next++;
+
+    if (next >= fd->refs->nref || next == fd->ref_prefetch)
+	return;
+    fd->ref_prefetch = next;
+
+    if (!(e = fd->refs->ref_id[next]) || e->seq || e->loading ||
+	e->length == 0 || !e->fn)
+	return;
+
+    if (!(j = malloc(sizeof(*j))))
+	return;
+    j->fd = fd;
+    j->id = next;
+
+    // Best effort only; don't wait for space in a busy queue.
+    if (hts_tpool_dispatch2(fd->pool, fd->tqueue,
+			    cram_ref_prefetch_thread, j, 1) < 0)
+	free(j);
+}
+
 /*
  * Returns a portion of a reference sequence from start to end inclusive.
  * The returned pointer is owned by either the cram_file fd or by the
@@ -2429,6 +2958,7 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
     ref_entry *r;
     char *seq;
     int ostart = start;
+    char path[PATH_MAX], *md5 = NULL;
 
     if (id == -1)
 	return NULL;
@@ -2484,6 +3014,9 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
      * rewrite my code to have one curl handle per thread.
      */
     pthread_mutex_lock(&fd->refs->lock);
+    while (r->loading)
+	pthread_cond_wait(&fd->refs->loaded, &fd->refs->lock);
+
     if (r->length == 0) {
 	if (cram_populate_ref(fd, id, r) == -1) {
 	    hts_log_error("Failed to populate reference for id %d", id);
@@ -2509,7 +3042,24 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
     if (start < 1)
 	return NULL;
 
-    if (end - start >= 0.5*r->length || fd->shared_ref) {
+    /*
+     * Prefer the REF_CACHE copy of a sequence to parsing the FASTA file
+     * into a private buffer.  Creating the cache file needs the whole
+     * sequence, to check its MD5 sum.  If the file can be mapped, mapping
+     * all of it is no dearer than reading part of it, so we then always
+     * load the whole sequence.
+     */
+    if (!r->seq && !r->is_md5 && cram_ref_cache_path(fd, r, path, &md5) == 0) {
+	cram_ref_use_cache(fd, r, path);
+	if (r->is_md5)
+	    md5 = NULL;
+    }
+
+    if (end - start >= 0.5*r->length || fd->shared_ref || md5
+#ifdef HAVE_MMAP
+	|| r->is_md5
+#endif
+	) {
 	start = 1;
 	end = r->length;
     }
@@ -2527,6 +3077,12 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 
 	if (id >= 0) {
 	    if (r->seq) {
+		if (fd->refs->prefetch_id == id) {
+		    // First use, so its count passes to refs->last
+		    cram_ref_drop_last(fd->refs);
+		    fd->refs->last = r;
+		    fd->refs->prefetch_id = -1;
+		}
 		cram_ref_incr_locked(fd->refs, id);
 	    } else {
 		ref_entry *e;
@@ -2536,6 +3092,10 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 		    return NULL;
 		}
 
+		if (md5 && !r->is_md5 &&
+		    cram_ref_cache_write(path, md5, e->seq, e->length) == 0)
+		    cram_ref_use_cache(fd, r, path);
+
 		/* unsorted data implies cache ref indefinitely, to avoid
 		 * continually loading and unloading.
 		 */
@@ -2549,6 +3109,8 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 	    fd->ref_id    = id;
 
 	    cp = fd->refs->ref_id[id]->seq + ostart-1;
+
+	    cram_ref_prefetch(fd, id);
 	} else {
 	    fd->ref = NULL;
 	    cp = NULL;
@@ -2616,6 +3178,70 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
     return seq + ostart - start;
 }
 
+/*
+ * With threads every reference is shared and loaded whole, which for a
+ * small region query can cost more than the query itself.  In that case
+ * this returns a private copy of the requested portion instead, read
+ * with load_ref_portion(), for the caller to free.
+ *
+ * Returns the reference from start to end inclusive on success;
+ *         NULL if cram_get_ref() should be used instead, or on failure.
+ */
+char *cram_get_ref_portion(cram_fd *fd, int id, int start, int end) {
+    ref_entry *r;
+    char *seq = NULL;
+    int64_t rstart, rend;
+
+    if (!fd->shared_ref || fd->unsorted || id < 0 || id != fd->range.refid
+	|| start < 1 || end < start)
+	return NULL;
+
+    pthread_mutex_lock(&fd->ref_lock);
+    pthread_mutex_lock(&fd->refs->lock);
+
+    if (id >= fd->refs->nref || !(r = fd->refs->ref_id[id]))
+	goto out;
+
+    // Already loaded or on its way, so share it.
+    if (r->seq || r->loading)
+	goto out;
+
+    if (r->length == 0) {
+	if (cram_populate_ref(fd, id, r) == -1)
+	    goto out;
+	r = fd->refs->ref_id[id];
+    }
+
+#ifdef HAVE_MMAP
+    // Mapping the whole file is cheaper than reading part of it.
+    if (r->is_md5)
+	goto out;
+#endif
+
+    rstart = MAX(fd->range.start, 1);
+    rend = MIN(fd->range.end, r->length);
+    if (rend - rstart >= 0.5*r->length || start > r->length)
+	goto out;
+    if (end > r->length)
+	end = r->length;
+
+    if (strcmp(fd->refs->fn, r->fn) || fd->refs->fp == NULL) {
+	if (fd->refs->fp)
+	    if (bgzf_close(fd->refs->fp) != 0)
+		goto out;
+	fd->refs->fn = r->fn;
+	if (!(fd->refs->fp = bgzf_open_ref(fd->refs->fn, "r", r->is_md5)))
+	    goto out;
+    }
+
+    seq = load_ref_portion(fd->refs->fp, r, start, end);
+
+ out:
+    pthread_mutex_unlock(&fd->refs->lock);
+    pthread_mutex_unlock(&fd->ref_lock);
+    return seq;
+}
+
 /*
  * If fd has been opened for reading, it may be permitted to specify 'fn'
  * as NULL and let the code auto-detect the reference by parsing the
@@ -2874,6 +3500,8 @@ cram_container *cram_read_container(cram_fd *fd) {
     c->offset = rd;
     c->slices = NULL;
     c->curr_slice = 0;
+    c->curr_slice_mt = 0;
+    c->slices_in_use = 0;
     c->max_slice = c->num_landmarks;
     c->slice_rec = 0;
     c->curr_rec = 0;
@@ -3241,6 +3869,7 @@ void cram_free_compression_header(cram_block_compression_hdr *hdr) {
     if (hdr->TD_keys)
 	string_pool_destroy(hdr->TD_keys);
 
+    free(hdr->ds_ids);
     free(hdr);
 }
 
@@ -3326,6 +3955,9 @@ void cram_free_slice(cram_slice *s) {
     if (s->aux_block)
 	free(s->aux_block);
 
+    if (s->ref_free)
+	free(s->ref_free);
+
     free(s);
 }
 
@@ -3399,9 +4031,13 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs) {
  *         NULL on failure
  */
 cram_slice *cram_read_slice(cram_fd *fd) {
+    return cram_read_slice2(fd, NULL);
+}
+
+cram_slice *cram_read_slice2(cram_fd *fd, cram_block_compression_hdr *hdr) {
     cram_block *b = cram_read_block(fd);
     cram_slice *s = calloc(1, sizeof(*s));
-    int i, n, max_id, min_id;
+    int i, n;
 
     if (!b || !s)
 	goto err;
@@ -3429,26 +4065,26 @@ cram_slice *cram_read_slice(cram_fd *fd) {
     if (!s->block)
 	goto err;
 
-    for (max_id = i = 0, min_id = INT_MAX; i < n; i++) {
-	if (!(s->block[i] = cram_read_block(fd)))
+    for (i = 0; i < n; i++) {
+	// Never skip an embedded reference
+	if (!(s->block[i] = cram_read_block2(fd, hdr, s->hdr->ref_base_id)))
 	    goto err;
-
-	if (s->block[i]->content_type == EXTERNAL) {
-	    if (max_id < s->block[i]->content_id)
-		max_id = s->block[i]->content_id;
-	    if (min_id > s->block[i]->content_id)
-		min_id = s->block[i]->content_id;
-	}
     }
-    if (min_id >= 0 && max_id < 1024) {
-	if (!(s->block_by_id = calloc(1024, sizeof(s->block[0]))))
-	    goto err;
 
-	for (i = 0; i < n; i++) {
-	    if (s->block[i]->content_type != EXTERNAL)
-		continue;
-	    s->block_by_id[s->block[i]->content_id] = s->block[i];
-	}
+    // Small content ids are indexed directly, the rest (eg aux tags) by
+    // a hash of the low bits; see cram_get_block_by_id.
+    if (!(s->block_by_id = calloc(1024 + 256, sizeof(s->block[0]))))
+	goto err;
+
+    for (i = 0; i < n; i++) {
+	int id = s->block[i]->content_id;
+	if (s->block[i]->content_type != EXTERNAL ||
+	    !CRAM_BLOCK_PRESENT(s->block[i]))
+	    continue;
+	if (id >= 0 && id < 1024)
+	    s->block_by_id[id] = s->block[i];
+	else
+	    s->block_by_id[1024 + (id & 255)] = s->block[i];
     }
 
     /* Initialise encoding/decoding tables */
@@ -4060,6 +4696,7 @@ cram_fd *cram_dopen(hFILE *fp, const char *filename, const char *mode) {
     fd->record_counter = 0;
 
     fd->ctr = NULL;
+    fd->ctr_mt = NULL;
     fd->refs  = refs_create();
     if (!fd->refs)
 	goto err;
@@ -4076,15 +4713,22 @@ cram_fd *cram_dopen(hFILE *fp, const char *filename, const char *mode) {
     fd->lossy_read_names = 0;
     fd->use_bz2 = 0;
     fd->use_rans = (CRAM_MAJOR_VERS(fd->version) >= 3);
+    fd->use_rans32 = 0;
+    fd->use_tok = 0;
+    fd->favour_read_speed = 0;
     fd->use_lzma = 0;
     fd->multi_seq = -1;
     fd->unsorted   = 0;
     fd->shared_ref = 0;
+    fd->ref_prefetch = -1;
 
     fd->index       = NULL;
+    fd->index_txt   = NULL;
+    fd->index_txt_pos = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
+    fd->tqueue      = NULL;
     fd->job_pending = NULL;
     fd->ooc         = 0;
     fd->required_fields = INT_MAX;
@@ -4122,6 +4766,7 @@ cram_fd *cram_dopen(hFILE *fp, const char *filename, const char *mode) {
  */
 int cram_seek(cram_fd *fd, off_t offset, int whence) {
     char buf[65536];
+    int err = herrno(fd->fp);
 
     fd->ooc = 0;
 
@@ -4139,6 +4784,10 @@ int cram_seek(cram_fd *fd, off_t offset, int whence) {
 	offset -= len;
     }
 
+    /* Reading worked, so the failed seek (e.g. ESPIPE) is not an error */
+    if (!err)
+	hclearerr(fd->fp);
+
     return 0;
 }
 
@@ -4184,10 +4833,13 @@ int cram_close(cram_fd *fd) {
 	    return -1;
     }
 
+    if (fd->mode != 'w')
+	cram_decode_reset(fd);
+
     if (fd->pool && fd->eof >= 0) {
 	hts_tpool_process_flush(fd->rqueue);
 
-	if (0 != cram_flush_result(fd))
+	if (fd->mode == 'w' && 0 != cram_flush_result(fd))
 	    return -1;
 
 	pthread_mutex_destroy(&fd->metrics_lock);
@@ -4199,6 +4851,11 @@ int cram_close(cram_fd *fd) {
 	//fprintf(stderr, "CRAM: destroy queue %p\n", fd->rqueue);
 
 	hts_tpool_process_destroy(fd->rqueue);
+
+	if (fd->tqueue) {
+	    hts_tpool_process_flush(fd->tqueue);
+	    hts_tpool_process_destroy(fd->tqueue);
+	}
     }
 
     if (fd->mode == 'w') {
@@ -4256,15 +4913,14 @@ int cram_close(cram_fd *fd) {
         free(fd->ref_free);
 
     for (i = 0; i < DS_END; i++)
-	if (fd->m[i])
-	    free(fd->m[i]);
+	cram_free_metrics(fd->m[i]);
 
     if (fd->tags_used) {
 	khint_t k;
 
 	for (k = kh_begin(fd->tags_used); k != kh_end(fd->tags_used); k++) {
 	    if (kh_exist(fd->tags_used, k))
-		free(kh_val(fd->tags_used, k));
+		cram_free_metrics(kh_val(fd->tags_used, k));
 	}
 
 	kh_destroy(m_metrics, fd->tags_used);
@@ -4382,6 +5038,18 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
 	fd->use_lzma = va_arg(args, int);
 	break;
 
+    case CRAM_OPT_USE_RANS32:
+	fd->use_rans32 = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_USE_TOK:
+	fd->use_tok = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_FAVOUR_READ_SPEED:
+	fd->favour_read_speed = va_arg(args, int);
+	break;
+
     case CRAM_OPT_SHARED_REF:
 	fd->shared_ref = 1;
 	refs = va_arg(args, refs_t *);
@@ -4432,6 +5100,7 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
                 return -1;
 
 	    fd->rqueue = hts_tpool_process_init(fd->pool, nthreads*2, 0);
+	    fd->tqueue = hts_tpool_process_init(fd->pool, nthreads*2, 1);
 	    pthread_mutex_init(&fd->metrics_lock, NULL);
 	    pthread_mutex_init(&fd->ref_lock, NULL);
 	    pthread_mutex_init(&fd->bam_list_lock, NULL);
@@ -4448,6 +5117,8 @@ int cram_set_voption(cram_fd *fd, enum hts_fmt_option opt, va_list args) {
 	    fd->rqueue = hts_tpool_process_init(fd->pool,
 						p->qsize ? p->qsize : hts_tpool_size(fd->pool)*2,
 						0);
+	    fd->tqueue = hts_tpool_process_init(fd->pool,
+						hts_tpool_size(fd->pool)*2, 1);
 	    pthread_mutex_init(&fd->metrics_lock, NULL);
 	    pthread_mutex_init(&fd->ref_lock, NULL);
 	    pthread_mutex_init(&fd->bam_list_lock, NULL);
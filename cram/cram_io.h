@@ -450,6 +450,24 @@ char *zlib_mem_inflate(char *cdata, size_t csize, size_t *size);
  */
 int cram_uncompress_block(cram_block *b);
 
+/*! Uncompresses an array of blocks, using the thread pool if fd has one.
+ *
+ * The order of the blocks in the array is not preserved.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 if any block failed
+ */
+int cram_uncompress_blocks(cram_fd *fd, cram_block **b, int nb);
+
+/*! INTERNAL:
+ * Calls func(arg, i) for i from 0 to n-1, returning once all have
+ * finished.  If parallel is set and fd has a thread pool the calls may
+ * run concurrently, with the calling thread taking part.
+ */
+void cram_run_tasks(cram_fd *fd, void (*func)(void *arg, int i), void *arg,
+		    int n, int parallel);
+
 /*! Compresses a block.
  *
  * Compresses a block using one of two different zlib strategies. If we only
@@ -466,22 +484,52 @@ int cram_uncompress_block(cram_block *b);
 int cram_compress_block(cram_fd *fd, cram_block *b, cram_metrics *metrics,
 			int method, int level);
 
+/*! Compresses a block of NUL-terminated read names.
+ *
+ * The name tokeniser is tried as well as the methods cram_compress_block()
+ * chooses between, and the smallest result is kept.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_compress_names(cram_fd *fd, cram_block *b, cram_metrics *metrics,
+			int method, int level);
+
 cram_metrics *cram_new_metrics(void);
+void cram_free_metrics(cram_metrics *m);
 char *cram_block_method2str(enum cram_block_method m);
 char *cram_content_type2str(enum cram_content_type t);
 
 /*
- * Find an external block by its content_id
+ * Blocks skipped by cram_read_slice2 are kept as placeholders with a size
+ * but no data.
+ */
+#define CRAM_BLOCK_PRESENT(b) ((b)->data || (b)->uncomp_size == 0)
+
+/*
+ * Find an external block by its content_id.  Skipped blocks are not
+ * returned.
  */
 
 static inline cram_block *cram_get_block_by_id(cram_slice *slice, int id) {
-    if (slice->block_by_id && id >= 0 && id < 1024) {
-        return slice->block_by_id[id];
-    } else {
+    if (slice->block_by_id) {
+	cram_block *b;
+	if (id >= 0 && id < 1024)
+	    return slice->block_by_id[id];
+
+	// Hashed; fall through to a search on collision
+	b = slice->block_by_id[1024 + (id & 255)];
+	if (!b || b->content_id == id)
+	    return b;
+    }
+
+    {
         int i;
         for (i = 0; i < slice->hdr->num_blocks; i++) {
 	    cram_block *b = slice->block[i];
-	    if (b && b->content_type == EXTERNAL && b->content_id == id)
+	    if (b && b->content_type == EXTERNAL && b->content_id == id &&
+		CRAM_BLOCK_PRESENT(b))
 	        return b;
 	}
     }
@@ -653,6 +701,17 @@ void refs_free(refs_t *r);
  *         NULL on failure
  */
 char *cram_get_ref(cram_fd *fd, int id, int start, int end);
+
+/*! Returns a private copy of part of a reference for a region query
+ *
+ * Used when threads would otherwise make cram_get_ref() load all of a
+ * reference sequence to answer a small region query.
+ *
+ * @return
+ * Returns the malloced portion on success, to be freed by the caller;
+ *         NULL if cram_get_ref() should be used instead, or on failure.
+ */
+char *cram_get_ref_portion(cram_fd *fd, int id, int start, int end);
 void cram_ref_incr(refs_t *r, int id);
 void cram_ref_decr(refs_t *r, int id);
 /**@}*/
@@ -751,6 +810,18 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs);
  */
 cram_slice *cram_read_slice(cram_fd *fd);
 
+/*! Loads a slice, skipping over external blocks that are not needed
+ * for the data series selected in hdr by cram_dependent_data_series.
+ *
+ * Skipped blocks are left as RAW placeholders without data.  Passing hdr as
+ * NULL reads every block, as cram_read_slice does.
+ *
+ * @return
+ * Returns cram_slice ptr on success;
+ *         NULL on failure
+ */
+cram_slice *cram_read_slice2(cram_fd *fd, cram_block_compression_hdr *hdr);
+
 
 
 /**@}*/
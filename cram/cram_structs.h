@@ -201,6 +201,10 @@ enum cram_block_method {
     RANS0    = 4,
     RANS1    = 10, // Not externalised; stored as RANS (generic)
     GZIP_RLE = 11, // NB: not externalised in CRAM
+    RANS32   = 40, // htslib extension; 32-way interleaved rANS, either order
+    RANS32_0 = 40,
+    RANS32_1 = 41, // Not externalised; stored as RANS32 (generic)
+    NAME_TOK = 42, // htslib extension; read name tokeniser
 };
 
 enum cram_content_type {
@@ -226,6 +230,7 @@ typedef struct {
     int sz_rans1;
     int sz_bzip2;
     int sz_lzma;
+    int sz_raw;    // uncompressed
 
     // resultant method from trials
     int method;
@@ -246,6 +251,9 @@ typedef struct {
     double rans1_extra;
     double bzip2_extra;
     double lzma_extra;
+
+    // Guards the above, so blocks of different types don't contend
+    pthread_mutex_t lock;
 } cram_metrics;
 
 // Hash aux key (XX:i) to cram_metrics
@@ -313,7 +321,11 @@ typedef struct cram_block_compression_hdr {
     char *uncomp; // A single block of uncompressed data
     size_t uncomp_size, uncomp_alloc;
 
-    unsigned int data_series; // See cram_fields enum below
+    // Data series and external block content ids needed to satisfy
+    // fd->required_fields; see cram_dependent_data_series.
+    int ds_ready;
+    uint32_t data_series;
+    int *ds_ids, nds_ids; // sorted; nds_ids < 0 means all blocks
 } cram_block_compression_hdr;
 
 typedef struct cram_map {
@@ -382,6 +394,8 @@ typedef struct cram_container {
     /* For construction purposes */
     int max_slice, curr_slice;   // maximum number of slices
     int max_rec, curr_rec;       // current and max recs per slice
+    int curr_slice_mt;           // slices read so far by decoder read-ahead
+    int slices_in_use;           // slices read but not yet consumed
     int max_c_rec, curr_c_rec;   // current and max recs per container
     int slice_rec;               // rec no. for start of this slice
     int curr_ref;                // current ref ID. -2 for no previous
@@ -547,6 +561,9 @@ typedef struct cram_slice {
     /* State used during encoding/decoding */
     int last_apos, max_apos;
 
+    /* Data series needed to decode this slice; see cram_fields below */
+    uint32_t data_series;
+
     /* Array of decoded cram records */
     cram_record *crecs;
 
@@ -582,6 +599,7 @@ typedef struct cram_slice {
     khash_t(m_s2i) *pair[2];   // for identifying read-pairs in this slice.
 
     char *ref;                 // slice of current reference
+    char *ref_free;            // private copy of ref, for region queries
     int ref_start;             // start position of current reference;
     int ref_end;               // end position of current reference;
     int ref_id;
@@ -606,6 +624,7 @@ typedef struct ref_entry {
     char *seq;
     mFILE *mf;
     int is_md5;            // Reference comes from a raw seq found by MD5
+    int loading;           // Being read in by a prefetch job
 } ref_entry;
 
 KHASH_MAP_INIT_STR(refs, ref_entry*)
@@ -626,6 +645,9 @@ typedef struct {
     pthread_mutex_t lock;  // Mutex for multi-threaded updating
     ref_entry *last;       // Last queried sequence
     int last_id;           // Used in cram_ref_decr_locked to delay free
+
+    pthread_cond_t loaded; // Signalled when a prefetch job finishes
+    int prefetch_id;       // Prefetched sequence holding a count, or -1
 } refs_t;
 
 /*-----------------------------------------------------------------------------
@@ -688,6 +710,9 @@ typedef struct cram_fd {
     // Current container being processed.
     cram_container *ctr;
 
+    // Container being read ahead of ctr when decoding.
+    cram_container *ctr_mt;
+
     // positions for encoding or decoding
     int first_base, last_base;
 
@@ -698,6 +723,7 @@ typedef struct cram_fd {
     int   ref_start;
     int   ref_end;
     char *ref_fn;   // reference fasta filename
+    int   ref_prefetch;        // last ref id queued for prefetching
 
     // compression level and metrics
     int level;
@@ -714,6 +740,9 @@ typedef struct cram_fd {
     int ignore_md5;
     int use_bz2;
     int use_rans;
+    int use_rans32;
+    int use_tok;
+    int favour_read_speed;
     int use_lzma;
     int shared_ref;
     unsigned int required_fields;
@@ -728,6 +757,9 @@ typedef struct cram_fd {
 
     int         index_sz;
     cram_index *index;                  // array, sizeof index_sz
+    char       *index_txt;              // .crai text, parsed on demand
+    size_t     *index_txt_pos;          // unparsed lines of index[i] are
+                                        // [2*i] to [2*i+1] in index_txt
     off_t first_container;
     int eof;
     int last_slice;                     // number of recs encoded in last slice
@@ -739,7 +771,8 @@ typedef struct cram_fd {
     int own_pool;
     hts_tpool *pool;
     hts_tpool_process *rqueue;
-    pthread_mutex_t metrics_lock;
+    hts_tpool_process *tqueue;          // cram_run_tasks helpers
+    pthread_mutex_t metrics_lock;       // fd->tags_used
     pthread_mutex_t ref_lock;
     spare_bams *bl;
     pthread_mutex_t bam_list_lock;
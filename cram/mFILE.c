@@ -122,11 +122,15 @@ int mfmmap(mFILE *mf, FILE *fp, const char *fn) {
 	return -1;
 
     mf->size = sb.st_size;
+    if (mf->size == 0)
+	return -1;
     mf->data = mmap(NULL, mf->size, PROT_READ, MAP_SHARED,
 		    fileno(fp), 0);
 
-    if (!mf->data)
+    if (mf->data == MAP_FAILED) {
+	mf->data = NULL;
 	return -1;
+    }
 
     mf->alloced = 0;
     return 0;
@@ -0,0 +1,705 @@
+/*
+ * Copyright (c) 2017 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A 32-way interleaved variant of the codecs in rANS_static.c.
+ *
+ * rANS_static.c keeps 4 states and renormalises a byte at a time, which
+ * leaves the decoder bound by the latency of each state's dependency chain.
+ * Here 32 states are interleaved and renormalised 16 bits at a time, so a
+ * state needs at most one word per symbol and 8 or 16 states can be stepped
+ * together in a SIMD register.
+ *
+ * Stream layout:
+ *
+ *   byte    order (0 or 1)
+ *   uint32  compressed size, excluding these first 9 bytes
+ *   uint32  uncompressed size
+ *   ...     frequency table(s), encoded as in rANS_static.c but summing
+ *           to exactly TOTFREQ
+ *   uint32  x 32  initial decoder states
+ *   uint16  x *   renormalisation words
+ *
+ * All integers are little-endian.  Order-0 data is dealt round robin, so
+ * symbol i belongs to state i%32.  Order-1 data is split into 32 equal
+ * segments, one per state, with the last state also taking the remainder;
+ * each segment starts with a context of 0.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cram/rANS_static32x16.h"
+#include "cram/rANS_byte.h"
+#include "htslib/hts_defs.h"
+
+#define TF_SHIFT 12
+#define TOTFREQ (1<<TF_SHIFT)
+
+#define NX 32                  // Number of interleaved states
+#define RANS_L16 (1u<<15)      // Lower bound of the normalisation interval
+
+/* The SIMD decoders are compiled in when the compiler can target them on a
+ * per-function basis, and are then selected at run time via CPU detection.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) \
+    && (HTS_GCC_AT_LEAST(4,9) || HTS_COMPILER_HAS(__target__))
+#define HTS_RANS_AVX2 1
+#if HTS_GCC_AT_LEAST(5,0) || defined(__clang__)
+#define HTS_RANS_AVX512 1
+#endif
+#include <immintrin.h>
+#endif
+
+static inline void u32_put(unsigned char *cp, uint32_t x) {
+    cp[0] = x; cp[1] = x >> 8; cp[2] = x >> 16; cp[3] = x >> 24;
+}
+
+static inline uint32_t u32_get(const unsigned char *cp) {
+    return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t) cp[3] << 24);
+}
+
+/*-----------------------------------------------------------------------------
+ * Frequency tables
+ */
+
+/*
+ * Scales the symbol counts in F[] (summing to total) to frequencies in N[]
+ * summing to exactly TOTFREQ, keeping every present symbol at least 1.
+ */
+static void normalise_freqs(const uint32_t *F, uint32_t *N, uint64_t total) {
+    uint32_t fsum = 0, m = 0;
+    int j, M = 0;
+
+    for (j = 0; j < 256; j++) {
+	N[j] = 0;
+	if (!F[j])
+	    continue;
+	if (m < F[j])
+	    m = F[j], M = j;
+	if ((N[j] = (uint64_t) F[j] * TOTFREQ / total) == 0)
+	    N[j] = 1;
+	fsum += N[j];
+    }
+
+    if (fsum < TOTFREQ) {
+	N[M] += TOTFREQ - fsum;
+    } else {
+	// Rounding rare symbols up to 1 can overshoot; take it back from
+	// the symbols that can spare it.
+	while (fsum > TOTFREQ) {
+	    for (j = 0; j < 256 && fsum > TOTFREQ; j++) {
+		if (N[j] > 1)
+		    N[j]--, fsum--;
+	    }
+	}
+    }
+}
+
+/*
+ * Writes the present symbols of N[] with their frequencies, run-length
+ * encoding consecutive symbols, as rANS_static.c does.  Returns the new
+ * output position.
+ */
+static unsigned char *write_freqs(unsigned char *cp, const uint32_t *N) {
+    int j, rle;
+
+    for (rle = j = 0; j < 256; j++) {
+	if (!N[j])
+	    continue;
+
+	if (rle) {
+	    rle--;
+	} else {
+	    *cp++ = j;
+	    if (j && N[j-1]) {
+		for (rle = j+1; rle < 256 && N[rle]; rle++)
+		    ;
+		rle -= j+1;
+		*cp++ = rle;
+	    }
+	}
+
+	if (N[j] < 128) {
+	    *cp++ = N[j];
+	} else {
+	    *cp++ = 128 | (N[j] >> 8);
+	    *cp++ = N[j] & 0xff;
+	}
+    }
+    *cp++ = 0;
+
+    return cp;
+}
+
+/*
+ * Reads a table written by write_freqs() and builds the decoder lookup
+ * for it in s3[0..TOTFREQ-1].  Each entry packs the symbol in bits
+ * 0-7, its offset within the symbol's range in bits 8-19 and the symbol
+ * frequency minus one in bits 20-31.
+ *
+ * Returns the new input position, or NULL if the table is malformed or
+ * does not sum to TOTFREQ.
+ */
+static unsigned char *read_freqs(unsigned char *cp, unsigned char *end,
+				 uint32_t *s3) {
+    uint32_t N[256] = {0}, x = 0, i;
+    int j, rle = 0;
+
+    if (cp >= end)
+	return NULL;
+    j = *cp++;
+    do {
+	uint32_t F;
+	if (end - cp < 4 || N[j])
+	    return NULL;
+	if ((F = *cp++) >= 128)
+	    F = ((F & 127) << 8) | *cp++;
+	if (F == 0 || F > TOTFREQ - x)
+	    return NULL;
+	N[j] = F;
+	for (i = 0; i < F; i++)
+	    s3[x+i] = j | (i << 8) | ((F-1) << 20);
+	x += F;
+
+	if (!rle && j+1 == *cp) {
+	    j = *cp++;
+	    rle = *cp++;
+	} else if (rle) {
+	    rle--;
+	    if (++j > 255)
+		return NULL;
+	} else {
+	    j = *cp++;
+	}
+    } while (j);
+
+    return x == TOTFREQ ? cp : NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Encoder
+ */
+
+static void enc_symbol_init(RansEncSymbol *s, uint32_t start, uint32_t freq) {
+    RansEncSymbolInit(s, start, freq, TF_SHIFT);
+    s->x_max = ((RANS_L16 >> TF_SHIFT) << 16) * freq;
+}
+
+static inline void enc_put(uint32_t *r, unsigned char **pptr,
+			   const RansEncSymbol *s) {
+    uint32_t x = *r, q;
+
+    if (x >= s->x_max) {
+	unsigned char *ptr = *pptr - 2;
+	ptr[0] = x;
+	ptr[1] = x >> 8;
+	*pptr = ptr;
+	x >>= 16;
+    }
+
+    q = (uint32_t) (((uint64_t) x * s->rcp_freq) >> s->rcp_shift);
+    *r = x + s->bias + q * s->cmpl_freq;
+}
+
+static void enc_symbols_init(RansEncSymbol *syms, const uint32_t *N) {
+    uint32_t x = 0;
+    int j;
+    for (j = 0; j < 256; j++) {
+	if (N[j]) {
+	    enc_symbol_init(&syms[j], x, N[j]);
+	    x += N[j];
+	}
+    }
+}
+
+unsigned char *rans_compress_32x16(unsigned char *in, unsigned int in_size,
+				   unsigned int *out_size, int order) {
+    // At most 12 bits per symbol, plus the tables and states.
+    size_t bound = (size_t) in_size + in_size/2 + 257*257*3 + 9 + NX*4 + 16;
+    unsigned char *out_buf = malloc(bound), *cp, *ptr, *out_end;
+    RansEncSymbol *syms = NULL;
+    uint32_t R[NX], *F = NULL, N[256];
+    unsigned int i, isz;
+    int j, k;
+
+    if (!out_buf)
+	return NULL;
+
+    out_end = ptr = out_buf + bound;
+    cp = out_buf + 9;
+    order = order ? 1 : 0;
+    isz = in_size / NX;
+
+    if (in_size == 0)
+	goto done;
+
+    if (!(F = calloc(order ? 256*256 : 256, sizeof(*F))))
+	goto err;
+    if (!(syms = malloc((order ? 256*256 : 256) * sizeof(*syms))))
+	goto err;
+
+    if (order == 0) {
+	for (i = 0; i < in_size; i++)
+	    F[in[i]]++;
+	normalise_freqs(F, N, in_size);
+	cp = write_freqs(cp, N);
+	enc_symbols_init(syms, N);
+    } else {
+	uint32_t T[256] = {0};
+	int rle;
+
+	for (j = 0; j < NX; j++) {
+	    unsigned int s = j * isz, e = j == NX-1 ? in_size : s + isz;
+	    unsigned char c = 0;
+	    for (i = s; i < e; i++) {
+		F[c*256 + in[i]]++;
+		T[c]++;
+		c = in[i];
+	    }
+	}
+
+	for (rle = j = 0; j < 256; j++) {
+	    if (!T[j])
+		continue;
+
+	    if (rle) {
+		rle--;
+	    } else {
+		*cp++ = j;
+		if (j && T[j-1]) {
+		    for (rle = j+1; rle < 256 && T[rle]; rle++)
+			;
+		    rle -= j+1;
+		    *cp++ = rle;
+		}
+	    }
+
+	    normalise_freqs(&F[j*256], N, T[j]);
+	    cp = write_freqs(cp, N);
+	    enc_symbols_init(&syms[j*256], N);
+	}
+	*cp++ = 0;
+    }
+
+    for (j = 0; j < NX; j++)
+	R[j] = RANS_L16;
+
+    // Encode backwards, in the reverse of the order the decoder reads.
+    if (order == 0) {
+	for (i = in_size; i > isz * NX; i--)
+	    enc_put(&R[(i-1) % NX], &ptr, &syms[in[i-1]]);
+	for (k = isz-1; k >= 0; k--) {
+	    unsigned char *c = &in[k*NX];
+	    for (j = NX-1; j >= 0; j--)
+		enc_put(&R[j], &ptr, &syms[c[j]]);
+	}
+    } else {
+	for (i = in_size; i > isz * NX; i--) {
+	    unsigned int c = i-1 > (NX-1)*isz ? in[i-2] : 0;
+	    enc_put(&R[NX-1], &ptr, &syms[c*256 + in[i-1]]);
+	}
+	for (k = isz-1; k >= 0; k--) {
+	    for (j = NX-1; j >= 0; j--) {
+		unsigned int c = k ? in[j*isz + k-1] : 0;
+		enc_put(&R[j], &ptr, &syms[c*256 + in[j*isz + k]]);
+	    }
+	}
+    }
+
+    for (j = NX-1; j >= 0; j--) {
+	ptr -= 4;
+	u32_put(ptr, R[j]);
+    }
+
+    memmove(cp, ptr, out_end - ptr);
+    cp += out_end - ptr;
+
+ done:
+    *out_size = cp - out_buf;
+    out_buf[0] = order;
+    u32_put(out_buf+1, *out_size - 9);
+    u32_put(out_buf+5, in_size);
+
+    free(F);
+    free(syms);
+    return out_buf;
+
+ err:
+    free(F);
+    free(syms);
+    free(out_buf);
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Decoder
+ *
+ * Each decode kernel steps all NX states through groups k..nk-1 of the
+ * input, for order-0 writing symbol j of group k to out[k*NX+j] and for
+ * order-1 (C != NULL, holding each state's context) to out[j*isz+k].
+ * States and contexts are read from and written back to R[] and C[].
+ *
+ * The SIMD kernels stop early, returning the group reached, once fewer
+ * bytes remain than a whole group could consume; the scalar kernel then
+ * finishes the job with bounds checks.
+ */
+
+typedef int dec_kernel(const uint32_t *s3, uint32_t *R, uint32_t *C,
+		       unsigned char **pptr, unsigned char *end,
+		       unsigned char *out, int k, int nk, size_t isz);
+
+static inline int dec_scalar_(const uint32_t *s3, uint32_t *R, uint32_t *C,
+			      unsigned char **pptr, unsigned char *end,
+			      unsigned char *out, int k, int nk, size_t isz) {
+    unsigned char *ptr = *pptr;
+    int j;
+
+    for (; k < nk; k++) {
+	for (j = 0; j < NX; j++) {
+	    uint32_t x = R[j], t;
+	    if (C) {
+		t = s3[(C[j] << TF_SHIFT) | (x & (TOTFREQ-1))];
+		out[j*isz + k] = C[j] = t & 0xff;
+	    } else {
+		t = s3[x & (TOTFREQ-1)];
+		out[(size_t)k*NX + j] = t;
+	    }
+	    x = ((t >> 20) + 1) * (x >> TF_SHIFT) + ((t >> 8) & 0xfff);
+	    if (x < RANS_L16) {
+		if (end - ptr < 2)
+		    return -1;
+		x = (x << 16) | ptr[0] | (ptr[1] << 8);
+		ptr += 2;
+	    }
+	    R[j] = x;
+	}
+    }
+
+    *pptr = ptr;
+    return k;
+}
+
+// Separate copies for each order keep the inner loop free of the test.
+static int dec_scalar(const uint32_t *s3, uint32_t *R, uint32_t *C,
+		      unsigned char **pptr, unsigned char *end,
+		      unsigned char *out, int k, int nk, size_t isz) {
+    return C ? dec_scalar_(s3, R, C, pptr, end, out, k, nk, isz)
+	     : dec_scalar_(s3, R, NULL, pptr, end, out, k, nk, isz);
+}
+
+#ifdef HTS_RANS_AVX2
+// perm8[m] moves the first popcount(m) words to the lanes set in m.
+static uint32_t perm8[256][8];
+static pthread_once_t perm8_once = PTHREAD_ONCE_INIT;
+
+static void perm8_init(void) {
+    int m, j;
+    for (m = 0; m < 256; m++) {
+	uint32_t c = 0;
+	for (j = 0; j < 8; j++)
+	    perm8[m][j] = (m >> j) & 1 ? c++ : 0;
+    }
+}
+
+__attribute__((target("avx2")))
+static int dec_avx2(const uint32_t *s3, uint32_t *R, uint32_t *C,
+		    unsigned char **pptr, unsigned char *end,
+		    unsigned char *out, int k, int nk, size_t isz) {
+    const __m256i mask = _mm256_set1_epi32(TOTFREQ-1);
+    const __m256i bmask = _mm256_set1_epi32(0xff);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i lim = _mm256_set1_epi32(RANS_L16);
+    const __m256i pack = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    unsigned char *ptr = *pptr;
+    __m256i x[4], c[4], s[4];
+    int v, j;
+
+    pthread_once(&perm8_once, perm8_init);
+
+    for (v = 0; v < 4; v++) {
+	x[v] = _mm256_loadu_si256((const __m256i *) &R[v*8]);
+	c[v] = C ? _mm256_loadu_si256((const __m256i *) &C[v*8])
+	         : _mm256_setzero_si256();
+    }
+
+    // Each vector consumes at most 16 bytes.
+    for (; k < nk && end - ptr >= 4*16; k++) {
+	for (v = 0; v < 4; v++) {
+	    __m256i m = _mm256_and_si256(x[v], mask);
+	    __m256i idx = C ? _mm256_or_si256(_mm256_slli_epi32(c[v], TF_SHIFT), m) : m;
+	    __m256i t = _mm256_i32gather_epi32((const int *) s3, idx, 4);
+	    __m256i f = _mm256_add_epi32(_mm256_srli_epi32(t, 20), one);
+	    __m256i b = _mm256_and_si256(_mm256_srli_epi32(t, 8), mask);
+	    __m256i y = _mm256_add_epi32(_mm256_mullo_epi32(f, _mm256_srli_epi32(x[v], TF_SHIFT)), b);
+	    __m256i lo = _mm256_cmpgt_epi32(lim, y);
+	    int msk = _mm256_movemask_ps(_mm256_castsi256_ps(lo));
+	    s[v] = _mm256_and_si256(t, bmask);
+	    if (msk) {
+		__m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) ptr));
+		w = _mm256_permutevar8x32_epi32(w, _mm256_loadu_si256((const __m256i *) perm8[msk]));
+		y = _mm256_blendv_epi8(y, _mm256_or_si256(_mm256_slli_epi32(y, 16), w), lo);
+		ptr += 2 * __builtin_popcount(msk);
+	    }
+	    x[v] = y;
+	}
+
+	if (C) {
+	    uint32_t sym[NX];
+	    for (v = 0; v < 4; v++) {
+		_mm256_storeu_si256((__m256i *) &sym[v*8], s[v]);
+		c[v] = s[v];
+	    }
+	    for (j = 0; j < NX; j++)
+		out[j*isz + k] = sym[j];
+	} else {
+	    __m256i p = _mm256_packus_epi16(_mm256_packus_epi32(s[0], s[1]),
+					    _mm256_packus_epi32(s[2], s[3]));
+	    p = _mm256_permutevar8x32_epi32(p, pack);
+	    _mm256_storeu_si256((__m256i *) &out[(size_t)k*NX], p);
+	}
+    }
+
+    for (v = 0; v < 4; v++) {
+	_mm256_storeu_si256((__m256i *) &R[v*8], x[v]);
+	if (C)
+	    _mm256_storeu_si256((__m256i *) &C[v*8], c[v]);
+    }
+
+    *pptr = ptr;
+    return k;
+}
+#endif
+
+#ifdef HTS_RANS_AVX512
+__attribute__((target("avx512f")))
+static int dec_avx512(const uint32_t *s3, uint32_t *R, uint32_t *C,
+		      unsigned char **pptr, unsigned char *end,
+		      unsigned char *out, int k, int nk, size_t isz) {
+    const __m512i mask = _mm512_set1_epi32(TOTFREQ-1);
+    const __m512i bmask = _mm512_set1_epi32(0xff);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i lim = _mm512_set1_epi32(RANS_L16);
+    unsigned char *ptr = *pptr;
+    __m512i x[2], c[2], s[2];
+    int v, j;
+
+    for (v = 0; v < 2; v++) {
+	x[v] = _mm512_loadu_si512(&R[v*16]);
+	c[v] = C ? _mm512_loadu_si512(&C[v*16]) : _mm512_setzero_si512();
+    }
+
+    // Each vector consumes at most 32 bytes.
+    for (; k < nk && end - ptr >= 2*32; k++) {
+	for (v = 0; v < 2; v++) {
+	    __m512i m = _mm512_and_si512(x[v], mask);
+	    __m512i idx = C ? _mm512_or_si512(_mm512_slli_epi32(c[v], TF_SHIFT), m) : m;
+	    __m512i t = _mm512_i32gather_epi32(idx, (const void *) s3, 4);
+	    __m512i f = _mm512_add_epi32(_mm512_srli_epi32(t, 20), one);
+	    __m512i b = _mm512_and_si512(_mm512_srli_epi32(t, 8), mask);
+	    __m512i y = _mm512_add_epi32(_mm512_mullo_epi32(f, _mm512_srli_epi32(x[v], TF_SHIFT)), b);
+	    __mmask16 lo = _mm512_cmplt_epu32_mask(y, lim);
+	    s[v] = _mm512_and_si512(t, bmask);
+	    if (lo) {
+		__m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) ptr));
+		y = _mm512_mask_or_epi32(y, lo, _mm512_slli_epi32(y, 16),
+					 _mm512_maskz_expand_epi32(lo, w));
+		ptr += 2 * __builtin_popcount(lo);
+	    }
+	    x[v] = y;
+	}
+
+	if (C) {
+	    uint32_t sym[NX];
+	    for (v = 0; v < 2; v++) {
+		_mm512_storeu_si512(&sym[v*16], s[v]);
+		c[v] = s[v];
+	    }
+	    for (j = 0; j < NX; j++)
+		out[j*isz + k] = sym[j];
+	} else {
+	    _mm_storeu_si128((__m128i *) &out[(size_t)k*NX],    _mm512_cvtepi32_epi8(s[0]));
+	    _mm_storeu_si128((__m128i *) &out[(size_t)k*NX+16], _mm512_cvtepi32_epi8(s[1]));
+	}
+    }
+
+    for (v = 0; v < 2; v++) {
+	_mm512_storeu_si512(&R[v*16], x[v]);
+	if (C)
+	    _mm512_storeu_si512(&C[v*16], c[v]);
+    }
+
+    *pptr = ptr;
+    return k;
+}
+#endif
+
+static int simd_level = -1;
+
+void rans_set_simd_32x16(int level) {
+    simd_level = level;
+}
+
+static dec_kernel *dec_select(void) {
+#ifdef HTS_RANS_AVX512
+    static int have_avx512 = -1;
+    if (have_avx512 < 0)
+	have_avx512 = __builtin_cpu_supports("avx512f") ? 1 : 0;
+    if (have_avx512 && (simd_level < 0 || simd_level >= 2))
+	return dec_avx512;
+#endif
+#ifdef HTS_RANS_AVX2
+    static int have_avx2 = -1;
+    if (have_avx2 < 0)
+	have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    if (have_avx2 && (simd_level < 0 || simd_level >= 1))
+	return dec_avx2;
+#endif
+    return dec_scalar;
+}
+
+unsigned char *rans_uncompress_32x16(unsigned char *in, unsigned int in_size,
+				     unsigned int *out_size) {
+    unsigned char *cp, *end = in + in_size, *out = NULL;
+    uint32_t *s3 = NULL, R[NX], C[NX], out_sz, i;
+    dec_kernel *kernel = dec_select();
+    int order, j, k;
+
+    if (in_size < 9)
+	return NULL;
+    order = in[0];
+    if (order > 1 || u32_get(in+1) != in_size - 9)
+	return NULL;
+    out_sz = u32_get(in+5);
+    cp = in + 9;
+
+    // Highly compressible data can legitimately expand a lot, so there
+    // is no useful bound from in_size; just keep the offsets in range.
+    if (out_sz >= INT_MAX)
+	return NULL;
+
+    if (!(out = malloc(out_sz ? out_sz : 1)))
+	return NULL;
+    if (out_sz == 0)
+	goto done;
+
+    if (order == 0) {
+	if (!(s3 = malloc(TOTFREQ * sizeof(*s3))))
+	    goto err;
+	if (!(cp = read_freqs(cp, end, s3)))
+	    goto err;
+    } else {
+	// Contexts without a table decode as garbage rather than out of
+	// bounds, so a zeroed table is safe on corrupt input.
+	int rle = 0, seen[256] = {0};
+
+	if (!(s3 = calloc(256 * TOTFREQ, sizeof(*s3))))
+	    goto err;
+	if (cp >= end)
+	    goto err;
+	j = *cp++;
+	do {
+	    if (seen[j]++)
+		goto err;
+	    if (!(cp = read_freqs(cp, end, &s3[j * TOTFREQ])))
+		goto err;
+	    if (cp >= end - 1)
+		goto err;
+	    if (!rle && j+1 == *cp) {
+		j = *cp++;
+		rle = *cp++;
+	    } else if (rle) {
+		rle--;
+		if (++j > 255)
+		    goto err;
+	    } else {
+		j = *cp++;
+	    }
+	} while (j);
+    }
+
+    if (end - cp < NX*4)
+	goto err;
+    for (j = 0; j < NX; j++, cp += 4) {
+	R[j] = u32_get(cp);
+	if (R[j] < RANS_L16 || R[j] >= 1u<<31)
+	    goto err;
+	C[j] = 0;
+    }
+
+    if (order == 0) {
+	int nk = out_sz / NX;
+	if ((k = kernel(s3, R, NULL, &cp, end, out, 0, nk, 0)) < 0)
+	    goto err;
+	if (dec_scalar(s3, R, NULL, &cp, end, out, k, nk, 0) < 0)
+	    goto err;
+
+	// The trailing symbols were the first ones encoded by their states.
+	for (i = nk * NX, j = 0; i < out_sz; i++, j++)
+	    out[i] = s3[R[j] & (TOTFREQ-1)];
+    } else {
+	size_t isz = out_sz / NX;
+	uint32_t x = 0;
+	if ((k = kernel(s3, R, C, &cp, end, out, 0, isz, isz)) < 0)
+	    goto err;
+	if (dec_scalar(s3, R, C, &cp, end, out, k, isz, isz) < 0)
+	    goto err;
+
+	// The last state carries on over the remainder.
+	for (i = isz * NX, x = R[NX-1]; i < out_sz; i++) {
+	    uint32_t t = s3[(C[NX-1] << TF_SHIFT) | (x & (TOTFREQ-1))];
+	    out[i] = C[NX-1] = t & 0xff;
+	    x = ((t >> 20) + 1) * (x >> TF_SHIFT) + ((t >> 8) & 0xfff);
+	    if (x < RANS_L16) {
+		if (end - cp < 2)
+		    goto err;
+		x = (x << 16) | cp[0] | (cp[1] << 8);
+		cp += 2;
+	    }
+	}
+    }
+
+ done:
+    free(s3);
+    *out_size = out_sz;
+    return out;
+
+ err:
+    free(s3);
+    free(out);
+    return NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2017 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RANS_STATIC32X16_H
+#define RANS_STATIC32X16_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * 32-way interleaved order-0 / order-1 rANS with 16-bit renormalisation.
+ *
+ * The interleaving is wide enough for the decoder to keep a full SIMD
+ * register of states busy; AVX2 and AVX-512 decoders are selected at run
+ * time when the CPU supports them, with a portable scalar fallback.
+ * The output is not compatible with rans_compress().
+ */
+unsigned char *rans_compress_32x16(unsigned char *in, unsigned int in_size,
+				   unsigned int *out_size, int order);
+unsigned char *rans_uncompress_32x16(unsigned char *in, unsigned int in_size,
+				     unsigned int *out_size);
+
+/*
+ * Limits the decoder to a given instruction set: 0 for the scalar code,
+ * 1 for up to AVX2, 2 for up to AVX-512, and -1 (the default) for the
+ * best the CPU supports.  Intended for testing and benchmarking.
+ */
+void rans_set_simd_32x16(int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RANS_STATIC32X16_H */
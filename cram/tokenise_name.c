@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2017 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A read name tokeniser.
+ *
+ * Each name is split into tokens: runs of letters, runs of digits and
+ * single punctuation characters.  Token i of a name is then coded against
+ * token i of the previous name, as a match, a small numeric delta or a new
+ * value.  The token types and each kind of value get their own stream per
+ * token position, so every stream holds similar data and compresses well
+ * with a plain entropy coder.  Names identical to the previous one, as
+ * with read pairs, are coded as a single duplicate marker.
+ *
+ * Stream layout:
+ *
+ *   uint32  total size of the names, including their NUL terminators
+ *   uint32  number of names
+ *   byte    number of token positions used, P
+ *   P x 5 streams, in the order of enum name_stream, each
+ *     byte    0 for an empty stream, 1 for raw data or 2 for rANS
+ *     uint32  length of the stream data (absent if empty)
+ *     ...     stream data
+ *
+ * All integers are little-endian.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cram/tokenise_name.h"
+#include "cram/rANS_static.h"
+#include "htslib/kstring.h"
+
+#define MAX_TOKENS 128
+
+// Token types, as held in the type stream for each position
+enum name_type {
+    N_END = 0, // End of the name
+    N_DUP,     // Whole name repeats the previous one; position 0 only
+    N_MATCH,   // Same as the previous name's token at this position
+    N_STRING,  // String, NUL-terminated in the string stream
+    N_CHAR,    // Single character, in the char stream
+    N_DIGITS,  // Number, as a uint32 in the digits stream
+    N_DELTA,   // Previous name's number plus 1 to 255, in the delta stream
+};
+
+// Streams held for each token position
+enum name_stream {
+    S_TYPE, S_STRING, S_CHAR, S_DIGITS, S_DELTA, N_STREAMS
+};
+
+typedef struct {
+    int type;          // N_STRING, N_CHAR or N_DIGITS
+    uint32_t num;      // Value of N_DIGITS tokens
+    uint32_t off, len; // Location of the token text in the name buffer
+} name_tok;
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+
+static inline uint32_t u32_get(const unsigned char *cp) {
+    return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t) cp[3] << 24);
+}
+
+static int put_u32(kstring_t *s, uint32_t x) {
+    char b[4];
+    b[0] = x; b[1] = x >> 8; b[2] = x >> 16; b[3] = x >> 24;
+    return kputsn(b, 4, s) < 0 ? -1 : 0;
+}
+
+/*
+ * Splits the name at buf[off..off+len) into tokens, returning how many.
+ * Digit runs are numbers unless they have leading zeros or too many digits
+ * to print back the same, in which case they are kept as strings.
+ */
+static int tokenise(const unsigned char *buf, uint32_t off, uint32_t len,
+		    name_tok *t) {
+    uint32_t i = off, end = off + len;
+    int n = 0;
+
+    while (i < end) {
+	uint32_t j = i + 1;
+
+	t[n].off = i;
+	t[n].num = 0;
+	if (n == MAX_TOKENS-2) {
+	    // Leave room for N_END, and keep the rest as one string
+	    t[n].type = N_STRING;
+	    j = end;
+	} else if (IS_DIGIT(buf[i])) {
+	    uint32_t v = buf[i] - '0';
+	    while (j < end && IS_DIGIT(buf[j]))
+		v = v*10 + buf[j++] - '0';
+	    if (j - i > 9 || (buf[i] == '0' && j - i > 1)) {
+		t[n].type = N_STRING;
+	    } else {
+		t[n].type = N_DIGITS;
+		t[n].num = v;
+	    }
+	} else if (IS_ALPHA(buf[i])) {
+	    while (j < end && IS_ALPHA(buf[j]))
+		j++;
+	    t[n].type = N_STRING;
+	} else {
+	    t[n].type = N_CHAR;
+	}
+	t[n].len = j - i;
+	n++;
+	i = j;
+    }
+
+    return n;
+}
+
+/*
+ * Appends a stream to out, compressed with rANS if that makes it smaller.
+ */
+static int put_stream(kstring_t *out, kstring_t *s) {
+    unsigned char *c = NULL, *c1;
+    unsigned int clen = 0, clen1;
+    int r;
+
+    if (s->l == 0)
+	return kputc(0, out) < 0 ? -1 : 0;
+
+    // Very short streams cost more in frequency tables than they save
+    if (s->l >= 32) {
+	c = rans_compress((unsigned char *) s->s, s->l, &clen, 0);
+	if (s->l >= 1024
+	    && (c1 = rans_compress((unsigned char *) s->s, s->l, &clen1, 1))) {
+	    if (!c || clen1 < clen) {
+		free(c);
+		c = c1;
+		clen = clen1;
+	    } else {
+		free(c1);
+	    }
+	}
+    }
+
+    if (c && clen < s->l)
+	r = kputc(2, out) < 0 || put_u32(out, clen) < 0
+	    || kputsn((char *) c, clen, out) < 0;
+    else
+	r = kputc(1, out) < 0 || put_u32(out, s->l) < 0
+	    || kputsn(s->s, s->l, out) < 0;
+
+    free(c);
+    return r ? -1 : 0;
+}
+
+unsigned char *tok_encode_names(unsigned char *in, unsigned int in_size,
+				unsigned int *out_size) {
+    kstring_t *st, out = {0, 0, NULL};
+    name_tok tok[2][MAX_TOKENS], *cur = tok[0], *prev = tok[1], *tmp;
+    uint32_t i, n_names = 0, prev_off = 0, prev_len = 0;
+    int prev_ntok = 0, max_pos = 0, p, r = 0;
+
+    if (in_size == 0 || in[in_size-1] != '\0')
+	return NULL;
+    if (!(st = calloc(MAX_TOKENS * N_STREAMS, sizeof(*st))))
+	return NULL;
+
+    for (i = 0; i < in_size; i += prev_len + 1, n_names++) {
+	uint32_t len = strlen((char *) in + i);
+	int ntok;
+
+	if (n_names && len == prev_len && memcmp(in+i, in+prev_off, len) == 0) {
+	    r |= kputc(N_DUP, &st[S_TYPE]) < 0;
+	    continue;
+	}
+
+	ntok = tokenise(in, i, len, cur);
+	for (p = 0; p < ntok; p++) {
+	    name_tok *t = &cur[p], *pt = &prev[p];
+	    kstring_t *ps = &st[p * N_STREAMS];
+	    int type = t->type;
+
+	    if (p < prev_ntok && pt->type == t->type) {
+		if (t->type == N_DIGITS) {
+		    if (t->num == pt->num)
+			type = N_MATCH;
+		    else if (t->num > pt->num && t->num - pt->num < 256)
+			type = N_DELTA;
+		} else if (t->len == pt->len
+			   && memcmp(in + t->off, in + pt->off, t->len) == 0) {
+		    type = N_MATCH;
+		}
+	    }
+
+	    r |= kputc(type, &ps[S_TYPE]) < 0;
+	    switch (type) {
+	    case N_STRING:
+		r |= kputsn((char *) in + t->off, t->len, &ps[S_STRING]) < 0;
+		r |= kputc(0, &ps[S_STRING]) < 0;
+		break;
+	    case N_CHAR:
+		r |= kputc(in[t->off], &ps[S_CHAR]) < 0;
+		break;
+	    case N_DIGITS:
+		r |= put_u32(&ps[S_DIGITS], t->num) < 0;
+		break;
+	    case N_DELTA:
+		r |= kputc(t->num - pt->num, &ps[S_DELTA]) < 0;
+		break;
+	    }
+	}
+	r |= kputc(N_END, &st[ntok * N_STREAMS + S_TYPE]) < 0;
+	if (max_pos < ntok + 1)
+	    max_pos = ntok + 1;
+
+	tmp = prev; prev = cur; cur = tmp;
+	prev_ntok = ntok;
+	prev_off = i;
+	prev_len = len;
+    }
+
+    r |= put_u32(&out, in_size) < 0;
+    r |= put_u32(&out, n_names) < 0;
+    r |= kputc(max_pos, &out) < 0;
+    for (p = 0; p < max_pos * N_STREAMS; p++)
+	r |= put_stream(&out, &st[p]) < 0;
+
+    for (p = 0; p < MAX_TOKENS * N_STREAMS; p++)
+	free(st[p].s);
+    free(st);
+
+    if (r) {
+	free(out.s);
+	return NULL;
+    }
+
+    *out_size = out.l;
+    return (unsigned char *) out.s;
+}
+
+typedef struct {
+    const unsigned char *p;
+    uint32_t len, pos;
+} tok_stream;
+
+static int put_num(unsigned char *out, uint32_t *o, uint32_t out_len,
+		   uint32_t v) {
+    char b[16];
+    int l = 0;
+
+    do b[l++] = '0' + v % 10; while (v /= 10);
+    if (l > out_len - *o)
+	return -1;
+    while (l)
+	out[(*o)++] = b[--l];
+
+    return 0;
+}
+
+unsigned char *tok_decode_names(unsigned char *in, unsigned int in_size,
+				unsigned int *out_size) {
+    tok_stream *st = NULL;
+    unsigned char **owned = NULL, *out = NULL, *cp, *end = in + in_size;
+    name_tok tok[2][MAX_TOKENS], *cur = tok[0], *prev = tok[1], *tmp;
+    uint32_t out_len, n_names, n, o = 0, prev_off = 0, prev_len = 0;
+    int max_pos, prev_ntok = 0, k;
+
+    if (in_size < 9)
+	return NULL;
+    out_len = u32_get(in);
+    n_names = u32_get(in+4);
+    max_pos = in[8];
+    if (out_len == 0 || n_names > out_len || max_pos > MAX_TOKENS)
+	return NULL;
+
+    if (!(st = calloc(max_pos * N_STREAMS + 1, sizeof(*st))))
+	goto err;
+    if (!(owned = calloc(max_pos * N_STREAMS + 1, sizeof(*owned))))
+	goto err;
+
+    for (cp = in + 9, k = 0; k < max_pos * N_STREAMS; k++) {
+	uint32_t len;
+	int m;
+
+	if (cp >= end)
+	    goto err;
+	if ((m = *cp++) == 0)
+	    continue;
+	if (m > 2 || end - cp < 4)
+	    goto err;
+	len = u32_get(cp);
+	cp += 4;
+	if (len > end - cp)
+	    goto err;
+
+	if (m == 1) {
+	    st[k].p = cp;
+	    st[k].len = len;
+	} else {
+	    unsigned int ulen;
+	    // No stream holds more than four bytes per output character, so
+	    // refuse a corrupt rANS size rather than decode gigabytes of it.
+	    if (len < 9 || u32_get(cp+5) > (uint64_t) out_len * 4)
+		goto err;
+	    if (!(owned[k] = rans_uncompress(cp, len, &ulen)))
+		goto err;
+	    st[k].p = owned[k];
+	    st[k].len = ulen;
+	}
+	cp += len;
+    }
+
+    if (!(out = malloc(out_len)))
+	goto err;
+
+    for (n = 0; n < n_names; n++) {
+	uint32_t start = o;
+	int p, dup = 0;
+
+	for (p = 0; ; p++) {
+	    tok_stream *ps = &st[p * N_STREAMS];
+	    name_tok *t = &cur[p], *pt = &prev[p];
+	    const unsigned char *s;
+	    int type;
+
+	    if (p >= max_pos || ps[S_TYPE].pos >= ps[S_TYPE].len)
+		goto err;
+	    type = ps[S_TYPE].p[ps[S_TYPE].pos++];
+	    if (type == N_END)
+		break;
+
+	    if (type == N_DUP) {
+		if (p != 0 || n == 0 || prev_len > out_len - o)
+		    goto err;
+		memcpy(out + o, out + prev_off, prev_len);
+		o += prev_len;
+		dup = 1;
+		break;
+	    }
+
+	    if (p == MAX_TOKENS-1)
+		goto err;
+	    t->off = o;
+	    switch (type) {
+	    case N_MATCH:
+		if (p >= prev_ntok)
+		    goto err;
+		t->type = pt->type;
+		t->num = pt->num;
+		if (pt->len > out_len - o)
+		    goto err;
+		memcpy(out + o, out + pt->off, pt->len);
+		o += pt->len;
+		break;
+
+	    case N_STRING:
+		ps += S_STRING;
+		s = ps->p + ps->pos;
+		if (ps->pos >= ps->len
+		    || !memchr(s, 0, ps->len - ps->pos))
+		    goto err;
+		t->type = N_STRING;
+		t->len = strlen((const char *) s);
+		if (t->len > out_len - o)
+		    goto err;
+		memcpy(out + o, s, t->len);
+		o += t->len;
+		ps->pos += t->len + 1;
+		break;
+
+	    case N_CHAR:
+		ps += S_CHAR;
+		if (ps->pos >= ps->len || o >= out_len)
+		    goto err;
+		t->type = N_CHAR;
+		out[o++] = ps->p[ps->pos++];
+		break;
+
+	    case N_DIGITS:
+		ps += S_DIGITS;
+		if (ps->len - ps->pos < 4)
+		    goto err;
+		t->type = N_DIGITS;
+		t->num = u32_get(ps->p + ps->pos);
+		ps->pos += 4;
+		if (put_num(out, &o, out_len, t->num) < 0)
+		    goto err;
+		break;
+
+	    case N_DELTA:
+		ps += S_DELTA;
+		if (p >= prev_ntok || pt->type != N_DIGITS
+		    || ps->pos >= ps->len)
+		    goto err;
+		t->type = N_DIGITS;
+		t->num = pt->num + ps->p[ps->pos++];
+		if (put_num(out, &o, out_len, t->num) < 0)
+		    goto err;
+		break;
+
+	    default:
+		goto err;
+	    }
+	    t->len = o - t->off;
+	}
+
+	if (!dup) {
+	    tmp = prev; prev = cur; cur = tmp;
+	    prev_ntok = p;
+	    prev_off = start;
+	    prev_len = o - start;
+	}
+
+	if (o >= out_len)
+	    goto err;
+	out[o++] = 0;
+    }
+
+    if (o != out_len)
+	goto err;
+
+    for (k = 0; k < max_pos * N_STREAMS; k++)
+	free(owned[k]);
+    free(owned);
+    free(st);
+    *out_size = out_len;
+    return out;
+
+ err:
+    if (owned) {
+	for (k = 0; k < max_pos * N_STREAMS; k++)
+	    free(owned[k]);
+	free(owned);
+    }
+    free(st);
+    free(out);
+    return NULL;
+}
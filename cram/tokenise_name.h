@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2017 Genome Research Ltd.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *       Institute nor the names of its contributors may be used to endorse
+ *       or promote products derived from this software without specific
+ *       prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TOKENISE_NAME_H
+#define TOKENISE_NAME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compresses a block of NUL-terminated read names by splitting each name
+ * into tokens and encoding each token against the same token of the
+ * previous name.
+ *
+ * Returns a malloced buffer holding the compressed data, or NULL if the
+ * input is not a series of NUL-terminated names or on memory failure.
+ */
+unsigned char *tok_encode_names(unsigned char *in, unsigned int in_size,
+				unsigned int *out_size);
+
+/*
+ * Reverses tok_encode_names().
+ *
+ * Returns a malloced buffer holding the names, or NULL if the input is
+ * corrupt or on memory failure.
+ */
+unsigned char *tok_decode_names(unsigned char *in, unsigned int in_size,
+				unsigned int *out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TOKENISE_NAME_H */
@@ -35,6 +35,11 @@ DEALINGS IN THE SOFTWARE.  */
 #include <errno.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <pthread.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "htslib/hts.h"
 #include "htslib/bgzf.h"
@@ -49,6 +54,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/khash.h"
 #include "htslib/kseq.h"
 #include "htslib/ksort.h"
+#include "htslib/regidx.h"
 
 KHASH_INIT2(s2i,, kh_cstr_t, int64_t, 1, kh_str_hash_func, kh_str_hash_equal)
 
@@ -537,6 +543,18 @@ int hts_opt_add(hts_opt **opts, const char *c_arg) {
              strcmp(o->arg, "USE_RANS") == 0)
         o->opt = CRAM_OPT_USE_RANS, o->val.i = atoi(val);
 
+    else if (strcmp(o->arg, "use_rans32") == 0 ||
+             strcmp(o->arg, "USE_RANS32") == 0)
+        o->opt = CRAM_OPT_USE_RANS32, o->val.i = atoi(val);
+
+    else if (strcmp(o->arg, "use_tok") == 0 ||
+             strcmp(o->arg, "USE_TOK") == 0)
+        o->opt = CRAM_OPT_USE_TOK, o->val.i = atoi(val);
+
+    else if (strcmp(o->arg, "favour_read_speed") == 0 ||
+             strcmp(o->arg, "FAVOUR_READ_SPEED") == 0)
+        o->opt = CRAM_OPT_FAVOUR_READ_SPEED, o->val.i = atoi(val);
+
     else if (strcmp(o->arg, "use_lzma") == 0 ||
              strcmp(o->arg, "USE_LZMA") == 0)
         o->opt = CRAM_OPT_USE_LZMA, o->val.i = atoi(val);
@@ -783,6 +801,8 @@ htsFile *hts_hopen(hFILE *hfile, const char *fn, const char *mode)
 
     fp->fn = strdup(fn);
     fp->is_be = ed_is_big();
+    fp->required_fields = ~0U;
+    fp->last_offset = -1;
 
     // Split mode into simple_mode,opts strings
     if ((cp = strchr(mode, ','))) {
@@ -893,9 +913,13 @@ error:
     return NULL;
 }
 
+static int idx_save_on_close(htsFile *fp);
+
 int hts_close(htsFile *fp)
 {
-    int ret, save;
+    int ret, save, idx_ret = 0;
+
+    if (fp->idx) idx_ret = idx_save_on_close(fp);
 
     switch (fp->format.format) {
     case binary_format:
@@ -932,9 +956,12 @@ int hts_close(htsFile *fp)
         break;
     }
 
+    if (idx_ret < 0) ret = -1;
+
     save = errno;
     free(fp->fn);
     free(fp->fn_aux);
+    free(fp->fnidx);
     free(fp->line.s);
     free(fp);
     errno = save;
@@ -1021,6 +1048,15 @@ int hts_set_opt(htsFile *fp, enum hts_fmt_option opt, ...) {
         return 0;
     }
 
+    case CRAM_OPT_REQUIRED_FIELDS:
+        if (fp->format.format == bam) {
+            va_start(args, opt);
+            fp->required_fields = va_arg(args, int);
+            va_end(args);
+            return 0;
+        }
+        break;
+
     default:
         break;
     }
@@ -1260,6 +1296,8 @@ int hts_check_EOF(htsFile *fp)
 #define pair64_lt(a,b) ((a).u < (b).u)
 
 KSORT_INIT(_off, hts_pair64_t, pair64_lt)
+KSORT_INIT_GENERIC(uint32_t)
+KSORT_INIT_GENERIC(uint64_t)
 
 typedef struct {
     int32_t m, n;
@@ -1275,6 +1313,136 @@ typedef struct {
     uint64_t *offset;
 } lidx_t;
 
+// Where the records starting in each window of the end index begin, and how
+// far they reach, gathered while building an index.  The mapped records'
+// coverage is also tallied: a record covering [beg,end) adds 1 to d_cov and
+// (window end - beg) to d_bases in beg's window, and takes 1 and
+// (window end - end) off them in end's window.
+typedef struct {
+    int32_t n, m;
+    uint64_t *off;      // virtual offset of the first record, or (uint64_t)-1
+    uint32_t *max_end;  // largest end position of the records, 0 if none
+    uint32_t *n_rec;    // number of mapped records starting in the window
+    int32_t *d_cov;     // change in coverage from the start of the window
+    int64_t *d_bases;   // covered bases in the window not counted by d_cov
+} eidx_t;
+
+// State for indexes loaded with HTS_IDX_LAZY
+typedef struct {
+    BGZF *fp;         // index file, kept open to load references on demand
+    int64_t *off;     // position of each reference's data in fp
+    pthread_mutex_t lock;
+} idx_lazy_t;
+
+// Read-only layout of the binning index made by hts_idx_freeze().  Each
+// reference's bins are sorted by bin number, which groups them by level, and
+// all the arrays live in one allocation.
+typedef struct {
+    uint32_t *ref_bin;    // reference i has bins ref_bin[i] to ref_bin[i+1]-1
+    uint32_t *lvl_bin;    // level l of reference i starts lvl_bin[i*(n_lvls+2)+l]
+                          // bins after ref_bin[i]; level n_lvls+1 is META_BIN
+    uint32_t *bin;        // bin numbers
+    uint64_t *loff;       // smallest virtual offset of any record in each bin
+    uint64_t *chunk_beg;  // bin j has chunks chunk_beg[j] to chunk_beg[j+1]-1
+    hts_pair64_t *chunk;
+    size_t n_bin, n_chunk;
+    void *mem;            // malloc'd block, or mapped .hmi file if is_mapped
+    size_t l_mem;
+    int is_mapped;
+} idx_frozen_t;
+
+// Size of the frozen layout's arrays, which are stored in the same order
+// in memory and in .hmi files
+static size_t frozen_size(int n_ref, int n_lvls, size_t n_bin, size_t n_chunk)
+{
+    return n_chunk * sizeof(hts_pair64_t) + (n_bin + 1) * sizeof(uint64_t)
+        + n_bin * sizeof(uint64_t) + (n_ref + 1) * sizeof(uint32_t)
+        + (size_t) n_ref * (n_lvls + 2) * sizeof(uint32_t)
+        + n_bin * sizeof(uint32_t);
+}
+
+// Points the frozen layout's arrays into mem, which holds frozen_size()
+// bytes.  They are in decreasing order of alignment.
+static void frozen_set_arrays(idx_frozen_t *f, uint8_t *mem, int n_ref, int n_lvls, size_t n_bin, size_t n_chunk)
+{
+    f->n_bin = n_bin;
+    f->n_chunk = n_chunk;
+    f->chunk = (hts_pair64_t*)mem;
+    f->chunk_beg = (uint64_t*)(f->chunk + n_chunk);
+    f->loff = f->chunk_beg + n_bin + 1;
+    f->ref_bin = (uint32_t*)(f->loff + n_bin);
+    f->lvl_bin = f->ref_bin + n_ref + 1;
+    f->bin = f->lvl_bin + (size_t) n_ref * (n_lvls + 2);
+}
+
+static void frozen_destroy(idx_frozen_t *f)
+{
+    if (f == NULL) return;
+#ifdef HAVE_MMAP
+    if (f->is_mapped) munmap(f->mem, f->l_mem);
+    else
+#endif
+    free(f->mem);
+    free(f);
+}
+
+// End index made from the eidx_t data by hts_idx_finish().  A long record
+// keeps the linear index pointing at itself for its whole length, so queries
+// would read every record that starts after it.  Knowing how far the records
+// of each window reach lets queries skip the windows that end too soon.
+typedef struct {
+    uint64_t *win_beg;    // reference i has windows win_beg[i] to win_beg[i+1]-1
+    uint64_t *off;        // virtual offset of the first record starting in or
+                          // after each window, or (uint64_t)-1 if there is none
+    uint32_t *max_end;    // largest end position of records starting in each window
+    uint32_t *first;      // earliest window with a record reaching each window
+    uint64_t *n_rec;      // mapped records starting in the reference up to the
+                          // end of each window, or NULL if not recorded
+    uint64_t *n_bases;    // bases covered by mapped records up to the end of
+                          // each window, summed over the records
+    size_t n_win;
+    int shift;            // windows are 1<<shift bases wide
+    void *mem;            // malloc'd block, or NULL if in a mapped .hmi file
+} idx_ends_t;
+
+// End index windows are a quarter of the size of the linear index's, so
+// that a long record drags in fewer short ones with it
+#define ENDS_SHIFT(min_shift) ((min_shift) > 2 ? (min_shift) - 2 : (min_shift))
+
+static size_t ends_size(int n_ref, size_t n_win)
+{
+    return (n_ref + 1) * sizeof(uint64_t) + n_win * sizeof(uint64_t)
+        + 2 * n_win * sizeof(uint32_t);
+}
+
+// Size of the optional coverage statistics, which follow the end index
+static size_t stats_size(size_t n_win)
+{
+    return 2 * n_win * sizeof(uint64_t);
+}
+
+static void ends_set_arrays(idx_ends_t *e, uint8_t *mem, int n_ref, size_t n_win, int has_stats)
+{
+    e->n_win = n_win;
+    e->win_beg = (uint64_t*)mem;
+    e->off = e->win_beg + n_ref + 1;
+    e->max_end = (uint32_t*)(e->off + n_win);
+    e->first = e->max_end + n_win;
+    if (has_stats) {
+        e->n_rec = (uint64_t*)(e->first + n_win);
+        e->n_bases = e->n_rec + n_win;
+    } else {
+        e->n_rec = e->n_bases = NULL;
+    }
+}
+
+static void ends_destroy(idx_ends_t *e)
+{
+    if (e == NULL) return;
+    free(e->mem);
+    free(e);
+}
+
 struct __hts_idx_t {
     int fmt, min_shift, n_lvls, n_bins;
     uint32_t l_meta;
@@ -1282,6 +1450,7 @@ struct __hts_idx_t {
     uint64_t n_no_coor;
     bidx_t **bidx;
     lidx_t *lidx;
+    eidx_t *eidx;
     uint8_t *meta; // MUST have a terminating NUL on the end
     struct {
         uint32_t last_bin, save_bin;
@@ -1289,7 +1458,13 @@ struct __hts_idx_t {
         uint64_t last_off, save_off;
         uint64_t off_beg, off_end;
         uint64_t n_mapped, n_unmapped;
+        uint64_t first_off; // where the first record starts
+        int first_tid, first_coor;
+        uint32_t first_bin; // of the first record, for hts_idx_append()
     } z; // keep internal states
+    idx_lazy_t *lazy; // NULL unless references are being loaded on demand
+    idx_frozen_t *frozen; // if set, replaces bidx, whose entries are all NULL
+    idx_ends_t *ends; // NULL unless the index was built, or loaded from .hmi
 };
 
 static char * idx_format_name(int fmt) {
@@ -1353,6 +1528,66 @@ static inline int insert_to_l(lidx_t *l, int64_t _beg, int64_t _end, uint64_t of
     return 0;
 }
 
+static inline int insert_to_e(eidx_t *e, int64_t beg, int64_t end, uint64_t offset, int shift, int is_mapped)
+{
+    int w, we;
+    if (beg < 0) beg = 0; // unmapped reads may have no position
+    if (end <= beg) end = beg + 1;
+    w = beg >> shift;
+    we = end >> shift;
+    if (e->m < we + 1) {
+        size_t new_m = e->m * 2 > we + 1 ? e->m * 2 : we + 1;
+        uint64_t *new_off;
+        uint32_t *new_max_end, *new_n_rec;
+        int32_t *new_d_cov;
+        int64_t *new_d_bases;
+
+        new_off = (uint64_t*)realloc(e->off, new_m * sizeof(uint64_t));
+        if (!new_off) return -1;
+        e->off = new_off;
+        new_max_end = (uint32_t*)realloc(e->max_end, new_m * sizeof(uint32_t));
+        if (!new_max_end) return -1;
+        e->max_end = new_max_end;
+        new_n_rec = (uint32_t*)realloc(e->n_rec, new_m * sizeof(uint32_t));
+        if (!new_n_rec) return -1;
+        e->n_rec = new_n_rec;
+        new_d_cov = (int32_t*)realloc(e->d_cov, new_m * sizeof(int32_t));
+        if (!new_d_cov) return -1;
+        e->d_cov = new_d_cov;
+        new_d_bases = (int64_t*)realloc(e->d_bases, new_m * sizeof(int64_t));
+        if (!new_d_bases) return -1;
+        e->d_bases = new_d_bases;
+
+        memset(e->off + e->m, 0xff, sizeof(uint64_t) * (new_m - e->m));
+        memset(e->max_end + e->m, 0, sizeof(uint32_t) * (new_m - e->m));
+        memset(e->n_rec + e->m, 0, sizeof(uint32_t) * (new_m - e->m));
+        memset(e->d_cov + e->m, 0, sizeof(int32_t) * (new_m - e->m));
+        memset(e->d_bases + e->m, 0, sizeof(int64_t) * (new_m - e->m));
+        e->m = new_m;
+    }
+    if (e->off[w] == (uint64_t)-1) e->off[w] = offset;
+    if (e->max_end[w] < end) e->max_end[w] = end;
+    if (e->n < w + 1) e->n = w + 1;
+    if (is_mapped) {
+        e->n_rec[w]++;
+        e->d_cov[w]++;
+        e->d_bases[w] += ((int64_t) (w + 1) << shift) - beg;
+        e->d_cov[we]--;
+        e->d_bases[we] -= ((int64_t) (we + 1) << shift) - end;
+    }
+    return 0;
+}
+
+static void eidx_free(eidx_t *e)
+{
+    free(e->off);
+    free(e->max_end);
+    free(e->n_rec);
+    free(e->d_cov);
+    free(e->d_bases);
+    memset(e, 0, sizeof(eidx_t));
+}
+
 hts_idx_t *hts_idx_init(int n, int fmt, uint64_t offset0, int min_shift, int n_lvls)
 {
     hts_idx_t *idx;
@@ -1370,7 +1605,11 @@ hts_idx_t *hts_idx_init(int n, int fmt, uint64_t offset0, int min_shift, int n_l
         idx->bidx = (bidx_t**)calloc(n, sizeof(bidx_t*));
         if (idx->bidx == NULL) { free(idx); return NULL; }
         idx->lidx = (lidx_t*) calloc(n, sizeof(lidx_t));
-        if (idx->lidx == NULL) { free(idx->bidx); free(idx); return NULL; }
+        idx->eidx = (eidx_t*) calloc(n, sizeof(eidx_t));
+        if (idx->lidx == NULL || idx->eidx == NULL) {
+            free(idx->bidx); free(idx->lidx); free(idx->eidx); free(idx);
+            return NULL;
+        }
     }
     return idx;
 }
@@ -1459,10 +1698,78 @@ static void compress_binning(hts_idx_t *idx, int i)
     }
 }
 
+// Number of windows in the end index of a reference, which runs on past the
+// last record start to cover the furthest record end
+static size_t eidx_n_win(const eidx_t *e, int shift)
+{
+    uint32_t max_end = 0;
+    size_t last;
+    int w;
+    for (w = 0; w < e->n; ++w)
+        if (max_end < e->max_end[w]) max_end = e->max_end[w];
+    if (max_end == 0) return 0;
+    last = (max_end - 1) >> shift;
+    return last + 1 > e->n ? last + 1 : e->n;
+}
+
+// Converts the data gathered in idx->eidx into idx->ends.  As the end index
+// only speeds up queries, failing to make it is not an error.
+static void idx_ends_build(hts_idx_t *idx)
+{
+    idx_ends_t *e = NULL;
+    size_t n_win = 0, w, q;
+    int i, shift = ENDS_SHIFT(idx->min_shift);
+
+    for (i = 0; i < idx->n; ++i) n_win += eidx_n_win(&idx->eidx[i], shift);
+    if (n_win > 0 && n_win < UINT32_MAX
+        && (e = (idx_ends_t*)calloc(1, sizeof(idx_ends_t))) != NULL
+        && (e->mem = malloc(ends_size(idx->n, n_win) + stats_size(n_win))) != NULL) {
+        ends_set_arrays(e, (uint8_t*)e->mem, idx->n, n_win, 1);
+        e->shift = shift;
+        for (i = 0, n_win = 0; i < idx->n; ++i) {
+            const eidx_t *x = &idx->eidx[i];
+            size_t nw = eidx_n_win(x, shift);
+            uint64_t *off = e->off + n_win, next = (uint64_t)-1;
+            uint32_t *max_end = e->max_end + n_win, *first = e->first + n_win;
+            uint64_t n_rec = 0, n_bases = 0;
+            int64_t cov = 0;
+            e->win_beg[i] = n_win;
+            for (w = nw; w-- > 0; ) {
+                if (w < x->n && x->off[w] != (uint64_t)-1) next = x->off[w];
+                off[w] = next;
+                max_end[w] = w < x->n ? x->max_end[w] : 0;
+                first[w] = w;
+            }
+            // Windows are visited in order, so each is claimed by the
+            // earliest one reaching it
+            for (w = q = 0; w < nw; ++w) {
+                if (max_end[w] == 0) continue;
+                if (q < w) q = w;
+                for (; q <= (max_end[w] - 1) >> shift; ++q)
+                    first[q] = w;
+            }
+            // Running totals of the coverage statistics
+            for (w = 0; w < nw; ++w) {
+                n_rec += x->n_rec[w];
+                n_bases += (cov << shift) + x->d_bases[w];
+                cov += x->d_cov[w];
+                e->n_rec[n_win + w] = n_rec;
+                e->n_bases[n_win + w] = n_bases;
+            }
+            n_win += nw;
+        }
+        e->win_beg[idx->n] = n_win;
+        idx->ends = e;
+    } else if (e) {
+        free(e);
+    }
+    for (i = 0; i < idx->m; ++i) eidx_free(&idx->eidx[i]);
+}
+
 void hts_idx_finish(hts_idx_t *idx, uint64_t final_offset)
 {
     int i;
-    if (idx == NULL || idx->z.finished) return; // do not run this function on an empty index or multiple times
+    if (idx == NULL || idx->z.finished || idx->frozen) return; // do not run this function on an empty index or multiple times
     if (idx->z.save_tid >= 0) {
         insert_to_b(idx->bidx[idx->z.save_tid], idx->z.save_bin, idx->z.save_off, final_offset);
         insert_to_b(idx->bidx[idx->z.save_tid], META_BIN(idx), idx->z.off_beg, final_offset);
@@ -1472,36 +1779,62 @@ void hts_idx_finish(hts_idx_t *idx, uint64_t final_offset)
         update_loff(idx, i, (idx->fmt == HTS_FMT_CSI));
         compress_binning(idx, i);
     }
+    idx_ends_build(idx);
     idx->z.finished = 1;
 }
 
+void hts_idx_amend_last(hts_idx_t *idx, uint64_t old_off, uint64_t new_off)
+{
+    if (idx->z.last_off == old_off) idx->z.last_off = new_off;
+}
+
+// Makes room in the index for references up to n - 1
+static int idx_grow(hts_idx_t *idx, int n)
+{
+    uint32_t new_m = idx->m * 2 > n ? idx->m * 2 : n;
+    bidx_t **new_bidx;
+    lidx_t *new_lidx;
+    eidx_t *new_eidx;
+
+    new_bidx = (bidx_t**)realloc(idx->bidx, new_m * sizeof(bidx_t*));
+    if (!new_bidx) return -1;
+    idx->bidx = new_bidx;
+
+    new_lidx = (lidx_t*) realloc(idx->lidx, new_m * sizeof(lidx_t));
+    if (!new_lidx) return -1;
+    idx->lidx = new_lidx;
+
+    new_eidx = (eidx_t*) realloc(idx->eidx, new_m * sizeof(eidx_t));
+    if (!new_eidx) return -1;
+    idx->eidx = new_eidx;
+
+    memset(&idx->bidx[idx->m], 0, (new_m - idx->m) * sizeof(bidx_t*));
+    memset(&idx->lidx[idx->m], 0, (new_m - idx->m) * sizeof(lidx_t));
+    memset(&idx->eidx[idx->m], 0, (new_m - idx->m) * sizeof(eidx_t));
+    idx->m = new_m;
+    return 0;
+}
+
 int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int is_mapped)
 {
     int bin;
     int64_t maxpos = (int64_t) 1 << (idx->min_shift + idx->n_lvls * 3);
+    if (idx->frozen) {
+        hts_log_error("Can't add to a frozen index");
+        return -1;
+    }
     if (tid<0) beg = -1, end = 0;
     if (tid >= 0 && (beg > maxpos || end > maxpos)) {
         goto pos_too_big;
     }
-    if (tid >= idx->m) { // enlarge the index
-        uint32_t new_m = idx->m * 2 > tid + 1 ? idx->m * 2 : tid + 1;
-        bidx_t **new_bidx;
-        lidx_t *new_lidx;
-
-        new_bidx = (bidx_t**)realloc(idx->bidx, new_m * sizeof(bidx_t*));
-        if (!new_bidx) return -1;
-        idx->bidx = new_bidx;
-
-        new_lidx = (lidx_t*) realloc(idx->lidx, new_m * sizeof(lidx_t));
-        if (!new_lidx) return -1;
-        idx->lidx = new_lidx;
-
-        memset(&idx->bidx[idx->m], 0, (new_m - idx->m) * sizeof(bidx_t*));
-        memset(&idx->lidx[idx->m], 0, (new_m - idx->m) * sizeof(lidx_t));
-        idx->m = new_m;
-    }
+    if (tid >= idx->m && idx_grow(idx, tid + 1) < 0) return -1;
     if (idx->n < tid + 1) idx->n = tid + 1;
     if (idx->z.finished) return 0;
+    if (idx->z.save_bin == 0xffffffffu) { // the first record
+        idx->z.first_off = idx->z.last_off;
+        idx->z.first_tid = tid;
+        idx->z.first_coor = beg;
+    }
     if (idx->z.last_tid != tid || (idx->z.last_tid >= 0 && tid < 0)) { // change of chromosome
         if ( tid>=0 && idx->n_no_coor )
         {
@@ -1530,6 +1863,8 @@ int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int
             if (insert_to_l(&idx->lidx[tid], beg, end,
                             idx->z.last_off, idx->min_shift) < 0) return -1;
         }
+        if (insert_to_e(&idx->eidx[tid], beg, end, idx->z.last_off,
+                        ENDS_SHIFT(idx->min_shift), is_mapped) < 0) return -1;
     }
     else idx->n_no_coor++;
     bin = hts_reg2bin(beg, end, idx->min_shift, idx->n_lvls);
@@ -1547,6 +1882,7 @@ int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int
             idx->z.n_mapped = idx->z.n_unmapped = 0;
             idx->z.off_beg = idx->z.off_end;
         }
+        if (idx->z.save_bin == 0xffffffffu) idx->z.first_bin = bin;
         idx->z.save_off = idx->z.last_off;
         idx->z.save_bin = idx->z.last_bin = bin;
         idx->z.save_tid = tid;
@@ -1584,9 +1920,27 @@ int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int
     }
 }
 
-void hts_idx_destroy(hts_idx_t *idx)
+static void idx_lazy_destroy(idx_lazy_t *lazy)
+{
+    if (lazy == NULL) return;
+    bgzf_close(lazy->fp);
+    pthread_mutex_destroy(&lazy->lock);
+    free(lazy->off);
+    free(lazy);
+}
+
+static void bidx_destroy(bidx_t *bidx)
 {
     khint_t k;
+    if (bidx == NULL) return;
+    for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+        if (kh_exist(bidx, k))
+            free(kh_value(bidx, k).list);
+    kh_destroy(bin, bidx);
+}
+
+void hts_idx_destroy(hts_idx_t *idx)
+{
     int i;
     if (idx == 0) return;
 
@@ -1599,18 +1953,224 @@ void hts_idx_destroy(hts_idx_t *idx)
     }
 
     for (i = 0; i < idx->m; ++i) {
-        bidx_t *bidx = idx->bidx[i];
         free(idx->lidx[i].offset);
-        if (bidx == 0) continue;
-        for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
-            if (kh_exist(bidx, k))
-                free(kh_value(bidx, k).list);
-        kh_destroy(bin, bidx);
+        eidx_free(&idx->eidx[i]);
+        bidx_destroy(idx->bidx[i]);
     }
-    free(idx->bidx); free(idx->lidx); free(idx->meta);
+    frozen_destroy(idx->frozen);
+    ends_destroy(idx->ends);
+    idx_lazy_destroy(idx->lazy);
+    free(idx->bidx); free(idx->lidx); free(idx->eidx); free(idx->meta);
     free(idx);
 }
 
+// Adds the linear index entries of p to l, keeping those l already has
+static int lidx_append(lidx_t *l, lidx_t *p)
+{
+    int i;
+    if (l->offset == NULL) {
+        *l = *p;
+        memset(p, 0, sizeof(lidx_t));
+        return 0;
+    }
+    if (l->m < p->n) {
+        uint64_t *new_offset = (uint64_t*)realloc(l->offset, p->n * sizeof(uint64_t));
+        if (!new_offset) return -1;
+        memset(new_offset + l->m, 0xff, sizeof(uint64_t) * (p->n - l->m));
+        l->offset = new_offset;
+        l->m = p->n;
+    }
+    for (i = 0; i < p->n; ++i)
+        if (l->offset[i] == (uint64_t)-1) l->offset[i] = p->offset[i];
+    if (l->n < p->n) l->n = p->n;
+    return 0;
+}
+
+// Adds the end index data of p to e, as if p's records had followed e's
+static int eidx_append(eidx_t *e, eidx_t *p)
+{
+    int i;
+    if (e->off == NULL) {
+        *e = *p;
+        memset(p, 0, sizeof(eidx_t));
+        return 0;
+    }
+    if (e->m < p->m) {
+        eidx_t t = *e;
+        memset(e, 0, sizeof(eidx_t));
+        e->m = p->m;
+        if (!(e->off = (uint64_t*)malloc(e->m * sizeof(uint64_t)))
+            || !(e->max_end = (uint32_t*)calloc(e->m, sizeof(uint32_t)))
+            || !(e->n_rec = (uint32_t*)calloc(e->m, sizeof(uint32_t)))
+            || !(e->d_cov = (int32_t*)calloc(e->m, sizeof(int32_t)))
+            || !(e->d_bases = (int64_t*)calloc(e->m, sizeof(int64_t)))) {
+            eidx_free(e);
+            *e = t;
+            return -1;
+        }
+        memset(e->off, 0xff, e->m * sizeof(uint64_t));
+        memcpy(e->off, t.off, t.m * sizeof(uint64_t));
+        memcpy(e->max_end, t.max_end, t.m * sizeof(uint32_t));
+        memcpy(e->n_rec, t.n_rec, t.m * sizeof(uint32_t));
+        memcpy(e->d_cov, t.d_cov, t.m * sizeof(int32_t));
+        memcpy(e->d_bases, t.d_bases, t.m * sizeof(int64_t));
+        e->n = t.n;
+        eidx_free(&t);
+    }
+    // Coverage changes can be recorded past p->n, so go up to p->m
+    for (i = 0; i < p->m; ++i) {
+        if (e->off[i] == (uint64_t)-1) e->off[i] = p->off[i];
+        if (e->max_end[i] < p->max_end[i]) e->max_end[i] = p->max_end[i];
+        e->n_rec[i] += p->n_rec[i];
+        e->d_cov[i] += p->d_cov[i];
+        e->d_bases[i] += p->d_bases[i];
+    }
+    if (e->n < p->n) e->n = p->n;
+    return 0;
+}
+
+// A pair added to a bin by hts_idx_push(), with when it was added: at the
+// offset the pair reaches, and in order within those added together
+typedef struct {
+    uint64_t t;
+    int seq;
+    uint32_t bin;
+    hts_pair64_t p;
+} bin_insert_t;
+
+#define bin_insert_lt(a, b) ((a).t < (b).t || ((a).t == (b).t && (a).seq < (b).seq))
+KSORT_INIT(_ins, bin_insert_t, bin_insert_lt)
+
+/*
+ * Adds the pairs in the bins of p to those of b, in the order
+ * hts_idx_push() would have added them, so that b's hash table ends up the
+ * same as if it had.  The index is written in hash table order.
+ */
+static int bidx_append(hts_idx_t *idx, bidx_t *b, bidx_t *p)
+{
+    bin_insert_t *ins;
+    size_t n = 0, i;
+    khint_t k;
+    uint32_t j;
+
+    for (k = kh_begin(p); k != kh_end(p); ++k)
+        if (kh_exist(p, k)) n += kh_val(p, k).n;
+    if (n == 0) return 0;
+    if (!(ins = (bin_insert_t*)malloc(n * sizeof(bin_insert_t)))) return -1;
+    for (k = kh_begin(p), n = 0; k != kh_end(p); ++k) {
+        bins_t *l;
+        if (!kh_exist(p, k)) continue;
+        l = &kh_val(p, k);
+        for (j = 0; j < l->n; ++j, ++n) {
+            ins[n].bin = kh_key(p, k);
+            ins[n].p = l->list[j];
+            if (kh_key(p, k) == META_BIN(idx)) {
+                // Offsets, then counts, added on leaving the reference
+                ins[n].t = l->list[0].v;
+                ins[n].seq = j + 1;
+            } else {
+                ins[n].t = l->list[j].v;
+                ins[n].seq = 0;
+            }
+        }
+    }
+    ks_introsort(_ins, n, ins);
+    for (i = 0; i < n; ++i)
+        if (insert_to_b(b, ins[i].bin, ins[i].p.u, ins[i].p.v) < 0) break;
+    free(ins);
+    return i < n ? -1 : 0;
+}
+
+int hts_idx_append(hts_idx_t *idx, hts_idx_t *part)
+{
+    int i, cont, tid0 = part->z.first_tid, ret = -1;
+    khint_t k;
+
+    if (part->z.save_bin == 0xffffffffu) { // nothing to add
+        ret = 0;
+        goto out;
+    }
+    if (idx->z.save_bin == 0xffffffffu) { // nothing to add to
+        hts_idx_t t = *idx;
+        *idx = *part;
+        *part = t;
+        ret = 0;
+        goto out;
+    }
+    if (part->m > idx->m && idx_grow(idx, part->m) < 0) goto out;
+
+    // The checks hts_idx_push() would have made at part's first record
+    cont = idx->z.last_tid == tid0;
+    if (!cont && tid0 >= 0 && idx->n_no_coor) {
+        hts_log_error("NO_COOR reads not in a single block at the end %d %d", tid0, idx->z.last_tid);
+        goto out;
+    }
+    if (cont && tid0 >= 0 && idx->z.last_coor > part->z.first_coor) {
+        hts_log_error("Unsorted positions on sequence #%d: %d followed by %d", tid0+1, idx->z.last_coor+1, part->z.first_coor+1);
+        goto out;
+    }
+    for (i = 0; i < part->n; ++i)
+        if (part->bidx[i] && idx->bidx[i] && !(cont && i == tid0)) {
+            hts_log_error("Chromosome blocks not continuous");
+            goto out;
+        }
+
+    // Join the chunks and metadata that straddle the two, which part
+    // started afresh.  Once part moved on to another bin or reference they
+    // are in its bins, and until then in its internal state.
+    if (cont && idx->z.last_bin == part->z.first_bin) {
+        if (part->z.save_off == part->z.first_off)
+            part->z.save_off = idx->z.save_off;
+        else if (tid0 >= 0 && (k = kh_get(bin, part->bidx[tid0], part->z.first_bin)) != kh_end(part->bidx[tid0]))
+            kh_val(part->bidx[tid0], k).list[0].u = idx->z.save_off;
+    } else if (idx->z.save_tid >= 0) {
+        if (insert_to_b(idx->bidx[idx->z.save_tid], idx->z.save_bin,
+                        idx->z.save_off, part->z.first_off) < 0) goto out;
+    }
+    if (cont) {
+        if (part->z.off_beg == part->z.first_off) {
+            part->z.off_beg = idx->z.off_beg;
+            part->z.n_mapped += idx->z.n_mapped;
+            part->z.n_unmapped += idx->z.n_unmapped;
+        } else if (tid0 >= 0 && (k = kh_get(bin, part->bidx[tid0], META_BIN(part))) != kh_end(part->bidx[tid0])) {
+            bins_t *p = &kh_val(part->bidx[tid0], k);
+            p->list[0].u = idx->z.off_beg;
+            p->list[1].u += idx->z.n_mapped;
+            p->list[1].v += idx->z.n_unmapped;
+        }
+    } else if (idx->z.save_tid >= 0) {
+        if (insert_to_b(idx->bidx[idx->z.save_tid], META_BIN(idx),
+                        idx->z.off_beg, part->z.first_off) < 0
+            || insert_to_b(idx->bidx[idx->z.save_tid], META_BIN(idx),
+                           idx->z.n_mapped, idx->z.n_unmapped) < 0) goto out;
+    }
+
+    for (i = 0; i < part->n; ++i) {
+        bidx_t *b = part->bidx[i];
+        if (b && !idx->bidx[i]) {
+            idx->bidx[i] = b;
+            part->bidx[i] = NULL;
+        } else if (b && bidx_append(idx, idx->bidx[i], b) < 0) {
+            goto out;
+        }
+        if (lidx_append(&idx->lidx[i], &part->lidx[i]) < 0
+            || eidx_append(&idx->eidx[i], &part->eidx[i]) < 0) goto out;
+    }
+    if (idx->n < part->n) idx->n = part->n;
+    idx->n_no_coor += part->n_no_coor;
+
+    part->z.first_off = idx->z.first_off;
+    part->z.first_tid = idx->z.first_tid;
+    part->z.first_coor = idx->z.first_coor;
+    part->z.first_bin = idx->z.first_bin;
+    idx->z = part->z;
+    ret = 0;
+
+ out:
+    hts_idx_destroy(part);
+    return ret;
+}
+
 // The optimizer eliminates these ed_is_big() calls; still it would be good to
 // TODO Determine endianness at configure- or compile-time
 
@@ -1641,6 +2201,116 @@ static inline void swap_bins(bins_t *p)
     }
 }
 
+static bidx_t *idx_get_bidx(const hts_idx_t *idx, int tid);
+static idx_frozen_t *idx_frozen_make(const hts_idx_t *idx);
+
+// The bins of one reference, in either the khash or the frozen layout
+typedef struct {
+    const bidx_t *h;        // khash layout, or NULL if frozen
+    int n;                  // number of bins
+    const uint32_t *bin;    // frozen layout arrays, starting at this reference
+    const uint32_t *lvl_bin;
+    const uint64_t *loff, *chunk_beg;
+    const hts_pair64_t *chunk;
+    int n_lvls;
+} ref_bins_t;
+
+// A bin's linear index offset and chunk list
+typedef struct {
+    uint64_t loff;
+    int n;
+    const hts_pair64_t *list;
+} bin_chunks_t;
+
+// Finds the bins of reference tid.  Returns 0 on success, or -1 if the
+// reference has no index data (or it could not be loaded).
+static int idx_ref_bins(const hts_idx_t *idx, int tid, ref_bins_t *rb)
+{
+    if (tid < 0 || tid >= idx->n) return -1;
+    if (idx->frozen) {
+        const idx_frozen_t *f = idx->frozen;
+        uint32_t b0 = f->ref_bin[tid];
+        rb->h = NULL;
+        rb->n = f->ref_bin[tid+1] - b0;
+        rb->bin = f->bin + b0;
+        rb->lvl_bin = f->lvl_bin + (size_t) tid * (idx->n_lvls + 2);
+        rb->loff = f->loff + b0;
+        rb->chunk_beg = f->chunk_beg + b0;
+        rb->chunk = f->chunk;
+        rb->n_lvls = idx->n_lvls;
+        return 0;
+    }
+    if ((rb->h = idx_get_bidx(idx, tid)) == NULL) return -1;
+    rb->n = kh_size(rb->h);
+    return 0;
+}
+
+static inline void ref_bins_at(const ref_bins_t *rb, int j, bin_chunks_t *b)
+{
+    b->loff = rb->loff[j];
+    b->n = rb->chunk_beg[j+1] - rb->chunk_beg[j];
+    b->list = rb->chunk + rb->chunk_beg[j];
+}
+
+// Looks up a bin.  Returns 1 and fills in *b if it is present, 0 if not.
+static inline int ref_bins_get(const ref_bins_t *rb, uint32_t bin, bin_chunks_t *b)
+{
+    if (rb->h) {
+        khint_t k = kh_get(bin, rb->h, bin);
+        if (k == kh_end(rb->h)) return 0;
+        b->loff = kh_val(rb->h, k).loff;
+        b->n = kh_val(rb->h, k).n;
+        b->list = kh_val(rb->h, k).list;
+        return 1;
+    } else {
+        const uint32_t *a = rb->bin;
+        uint32_t first = 0;
+        int l = 0, lo, hi;
+        while (l <= rb->n_lvls && bin >= (first<<3) + 1) first = (first<<3) + 1, ++l;
+        lo = rb->lvl_bin[l];
+        hi = l <= rb->n_lvls ? rb->lvl_bin[l+1] : rb->n;
+        if (lo == hi || bin < a[lo]) return 0;
+        // Bin numbers are distinct, so bin can be no further than this from
+        // lo.  Levels are usually densely populated, making this a direct hit.
+        if ((uint64_t) bin - a[lo] < (uint64_t) (hi - lo)) {
+            int guess = lo + (bin - a[lo]);
+            if (a[guess] == bin) { ref_bins_at(rb, guess, b); return 1; }
+            hi = guess;
+        }
+        while (lo < hi) {
+            int mid = (lo + hi) >> 1;
+            if (a[mid] < bin) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == rb->n || a[lo] != bin) return 0;
+        ref_bins_at(rb, lo, b);
+        return 1;
+    }
+}
+
+// Iterates over the bins of a reference, in no particular order.  Start
+// with *i = 0; returns 0 when there are no more bins.
+static inline int ref_bins_next(const ref_bins_t *rb, uint32_t *i, uint32_t *bin, bin_chunks_t *b)
+{
+    if (rb->h) {
+        for (; *i < kh_end(rb->h); ++*i)
+            if (kh_exist(rb->h, *i)) {
+                *bin = kh_key(rb->h, *i);
+                b->loff = kh_val(rb->h, *i).loff;
+                b->n = kh_val(rb->h, *i).n;
+                b->list = kh_val(rb->h, *i).list;
+                ++*i;
+                return 1;
+            }
+        return 0;
+    }
+    if (*i >= rb->n) return 0;
+    *bin = rb->bin[*i];
+    ref_bins_at(rb, *i, b);
+    ++*i;
+    return 1;
+}
+
 static int hts_idx_save_core(const hts_idx_t *idx, BGZF *fp, int fmt)
 {
     int32_t i, j;
@@ -1652,24 +2322,26 @@ static int hts_idx_save_core(const hts_idx_t *idx, BGZF *fp, int fmt)
         check(bgzf_write(fp, idx->meta, idx->l_meta));
 
     for (i = 0; i < idx->n; ++i) {
-        khint_t k;
-        bidx_t *bidx = idx->bidx[i];
+        ref_bins_t rb;
+        bin_chunks_t p;
+        uint32_t k = 0, bin;
         lidx_t *lidx = &idx->lidx[i];
+        if (idx_ref_bins(idx, i, &rb) < 0) {
+            if (idx->lazy) return -1;
+            rb.n = 0;
+        }
         // write binning index
-        check(idx_write_int32(fp, bidx? kh_size(bidx) : 0));
-        if (bidx)
-            for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
-                if (kh_exist(bidx, k)) {
-                    bins_t *p = &kh_value(bidx, k);
-                    check(idx_write_uint32(fp, kh_key(bidx, k)));
-                    if (fmt == HTS_FMT_CSI) check(idx_write_uint64(fp, p->loff));
-                    //int j;for(j=0;j<p->n;++j)fprintf(stderr,"%d,%llx,%d,%llx:%llx\n",kh_key(bidx,k),kh_val(bidx, k).loff,j,p->list[j].u,p->list[j].v);
-                    check(idx_write_int32(fp, p->n));
-                    for (j = 0; j < p->n; ++j) {
-                        check(idx_write_uint64(fp, p->list[j].u));
-                        check(idx_write_uint64(fp, p->list[j].v));
-                    }
+        check(idx_write_int32(fp, rb.n));
+        if (rb.n)
+            while (ref_bins_next(&rb, &k, &bin, &p)) {
+                check(idx_write_uint32(fp, bin));
+                if (fmt == HTS_FMT_CSI) check(idx_write_uint64(fp, p.loff));
+                check(idx_write_int32(fp, p.n));
+                for (j = 0; j < p.n; ++j) {
+                    check(idx_write_uint64(fp, p.list[j].u));
+                    check(idx_write_uint64(fp, p.list[j].v));
                 }
+            }
 
         // write linear index
         if (fmt != HTS_FMT_CSI) {
@@ -1695,6 +2367,7 @@ int hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt)
     case HTS_FMT_BAI: strcat(fnidx, ".bai"); break;
     case HTS_FMT_CSI: strcat(fnidx, ".csi"); break;
     case HTS_FMT_TBI: strcat(fnidx, ".tbi"); break;
+    case HTS_FMT_HMI: strcat(fnidx, ".hmi"); break;
     default: abort();
     }
 
@@ -1705,6 +2378,96 @@ int hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt)
     return ret;
 }
 
+/* .hmi files hold the frozen layout of an index so that it can be mapped
+   into memory and used as is.  A 64 byte header, with little-endian values
+       magic "HMI\1", int32 fmt, min_shift, n_lvls, n_ref, uint32 l_meta,
+       uint64 n_no_coor, n_bin, n_chunk, n_win, int32 ends_shift, uint32 flags,
+   is followed by the frozen_size() bytes of arrays.  If n_win is not zero,
+   the ends_size() bytes of the end index come next, padded to a multiple of
+   8 bytes, and then the stats_size() bytes of coverage statistics if flags
+   has HMI_STATS set.  The l_meta bytes of meta are last.
+*/
+#define HMI_HDR_LEN 64
+#define HMI_PAD(sz) ((8 - (sz) % 8) % 8)
+#define HMI_STATS 1
+
+static int idx_save_hmi(const hts_idx_t *idx, const char *fnidx)
+{
+    const idx_frozen_t *f = idx->frozen;
+    const idx_ends_t *e = idx->ends;
+    idx_frozen_t *tmp = NULL;
+    uint8_t hdr[HMI_HDR_LEN] = "HMI\1";
+    static const uint8_t zeros[8] = { 0 };
+    size_t i, n, sz;
+    BGZF *fp;
+
+    #define check(ret) if ((ret) < 0) goto fail
+
+    // Save the layout that hts_idx_freeze() would make
+    if (f == NULL && (f = tmp = idx_frozen_make(idx)) == NULL) return -1;
+    sz = frozen_size(idx->n, idx->n_lvls, f->n_bin, f->n_chunk);
+    i32_to_le(idx->fmt, hdr + 4);
+    i32_to_le(idx->min_shift, hdr + 8);
+    i32_to_le(idx->n_lvls, hdr + 12);
+    i32_to_le(idx->n, hdr + 16);
+    u32_to_le(idx->l_meta, hdr + 20);
+    u64_to_le(idx->n_no_coor, hdr + 24);
+    u64_to_le(f->n_bin, hdr + 32);
+    u64_to_le(f->n_chunk, hdr + 40);
+    u64_to_le(e ? e->n_win : 0, hdr + 48);
+    i32_to_le(e ? e->shift : 0, hdr + 56);
+    u32_to_le(e && e->n_rec ? HMI_STATS : 0, hdr + 60);
+
+    fp = bgzf_open(fnidx, "wu");
+    if (fp == NULL) { frozen_destroy(tmp); return -1; }
+    check(bgzf_write(fp, hdr, HMI_HDR_LEN));
+    if (!ed_is_big()) {
+        check(bgzf_write(fp, f->chunk, sz));
+    } else {
+        for (i = 0; i < f->n_chunk; ++i) {
+            check(idx_write_uint64(fp, f->chunk[i].u));
+            check(idx_write_uint64(fp, f->chunk[i].v));
+        }
+        for (i = 0; i <= f->n_bin; ++i) check(idx_write_uint64(fp, f->chunk_beg[i]));
+        for (i = 0; i < f->n_bin; ++i) check(idx_write_uint64(fp, f->loff[i]));
+        n = (idx->n + 1) + (size_t) idx->n * (idx->n_lvls + 2) + f->n_bin;
+        for (i = 0; i < n; ++i) check(idx_write_uint32(fp, f->ref_bin[i]));
+    }
+    if (e) {
+        check(bgzf_write(fp, zeros, HMI_PAD(sz)));
+        if (!ed_is_big()) {
+            check(bgzf_write(fp, e->win_beg, ends_size(idx->n, e->n_win)));
+        } else {
+            for (i = 0; i <= idx->n; ++i) check(idx_write_uint64(fp, e->win_beg[i]));
+            for (i = 0; i < e->n_win; ++i) check(idx_write_uint64(fp, e->off[i]));
+            for (i = 0; i < 2 * e->n_win; ++i) check(idx_write_uint32(fp, e->max_end[i]));
+        }
+        if (e->n_rec) {
+            if (!ed_is_big()) {
+                check(bgzf_write(fp, e->n_rec, stats_size(e->n_win)));
+            } else {
+                for (i = 0; i < 2 * e->n_win; ++i) check(idx_write_uint64(fp, e->n_rec[i]));
+            }
+        }
+    }
+    if (idx->l_meta) check(bgzf_write(fp, idx->meta, idx->l_meta));
+    frozen_destroy(tmp);
+    return bgzf_close(fp);
+    #undef check
+
+fail:
+    frozen_destroy(tmp);
+    bgzf_close(fp);
+    return -1;
+}
+
+// Whether fnidx names an .hmi file
+static int is_hmi_fn(const char *fnidx)
+{
+    size_t l = strlen(fnidx);
+    return l >= 4 && strcmp(fnidx + l - 4, ".hmi") == 0;
+}
+
 int hts_idx_save_as(const hts_idx_t *idx, const char *fn, const char *fnidx, int fmt)
 {
     BGZF *fp;
@@ -1712,6 +2475,7 @@ int hts_idx_save_as(const hts_idx_t *idx, const char *fn, const char *fnidx, int
     #define check(ret) if ((ret) < 0) goto fail
 
     if (fnidx == NULL) return hts_idx_save(idx, fn, fmt);
+    if (fmt == HTS_FMT_HMI || is_hmi_fn(fnidx)) return idx_save_hmi(idx, fnidx);
 
     fp = bgzf_open(fnidx, (fmt == HTS_FMT_BAI)? "wu" : "w");
     if (fp == NULL) return -1;
@@ -1738,79 +2502,426 @@ fail:
     return -1;
 }
 
-static int hts_idx_load_core(hts_idx_t *idx, BGZF *fp, int fmt)
+// Finishes and saves an index built by sam_idx_init() or bcf_idx_init()
+static int idx_save_on_close(htsFile *fp)
 {
-    int32_t i, n, is_be;
-    is_be = ed_is_big();
-    if (idx == NULL) return -4;
-    for (i = 0; i < idx->n; ++i) {
-        bidx_t *h;
-        lidx_t *l = &idx->lidx[i];
-        uint32_t key;
-        int j, absent;
-        bins_t *p;
-        h = idx->bidx[i] = kh_init(bin);
+    BGZF *bfp = fp->fp.bgzf;
+    hts_idx_t *idx = fp->idx;
+    int ret = -1;
+
+    fp->idx = NULL;
+    if (bgzf_flush(bfp) == 0) {
+        hts_idx_finish(idx, bgzf_tell(bfp));
+        ret = hts_idx_save_as(idx, fp->fn, fp->fnidx, idx->fmt);
+    }
+    if (ret < 0)
+        hts_log_error("Failed to save the index for %s", fp->fn);
+    bfp->hidx = NULL;
+    hts_idx_destroy(idx);
+    return ret;
+}
+
+// Reads the binning and linear indexes of reference i
+static int idx_read_ref(hts_idx_t *idx, BGZF *fp, int i)
+{
+    int32_t n, is_be = ed_is_big();
+    int fmt = idx->fmt;
+    bidx_t *h;
+    lidx_t *l = &idx->lidx[i];
+    uint32_t key;
+    int j, absent;
+    bins_t *p;
+    h = idx->bidx[i] = kh_init(bin);
+    if (h == NULL) return -2;
+    if (bgzf_read(fp, &n, 4) != 4) return -1;
+    if (is_be) ed_swap_4p(&n);
+    for (j = 0; j < n; ++j) {
+        khint_t k;
+        if (bgzf_read(fp, &key, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&key);
+        k = kh_put(bin, h, key, &absent);
+        if (absent <= 0) return -3; // Duplicate bin number
+        p = &kh_val(h, k);
+        p->list = NULL;
+        if (fmt == HTS_FMT_CSI) {
+            if (bgzf_read(fp, &p->loff, 8) != 8) return -1;
+            if (is_be) ed_swap_8p(&p->loff);
+        } else p->loff = 0;
+        if (bgzf_read(fp, &p->n, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&p->n);
+        p->m = p->n;
+        p->list = (hts_pair64_t*)malloc(p->m * sizeof(hts_pair64_t));
+        if (p->list == NULL) return -2;
+        if (bgzf_read(fp, p->list, p->n<<4) != p->n<<4) return -1;
+        if (is_be) swap_bins(p);
+    }
+    if (fmt != HTS_FMT_CSI) { // load linear index
+        int j;
+        if (bgzf_read(fp, &l->n, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&l->n);
+        l->m = l->n;
+        l->offset = (uint64_t*)malloc(l->n * sizeof(uint64_t));
+        if (l->offset == NULL) return -2;
+        if (bgzf_read(fp, l->offset, l->n << 3) != l->n << 3) return -1;
+        if (is_be) for (j = 0; j < l->n; ++j) ed_swap_8p(&l->offset[j]);
+        for (j = 1; j < l->n; ++j) // fill missing values; may happen given older samtools and tabix
+            if (l->offset[j] == 0) l->offset[j] = l->offset[j-1];
+        update_loff(idx, i, 1);
+    }
+    return 0;
+}
+
+// Skips over the index data of one reference without decoding it
+static int idx_skip_ref(BGZF *fp, int fmt)
+{
+    int32_t n_bin, n, is_be = ed_is_big();
+    size_t bin_hdr = fmt == HTS_FMT_CSI ? 12 : 4; // bin number and loff
+    int j;
+    if (bgzf_read(fp, &n_bin, 4) != 4) return -1;
+    if (is_be) ed_swap_4p(&n_bin);
+    for (j = 0; j < n_bin; ++j) {
+        if (bgzf_skip(fp, bin_hdr) != (ssize_t) bin_hdr) return -1;
         if (bgzf_read(fp, &n, 4) != 4) return -1;
         if (is_be) ed_swap_4p(&n);
-        for (j = 0; j < n; ++j) {
-            khint_t k;
-            if (bgzf_read(fp, &key, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&key);
-            k = kh_put(bin, h, key, &absent);
-            if (absent <= 0) return -3; // Duplicate bin number
-            p = &kh_val(h, k);
-            if (fmt == HTS_FMT_CSI) {
-                if (bgzf_read(fp, &p->loff, 8) != 8) return -1;
-                if (is_be) ed_swap_8p(&p->loff);
-            } else p->loff = 0;
-            if (bgzf_read(fp, &p->n, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&p->n);
-            p->m = p->n;
-            p->list = (hts_pair64_t*)malloc(p->m * sizeof(hts_pair64_t));
-            if (p->list == NULL) return -2;
-            if (bgzf_read(fp, p->list, p->n<<4) != p->n<<4) return -1;
-            if (is_be) swap_bins(p);
-        }
-        if (fmt != HTS_FMT_CSI) { // load linear index
-            int j;
-            if (bgzf_read(fp, &l->n, 4) != 4) return -1;
-            if (is_be) ed_swap_4p(&l->n);
-            l->m = l->n;
-            l->offset = (uint64_t*)malloc(l->n * sizeof(uint64_t));
-            if (l->offset == NULL) return -2;
-            if (bgzf_read(fp, l->offset, l->n << 3) != l->n << 3) return -1;
-            if (is_be) for (j = 0; j < l->n; ++j) ed_swap_8p(&l->offset[j]);
-            for (j = 1; j < l->n; ++j) // fill missing values; may happen given older samtools and tabix
-                if (l->offset[j] == 0) l->offset[j] = l->offset[j-1];
-            update_loff(idx, i, 1);
+        if (n < 0) return -3;
+        if (bgzf_skip(fp, (size_t) n << 4) != (ssize_t) ((size_t) n << 4)) return -1;
+    }
+    if (fmt != HTS_FMT_CSI) {
+        if (bgzf_read(fp, &n, 4) != 4) return -1;
+        if (is_be) ed_swap_4p(&n);
+        if (n < 0) return -3;
+        if (bgzf_skip(fp, (size_t) n << 3) != (ssize_t) ((size_t) n << 3)) return -1;
+    }
+    return 0;
+}
+
+// Positions in index files that may be uncompressed (i.e. BAI)
+static inline int64_t idx_file_tell(BGZF *fp)
+{
+    return fp->is_compressed ? bgzf_tell(fp) : bgzf_utell(fp);
+}
+
+static inline int idx_file_seek(BGZF *fp, int64_t off)
+{
+    return fp->is_compressed ? bgzf_seek(fp, off, SEEK_SET) : bgzf_useek(fp, off, SEEK_SET);
+}
+
+static void idx_free_ref(hts_idx_t *idx, int i)
+{
+    free(idx->lidx[i].offset);
+    memset(&idx->lidx[i], 0, sizeof(lidx_t));
+    bidx_destroy(idx->bidx[i]);
+    idx->bidx[i] = NULL;
+}
+
+static int hts_idx_load_core(hts_idx_t *idx, BGZF *fp, int fmt, int flags)
+{
+    int32_t i, is_be;
+    int ret;
+    is_be = ed_is_big();
+    if (idx == NULL) return -4;
+    if (flags & HTS_IDX_LAZY) {
+        // Note where each reference's data starts; it is read on first use
+        idx_lazy_t *lazy = (idx_lazy_t*)calloc(1, sizeof(idx_lazy_t));
+        if (lazy == NULL) return -2;
+        lazy->off = (int64_t*)malloc((idx->n > 0 ? idx->n : 1) * sizeof(int64_t));
+        if (lazy->off == NULL) { free(lazy); return -2; }
+        pthread_mutex_init(&lazy->lock, NULL);
+        idx->lazy = lazy;
+        for (i = 0; i < idx->n; ++i) {
+            lazy->off[i] = idx_file_tell(fp);
+            if ((ret = idx_skip_ref(fp, fmt)) < 0) return ret;
         }
+    } else {
+        for (i = 0; i < idx->n; ++i)
+            if ((ret = idx_read_ref(idx, fp, i)) < 0) return ret;
     }
     if (bgzf_read(fp, &idx->n_no_coor, 8) != 8) idx->n_no_coor = 0;
     if (is_be) ed_swap_8p(&idx->n_no_coor);
     return 0;
 }
 
-static hts_idx_t *hts_idx_load_local(const char *fn)
+// Returns the binning index of reference tid, reading it from the index
+// file first if it was loaded with HTS_IDX_LAZY.
+static bidx_t *idx_get_bidx(const hts_idx_t *idx, int tid)
 {
-    uint8_t magic[4];
-    int i, is_be;
-    hts_idx_t *idx = NULL;
-    uint8_t *meta = NULL;
-    BGZF *fp = bgzf_open(fn, "r");
-    if (fp == NULL) return NULL;
-    is_be = ed_is_big();
-    if (bgzf_read(fp, magic, 4) != 4) goto fail;
-
-    if (memcmp(magic, "CSI\1", 4) == 0) {
-        uint32_t x[3], n;
-        if (bgzf_read(fp, x, 12) != 12) goto fail;
-        if (is_be) for (i = 0; i < 3; ++i) ed_swap_4p(&x[i]);
-        if (x[2]) {
-            if (SIZE_MAX - x[2] < 1) goto fail; // Prevent possible overflow
-            if ((meta = (uint8_t*)malloc((size_t) x[2] + 1)) == NULL) goto fail;
-            if (bgzf_read(fp, meta, x[2]) != x[2]) goto fail;
-            // Prevent possible strlen past the end in tbx_index_load2
-            meta[x[2]] = '\0';
+    hts_idx_t *x = (hts_idx_t *) idx; // loading on demand is not a visible change
+    bidx_t *bidx;
+    if (!idx->lazy) return idx->bidx[tid];
+    pthread_mutex_lock(&x->lazy->lock);
+    if ((bidx = idx->bidx[tid]) == NULL) {
+        if (idx_file_seek(x->lazy->fp, x->lazy->off[tid]) < 0
+            || idx_read_ref(x, x->lazy->fp, tid) < 0) {
+            hts_log_error("Failed to load the index for reference #%d", tid + 1);
+            idx_free_ref(x, tid);
+        }
+        bidx = idx->bidx[tid];
+    }
+    pthread_mutex_unlock(&x->lazy->lock);
+    return bidx;
+}
+
+// Makes the frozen layout of an index that is still using hash tables
+static idx_frozen_t *idx_frozen_make(const hts_idx_t *idx)
+{
+    idx_frozen_t *f;
+    size_t n_bin = 0, n_chunk = 0, sz;
+    uint8_t *mem;
+    int i;
+
+    for (i = 0; i < idx->n; ++i) {
+        bidx_t *bidx = idx_get_bidx(idx, i);
+        khint_t k;
+        if (bidx == NULL) {
+            if (idx->lazy) return NULL;
+            continue;
+        }
+        n_bin += kh_size(bidx);
+        for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+            if (kh_exist(bidx, k)) n_chunk += kh_val(bidx, k).n;
+    }
+    if (n_bin >= UINT32_MAX) {
+        hts_log_error("Too many bins to freeze the index");
+        return NULL;
+    }
+
+    sz = frozen_size(idx->n, idx->n_lvls, n_bin, n_chunk);
+    f = (idx_frozen_t*)calloc(1, sizeof(idx_frozen_t));
+    mem = (uint8_t*)malloc(sz);
+    if (f == NULL || mem == NULL) {
+        free(f);
+        free(mem);
+        return NULL;
+    }
+    f->mem = mem;
+    f->l_mem = sz;
+    frozen_set_arrays(f, mem, idx->n, idx->n_lvls, n_bin, n_chunk);
+
+    n_bin = n_chunk = 0;
+    for (i = 0; i < idx->n; ++i) {
+        bidx_t *bidx = idx->bidx[i];
+        uint32_t *lvl_bin = f->lvl_bin + (size_t) i * (idx->n_lvls + 2);
+        uint32_t first = 0;
+        khint_t k;
+        size_t j, b0 = n_bin;
+        int l;
+        f->ref_bin[i] = n_bin;
+        if (bidx != NULL)
+            for (k = kh_begin(bidx); k != kh_end(bidx); ++k)
+                if (kh_exist(bidx, k)) f->bin[n_bin++] = kh_key(bidx, k);
+        ks_introsort(uint32_t, n_bin - b0, f->bin + b0);
+        for (l = 0, j = b0; l <= idx->n_lvls + 1; ++l) {
+            while (j < n_bin && f->bin[j] < first) ++j;
+            lvl_bin[l] = j - b0;
+            first = (first<<3) + 1;
+        }
+        for (j = b0; j < n_bin; ++j) {
+            const bins_t *p = &kh_val(bidx, kh_get(bin, bidx, f->bin[j]));
+            f->loff[j] = p->loff;
+            f->chunk_beg[j] = n_chunk;
+            memcpy(f->chunk + n_chunk, p->list, p->n * sizeof(hts_pair64_t));
+            n_chunk += p->n;
+        }
+    }
+    f->ref_bin[idx->n] = n_bin;
+    f->chunk_beg[n_bin] = n_chunk;
+    return f;
+}
+
+int hts_idx_freeze(hts_idx_t *idx)
+{
+    idx_frozen_t *f;
+    int i;
+
+    if (idx->fmt == HTS_FMT_CRAI || idx->frozen) return 0;
+    if ((f = idx_frozen_make(idx)) == NULL) return -1;
+
+    for (i = 0; i < idx->m; ++i) {
+        bidx_destroy(idx->bidx[i]);
+        idx->bidx[i] = NULL;
+    }
+    idx_lazy_destroy(idx->lazy); // everything has been loaded now
+    idx->lazy = NULL;
+    idx->frozen = f;
+    return 0;
+}
+
+// Loads an HMI file, whose magic number has already been read from fp.
+// When possible the file is mapped into memory, otherwise it is read in.
+// Files that have been BGZF-compressed can only be read in.
+static hts_idx_t *idx_load_hmi(BGZF *fp, const char *fn)
+{
+    uint8_t hdr[HMI_HDR_LEN];
+    int fmt, min_shift, n_lvls, n, i, l, ends_shift, has_stats;
+    uint32_t l_meta, flags;
+    uint64_t n_bin, n_chunk, n_win;
+    size_t sz, l_ends, j;
+    uint8_t *arrays = NULL;
+    hts_idx_t *idx;
+    idx_frozen_t *f;
+    idx_ends_t *e = NULL;
+
+    if (bgzf_read(fp, hdr + 4, HMI_HDR_LEN - 4) != HMI_HDR_LEN - 4) return NULL;
+    fmt = le_to_i32(hdr + 4);
+    min_shift = le_to_i32(hdr + 8);
+    n_lvls = le_to_i32(hdr + 12);
+    n = le_to_i32(hdr + 16);
+    l_meta = le_to_u32(hdr + 20);
+    n_bin = le_to_u64(hdr + 32);
+    n_chunk = le_to_u64(hdr + 40);
+    n_win = le_to_u64(hdr + 48);
+    ends_shift = le_to_i32(hdr + 56);
+    flags = le_to_u32(hdr + 60);
+    if ((fmt != HTS_FMT_CSI && fmt != HTS_FMT_BAI && fmt != HTS_FMT_TBI)
+        || min_shift < 0 || n_lvls < 0 || n_lvls > 9 || n < 0
+        || n_bin >= UINT32_MAX || n_chunk > SIZE_MAX / 32
+        || n_win >= UINT32_MAX || ends_shift < 0 || ends_shift > 30
+        || (flags & ~HMI_STATS) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    has_stats = n_win && (flags & HMI_STATS);
+    sz = frozen_size(n, n_lvls, n_bin, n_chunk);
+    l_ends = n_win ? HMI_PAD(sz) + ends_size(n, n_win) : 0;
+    if (has_stats) l_ends += stats_size(n_win);
+
+    idx = hts_idx_init(n, fmt, 0, min_shift, n_lvls);
+    if (idx == NULL) return NULL;
+    idx->n_no_coor = le_to_u64(hdr + 24);
+    if ((f = (idx_frozen_t*)calloc(1, sizeof(idx_frozen_t))) == NULL) goto fail;
+    idx->frozen = f;
+    if (n_win) {
+        if ((e = idx->ends = (idx_ends_t*)calloc(1, sizeof(idx_ends_t))) == NULL)
+            goto fail;
+        e->shift = ends_shift;
+    }
+
+#ifdef HAVE_MMAP
+    // Mapped pages are shared between all processes using the index
+    if (!ed_is_big() && !fp->is_compressed && !hisremote(fn)) {
+        struct stat st;
+        size_t l_map = HMI_HDR_LEN + sz + l_ends + l_meta;
+        int fd = open(fn, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= l_map) {
+            void *map = mmap(NULL, l_map, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                f->mem = map;
+                f->l_mem = l_map;
+                f->is_mapped = 1;
+                arrays = (uint8_t*)map + HMI_HDR_LEN;
+            }
+        }
+        if (fd >= 0) close(fd);
+    }
+#endif
+    if (arrays == NULL) {
+        if ((f->mem = malloc(sz)) == NULL) goto fail;
+        f->l_mem = sz;
+        if (bgzf_read(fp, f->mem, sz) != sz) goto fail;
+        arrays = (uint8_t*)f->mem;
+    }
+    frozen_set_arrays(f, arrays, n, n_lvls, n_bin, n_chunk);
+    if (!f->is_mapped && ed_is_big()) {
+        size_t n32 = (n + 1) + (size_t) n * (n_lvls + 2) + n_bin;
+        for (j = 0; j < n_chunk; ++j) {
+            ed_swap_8p(&f->chunk[j].u);
+            ed_swap_8p(&f->chunk[j].v);
+        }
+        for (j = 0; j <= n_bin; ++j) ed_swap_8p(&f->chunk_beg[j]);
+        for (j = 0; j < n_bin; ++j) ed_swap_8p(&f->loff[j]);
+        for (j = 0; j < n32; ++j) ed_swap_4p(&f->ref_bin[j]);
+    }
+
+    if (e) {
+        if (f->is_mapped) {
+            ends_set_arrays(e, arrays + sz + HMI_PAD(sz), n, n_win, has_stats);
+        } else {
+            uint8_t pad[8];
+            if ((e->mem = malloc(l_ends - HMI_PAD(sz))) == NULL) goto fail;
+            if (bgzf_read(fp, pad, HMI_PAD(sz)) != HMI_PAD(sz)
+                || bgzf_read(fp, e->mem, l_ends - HMI_PAD(sz)) != l_ends - HMI_PAD(sz))
+                goto fail;
+            ends_set_arrays(e, (uint8_t*)e->mem, n, n_win, has_stats);
+            if (ed_is_big()) {
+                for (j = 0; j <= n; ++j) ed_swap_8p(&e->win_beg[j]);
+                for (j = 0; j < n_win; ++j) ed_swap_8p(&e->off[j]);
+                for (j = 0; j < 2 * n_win; ++j) ed_swap_4p(&e->max_end[j]);
+                if (has_stats)
+                    for (j = 0; j < 2 * n_win; ++j) ed_swap_8p(&e->n_rec[j]);
+            }
+        }
+    }
+
+    if (l_meta) {
+        if ((idx->meta = (uint8_t*)malloc(l_meta + 1)) == NULL) goto fail;
+        if (f->is_mapped) memcpy(idx->meta, arrays + sz + l_ends, l_meta);
+        else if (bgzf_read(fp, idx->meta, l_meta) != l_meta) goto fail;
+        idx->meta[l_meta] = '\0';
+        idx->l_meta = l_meta;
+    }
+
+    // Check the tables, so queries stay within the arrays and the bin
+    // searches find what they are looking for
+    if (f->ref_bin[0] != 0 || f->ref_bin[n] != n_bin || f->chunk_beg[n_bin] != n_chunk)
+        goto bad;
+    for (j = 0; j < n_bin; ++j)
+        if (f->chunk_beg[j] > f->chunk_beg[j+1]) goto bad;
+    for (i = 0; i < n; ++i) {
+        const uint32_t *lvl_bin = f->lvl_bin + (size_t) i * (n_lvls + 2);
+        const uint32_t *bin = f->bin + f->ref_bin[i];
+        uint32_t n_ref_bin, first = 0;
+        if (f->ref_bin[i+1] < f->ref_bin[i] || f->ref_bin[i+1] > n_bin) goto bad;
+        n_ref_bin = f->ref_bin[i+1] - f->ref_bin[i];
+        for (l = 0; l <= n_lvls + 1; ++l) {
+            if (lvl_bin[l] > n_ref_bin || (l > 0 && lvl_bin[l] < lvl_bin[l-1]))
+                goto bad;
+            // Level l starts at the first bin numbered from first onwards
+            if ((lvl_bin[l] < n_ref_bin && bin[lvl_bin[l]] < first)
+                || (lvl_bin[l] > 0 && bin[lvl_bin[l] - 1] >= first))
+                goto bad;
+            first = (first<<3) + 1;
+        }
+        for (j = 1; j < n_ref_bin; ++j)
+            if (bin[j] <= bin[j-1]) goto bad;
+        if (e && e->win_beg[i+1] < e->win_beg[i]) goto bad;
+    }
+    if (e && (e->win_beg[0] != 0 || e->win_beg[n] != n_win)) goto bad;
+    // idx_ends_filter() walks from first[w] up to w, which must stay within
+    // the windows of the same reference
+    for (i = 0; e && i < n; ++i)
+        for (j = e->win_beg[i]; j < e->win_beg[i+1]; ++j)
+            if (e->first[j] > j - e->win_beg[i]) goto bad;
+    return idx;
+
+ bad:
+    hts_log_error("Corrupted HMI index file %s", fn);
+    errno = EINVAL;
+ fail:
+    hts_idx_destroy(idx);
+    return NULL;
+}
+
+static hts_idx_t *hts_idx_load_local(const char *fn, int flags)
+{
+    uint8_t magic[4];
+    int i, is_be;
+    hts_idx_t *idx = NULL;
+    uint8_t *meta = NULL;
+    BGZF *fp = bgzf_open(fn, "r");
+    if (fp == NULL) return NULL;
+    is_be = ed_is_big();
+    if (bgzf_read(fp, magic, 4) != 4) goto fail;
+
+    if (memcmp(magic, "CSI\1", 4) == 0) {
+        uint32_t x[3], n;
+        if (bgzf_read(fp, x, 12) != 12) goto fail;
+        if (is_be) for (i = 0; i < 3; ++i) ed_swap_4p(&x[i]);
+        if (x[2]) {
+            if (SIZE_MAX - x[2] < 1) goto fail; // Prevent possible overflow
+            if ((meta = (uint8_t*)malloc((size_t) x[2] + 1)) == NULL) goto fail;
+            if (bgzf_read(fp, meta, x[2]) != x[2]) goto fail;
+            // Prevent possible strlen past the end in tbx_index_load2
+            meta[x[2]] = '\0';
         }
         if (bgzf_read(fp, &n, 4) != 4) goto fail;
         if (is_be) ed_swap_4p(&n);
@@ -1818,7 +2929,7 @@ static hts_idx_t *hts_idx_load_local(const char *fn)
         idx->l_meta = x[2];
         idx->meta = meta;
         meta = NULL;
-        if (hts_idx_load_core(idx, fp, HTS_FMT_CSI) < 0) goto fail;
+        if (hts_idx_load_core(idx, fp, HTS_FMT_CSI, flags) < 0) goto fail;
     }
     else if (memcmp(magic, "TBI\1", 4) == 0) {
         uint8_t x[8 * 4];
@@ -1838,18 +2949,22 @@ static hts_idx_t *hts_idx_load_local(const char *fn)
         if (bgzf_read(fp, idx->meta + 28, n) != n) goto fail;
         // Prevent possible strlen past the end in tbx_index_load2
         idx->meta[idx->l_meta] = '\0';
-        if (hts_idx_load_core(idx, fp, HTS_FMT_TBI) < 0) goto fail;
+        if (hts_idx_load_core(idx, fp, HTS_FMT_TBI, flags) < 0) goto fail;
     }
     else if (memcmp(magic, "BAI\1", 4) == 0) {
         uint32_t n;
         if (bgzf_read(fp, &n, 4) != 4) goto fail;
         if (is_be) ed_swap_4p(&n);
         idx = hts_idx_init(n, HTS_FMT_BAI, 0, 14, 5);
-        if (hts_idx_load_core(idx, fp, HTS_FMT_BAI) < 0) goto fail;
+        if (hts_idx_load_core(idx, fp, HTS_FMT_BAI, flags) < 0) goto fail;
+    }
+    else if (memcmp(magic, "HMI\1", 4) == 0) {
+        if ((idx = idx_load_hmi(fp, fn)) == NULL) goto fail;
     }
     else { errno = EINVAL; goto fail; }
 
-    bgzf_close(fp);
+    if (idx->lazy) idx->lazy->fp = fp;
+    else bgzf_close(fp);
     return idx;
 
 fail:
@@ -1899,8 +3014,9 @@ const char **hts_idx_seqnames(const hts_idx_t *idx, int *n, hts_id2name_f getid,
     const char **names = (const char**) calloc(idx->n,sizeof(const char*));
     for (i=0; i<idx->n; i++)
     {
+        // All references of lazily loaded and frozen indexes are present
         bidx_t *bidx = idx->bidx[i];
-        if ( !bidx ) continue;
+        if ( !bidx && !idx->lazy && !idx->frozen ) continue;
         names[tid++] = getid(hdr,i);
     }
     *n = tid;
@@ -1914,11 +3030,11 @@ int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t*
         return -1;
     }
 
-    bidx_t *h = idx->bidx[tid];
-    khint_t k = kh_get(bin, h, META_BIN(idx));
-    if (k != kh_end(h)) {
-        *mapped = kh_val(h, k).list[1].u;
-        *unmapped = kh_val(h, k).list[1].v;
+    ref_bins_t rb;
+    bin_chunks_t p;
+    if (idx_ref_bins(idx, tid, &rb) == 0 && ref_bins_get(&rb, META_BIN(idx), &p)) {
+        *mapped = p.list[1].u;
+        *unmapped = p.list[1].v;
         return 0;
     } else {
         *mapped = 0; *unmapped = 0;
@@ -1931,6 +3047,38 @@ uint64_t hts_idx_get_n_no_coor(const hts_idx_t* idx)
     return idx->n_no_coor;
 }
 
+// Running total from cum, one entry per window, up to position x.  Within a
+// window the total is assumed to grow evenly.
+static uint64_t cum_at(const uint64_t *cum, size_t nw, int shift, int64_t x)
+{
+    size_t w = x >> shift;
+    uint64_t prev;
+    if (w >= nw) return nw ? cum[nw - 1] : 0;
+    prev = w ? cum[w - 1] : 0;
+    return prev + (uint64_t) ((double) (cum[w] - prev)
+                              * (x & ((1 << shift) - 1)) / (1 << shift));
+}
+
+int hts_idx_reg_stats(const hts_idx_t *idx, int tid, int beg, int end,
+                      uint64_t *n_records, uint64_t *n_bases)
+{
+    const idx_ends_t *e;
+    size_t w0, nw;
+    *n_records = *n_bases = 0;
+    if (idx == NULL || idx->fmt == HTS_FMT_CRAI) return -1;
+    e = idx->ends;
+    if (e == NULL || e->n_rec == NULL || tid < 0 || tid >= idx->n) return -1;
+    if (beg < 0) beg = 0;
+    if (end <= beg) return 0;
+    w0 = e->win_beg[tid];
+    nw = e->win_beg[tid + 1] - w0;
+    *n_records = cum_at(e->n_rec + w0, nw, e->shift, end)
+        - cum_at(e->n_rec + w0, nw, e->shift, beg);
+    *n_bases = cum_at(e->n_bases + w0, nw, e->shift, end)
+        - cum_at(e->n_bases + w0, nw, e->shift, beg);
+    return 0;
+}
+
 /****************
  *** Iterator ***
  ****************/
@@ -1953,94 +3101,109 @@ static inline int reg2bins(int64_t beg, int64_t end, hts_itr_t *itr, int min_shi
     return itr->bins.n;
 }
 
-hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec)
+// Sorts a chunk list and reduces it to non-overlapping chunks covering the
+// same file ranges, joining chunks that meet.  Gaps within a BGZF block are
+// kept, as iterators skip over them cheaply.  Returns the new number of chunks.
+static int merge_chunks(hts_pair64_t *off, int n_off)
 {
-    int i, n_off, l, bin;
-    hts_pair64_t *off;
-    khint_t k;
-    bidx_t *bidx;
-    uint64_t min_off, max_off;
-    hts_itr_t *iter = 0;
-    if (tid < 0) {
-        int finished0 = 0;
-        uint64_t off0 = (uint64_t)-1;
-        khint_t k;
-        switch (tid) {
-        case HTS_IDX_START:
-            // Find the smallest offset, note that sequence ids may not be ordered sequentially
-            for (i=0; i<idx->n; i++)
-            {
-                bidx = idx->bidx[i];
-                k = kh_get(bin, bidx, META_BIN(idx));
-                if (k == kh_end(bidx)) continue;
-                if ( off0 > kh_val(bidx, k).list[0].u ) off0 = kh_val(bidx, k).list[0].u;
-            }
-            if ( off0==(uint64_t)-1 && idx->n_no_coor ) off0 = 0; // only no-coor reads in this bam
-            break;
-
-        case HTS_IDX_NOCOOR:
-            /* No-coor reads sort after all of the mapped reads.  The position
-               is not stored in the index itself, so need to find the end
-               offset for the last mapped read.  A loop is needed here in
-               case references at the end of the file have no mapped reads,
-               or sequence ids are not ordered sequentially.
-               See issue samtools#568 and commits b2aab8, 60c22d and cc207d. */
-            for (i = 0; i < idx->n; i++) {
-                bidx = idx->bidx[i];
-                k = kh_get(bin, bidx, META_BIN(idx));
-                if (k != kh_end(bidx)) {
-                    if (off0==(uint64_t)-1 || off0 < kh_val(bidx, k).list[0].v) {
-                        off0 = kh_val(bidx, k).list[0].v;
-                    }
-                }
-            }
-            if ( off0==(uint64_t)-1 && idx->n_no_coor ) off0 = 0; // only no-coor reads in this bam
-            break;
-
-        case HTS_IDX_REST:
-            off0 = 0;
-            break;
+    int i, l;
+    ks_introsort(_off, n_off, off);
+    // resolve completely contained adjacent blocks
+    for (i = 1, l = 0; i < n_off; ++i)
+        if (off[l].v < off[i].v) off[++l] = off[i];
+    n_off = l + 1;
+    // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
+    for (i = 1; i < n_off; ++i)
+        if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
+    // merge adjacent chunks
+    for (i = 1, l = 0; i < n_off; ++i) {
+        if (off[l].v == off[i].u) off[l].v = off[i].v;
+        else off[++l] = off[i];
+    }
+    return l + 1;
+}
 
-        case HTS_IDX_NONE:
-            finished0 = 1;
-            off0 = 0;
-            break;
+// Trims the chunks off[n0] to off[*n_off-1] of reference tid, found from the
+// bins for beg..end, down to the windows of the end index that hold a record
+// reaching beg.  Chunks may be split, growing the array as necessary.
+static int idx_ends_filter(const hts_idx_t *idx, int tid, int beg, int end, hts_pair64_t **off, int n0, int *n_off, int *m_off)
+{
+    const idx_ends_t *e = idx->ends;
+    const uint64_t *w_off;
+    const uint32_t *w_max_end;
+    size_t nw, q0, q1, w;
+    hts_pair64_t *tmp, *r, *out;
+    int i, j, n_r = 0, n_out = 0, n_c = *n_off - n0;
+
+    if (e == NULL || n_c == 0) return 0;
+    nw = e->win_beg[tid+1] - e->win_beg[tid];
+    w_off = e->off + e->win_beg[tid];
+    w_max_end = e->max_end + e->win_beg[tid];
+    q0 = beg >> e->shift;
+    q1 = (end - 1) >> e->shift;
+    if (q0 >= nw) { *n_off = n0; return 0; } // nothing reaches this far
+    if (q1 >= nw) q1 = nw - 1;
+    w = e->first[e->win_beg[tid] + q0];
+    // The linear index already copes when nothing reaches in from the left
+    if (w >= q0) return 0;
+
+    tmp = (hts_pair64_t*)malloc((2 * (q1 - w + 1) + n_c) * sizeof(hts_pair64_t));
+    if (tmp == NULL) return -1;
+    r = tmp;
+    for (; w <= q1; ++w) {
+        uint64_t u = w_off[w], v = w + 1 < nw ? w_off[w+1] : (uint64_t)-1;
+        if (w_max_end[w] <= beg || u == (uint64_t)-1 || u == v) continue;
+        if (n_r > 0 && r[n_r-1].v == u) r[n_r-1].v = v;
+        else r[n_r].u = u, r[n_r++].v = v;
+    }
 
-        default:
-            return 0;
+    out = r + n_r;
+    n_c = merge_chunks(*off + n0, n_c);
+    for (i = n0, j = 0; i < n0 + n_c; ++i) {
+        const hts_pair64_t *c = &(*off)[i];
+        int k;
+        while (j < n_r && r[j].v <= c->u) ++j;
+        for (k = j; k < n_r && r[k].u < c->v; ++k) {
+            out[n_out].u = c->u > r[k].u ? c->u : r[k].u;
+            out[n_out].v = c->v < r[k].v ? c->v : r[k].v;
+            ++n_out;
         }
-        if (off0 != (uint64_t)-1) {
-            iter = (hts_itr_t*)calloc(1, sizeof(hts_itr_t));
-            iter->read_rest = 1;
-            iter->finished = finished0;
-            iter->curr_off = off0;
-            iter->readrec = readrec;
-            return iter;
-        } else return 0;
     }
 
-    if (beg < 0) beg = 0;
-    if (end < beg) return 0;
-    if (tid >= idx->n || (bidx = idx->bidx[tid]) == NULL) return 0;
-
-    iter = (hts_itr_t*)calloc(1, sizeof(hts_itr_t));
-    iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
-    iter->readrec = readrec;
+    if (n0 + n_out > *m_off) {
+        int new_m = n0 + n_out;
+        hts_pair64_t *new_off;
+        kroundup32(new_m);
+        new_off = (hts_pair64_t*)realloc(*off, new_m * sizeof(hts_pair64_t));
+        if (new_off == NULL) { free(tmp); return -1; }
+        *off = new_off; *m_off = new_m;
+    }
+    memcpy(*off + n0, out, n_out * sizeof(hts_pair64_t));
+    *n_off = n0 + n_out;
+    free(tmp);
+    return 0;
+}
 
-    if ( !kh_size(bidx) ) { iter->finished = 1; return iter; }
+// Appends to *off the chunks of reference tid, whose bins are rb, that may
+// hold records overlapping beg..end, growing the array as necessary.
+// iter->bins is used as scratch.
+static int idx_reg_chunks(const hts_idx_t *idx, int tid, const ref_bins_t *rb, int beg, int end, hts_itr_t *iter, hts_pair64_t **off, int *n_off, int *m_off)
+{
+    int i, n, bin, found, n0 = *n_off;
+    bin_chunks_t p;
+    uint64_t min_off, max_off;
 
     // compute min_off
     bin = hts_bin_first(idx->n_lvls) + (beg>>idx->min_shift);
     do {
         int first;
-        k = kh_get(bin, bidx, bin);
-        if (k != kh_end(bidx)) break;
+        if ((found = ref_bins_get(rb, bin, &p))) break;
         first = (hts_bin_parent(bin)<<3) + 1;
         if (bin > first) --bin;
         else bin = hts_bin_parent(bin);
     } while (bin);
-    if (bin == 0) k = kh_get(bin, bidx, bin);
-    min_off = k != kh_end(bidx)? kh_val(bidx, k).loff : 0;
+    if (bin == 0) found = ref_bins_get(rb, bin, &p);
+    min_off = found? p.loff : 0;
 
     // compute max_off: a virtual offset from a bin to the right of end
     bin = hts_bin_first(idx->n_lvls) + ((end-1) >> idx->min_shift) + 1;
@@ -2051,57 +3214,355 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_re
         // off the RHS, which wraps around and immediately goes up to bin 0)
         while (bin % 8 == 1) bin = hts_bin_parent(bin);
         if (bin == 0) { max_off = (uint64_t)-1; break; }
-        k = kh_get(bin, bidx, bin);
-        if (k != kh_end(bidx) && kh_val(bidx, k).n > 0) { max_off = kh_val(bidx, k).list[0].u; break; }
+        if (ref_bins_get(rb, bin, &p) && p.n > 0) { max_off = p.list[0].u; break; }
         bin++;
     }
 
     // retrieve bins
+    iter->bins.n = 0;
     reg2bins(beg, end, iter, idx->min_shift, idx->n_lvls);
-    for (i = n_off = 0; i < iter->bins.n; ++i)
-        if ((k = kh_get(bin, bidx, iter->bins.a[i])) != kh_end(bidx))
-            n_off += kh_value(bidx, k).n;
+    for (i = n = 0; i < iter->bins.n; ++i)
+        if (ref_bins_get(rb, iter->bins.a[i], &p))
+            n += p.n;
+    if (n == 0) return 0;
+    if (*n_off + n > *m_off) {
+        int new_m = *n_off + n;
+        hts_pair64_t *new_off;
+        kroundup32(new_m);
+        new_off = (hts_pair64_t*)realloc(*off, new_m * sizeof(hts_pair64_t));
+        if (new_off == NULL) return -1;
+        *off = new_off; *m_off = new_m;
+    }
+    for (i = 0; i < iter->bins.n; ++i) {
+        if (ref_bins_get(rb, iter->bins.a[i], &p)) {
+            int j;
+            for (j = 0; j < p.n; ++j)
+                if (p.list[j].v > min_off && p.list[j].u < max_off)
+                    (*off)[(*n_off)++] = p.list[j];
+        }
+    }
+    return idx_ends_filter(idx, tid, beg, end, off, n0, n_off, m_off);
+}
+
+// Finds where an iterator over one of the special HTS_IDX_* tids starts.
+// Returns 0 and sets *off0, and *finished for HTS_IDX_NONE; or -1 if there
+// is nothing to read or tid is not valid.
+static int itr_special_off(const hts_idx_t *idx, int tid, uint64_t *off0_ret, int *finished)
+{
+    int i;
+    uint64_t off0 = (uint64_t)-1;
+    ref_bins_t rb;
+    bin_chunks_t p;
+    *finished = 0;
+    switch (tid) {
+    case HTS_IDX_START:
+        // Find the smallest offset, note that sequence ids may not be ordered sequentially
+        for (i=0; i<idx->n; i++)
+        {
+            if (idx_ref_bins(idx, i, &rb) < 0) continue;
+            if (!ref_bins_get(&rb, META_BIN(idx), &p)) continue;
+            if ( off0 > p.list[0].u ) off0 = p.list[0].u;
+        }
+        if ( off0==(uint64_t)-1 && idx->n_no_coor ) off0 = 0; // only no-coor reads in this bam
+        break;
+
+    case HTS_IDX_NOCOOR:
+        /* No-coor reads sort after all of the mapped reads.  The position
+           is not stored in the index itself, so need to find the end
+           offset for the last mapped read.  A loop is needed here in
+           case references at the end of the file have no mapped reads,
+           or sequence ids are not ordered sequentially.
+           See issue samtools#568 and commits b2aab8, 60c22d and cc207d. */
+        for (i = 0; i < idx->n; i++) {
+            if (idx_ref_bins(idx, i, &rb) < 0) continue;
+            if (ref_bins_get(&rb, META_BIN(idx), &p)) {
+                if (off0==(uint64_t)-1 || off0 < p.list[0].v) {
+                    off0 = p.list[0].v;
+                }
+            }
+        }
+        if ( off0==(uint64_t)-1 && idx->n_no_coor ) off0 = 0; // only no-coor reads in this bam
+        break;
+
+    case HTS_IDX_REST:
+        off0 = 0;
+        break;
+
+    case HTS_IDX_NONE:
+        *finished = 1;
+        off0 = 0;
+        break;
+
+    default:
+        return -1;
+    }
+    *off0_ret = off0;
+    return off0 != (uint64_t)-1 ? 0 : -1;
+}
+
+// Fills in iter's chunk list for tid:beg-end, reusing its off array
+static int itr_query_reg(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end)
+{
+    int n_off = 0;
+    ref_bins_t rb;
+
+    if (idx_ref_bins(idx, tid, &rb) < 0) return -1;
+    iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
+    iter->n_off = 0;
+
+    if (rb.n == 0) { iter->finished = 1; return 0; }
+
+    if (idx_reg_chunks(idx, tid, &rb, beg, end, iter, &iter->off, &n_off, &iter->m_off) < 0)
+        return -1;
     if (n_off == 0) {
         // No overlapping bins means the iterator has already finished.
         iter->finished = 1;
+        return 0;
+    }
+    iter->n_off = merge_chunks(iter->off, n_off);
+    return 0;
+}
+
+hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec)
+{
+    hts_itr_t *iter = 0;
+    if (tid < 0) {
+        int finished0;
+        uint64_t off0;
+        if (itr_special_off(idx, tid, &off0, &finished0) < 0) return 0;
+        iter = (hts_itr_t*)calloc(1, sizeof(hts_itr_t));
+        iter->read_rest = 1;
+        iter->finished = finished0;
+        iter->curr_off = off0;
+        iter->readrec = readrec;
         return iter;
     }
-    off = (hts_pair64_t*)calloc(n_off, sizeof(hts_pair64_t));
-    for (i = n_off = 0; i < iter->bins.n; ++i) {
-        if ((k = kh_get(bin, bidx, iter->bins.a[i])) != kh_end(bidx)) {
-            int j;
-            bins_t *p = &kh_value(bidx, k);
-            for (j = 0; j < p->n; ++j)
-                if (p->list[j].v > min_off && p->list[j].u < max_off)
-                    off[n_off++] = p->list[j];
+
+    if (beg < 0) beg = 0;
+    if (end < beg) return 0;
+
+    iter = (hts_itr_t*)calloc(1, sizeof(hts_itr_t));
+    iter->readrec = readrec;
+    if (itr_query_reg(idx, iter, tid, beg, end) < 0) {
+        hts_itr_destroy(iter);
+        return NULL;
+    }
+    return iter;
+}
+
+// Chunk lists of an iterator's most recent queries, so that repeating one
+// needs no index lookup
+#define ITR_CACHE_SIZE 4
+struct hts_itr_cache_t {
+    struct {
+        int tid, beg, end, n_off, m_off;
+        hts_pair64_t *off;
+        uint64_t used;
+    } e[ITR_CACHE_SIZE];
+    uint64_t clock;
+};
+
+static void itr_cache_destroy(struct hts_itr_cache_t *c)
+{
+    int i;
+    if (c == NULL) return;
+    for (i = 0; i < ITR_CACHE_SIZE; ++i) free(c->e[i].off);
+    free(c);
+}
+
+int hts_itr_requery(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end)
+{
+    struct hts_itr_cache_t *c;
+    int i, lru = 0;
+
+    if (iter == NULL) return -1;
+    iter->read_rest = iter->finished = iter->unfiltered = 0;
+    iter->tid = tid; iter->beg = beg; iter->end = end;
+    iter->n_off = 0; iter->i = -1;
+    iter->curr_tid = iter->curr_beg = iter->curr_end = 0;
+    iter->curr_off = 0;
+    if (iter->is_cram || idx == NULL) goto fail;
+
+    if (tid < 0) {
+        int finished0;
+        uint64_t off0;
+        if (itr_special_off(idx, tid, &off0, &finished0) < 0) goto fail;
+        iter->read_rest = 1;
+        iter->finished = finished0;
+        iter->curr_off = off0;
+        return 0;
+    }
+
+    if (beg < 0) iter->beg = beg = 0;
+    if (end < beg) goto fail;
+
+    if ((c = iter->cache) == NULL
+        && (c = iter->cache = (struct hts_itr_cache_t*)calloc(1, sizeof(*c))) == NULL)
+        goto fail;
+    c->clock++;
+    for (i = 0; i < ITR_CACHE_SIZE; ++i) {
+        if (c->e[i].used && c->e[i].tid == tid && c->e[i].beg == beg
+            && c->e[i].end == end)
+            break;
+        if (c->e[i].used < c->e[lru].used) lru = i;
+    }
+
+    if (i < ITR_CACHE_SIZE) { // cache hit
+        int n = c->e[i].n_off;
+        c->e[i].used = c->clock;
+        if (n > iter->m_off) {
+            hts_pair64_t *new_off = (hts_pair64_t*)realloc(iter->off, n * sizeof(hts_pair64_t));
+            if (new_off == NULL) goto fail;
+            iter->off = new_off; iter->m_off = n;
         }
+        if (n > 0) memcpy(iter->off, c->e[i].off, n * sizeof(hts_pair64_t));
+        iter->n_off = n;
+        iter->finished = (n == 0);
+        return 0;
     }
-    if (n_off == 0) {
-        free(off);
-        iter->finished = 1;
+
+    if (itr_query_reg(idx, iter, tid, beg, end) < 0) goto fail;
+
+    // Keep a copy, replacing the least recently used entry
+    if (iter->n_off > c->e[lru].m_off) {
+        hts_pair64_t *new_off = (hts_pair64_t*)realloc(c->e[lru].off, iter->n_off * sizeof(hts_pair64_t));
+        if (new_off == NULL) return 0; // only the cache is affected
+        c->e[lru].off = new_off; c->e[lru].m_off = iter->n_off;
+    }
+    if (iter->n_off > 0) memcpy(c->e[lru].off, iter->off, iter->n_off * sizeof(hts_pair64_t));
+    c->e[lru].n_off = iter->n_off;
+    c->e[lru].tid = tid; c->e[lru].beg = beg; c->e[lru].end = end;
+    c->e[lru].used = c->clock;
+    return 0;
+
+ fail:
+    iter->finished = 1;
+    return -1;
+}
+
+
+hts_itr_t *hts_itr_off(uint64_t beg, uint64_t end, hts_readrec_func *readrec)
+{
+    hts_itr_t *iter = (hts_itr_t*)calloc(1, sizeof(hts_itr_t));
+    if (iter == NULL) return NULL;
+    iter->readrec = readrec;
+    if (end == UINT64_MAX) { // read to the end of the file
+        iter->read_rest = 1;
+        iter->curr_off = beg;
         return iter;
     }
-    ks_introsort(_off, n_off, off);
-    // resolve completely contained adjacent blocks
-    for (i = 1, l = 0; i < n_off; ++i)
-        if (off[l].v < off[i].v) off[++l] = off[i];
-    n_off = l + 1;
-    // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
-    for (i = 1; i < n_off; ++i)
-        if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
-    // merge adjacent blocks
-    for (i = 1, l = 0; i < n_off; ++i) {
-        if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
-        else off[++l] = off[i];
+    if (end <= beg) { iter->finished = 1; return iter; }
+    iter->off = (hts_pair64_t*)malloc(sizeof(hts_pair64_t));
+    if (iter->off == NULL) { free(iter); return NULL; }
+    iter->off[0].u = beg;
+    iter->off[0].v = end;
+    iter->n_off = 1;
+    iter->i = -1;
+    iter->unfiltered = 1;
+    return iter;
+}
+
+int hts_idx_shards(const hts_idx_t *idx, int n, hts_pair64_t **shards)
+{
+    hts_pair64_t *sh;
+    uint64_t *cand = NULL, beg = (uint64_t)-1, last = 0, lo, span;
+    size_t n_cand = 0, m_cand = 0, c, j;
+    int i, k, n_sh;
+
+    *shards = NULL;
+    if (idx->fmt == HTS_FMT_CRAI) {
+        hts_log_error("Sharding is not supported for CRAM files");
+        return -1;
     }
-    n_off = l + 1;
-    iter->n_off = n_off; iter->off = off;
+    if (n < 1) n = 1;
+
+    // Chunks start at records, as do the linear index offsets kept in the
+    // bins, so these are the places the file can be split.  The META_BIN
+    // pseudo-bin gives each reference's first record and the end of its
+    // last one.
+    for (i = 0; i < idx->n; ++i) {
+        ref_bins_t rb;
+        bin_chunks_t p;
+        uint32_t it = 0, bin;
+        if (idx_ref_bins(idx, i, &rb) < 0) {
+            if (idx->lazy) goto fail;
+            continue;
+        }
+        while (ref_bins_next(&rb, &it, &bin, &p)) {
+            if (bin == META_BIN(idx)) {
+                if (p.n < 1) continue;
+                if (beg > p.list[0].u) beg = p.list[0].u;
+                if (last < p.list[0].v) last = p.list[0].v;
+                continue;
+            }
+            if (n_cand + p.n + 1 > m_cand) {
+                uint64_t *new_cand;
+                m_cand = m_cand ? m_cand * 2 : 1024;
+                while (m_cand < n_cand + p.n + 1) m_cand *= 2;
+                new_cand = (uint64_t*)realloc(cand, m_cand * sizeof(uint64_t));
+                if (new_cand == NULL) goto fail;
+                cand = new_cand;
+            }
+            for (j = 0; j < p.n; ++j) cand[n_cand++] = p.list[j].u;
+            if (p.loff) cand[n_cand++] = p.loff;
+        }
+    }
+
+    sh = (hts_pair64_t*)malloc(n * sizeof(hts_pair64_t));
+    if (sh == NULL) goto fail;
+    if (beg == (uint64_t)-1) { // only unplaced reads, if any
+        sh[0].u = 0;
+        sh[0].v = UINT64_MAX;
+        free(cand);
+        *shards = sh;
+        return 1;
+    }
+
+    // Split at the candidate nearest to each multiple of the compressed
+    // size divided by n
+    ks_introsort(uint64_t, n_cand, cand);
+    lo = beg >> 16;
+    span = (last >> 16) > lo ? (last >> 16) - lo : 0;
+    sh[0].u = beg;
+    for (k = 1, n_sh = 1, c = 0; k < n; ++k) {
+        uint64_t target = lo + span / n * k + span % n * k / n;
+        uint64_t split;
+        while (c < n_cand && (cand[c] >> 16 < target || cand[c] <= sh[n_sh-1].u))
+            ++c;
+        if (c > 0 && cand[c-1] > sh[n_sh-1].u
+            && (c == n_cand || target - (cand[c-1] >> 16) < (cand[c] >> 16) - target))
+            split = cand[c-1];
+        else if (c < n_cand)
+            split = cand[c++];
+        else
+            break;
+        sh[n_sh-1].v = split;
+        sh[n_sh++].u = split;
+    }
+    sh[n_sh-1].v = UINT64_MAX; // includes any unplaced reads at the end
+    free(cand);
+    *shards = sh;
+    return n_sh;
+
+ fail:
+    free(cand);
+    return -1;
+}
+
+hts_itr_t *hts_itr_set_skiprec(hts_itr_t *iter, hts_skiprec_func *skiprec)
+{
+    if (iter) iter->skiprec = skiprec;
     return iter;
 }
 
 void hts_itr_destroy(hts_itr_t *iter)
 {
-    if (iter) { free(iter->off); free(iter->bins.a); free(iter); }
+    if (iter) {
+        free(iter->off);
+        free(iter->bins.a);
+        itr_cache_destroy(iter->cache);
+        free(iter);
+    }
 }
 
 static inline long long push_digit(long long i, char c)
@@ -2176,38 +3637,76 @@ const char *hts_parse_reg(const char *s, int *beg, int *end)
     return colon;
 }
 
-hts_itr_t *hts_itr_querys(const hts_idx_t *idx, const char *reg, hts_name2id_f getid, void *hdr, hts_itr_query_func *itr_query, hts_readrec_func *readrec)
+// Parses a "CHR:START-END" region, looking up CHR via getid.  Sets *tid to
+// a negative value if the reference is unknown; returns -1 on failure.
+static int parse_region_tid(const char *reg, hts_name2id_f getid, void *hdr, int *tid, int *beg, int *end)
 {
-    int tid, beg, end;
-    const char *q;
-
-    if (strcmp(reg, ".") == 0)
-        return itr_query(idx, HTS_IDX_START, 0, 0, readrec);
-    else if (strcmp(reg, "*") == 0)
-        return itr_query(idx, HTS_IDX_NOCOOR, 0, 0, readrec);
-
-    q = hts_parse_reg(reg, &beg, &end);
+    const char *q = hts_parse_reg(reg, beg, end);
     if (q) {
         char tmp_a[1024], *tmp = tmp_a;
         if (q - reg + 1 > 1024)
             if (!(tmp = malloc(q - reg + 1)))
-                return NULL;
+                return -1;
         strncpy(tmp, reg, q - reg);
         tmp[q - reg] = 0;
-        tid = getid(hdr, tmp);
+        *tid = getid(hdr, tmp);
         if (tmp != tmp_a)
             free(tmp);
     }
     else {
         // not parsable as a region, but possibly a sequence named "foo:a"
-        tid = getid(hdr, reg);
-        beg = 0; end = INT_MAX;
+        *tid = getid(hdr, reg);
+        *beg = 0; *end = INT_MAX;
     }
+    return 0;
+}
+
+hts_itr_t *hts_itr_querys(const hts_idx_t *idx, const char *reg, hts_name2id_f getid, void *hdr, hts_itr_query_func *itr_query, hts_readrec_func *readrec)
+{
+    int tid, beg, end;
 
+    if (strcmp(reg, ".") == 0)
+        return itr_query(idx, HTS_IDX_START, 0, 0, readrec);
+    else if (strcmp(reg, "*") == 0)
+        return itr_query(idx, HTS_IDX_NOCOOR, 0, 0, readrec);
+
+    if (parse_region_tid(reg, getid, hdr, &tid, &beg, &end) < 0) return NULL;
     if (tid < 0) return NULL;
     return itr_query(idx, tid, beg, end, readrec);
 }
 
+int hts_itr_requerys(const hts_idx_t *idx, hts_itr_t *iter, const char *reg, hts_name2id_f getid, void *hdr, hts_itr_requery_func *itr_requery)
+{
+    int tid, beg, end;
+
+    if (strcmp(reg, ".") == 0)
+        return itr_requery(idx, iter, HTS_IDX_START, 0, 0);
+    else if (strcmp(reg, "*") == 0)
+        return itr_requery(idx, iter, HTS_IDX_NOCOOR, 0, 0);
+
+    if (parse_region_tid(reg, getid, hdr, &tid, &beg, &end) < 0 || tid < 0) {
+        if (iter) iter->finished = 1;
+        return -1;
+    }
+    return itr_requery(idx, iter, tid, beg, end);
+}
+
+// Moves from curr_off, in chunk i of an iterator's chunk list, to the start
+// of chunk i+1.  A later place in the same BGZF block is reached by skipping
+// forwards, which avoids reloading the block.
+static int itr_next_chunk(BGZF *fp, const hts_pair64_t *off, int i, uint64_t *curr_off)
+{
+    uint64_t next = off[i+1].u;
+    if (i >= 0 && off[i].v == next) return 0; // adjacent chunks
+    if (i >= 0 && *curr_off >> 16 == next >> 16 && *curr_off <= next) {
+        if (bgzf_skip(fp, next - *curr_off) < 0) return -1;
+    } else if (bgzf_seek(fp, next, SEEK_SET) < 0) {
+        return -1;
+    }
+    *curr_off = bgzf_tell(fp);
+    return 0;
+}
+
 int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
 {
     int ret, tid, beg, end;
@@ -2229,14 +3728,21 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
     for (;;) {
         if (iter->curr_off == 0 || iter->curr_off >= iter->off[iter->i].v) { // then jump to the next chunk
             if (iter->i == iter->n_off - 1) { ret = -1; break; } // no more chunks
-            if (iter->i < 0 || iter->off[iter->i].v != iter->off[iter->i+1].u) { // not adjacent chunks; then seek
-                if (bgzf_seek(fp, iter->off[iter->i+1].u, SEEK_SET) < 0) return -1;
-                iter->curr_off = bgzf_tell(fp);
-            }
+            if (itr_next_chunk(fp, iter->off, iter->i, &iter->curr_off) < 0) return -1;
             ++iter->i;
         }
-        if ((ret = iter->readrec(fp, data, r, &tid, &beg, &end)) >= 0) {
+        if (iter->skiprec && !iter->unfiltered)
+            ret = iter->skiprec(fp, data, r, &tid, &beg, &end, iter->tid, iter->beg);
+        else
+            ret = iter->readrec(fp, data, r, &tid, &beg, &end);
+        if (ret >= 0) {
             iter->curr_off = bgzf_tell(fp);
+            if (iter->unfiltered) { // every record in the offset range
+                iter->curr_tid = tid;
+                iter->curr_beg = beg;
+                iter->curr_end = end;
+                return ret;
+            }
             if (tid != iter->tid || beg >= iter->end) { // no need to proceed
                 ret = -1; break;
             } else if (end > iter->beg && iter->end > beg) {
@@ -2251,6 +3757,202 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
     return ret;
 }
 
+/*****************************
+ *** Multi-region iterator ***
+ *****************************/
+
+typedef struct {
+    hts_region_t r;
+    int id;
+} region_id_t;
+
+#define region_id_lt(a, b) ((a).r.tid < (b).r.tid || ((a).r.tid == (b).r.tid && ((a).r.beg < (b).r.beg || ((a).r.beg == (b).r.beg && (a).id < (b).id))))
+
+KSORT_INIT(_reg, region_id_t, region_id_lt)
+
+hts_itr_multi_t *hts_itr_multi_query(const hts_idx_t *idx, const hts_region_t *reg, int n_reg, hts_readrec_func *readrec)
+{
+    hts_itr_multi_t *iter;
+    hts_itr_t scratch;
+    region_id_t *sorted = NULL;
+    int i, j, n, m_off = 0;
+
+    if (idx == NULL || n_reg < 0) return NULL;
+    memset(&scratch, 0, sizeof(scratch));
+    iter = (hts_itr_multi_t*)calloc(1, sizeof(hts_itr_multi_t));
+    if (iter == NULL) return NULL;
+    iter->readrec = readrec;
+    iter->i = -1;
+
+    // Sort the usable regions by position, remembering the caller's indices
+    if (n_reg > 0 && (sorted = (region_id_t*)malloc(n_reg * sizeof(region_id_t))) == NULL)
+        goto fail;
+    for (i = n = 0; i < n_reg; ++i) {
+        int beg = reg[i].beg < 0 ? 0 : reg[i].beg;
+        if (reg[i].tid < 0 || beg >= reg[i].end) continue;
+        sorted[n].r.tid = reg[i].tid;
+        sorted[n].r.beg = beg;
+        sorted[n].r.end = reg[i].end;
+        sorted[n].id = i;
+        ++n;
+    }
+    if (n == 0) { free(sorted); iter->finished = 1; return iter; }
+    ks_introsort(_reg, n, sorted);
+
+    iter->reg = (hts_region_t*)malloc(n * sizeof(hts_region_t));
+    iter->reg_id = (int*)malloc(n * sizeof(int));
+    if (iter->reg == NULL || iter->reg_id == NULL) goto fail;
+    for (i = 0; i < n; ++i) {
+        iter->reg[i] = sorted[i].r;
+        iter->reg_id[i] = sorted[i].id;
+    }
+    iter->n_reg = n;
+    free(sorted);
+    sorted = NULL;
+
+    // Gather the chunks for each run of overlapping regions.  Doing this on
+    // the merged intervals keeps the chunk list small for dense region sets.
+    for (i = 0; i < n; i = j) {
+        const hts_region_t *r = &iter->reg[i];
+        int end = r->end;
+        ref_bins_t rb;
+        for (j = i + 1; j < n && iter->reg[j].tid == r->tid && iter->reg[j].beg <= end; ++j)
+            if (iter->reg[j].end > end) end = iter->reg[j].end;
+        if (idx_ref_bins(idx, r->tid, &rb) < 0 || rb.n == 0)
+            continue;
+        if (idx_reg_chunks(idx, r->tid, &rb, r->beg, end, &scratch, &iter->off, &iter->n_off, &m_off) < 0)
+            goto fail;
+    }
+    free(scratch.bins.a);
+
+    if (iter->n_off == 0) iter->finished = 1;
+    else iter->n_off = merge_chunks(iter->off, iter->n_off);
+    return iter;
+
+ fail:
+    free(sorted);
+    free(scratch.bins.a);
+    hts_itr_multi_destroy(iter);
+    return NULL;
+}
+
+hts_itr_multi_t *hts_itr_multi_querys(const hts_idx_t *idx, const char **regs, int n_regs, hts_name2id_f getid, void *hdr, hts_readrec_func *readrec)
+{
+    hts_itr_multi_t *iter;
+    hts_region_t *reg;
+    int i;
+
+    if (n_regs < 0) return NULL;
+    reg = (hts_region_t*)malloc((n_regs > 0 ? n_regs : 1) * sizeof(hts_region_t));
+    if (reg == NULL) return NULL;
+    for (i = 0; i < n_regs; ++i) {
+        if (parse_region_tid(regs[i], getid, hdr, &reg[i].tid, &reg[i].beg, &reg[i].end) < 0) {
+            free(reg);
+            return NULL;
+        }
+        if (reg[i].tid < 0)
+            hts_log_warning("Region '%s' specifies an unknown reference name. Continue anyway", regs[i]);
+    }
+    iter = hts_itr_multi_query(idx, reg, n_regs, readrec);
+    free(reg);
+    return iter;
+}
+
+hts_itr_multi_t *hts_itr_multi_regidx(const hts_idx_t *idx, struct _regidx_t *regidx, hts_name2id_f getid, void *hdr, hts_readrec_func *readrec)
+{
+    hts_itr_multi_t *iter;
+    hts_region_t *reg;
+    char **seqs;
+    int i, n_seqs, n = 0, n_regs = regidx_nregs(regidx);
+
+    reg = (hts_region_t*)malloc((n_regs > 0 ? n_regs : 1) * sizeof(hts_region_t));
+    if (reg == NULL) return NULL;
+    seqs = regidx_seq_names(regidx, &n_seqs);
+    for (i = 0; i < n_seqs; ++i) {
+        int tid = getid(hdr, seqs[i]);
+        regitr_t itr;
+        if (tid < 0)
+            hts_log_warning("Region list contains unknown reference name '%s'. Continue anyway", seqs[i]);
+        if (!regidx_overlap(regidx, seqs[i], 0, UINT32_MAX, &itr)) continue;
+        for (; itr.i < itr.n && n < n_regs; ++itr.i) {
+            // regidx coordinates are 0-based inclusive
+            uint32_t end = REGITR_END(itr);
+            reg[n].tid = tid;
+            reg[n].beg = REGITR_START(itr) > INT_MAX ? INT_MAX : REGITR_START(itr);
+            reg[n].end = end >= INT_MAX ? INT_MAX : end + 1;
+            ++n;
+        }
+    }
+    iter = hts_itr_multi_query(idx, reg, n, readrec);
+    free(reg);
+    return iter;
+}
+
+void hts_itr_multi_destroy(hts_itr_multi_t *iter)
+{
+    if (iter) {
+        free(iter->off); free(iter->reg); free(iter->reg_id);
+        free(iter->hits.a); free(iter);
+    }
+}
+
+hts_itr_multi_t *hts_itr_multi_set_skiprec(hts_itr_multi_t *iter, hts_skiprec_func *skiprec)
+{
+    if (iter) iter->skiprec = skiprec;
+    return iter;
+}
+
+int hts_itr_multi_next(BGZF *fp, hts_itr_multi_t *iter, void *r, void *data)
+{
+    int ret, tid, beg, end;
+    if (iter == NULL || iter->finished) return -1;
+    // A NULL iter->off should always be accompanied by iter->finished.
+    assert(iter->off != NULL);
+    for (;;) {
+        int j;
+        if (iter->curr_off == 0 || iter->curr_off >= iter->off[iter->i].v) { // then jump to the next chunk
+            if (iter->i == iter->n_off - 1) { ret = -1; break; } // no more chunks
+            if (itr_next_chunk(fp, iter->off, iter->i, &iter->curr_off) < 0) return -1;
+            ++iter->i;
+        }
+        // Nothing ending before the first region still in play is wanted
+        if (iter->skiprec && iter->reg_i < iter->n_reg)
+            ret = iter->skiprec(fp, data, r, &tid, &beg, &end,
+                                iter->reg[iter->reg_i].tid, iter->reg[iter->reg_i].beg);
+        else
+            ret = iter->readrec(fp, data, r, &tid, &beg, &end);
+        if (ret < 0) break; // end of file or error
+        iter->curr_off = bgzf_tell(fp);
+        if (tid < 0) { ret = -1; break; } // into the unplaced reads
+        // Retire regions wholly to the left of this record; as the file is
+        // sorted, no later record can overlap them either.
+        while (iter->reg_i < iter->n_reg
+               && (iter->reg[iter->reg_i].tid < tid
+                   || (iter->reg[iter->reg_i].tid == tid && iter->reg[iter->reg_i].end <= beg)))
+            ++iter->reg_i;
+        if (iter->reg_i == iter->n_reg) { ret = -1; break; } // no need to proceed
+        iter->hits.n = 0;
+        for (j = iter->reg_i; j < iter->n_reg && iter->reg[j].tid == tid && iter->reg[j].beg < end; ++j) {
+            if (iter->reg[j].end <= beg) continue;
+            if (iter->hits.n == iter->hits.m) {
+                int new_m = iter->hits.m ? iter->hits.m * 2 : 8;
+                int *new_a = (int*)realloc(iter->hits.a, new_m * sizeof(int));
+                if (new_a == NULL) return -2;
+                iter->hits.a = new_a; iter->hits.m = new_m;
+            }
+            iter->hits.a[iter->hits.n++] = iter->reg_id[j];
+        }
+        if (iter->hits.n > 0) {
+            iter->curr_tid = tid;
+            iter->curr_beg = beg;
+            iter->curr_end = end;
+            return ret;
+        }
+    }
+    iter->finished = 1;
+    return ret;
+}
+
 /**********************
  *** Retrieve index ***
  **********************/
@@ -2321,28 +4023,53 @@ char *hts_idx_getfn(const char *fn, const char *ext)
 
 hts_idx_t *hts_idx_load(const char *fn, int fmt)
 {
-    char *fnidx;
-    hts_idx_t *idx;
-    fnidx = hts_idx_getfn(fn, ".csi");
-    if (! fnidx) fnidx = hts_idx_getfn(fn, fmt == HTS_FMT_BAI? ".bai" : ".tbi");
-    if (fnidx == 0) return 0;
-
-    idx = hts_idx_load2(fn, fnidx);
-    free(fnidx);
-    return idx;
+    return hts_idx_load3(fn, NULL, fmt, 0);
 }
 
 hts_idx_t *hts_idx_load2(const char *fn, const char *fnidx)
 {
-    // Check that the index file is up to date, the main file might have changed
+    return hts_idx_load3(fn, fnidx, 0, 0);
+}
+
+hts_idx_t *hts_idx_load3(const char *fn, const char *fnidx, int fmt, int flags)
+{
+    char *local_fnidx = NULL, *hmi_fnidx = NULL;
+    hts_idx_t *idx;
     struct stat stat_idx,stat_main;
+
+    if (fnidx == NULL) {
+        if (!hisremote(fn)) hmi_fnidx = hts_idx_getfn(fn, ".hmi");
+        local_fnidx = hts_idx_getfn(fn, ".csi");
+        if (! local_fnidx) local_fnidx = hts_idx_getfn(fn, fmt == HTS_FMT_BAI? ".bai" : ".tbi");
+        // A local .hmi sidecar is preferred, as it needs no decoding, unless
+        // it is older than the other index and so may be left over from
+        // before the file was reindexed
+        if (hmi_fnidx) {
+            if (local_fnidx == NULL
+                || (!stat(hmi_fnidx, &stat_idx) && !stat(local_fnidx, &stat_main)
+                    && stat_idx.st_mtime >= stat_main.st_mtime)) {
+                free(local_fnidx);
+                local_fnidx = hmi_fnidx;
+            } else {
+                free(hmi_fnidx);
+            }
+        }
+        if (local_fnidx == 0) return 0;
+        fnidx = local_fnidx;
+    }
+
+    // Check that the index file is up to date, the main file might have changed
     if ( !stat(fn, &stat_main) && !stat(fnidx, &stat_idx) )
     {
         if ( stat_idx.st_mtime < stat_main.st_mtime )
             hts_log_warning("The index file is older than the data file: %s", fnidx);
     }
 
-    return hts_idx_load_local(fnidx);
+    idx = hts_idx_load_local(fnidx, flags);
+    free(local_fnidx);
+    // If there isn't memory to spare for freezing, the khash layout still works
+    if (idx && !(flags & HTS_IDX_LAZY)) (void) hts_idx_freeze(idx);
+    return idx;
 }
 
 
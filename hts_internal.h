@@ -55,6 +55,24 @@ size_t hts_base64_decoded_length(size_t len);
 */
 int hts_decode_base64(char *dest, size_t *destlen, const char *s);
 
+/// Move the end of the record last pushed to an index
+/** If the last record given to hts_idx_push() ended at virtual offset
+    _old_off_, it is changed to _new_off_.  BGZF uses this when flushing a
+    block moves that position to the start of the next block, so the index
+    matches what a reader would see.
+*/
+void hts_idx_amend_last(hts_idx_t *idx, uint64_t old_off, uint64_t new_off);
+
+/// Add an index of the records that follow those in another
+/** _part_ must have been made by hts_idx_init() with the same parameters as
+    _idx_, from the records following those pushed to _idx_, starting at the
+    offset where the last of them ended.  Neither may have been finished.
+    Afterwards _idx_ is as if all the records had been pushed to it, and
+    _part_ has been destroyed.  Returns 0 on success, or -1 if the records
+    are unsorted or on failure to allocate memory.
+*/
+int hts_idx_append(hts_idx_t *idx, hts_idx_t *part);
+
 
 /// Token structure returned by JSON lexing functions
 /** Token types correspond to scalar JSON values and selected punctuation
@@ -54,6 +54,7 @@ extern "C" {
 struct hFILE;
 struct hts_tpool;
 struct bgzf_mtaux_t;
+struct __hts_idx_t;
 typedef struct __bgzidx_t bgzidx_t;
 
 struct BGZF {
@@ -71,6 +72,7 @@ struct BGZF {
     bgzidx_t *idx;      // BGZF index
     int idx_build_otf;  // build index on the fly, set by bgzf_index_build_init()
     z_stream *gz_stream;// for gzip-compressed files
+    struct __hts_idx_t *hidx; // index fed by bgzf_idx_push(), if any
 };
 #ifndef HTS_BGZF_TYPEDEF
 typedef struct BGZF BGZF;
@@ -137,6 +139,15 @@ typedef struct __kstring_t {
      */
     ssize_t bgzf_read(BGZF *fp, void *data, size_t length) HTS_RESULT_USED;
 
+    /**
+     * Advance past _length_ bytes of uncompressed data without copying it.
+     *
+     * @param fp     BGZF file handler
+     * @param length number of bytes to skip
+     * @return       number of bytes actually skipped; 0 on end-of-file and -1 on error
+     */
+    ssize_t bgzf_skip(BGZF *fp, size_t length) HTS_RESULT_USED;
+
     /**
      * Write _length_ bytes from _data_ to the file.  If no I/O errors occur,
      * the complete _length_ bytes will be written (or queued for writing).
@@ -259,6 +270,19 @@ typedef struct __kstring_t {
      */
     int bgzf_flush_try(BGZF *fp, ssize_t size) HTS_RESULT_USED;
 
+    /**
+     * Add an entry for the record just written to an index being built on
+     * the fly.  The record is taken to end at the current write position;
+     * with multi-threaded compression the entry is held back and pushed by
+     * the writer thread once the block's compressed address is known.
+     *
+     * @param fp        BGZF file handler, opened for writing
+     * @param hidx      Index, passed to hts_idx_push()
+     * @param tid, beg, end, is_mapped  As for hts_idx_push()
+     * @return      0 on success; -1 on failure
+     */
+    int bgzf_idx_push(BGZF *fp, struct __hts_idx_t *hidx, int tid, int beg, int end, int is_mapped) HTS_RESULT_USED;
+
     /**
      * Read one byte from a BGZF file. It is faster than bgzf_read()
      * @param fp     BGZF file handler
@@ -174,6 +174,10 @@ typedef struct {
         struct hFILE *hfile;
     } fp;
     htsFormat format;
+    uint32_t required_fields;  // SAM_* fields wanted when reading BAM
+    int64_t last_offset;       // virtual offset of the last BAM record read
+    struct __hts_idx_t *idx;   // index being built as records are written
+    char *fnidx;               // filename for idx, or NULL to derive from fn
 } htsFile;
 
 // A combined thread pool and queue allocation size.
@@ -229,6 +233,9 @@ enum hts_fmt_option {
     CRAM_OPT_REQUIRED_FIELDS,
     CRAM_OPT_LOSSY_NAMES,
     CRAM_OPT_BASES_PER_SLICE,
+    CRAM_OPT_USE_RANS32,
+    CRAM_OPT_USE_TOK,
+    CRAM_OPT_FAVOUR_READ_SPEED,
 
     // General purpose
     HTS_OPT_COMPRESSION_LEVEL = 100,
@@ -505,6 +512,7 @@ When REST or NONE is used, idx is also ignored and may be NULL.
 #define HTS_FMT_BAI 1
 #define HTS_FMT_TBI 2
 #define HTS_FMT_CRAI 3
+#define HTS_FMT_HMI 4  ///< Uncompressed, memory-mappable frozen index
 
 struct __hts_idx_t;
 typedef struct __hts_idx_t hts_idx_t;
@@ -515,8 +523,16 @@ typedef struct {
 
 typedef int hts_readrec_func(BGZF *fp, void *data, void *r, int *tid, int *beg, int *end);
 
+/// Read a record, or skip it if it ends before a position
+/** As for hts_readrec_func, except that a record on reference @p qtid that
+    ends at or before @p qbeg may be skipped over without being decoded into
+    @p r.  *tid, *beg and *end are set either way.  Iterators use this to pass
+    over the records at the start of a chunk that lie before the region.
+*/
+typedef int hts_skiprec_func(BGZF *fp, void *data, void *r, int *tid, int *beg, int *end, int qtid, int qbeg);
+
 typedef struct {
-    uint32_t read_rest:1, finished:1, is_cram:1, dummy:29;
+    uint32_t read_rest:1, finished:1, is_cram:1, unfiltered:1, dummy:28;
     int tid, beg, end, n_off, i;
     int curr_tid, curr_beg, curr_end;
     uint64_t curr_off;
@@ -526,8 +542,39 @@ typedef struct {
         int n, m;
         int *a;
     } bins;
+    hts_skiprec_func *skiprec; // optional, used in place of readrec when set
+    int m_off;                 // allocated size of off
+    struct hts_itr_cache_t *cache; // recent results of hts_itr_requery()
 } hts_itr_t;
 
+/// A region of a reference sequence, as used by multi-region iterators
+typedef struct {
+    int tid;       ///< Reference sequence id
+    int beg, end;  ///< 0-based start and end (exclusive) of the region
+} hts_region_t;
+
+/// Iterator over the records overlapping any of a list of regions
+/** Records are returned in file order, each at most once, and each BGZF
+    block covered by the regions is read at most once.  After a successful
+    hts_itr_multi_next() call, hits.a[0..hits.n-1] holds the indices (in the
+    list given to the query function) of the regions the record overlaps.
+*/
+typedef struct {
+    uint32_t finished:1, dummy:31;
+    int n_reg, reg_i, n_off, i;
+    int curr_tid, curr_beg, curr_end;
+    uint64_t curr_off;
+    hts_region_t *reg;  // usable regions, sorted by position
+    int *reg_id;        // index of each sorted region in the caller's list
+    hts_pair64_t *off;
+    hts_readrec_func *readrec;
+    struct {
+        int n, m;
+        int *a;
+    } hits;
+    hts_skiprec_func *skiprec; // optional, used in place of readrec when set
+} hts_itr_multi_t;
+
     #define hts_bin_first(l) (((1<<(((l)<<1) + (l))) - 1) / 7)
     #define hts_bin_parent(l) (((l) - 1) >> 3)
 
@@ -536,6 +583,21 @@ typedef struct {
     int hts_idx_push(hts_idx_t *idx, int tid, int beg, int end, uint64_t offset, int is_mapped);
     void hts_idx_finish(hts_idx_t *idx, uint64_t final_offset);
 
+/// Convert an index to a compact, read-only layout for faster queries
+/** @param idx  The index, which must be finished or loaded from a file
+    @return  0 if successful, or -1 if an error occurred (in which case the
+             index is unchanged and can still be used).
+
+Each reference's bins are stored sorted by bin number, with all chunk
+lists in one contiguous array, which uses much less memory than the hash
+tables used while building and makes queries more cache-friendly.  No
+more records can be added to a frozen index, but it can be queried and
+saved as usual.  Any references not yet loaded by HTS_IDX_LAZY are read
+first.  Indexes loaded by hts_idx_load() and friends without HTS_IDX_LAZY
+are frozen automatically.  This function is not thread-safe.
+*/
+    int hts_idx_freeze(hts_idx_t *idx);
+
 /// Save an index to a file
 /** @param idx  Index to be written
     @param fn   Input BAM/BCF/etc filename, to which .bai/.csi/etc will be added
@@ -550,6 +612,19 @@ int hts_idx_save(const hts_idx_t *idx, const char *fn, int fmt) HTS_RESULT_USED;
     @param fnidx  Output filename, or NULL to add .bai/.csi/etc to @a fn
     @param fmt    One of the HTS_FMT_* index formats
     @return  0 if successful, or negative if an error occurred.
+
+HTS_FMT_HMI writes an uncompressed sidecar file (.hmi) holding the frozen
+layout of the index, see hts_idx_freeze().  Loading it needs no decoding:
+where possible the file is mapped into memory, so processes using the same
+index share its pages.  To convert an existing .bai/.csi/.tbi, load it and
+save it with this format.  If @p fnidx ends in ".hmi", the index is saved
+in HMI format whatever @p fmt is, so the *_index_build*() functions and
+indexing on the fly can write HMI files directly.
+
+An index that has just been built, rather than loaded, also records how far
+the records starting in each small window of the reference reach.  Queries
+use this to skip records that end before the region, which matters for long
+reads.  It is kept when saving in HMI format, but not in the other formats.
 */
 int hts_idx_save_as(const hts_idx_t *idx, const char *fn, const char *fnidx, int fmt) HTS_RESULT_USED;
 
@@ -558,6 +633,9 @@ int hts_idx_save_as(const hts_idx_t *idx, const char *fn, const char *fnidx, int
                 the extension substituted, to search for an existing index file
     @param fmt  One of the HTS_FMT_* index formats
     @return  The index, or NULL if an error occurred.
+
+For local files, an .hmi index is used in preference to any other kind,
+unless it is older than that index.
 */
 hts_idx_t *hts_idx_load(const char *fn, int fmt);
 
@@ -568,6 +646,26 @@ hts_idx_t *hts_idx_load(const char *fn, int fmt);
 */
 hts_idx_t *hts_idx_load2(const char *fn, const char *fnidx);
 
+/// Flags for hts_idx_load3()
+#define HTS_IDX_LAZY 1  ///< Read each reference's bins only when first queried
+
+/// Load an index file, with control over how it is loaded
+/** @param fn     Input BAM/BCF/etc filename
+    @param fnidx  The input index filename, or NULL to search for one as
+                  hts_idx_load() does
+    @param fmt    One of the HTS_FMT_* index formats, used when searching
+    @param flags  Bitwise OR of HTS_IDX_* flags, or 0
+    @return  The index, or NULL if an error occurred.
+
+With HTS_IDX_LAZY, only the index header and the file offset of each
+reference's section are read up front.  The bins of a reference are read
+the first time it is queried, so opening an index on a file with many
+references and running a few queries costs much less than a full load.
+The index file is kept open until hts_idx_destroy() is called.  Lazily
+loaded indexes may be shared between threads.
+*/
+hts_idx_t *hts_idx_load3(const char *fn, const char *fnidx, int fmt, int flags);
+
 
 /// Get extra index meta-data
 /** @param idx    The index
@@ -599,6 +697,28 @@ int hts_idx_set_meta(hts_idx_t *idx, uint32_t l_meta, uint8_t *meta, int is_copy
     int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t* unmapped);
     uint64_t hts_idx_get_n_no_coor(const hts_idx_t* idx);
 
+/// Estimate how many records, and how much coverage, a region holds
+/** @param idx       Index built in this session, or loaded from an .hmi file
+    @param tid       Reference id
+    @param beg       Start of the region (0-based)
+    @param end       End of the region (exclusive)
+    @param[out] n_records  Mapped records starting in the region
+    @param[out] n_bases    Bases of the region covered by mapped records,
+                           summed over the records
+    @return 0 on success; -1 if idx has no statistics or tid is invalid
+
+    Indexes count the mapped records starting, and the bases they cover, in
+    each window of 1/4 of the linear index size (4kb for BAI), so this works
+    without reading the data file.  The counts are exact for regions aligned
+    to these windows and interpolated within a window otherwise.  The mean
+    depth of the region is n_bases / (end - beg).
+
+    Only .hmi files keep these statistics; indexes loaded from .bai, .csi or
+    .tbi files do not have them.
+*/
+int hts_idx_reg_stats(const hts_idx_t *idx, int tid, int beg, int end,
+                      uint64_t *n_records, uint64_t *n_bases);
+
 
 #define HTS_PARSE_THOUSANDS_SEP 1  ///< Ignore ',' separators within numbers
 
@@ -634,8 +754,105 @@ const char *hts_parse_reg(const char *str, int *beg, int *end);
 
     hts_itr_t *hts_itr_querys(const hts_idx_t *idx, const char *reg, hts_name2id_f getid, void *hdr, hts_itr_query_func *itr_query, hts_readrec_func *readrec);
     int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data) HTS_RESULT_USED;
+
+/// Let an iterator skip records before its region without decoding them
+/** @param iter    Iterator, or NULL
+    @param skiprec Record reader matching the iterator's readrec function
+    @return @p iter, so that this can wrap a query function call
+*/
+hts_itr_t *hts_itr_set_skiprec(hts_itr_t *iter, hts_skiprec_func *skiprec);
+
+/// Point an existing iterator at a new region
+/** @param idx   The index the iterator was made from
+    @param iter  Iterator from hts_itr_query() or hts_itr_querys()
+    @param tid   Reference id, or one of the HTS_IDX_* values
+    @param beg   Start of the region (0-based)
+    @param end   End of the region
+    @return 0 on success; -1 on failure, which leaves @p iter finished
+
+    This gives the same results as destroying @p iter and making a new one
+    with hts_itr_query(), but reuses its buffers.  Each iterator also
+    remembers the chunks of the last few regions it was pointed at, so
+    repeating a recent query needs no index lookup.  The iterator must only
+    be used with the index it was made from.
+*/
+int hts_itr_requery(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end);
+
+    typedef int hts_itr_requery_func(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end);
+
+/// As hts_itr_requery(), taking a region string as for hts_itr_querys()
+int hts_itr_requerys(const hts_idx_t *idx, hts_itr_t *iter, const char *reg, hts_name2id_f getid, void *hdr, hts_itr_requery_func *itr_requery);
+
     const char **hts_idx_seqnames(const hts_idx_t *idx, int *n, hts_id2name_f getid, void *hdr); // free only the array, not the values
 
+struct _regidx_t;
+
+/// Create an iterator over several regions at once
+/** @param idx     Index
+    @param reg     Regions to query; they may overlap and be in any order
+    @param n_reg   Number of regions
+    @param readrec Function to read a record, as for hts_itr_query()
+    @return An iterator, or NULL on error.
+
+    Regions with an unknown (negative) tid or no extent are ignored.  The
+    chunks of all regions are merged, so records lying in several regions
+    are only read and returned once.  The data file must be sorted by
+    position.
+*/
+hts_itr_multi_t *hts_itr_multi_query(const hts_idx_t *idx, const hts_region_t *reg, int n_reg, hts_readrec_func *readrec);
+
+/// Create a multi-region iterator from "CHR:START-END" region strings
+/** Special regions such as "." and "*" are not supported.  Regions naming
+    unknown references are skipped with a warning; hit indices still refer
+    to positions in @p regs.
+*/
+hts_itr_multi_t *hts_itr_multi_querys(const hts_idx_t *idx, const char **regs, int n_regs, hts_name2id_f getid, void *hdr, hts_readrec_func *readrec);
+
+/// Create a multi-region iterator from all the regions in a regidx_t
+/** Hit indices number the regions in the order of regidx_seq_names(), and
+    by position within each sequence.
+*/
+hts_itr_multi_t *hts_itr_multi_regidx(const hts_idx_t *idx, struct _regidx_t *regidx, hts_name2id_f getid, void *hdr, hts_readrec_func *readrec);
+
+/// Read the next record overlapping any of the iterator's regions
+/** @return >= 0 on success, -1 when there are no more records, or < -1
+    on error.
+*/
+int hts_itr_multi_next(BGZF *fp, hts_itr_multi_t *iter, void *r, void *data) HTS_RESULT_USED;
+void hts_itr_multi_destroy(hts_itr_multi_t *iter);
+
+/// As hts_itr_set_skiprec(), for multi-region iterators
+hts_itr_multi_t *hts_itr_multi_set_skiprec(hts_itr_multi_t *iter, hts_skiprec_func *skiprec);
+
+/// Split an indexed file into pieces of roughly equal compressed size
+/** @param idx     Index
+    @param n       Number of pieces wanted
+    @param shards  Set to a malloc()ed array of virtual offset ranges
+    @return The number of pieces, which is at most @p n, or -1 on error.
+
+    Piece i holds the records starting at virtual offsets in
+    [(*shards)[i].u, (*shards)[i].v).  Pieces are in file order, start at
+    record boundaries and between them cover every record exactly once.
+    The last piece ends at UINT64_MAX, so it includes unplaced reads at
+    the end of the file.  Fewer than @p n pieces are returned when the
+    index has too few split points.  Read a piece with hts_itr_off() or
+    the sam_itr_off(), bcf_itr_off() and tbx_itr_off() wrappers, and free()
+    the array when done.  CRAM files are not supported.
+*/
+int hts_idx_shards(const hts_idx_t *idx, int n, hts_pair64_t **shards);
+
+/// Create an iterator over all records in a range of virtual offsets
+/** @param beg     Virtual offset of the first record
+    @param end     Records starting at or after this offset are not read;
+                   UINT64_MAX reads to the end of the file
+    @param readrec Function to read a record, as for hts_itr_query()
+    @return An iterator for use with hts_itr_next(), or NULL on error.
+
+    Records are returned whatever their position.  If @p beg is 0 and
+    @p end is UINT64_MAX, reading continues from the current file position.
+*/
+hts_itr_t *hts_itr_off(uint64_t beg, uint64_t end, hts_readrec_func *readrec);
+
     /**
      * hts_file_type() - Convenience function to determine file type
      * DEPRECATED:  This function has been replaced by hts_detect_format().
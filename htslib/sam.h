@@ -331,6 +331,17 @@ hts_idx_t *sam_index_load(htsFile *fp, const char *fn);
 */
 hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx);
 
+/// Load a BAM (.csi or .bai) or CRAM (.crai) index file, with control over how
+/** @param fp     File handle of the data file whose index is being opened
+    @param fn     BAM/CRAM/etc data file filename
+    @param fnidx  Index filename, or NULL to search alongside @a fn
+    @param flags  Bitwise OR of HTS_IDX_* flags, as for hts_idx_load3()
+    @return  The index, or NULL if an error occurred.
+
+Flags are ignored for CRAM indexes.
+*/
+hts_idx_t *sam_index_load3(htsFile *fp, const char *fn, const char *fnidx, int flags);
+
 /// Generate and save an index file
 /** @param fn        Input BAM/etc filename, to which .csi/etc will be added
     @param min_shift Positive to generate CSI, or 0 to generate BAI
@@ -346,15 +357,77 @@ int sam_index_build(const char *fn, int min_shift) HTS_RESULT_USED;
     @param min_shift Positive to generate CSI, or 0 to generate BAI
     @return  0 if successful, or negative if an error occurred (see
              sam_index_build for error codes)
+
+If @p fnidx ends in ".hmi", the index is saved in HMI format with its
+end index, which speeds up queries on long reads (see hts_idx_save_as()).
 */
 int sam_index_build2(const char *fn, const char *fnidx, int min_shift) HTS_RESULT_USED;
 int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthreads) HTS_RESULT_USED;
 
+/// Build an index while writing a BAM file
+/** @param fp        BAM file opened for writing, with the header written
+    @param h         The file's header
+    @param min_shift Positive to generate CSI, or 0 to generate BAI
+    @param fnidx     Index filename, or NULL to add .bai/.csi to the file name
+    @return  0 on success; -1 on failure
+
+    Subsequent sam_write1() calls add their records to the index, which is
+    saved when the file is closed by sam_close(), avoiding a second pass
+    over the file.  Records must be written in coordinate order.  This works
+    with multi-threaded compression.
+*/
+int sam_idx_init(htsFile *fp, bam_hdr_t *h, int min_shift, const char *fnidx) HTS_RESULT_USED;
+
     #define sam_itr_destroy(iter) hts_itr_destroy(iter)
     hts_itr_t *sam_itr_queryi(const hts_idx_t *idx, int tid, int beg, int end);
     hts_itr_t *sam_itr_querys(const hts_idx_t *idx, bam_hdr_t *hdr, const char *region);
     #define sam_itr_next(htsfp, itr, r) hts_itr_next((htsfp)->fp.bgzf, (itr), (r), (htsfp))
 
+/// Point an iterator from sam_itr_queryi() or sam_itr_querys() at a new region
+/** @param idx   The index the iterator was made from
+    @param iter  Iterator to reuse
+    @param tid   Reference id, or one of the HTS_IDX_* values
+    @param beg   Start of the region (0-based)
+    @param end   End of the region
+    @return 0 on success; -1 on failure, which leaves @p iter finished
+
+    Reusing an iterator avoids allocating a new one for each query, and
+    repeated queries of recent regions are answered from a small cache.
+    See hts_itr_requery().
+*/
+int sam_itr_requeryi(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end);
+
+/// As sam_itr_requeryi(), taking a region string as for sam_itr_querys()
+int sam_itr_requerys(const hts_idx_t *idx, bam_hdr_t *hdr, hts_itr_t *iter, const char *region);
+
+/// Create an iterator over the records overlapping any of several regions
+/** @param idx     BAM index
+    @param hdr     Header, used to look up reference names
+    @param regs    Array of "CHR:START-END" region strings
+    @param n_regs  Number of regions
+    @return An iterator, or NULL on error (including for CRAM indexes)
+
+    Each record is returned once even if it lies in several regions; after
+    sam_itr_multi_next() the iterator's hits array lists the indices into
+    @p regs of the regions it overlaps.  See hts_itr_multi_query().
+*/
+hts_itr_multi_t *sam_itr_regions(const hts_idx_t *idx, bam_hdr_t *hdr, const char **regs, int n_regs);
+
+/// Create a multi-region iterator over all the regions in a regidx_t
+hts_itr_multi_t *sam_itr_regidx(const hts_idx_t *idx, bam_hdr_t *hdr, struct _regidx_t *regidx);
+
+    #define sam_itr_multi_destroy(iter) hts_itr_multi_destroy(iter)
+    #define sam_itr_multi_next(htsfp, itr, r) hts_itr_multi_next((htsfp)->fp.bgzf, (itr), (r), (htsfp))
+
+/// Create an iterator over a piece of a file found by hts_idx_shards()
+/** @param idx  BAM index
+    @param beg  Virtual offset of the piece's first record
+    @param end  Virtual offset of the end of the piece, or UINT64_MAX
+    @return An iterator for use with sam_itr_next(), or NULL on error
+            (including for CRAM indexes)
+*/
+hts_itr_t *sam_itr_off(const hts_idx_t *idx, uint64_t beg, uint64_t end);
+
     /***************
      *** SAM I/O ***
      ***************/
@@ -384,6 +457,21 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
      *  @return >= 0 on successfully reading a new record, -1 on end of stream, < -1 on error
      **/
     int sam_read1(samFile *fp, bam_hdr_t *h, bam1_t *b) HTS_RESULT_USED;
+
+    /*!
+     *  @abstract  Load the parts of the last record read that were skipped
+     *  @param fp  BAM file handle on which CRAM_OPT_REQUIRED_FIELDS was set
+     *  @param b   The record most recently returned by sam_read1() or
+     *             sam_itr_next() on fp
+     *  @return >= 0 on success, < -1 on error
+     *
+     *  Setting CRAM_OPT_REQUIRED_FIELDS on a BAM file makes sam_read1() skip
+     *  over QNAME, SEQ, QUAL and aux data that was not asked for without
+     *  copying it.  This re-reads the whole of the current record, so the
+     *  file must be seekable.  It does nothing if no fields were skipped.
+     */
+    int sam_fill1(samFile *fp, bam1_t *b) HTS_RESULT_USED;
+
     int sam_write1(samFile *fp, const bam_hdr_t *h, const bam1_t *b) HTS_RESULT_USED;
 
     /*************************************
@@ -401,6 +489,19 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
  */
 uint8_t *bam_aux_get(const bam1_t *b, const char tag[2]);
 
+/// Return pointers to several aux records, scanning the aux data once
+/** @param b     Pointer to the bam record
+    @param tags  Concatenated two-character tags to look up, e.g. "RGNMMD"
+    @param vals  Array of strlen(tags)/2 pointers, filled in with the tag
+                 data for each tag as bam_aux_get() would return it, or
+                 NULL if that tag is not present
+    @return The number of tags found, or -1 on error
+    This is faster than calling bam_aux_get() once per tag when several
+    tags are needed from each record.  If the bam record's aux data is
+    corrupt, errno is set to EINVAL and -1 is returned.
+ */
+int bam_aux_get_multi(const bam1_t *b, const char *tags, uint8_t **vals);
+
 /// Get an integer aux value
 /** @param s Pointer to the tag data, as returned by bam_aux_get()
     @return The value, or 0 if the tag was not an integer type
@@ -490,6 +591,67 @@ int bam_aux_del(bam1_t *b, uint8_t *s);
 */
 int bam_aux_update_str(bam1_t *b, const char tag[2], int len, const char *data);
 
+/*! @typedef
+ @abstract  Batch of aux tag changes to be applied to a record in one go
+ @discussion Each of bam_aux_append(), bam_aux_del() and bam_aux_update_str()
+ reallocates and moves the aux data, which is slow when several tags are
+ rewritten per record.  Instead, queue the changes on a bam_aux_edit_t and
+ then call bam_aux_edit_apply() to rebuild the aux block once.  The editor
+ can be reused for further records.
+ */
+typedef struct bam_aux_edit_t bam_aux_edit_t;
+
+/// Create an aux editor
+/** @return New editor, or NULL if out of memory */
+bam_aux_edit_t *bam_aux_edit_init(void);
+
+/// Free an aux editor
+void bam_aux_edit_destroy(bam_aux_edit_t *e);
+
+/// Discard all queued changes
+void bam_aux_edit_clear(bam_aux_edit_t *e);
+
+/// Queue setting a tag, with data as for bam_aux_append()
+/** @param e    The aux editor
+    @param tag  Tag identifier
+    @param type Tag data type
+    @param len  Length of the data in bytes
+    @param data The tag data
+    @return 0 on success, -1 on failure
+    Existing tags are updated in place; others are added at the end.  If the
+    same tag is queued more than once, the last change wins.
+ */
+int bam_aux_edit_set(bam_aux_edit_t *e, const char tag[2], char type,
+                     int len, const uint8_t *data);
+
+/// Queue setting a string-type tag
+int bam_aux_edit_set_str(bam_aux_edit_t *e, const char tag[2], const char *str);
+
+/// Queue setting an integer tag, using the smallest type that holds val
+/** @return 0 on success, -1 on failure
+    errno is set to EINVAL if val cannot be stored in a BAM integer tag.
+ */
+int bam_aux_edit_set_int(bam_aux_edit_t *e, const char tag[2], int64_t val);
+
+/// Queue setting a float-type tag
+int bam_aux_edit_set_float(bam_aux_edit_t *e, const char tag[2], float val);
+
+/// Queue deleting a tag
+/** As with bam_aux_del(), only the first copy of the tag is removed.  It
+    is not an error if the record does not have the tag.
+ */
+int bam_aux_edit_del(bam_aux_edit_t *e, const char tag[2]);
+
+/// Apply the queued changes to a record and clear them
+/** @param e The aux editor
+    @param b The bam record to update
+    @return 0 on success, -1 on failure
+    If the bam record's aux data is corrupt, errno is set to EINVAL; if
+    there is not enough memory, errno is set to ENOMEM.  In both cases the
+    record is left unchanged and the changes remain queued.
+ */
+int bam_aux_edit_apply(bam_aux_edit_t *e, bam1_t *b);
+
 /**************************
  *** Pileup and Mpileup ***
  **************************/
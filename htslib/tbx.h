@@ -55,16 +55,22 @@ typedef struct {
 extern const tbx_conf_t tbx_conf_gff, tbx_conf_bed, tbx_conf_psltbl, tbx_conf_sam, tbx_conf_vcf;
 
     #define tbx_itr_destroy(iter) hts_itr_destroy(iter)
-    #define tbx_itr_queryi(tbx, tid, beg, end) hts_itr_query((tbx)->idx, (tid), (beg), (end), tbx_readrec)
-    #define tbx_itr_querys(tbx, s) hts_itr_querys((tbx)->idx, (s), (hts_name2id_f)(tbx_name2id), (tbx), hts_itr_query, tbx_readrec)
+    #define tbx_itr_queryi(tbx, tid, beg, end) hts_itr_set_skiprec(hts_itr_query((tbx)->idx, (tid), (beg), (end), tbx_readrec), tbx_skiprec)
+    #define tbx_itr_querys(tbx, s) hts_itr_set_skiprec(hts_itr_querys((tbx)->idx, (s), (hts_name2id_f)(tbx_name2id), (tbx), hts_itr_query, tbx_readrec), tbx_skiprec)
     #define tbx_itr_next(htsfp, tbx, itr, r) hts_itr_next(hts_get_bgzfp(htsfp), (itr), (r), (tbx))
     #define tbx_bgzf_itr_next(bgzfp, tbx, itr, r) hts_itr_next((bgzfp), (itr), (r), (tbx))
+    #define tbx_itr_requeryi(tbx, itr, tid, beg, end) hts_itr_requery((tbx)->idx, (itr), (tid), (beg), (end))
+    #define tbx_itr_requerys(tbx, itr, s) hts_itr_requerys((tbx)->idx, (itr), (s), (hts_name2id_f)(tbx_name2id), (tbx), hts_itr_requery)
+    #define tbx_itr_regions(tbx, regs, n) hts_itr_multi_set_skiprec(hts_itr_multi_querys((tbx)->idx, (regs), (n), (hts_name2id_f)(tbx_name2id), (tbx), tbx_readrec), tbx_skiprec)
+    #define tbx_itr_multi_next(htsfp, tbx, itr, r) hts_itr_multi_next(hts_get_bgzfp(htsfp), (itr), (r), (tbx))
+    #define tbx_itr_off(beg, end) hts_itr_off((beg), (end), tbx_readrec)
 
     int tbx_name2id(tbx_t *tbx, const char *ss);
 
     /* Internal helper function used by tbx_itr_next() */
     BGZF *hts_get_bgzfp(htsFile *fp);
     int tbx_readrec(BGZF *fp, void *tbxv, void *sv, int *tid, int *beg, int *end);
+    int tbx_skiprec(BGZF *fp, void *tbxv, void *sv, int *tid, int *beg, int *end, int qtid, int qbeg);
 
     tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf);
     int tbx_index_build(const char *fn, int min_shift, const tbx_conf_t *conf);
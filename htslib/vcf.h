@@ -381,6 +381,8 @@ typedef struct {
 
     /** Helper function for the bcf_itr_next() macro; internal use, ignore it */
     int bcf_readrec(BGZF *fp, void *null, void *v, int *tid, int *beg, int *end);
+    /** Helper function for the bcf_itr_query*() macros; internal use, ignore it */
+    int bcf_skiprec(BGZF *fp, void *null, void *v, int *tid, int *beg, int *end, int qtid, int qbeg);
 
 
 
@@ -792,13 +794,19 @@ typedef struct {
      **************************************************************************/
 
     #define bcf_itr_destroy(iter) hts_itr_destroy(iter)
-    #define bcf_itr_queryi(idx, tid, beg, end) hts_itr_query((idx), (tid), (beg), (end), bcf_readrec)
-    #define bcf_itr_querys(idx, hdr, s) hts_itr_querys((idx), (s), (hts_name2id_f)(bcf_hdr_name2id), (hdr), hts_itr_query, bcf_readrec)
+    #define bcf_itr_queryi(idx, tid, beg, end) hts_itr_set_skiprec(hts_itr_query((idx), (tid), (beg), (end), bcf_readrec), bcf_skiprec)
+    #define bcf_itr_querys(idx, hdr, s) hts_itr_set_skiprec(hts_itr_querys((idx), (s), (hts_name2id_f)(bcf_hdr_name2id), (hdr), hts_itr_query, bcf_readrec), bcf_skiprec)
     #define bcf_itr_next(htsfp, itr, r) hts_itr_next((htsfp)->fp.bgzf, (itr), (r), 0)
+    #define bcf_itr_requeryi(idx, itr, tid, beg, end) hts_itr_requery((idx), (itr), (tid), (beg), (end))
+    #define bcf_itr_requerys(idx, hdr, itr, s) hts_itr_requerys((idx), (itr), (s), (hts_name2id_f)(bcf_hdr_name2id), (hdr), hts_itr_requery)
+    #define bcf_itr_regions(idx, hdr, regs, n) hts_itr_multi_set_skiprec(hts_itr_multi_querys((idx), (regs), (n), (hts_name2id_f)(bcf_hdr_name2id), (hdr), bcf_readrec), bcf_skiprec)
+    #define bcf_itr_multi_next(htsfp, itr, r) hts_itr_multi_next((htsfp)->fp.bgzf, (itr), (r), 0)
+    #define bcf_itr_off(beg, end) hts_itr_off((beg), (end), bcf_readrec)
     #define bcf_index_load(fn) hts_idx_load(fn, HTS_FMT_CSI)
     #define bcf_index_seqnames(idx, hdr, nptr) hts_idx_seqnames((idx),(nptr),(hts_id2name_f)(bcf_hdr_id2name),(hdr))
 
     hts_idx_t *bcf_index_load2(const char *fn, const char *fnidx);
+    #define bcf_index_load3(fn, fnidx, flags) hts_idx_load3((fn), (fnidx), HTS_FMT_CSI, (flags))
 
     /**
      *  bcf_index_build() - Generate and save an index file
@@ -848,6 +856,22 @@ typedef struct {
      */
      int bcf_index_build3(const char *fn, const char *fnidx, int min_shift, int n_threads);
 
+    /**
+     *  bcf_idx_init() - Build an index while writing a BCF or bgzipped VCF file
+     *  @fp:         File opened for writing, with the header already written
+     *  @h:          The file's header
+     *  @min_shift:  Positive to generate CSI, or 0 to generate TBI (VCF only;
+     *               BCF is always indexed with CSI)
+     *  @fnidx:      Output filename, or NULL to add .csi/.tbi to the file name
+     *
+     *  Records passed to bcf_write() are added to the index, which is saved
+     *  when the file is closed by hts_close().  Records must be written in
+     *  coordinate order.
+     *
+     *  Returns 0 on success, or -1 on failure.
+     */
+    int bcf_idx_init(htsFile *fp, bcf_hdr_t *h, int min_shift, const char *fnidx) HTS_RESULT_USED;
+
 /*******************
  * Typed value I/O *
  *******************/
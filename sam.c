@@ -38,6 +38,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "hts_internal.h"
 #include "htslib/hfile.h"
 #include "htslib/hts_endian.h"
+#include "htslib/thread_pool.h"
 
 #include "htslib/khash.h"
 KHASH_DECLARE(s2i, kh_cstr_t, int64_t)
@@ -377,11 +378,34 @@ static void swap_data(const bam1_core_t *c, int l_data, uint8_t *data, int is_ho
     for (i = 0; i < c->n_cigar; ++i) ed_swap_4p(&cigar[i]);
 }
 
-int bam_read1(BGZF *fp, bam1_t *b)
+// True if fields requests everything bam_read1_fields() could otherwise skip
+static inline int bam_fields_complete(uint32_t fields)
+{
+    return (fields & SAM_QNAME) && (fields & SAM_QUAL)
+        && (fields & (SAM_AUX|SAM_RGAUX));
+}
+
+// Read len bytes into data, or just skip them if data is NULL
+static inline int bam_read_part(BGZF *fp, uint8_t *data, size_t len)
+{
+    ssize_t ret = data? bgzf_read(fp, data, len) : bgzf_skip(fp, len);
+    return ret == (ssize_t) len? 0 : -1;
+}
+
+/*
+ * Reads a BAM record, copying only the variable-length parts selected by
+ * fields (a mask of SAM_* values, as used by CRAM_OPT_REQUIRED_FIELDS).
+ * Unwanted parts are skipped in the BGZF stream and replaced as the CRAM
+ * decoder does: QNAME becomes "?", SEQ becomes "*" (l_qseq == 0) and QUAL
+ * becomes 0xff.  CIGAR is always kept so that bam_endpos() still works.
+ */
+static int bam_read1_fields(BGZF *fp, bam1_t *b, uint32_t fields)
 {
     bam1_core_t *c = &b->core;
     int32_t block_len, ret, i;
-    uint32_t x[8];
+    uint32_t x[8], l_qname, l_seq, l_aux;
+    int keep_seq, keep_qual, keep_aux;
+    uint8_t *d;
     if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
         if (ret == 0) return -1; // normal end-of-file
         else return -2; // truncated
@@ -392,18 +416,28 @@ int bam_read1(BGZF *fp, bam1_t *b)
         for (i = 0; i < 8; ++i) ed_swap_4p(x + i);
     }
     c->tid = x[0]; c->pos = x[1];
-    c->bin = x[2]>>16; c->qual = x[2]>>8&0xff; c->l_qname = x[2]&0xff;
-    c->l_extranul = (c->l_qname%4 != 0)? (4 - c->l_qname%4) : 0;
-    if ((uint32_t) c->l_qname + c->l_extranul > 255) // l_qname would overflow
-        return -4;
+    c->bin = x[2]>>16; c->qual = x[2]>>8&0xff; c->l_qname = l_qname = x[2]&0xff;
     c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
     c->l_qseq = x[4];
     c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
-    b->l_data = block_len - 32 + c->l_extranul;
-    if (b->l_data < 0 || c->l_qseq < 0 || c->l_qname < 1) return -4;
-    if (((uint64_t) c->n_cigar << 2) + c->l_qname + c->l_extranul
-        + (((uint64_t) c->l_qseq + 1) >> 1) + c->l_qseq > (uint64_t) b->l_data)
+    if (block_len < 32 || c->l_qseq < 0 || l_qname < 1) return -4;
+    l_seq = ((uint32_t) c->l_qseq + 1) >> 1;
+    if (((uint64_t) c->n_cigar << 2) + l_qname + l_seq + c->l_qseq
+        > (uint64_t) block_len - 32)
         return -4;
+    l_aux = block_len - 32 - l_qname - (c->n_cigar << 2) - l_seq - c->l_qseq;
+
+    keep_seq  = (fields & (SAM_SEQ|SAM_QUAL)) != 0;
+    keep_qual = (fields & SAM_QUAL) != 0;
+    keep_aux  = (fields & (SAM_AUX|SAM_RGAUX)) != 0;
+
+    if (!(fields & SAM_QNAME)) c->l_qname = 2;
+    c->l_extranul = (c->l_qname%4 != 0)? (4 - c->l_qname%4) : 0;
+    if ((uint32_t) c->l_qname + c->l_extranul > 255) // l_qname would overflow
+        return -4;
+
+    b->l_data = c->l_qname + c->l_extranul + (c->n_cigar << 2)
+        + (keep_seq? l_seq + c->l_qseq : 0) + (keep_aux? l_aux : 0);
     if (b->m_data < b->l_data) {
         uint8_t *new_data;
         uint32_t new_m = b->l_data;
@@ -414,16 +448,47 @@ int bam_read1(BGZF *fp, bam1_t *b)
         b->data = new_data;
         b->m_data = new_m;
     }
-    if (bgzf_read(fp, b->data, c->l_qname) != c->l_qname) return -4;
-    for (i = 0; i < c->l_extranul; ++i) b->data[c->l_qname+i] = '\0';
+
+    d = b->data;
+    if (fields & SAM_QNAME) {
+        if (bgzf_read(fp, d, l_qname) != l_qname) return -4;
+    } else {
+        if (bam_read_part(fp, NULL, l_qname) < 0) return -4;
+        d[0] = '?'; d[1] = '\0';
+    }
+    for (i = 0; i < c->l_extranul; ++i) d[c->l_qname+i] = '\0';
     c->l_qname += c->l_extranul;
-    if (b->l_data < c->l_qname ||
-        bgzf_read(fp, b->data + c->l_qname, b->l_data - c->l_qname) != b->l_data - c->l_qname)
-        return -4;
+    d += c->l_qname;
+
+    if (bam_fields_complete(fields)) {
+        // Everything else is wanted, so read it in one go
+        if (bgzf_read(fp, d, b->l_data - c->l_qname) != b->l_data - c->l_qname)
+            return -4;
+    } else {
+        if (bam_read_part(fp, d, c->n_cigar << 2) < 0) return -4;
+        d += c->n_cigar << 2;
+        if (keep_seq) {
+            if (bam_read_part(fp, d, l_seq) < 0) return -4;
+            d += l_seq;
+            if (bam_read_part(fp, keep_qual? d : NULL, c->l_qseq) < 0)
+                return -4;
+            if (!keep_qual) memset(d, 0xff, c->l_qseq);
+            d += c->l_qseq;
+        } else {
+            if (bam_read_part(fp, NULL, l_seq + c->l_qseq) < 0) return -4;
+            c->l_qseq = 0;
+        }
+        if (bam_read_part(fp, keep_aux? d : NULL, l_aux) < 0) return -4;
+    }
     if (fp->is_be) swap_data(c, b->l_data, b->data, 0);
     return 4 + block_len;
 }
 
+int bam_read1(BGZF *fp, bam1_t *b)
+{
+    return bam_read1_fields(fp, b, ~0U);
+}
+
 int bam_write1(BGZF *fp, const bam1_t *b)
 {
     const bam1_core_t *c = &b->core;
@@ -462,37 +527,397 @@ int bam_write1(BGZF *fp, const bam1_t *b)
  *** BAM indexing ***
  ********************/
 
-static hts_idx_t *bam_index(BGZF *fp, int min_shift)
+/*
+ * Finds the reference, start and end of a BAM record from its raw data d,
+ * which follows the block_size field and is block_len bytes long.  Returns
+ * 0 on success, or -4 if the record is malformed.
+ */
+static int bam_raw_span(const uint8_t *d, int32_t block_len, int *tid,
+                        int *beg, int *end, int *is_mapped)
+{
+    int32_t l_qname, l_qseq, pos;
+    uint32_t flag, n_cigar, i, rlen;
+
+    *tid = le_to_i32(d);
+    pos = le_to_i32(d + 4);
+    l_qname = d[8];
+    flag = le_to_u32(d + 12) >> 16;
+    n_cigar = le_to_u32(d + 12) & 0xffff;
+    l_qseq = le_to_i32(d + 16);
+    if (l_qseq < 0 || l_qname < 1 || l_qname > 252) return -4;
+    if (((uint64_t) n_cigar << 2) + l_qname + (((uint64_t) l_qseq + 1) >> 1)
+        + l_qseq > (uint64_t) block_len - 32)
+        return -4;
+
+    rlen = 1;
+    if (!(flag & BAM_FUNMAP) && n_cigar > 0) {
+        const uint8_t *cigar = d + 32 + l_qname;
+        for (i = 0, rlen = 0; i < n_cigar; i++) {
+            uint32_t c = le_to_u32(cigar + 4 * i);
+            if (bam_cigar_type(bam_cigar_op(c)) & 2) rlen += bam_cigar_oplen(c);
+        }
+    }
+    *beg = pos;
+    *end = pos + rlen;
+    *is_mapped = !(flag & BAM_FUNMAP);
+    return 0;
+}
+
+/*
+ * Reads the next BAM record far enough to index it.  Where the whole record
+ * lies within the current BGZF block it is parsed in place, so the record
+ * data is never copied; records that straddle a block boundary are read
+ * into *tmp.  Returns values as for bam_read1().
+ */
+static int bam_index_scan1(BGZF *fp, kstring_t *tmp, int *tid, int *beg,
+                           int *end, int *is_mapped)
 {
-    int n_lvls, i, fmt, ret;
-    bam1_t *b;
+    const uint8_t *d;
+    int32_t block_len;
+    int available = fp->block_length - fp->block_offset;
+
+    if (available >= 4) {
+        d = (const uint8_t *) fp->uncompressed_block + fp->block_offset;
+        block_len = le_to_i32(d);
+        if (block_len < 32) return -4;
+    }
+    if (available >= 4 && block_len <= available - 4) {
+        d += 4;
+    } else {
+        ssize_t ret = bgzf_read(fp, &block_len, 4);
+        if (ret != 4) return ret == 0? -1 : -2;
+        block_len = le_to_i32((uint8_t *) &block_len);
+        if (block_len < 32) return -4;
+        if (ks_resize(tmp, block_len) < 0) return -4;
+        ret = bgzf_read(fp, tmp->s, block_len);
+        if (ret != block_len) return ret < 32? -3 : -4;
+        d = (const uint8_t *) tmp->s;
+        available = 0;
+    }
+
+    if (bam_raw_span(d, block_len, tid, beg, end, is_mapped) < 0) return -4;
+
+    // Consume the record if it was parsed in place
+    if (available && bgzf_skip(fp, 4 + block_len) != 4 + block_len) return -4;
+    return 4 + block_len;
+}
+
+/*
+ * Partitioned indexing.  With threads, the file is cut at BGZF block
+ * boundaries, each part is read and indexed by its own job, and the parts'
+ * indexes are joined in order with hts_idx_append().  Nothing in BAM marks
+ * where a record begins, so each job guesses where its first record starts
+ * from a run of plausible records in its first block.  The job before it
+ * reads on to the first record starting at or beyond the boundary, which
+ * confirms the guess; a part guessed wrongly is indexed again from there.
+ */
+
+#define BAM_INDEX_PART_MIN (1 << 20)  // smallest part worth a job, compressed
+#define BAM_INDEX_PARTS_PER_THREAD 4  // more parts than threads, to even out
+#define BAM_INDEX_GUESS_SIZE (1 << 18)  // data examined for the first record
+#define BAM_INDEX_GUESS_RECS 4        // records in a run taken as plausible
+
+typedef struct {
+    const char *fn;
+    const bam_hdr_t *h;
+    int fmt, min_shift, n_lvls;
+    int64_t block;      // file offset of the part's first BGZF block
+    int64_t next;       // and of the next part's, or -1 for the last part
+    uint64_t beg;       // virtual offset of the first record, or -1 if unknown
+    uint64_t end;       // where the next part's first record starts, or EOF
     hts_idx_t *idx;
-    bam_hdr_t *h;
-    h = bam_hdr_read(fp);
-    if (h == NULL) return NULL;
-    if (min_shift > 0) {
+    int ret;
+} bam_index_part_t;
+
+static int bam_index_fmt(const bam_hdr_t *h, int *min_shift, int *n_lvls)
+{
+    if (*min_shift > 0) {
         int64_t max_len = 0, s;
+        int i;
         for (i = 0; i < h->n_targets; ++i)
             if (max_len < h->target_len[i]) max_len = h->target_len[i];
         max_len += 256;
-        for (n_lvls = 0, s = 1<<min_shift; max_len > s; ++n_lvls, s <<= 3);
-        fmt = HTS_FMT_CSI;
-    } else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_BAI;
+        for (*n_lvls = 0, s = 1<<*min_shift; max_len > s; ++*n_lvls, s <<= 3);
+        return HTS_FMT_CSI;
+    }
+    *min_shift = 14;
+    *n_lvls = 5;
+    return HTS_FMT_BAI;
+}
+
+// Tests for a BGZF block header at d
+static int bgzf_header_at(const uint8_t *d)
+{
+    static const uint8_t magic[16] = "\37\213\10\4\0\0\0\0\0\377\6\0BC\2\0";
+    return memcmp(d, magic, 4) == 0 && memcmp(d + 10, magic + 10, 6) == 0;
+}
+
+/*
+ * Finds the first BGZF block holding data that starts at or after pos in
+ * hf, a file of size bytes.  As a chance match of a header is possible, it
+ * must be followed by another at the place it says.  Returns the block's
+ * offset, or -1 if none is found.
+ */
+static int64_t bam_index_find_block(hFILE *hf, int64_t pos, int64_t size)
+{
+    uint8_t *buf = malloc(4 * BGZF_MAX_BLOCK_SIZE);
+    ssize_t n, i, next;
+    int64_t found = -1;
+
+    if (!buf || hseek(hf, pos, SEEK_SET) < 0
+        || (n = hread(hf, buf, 4 * BGZF_MAX_BLOCK_SIZE)) < 0) {
+        free(buf);
+        return -1;
+    }
+    for (i = 0; i < BGZF_MAX_BLOCK_SIZE && i + 18 <= n; i++) {
+        if (!bgzf_header_at(buf + i)) continue;
+        next = i + le_to_u16(buf + i + 16) + 1;
+        if (next > n || (pos + next < size
+                         && (next + 18 > n || !bgzf_header_at(buf + next))))
+            continue;
+        if (le_to_u32(buf + next - 4) == 0) { // empty, like the EOF marker
+            i = next - 1;
+            continue;
+        }
+        found = pos + i;
+        break;
+    }
+    free(buf);
+    return found;
+}
+
+/*
+ * Checks whether a BAM record plausibly starts at d, where n bytes are
+ * available.  Returns its length, 0 if it is plausible as far as it goes
+ * but runs on past n, or -1 if not.
+ */
+static int bam_index_plausible(const uint8_t *d, size_t n, const bam_hdr_t *h)
+{
+    int32_t block_len, tid, mtid, l_qname, i;
+    int beg, end, is_mapped;
+
+    if (n < 36) return 0;
+    block_len = le_to_i32(d);
+    tid = le_to_i32(d + 4);
+    mtid = le_to_i32(d + 24);
+    l_qname = d[12];
+    if (block_len < 32 || tid < -1 || tid >= h->n_targets || mtid < -1
+        || mtid >= h->n_targets || le_to_i32(d + 8) < -1
+        || le_to_i32(d + 28) < -1 || l_qname < 1)
+        return -1;
+    if (n < 36 + l_qname) return 0;
+    if (d[36 + l_qname - 1] != '\0') return -1;
+    for (i = 0; i < l_qname - 1; i++)
+        if (d[36 + i] < '!' || d[36 + i] > '~') return -1;
+    if (n < 4 + (size_t) block_len) return 0;
+    if (bam_raw_span(d + 4, block_len, &tid, &beg, &end, &is_mapped) < 0)
+        return -1;
+    return 4 + block_len;
+}
+
+/*
+ * Finds the first offset in the first len bytes of buf, which holds n
+ * bytes, that is followed by a run of plausible records.  Returns the
+ * offset, or -1 if there is none.
+ */
+static int bam_index_guess(const uint8_t *buf, size_t n, int len,
+                           const bam_hdr_t *h)
+{
+    int i;
+    for (i = 0; i < len; i++) {
+        size_t off = i;
+        int nrec = 0, r = 0;
+        while (nrec < BAM_INDEX_GUESS_RECS
+               && (r = bam_index_plausible(buf + off, n - off, h)) > 0) {
+            off += r;
+            nrec++;
+        }
+        // A record running past the data examined is given the benefit
+        // of the doubt if others came before it, or its name was checked
+        if (nrec == BAM_INDEX_GUESS_RECS
+            || (r == 0 && (nrec > 0 || n - off >= 36 + 256)))
+            return i;
+    }
+    return -1;
+}
+
+// Indexes the records of one part.  Sets p->ret to 0 on success.
+static void *bam_index_part(void *arg)
+{
+    bam_index_part_t *p = (bam_index_part_t *) arg;
+    BGZF *fp = bgzf_open(p->fn, "r");
+    kstring_t tmp = { 0, 0, NULL };
+    int tid, beg, end, is_mapped, ret = 0;
+
+    p->ret = -1;
+    if (!fp) return p;
+    if (p->beg == (uint64_t) -1) {
+        uint8_t *buf = malloc(BAM_INDEX_GUESS_SIZE);
+        ssize_t n;
+        int len, off = -1;
+        if (buf && bgzf_seek(fp, p->block << 16, SEEK_SET) == 0
+            && bgzf_read_block(fp) == 0 && (len = fp->block_length) > 0
+            && (n = bgzf_read(fp, buf, BAM_INDEX_GUESS_SIZE)) > 0)
+            off = bam_index_guess(buf, n, len, p->h);
+        free(buf);
+        if (off < 0) goto out;
+        p->beg = p->block << 16 | off;
+    }
+    if (bgzf_seek(fp, p->beg, SEEK_SET) < 0) goto out;
+
+    p->idx = hts_idx_init(p->h->n_targets, p->fmt, p->beg, p->min_shift,
+                          p->n_lvls);
+    if (!p->idx) goto out;
+    while (p->next < 0 || bgzf_tell(fp) >> 16 < p->next) {
+        if ((ret = bam_index_scan1(fp, &tmp, &tid, &beg, &end, &is_mapped)) < 0)
+            break;
+        if (hts_idx_push(p->idx, tid, beg, end, bgzf_tell(fp), is_mapped) < 0)
+            goto out;
+    }
+    if (ret < -1) goto out;
+    p->end = bgzf_tell(fp);
+    p->ret = 0;
+
+ out:
+    free(tmp.s);
+    bgzf_close(fp);
+    return p;
+}
+
+/*
+ * Indexes fn in parts on a pool of nthreads threads, giving the same index
+ * as bam_index().  Returns 0 on success, -1 on failure, or 1 if the file
+ * can not be split, in which case *idx is not set.
+ */
+static int bam_index_parts(const char *fn, int min_shift, int nthreads,
+                           hts_idx_t **idx)
+{
+    bam_index_part_t *parts = NULL;
+    bam_hdr_t *h = NULL;
+    BGZF *fp = NULL;
+    hFILE *hf = NULL;
+    hts_tpool *pool = NULL;
+    hts_tpool_process *q = NULL;
+    int64_t size, b;
+    uint64_t start;
+    int i, n, n_sent = 0, n_lvls, fmt, ret = -1;
+
+    *idx = NULL;
+    if (strcmp(fn, "-") == 0 || !(hf = hopen(fn, "r"))
+        || (size = hseek(hf, 0, SEEK_END)) < 0
+        || (n = size / BAM_INDEX_PART_MIN) < 2) {
+        ret = 1;
+        goto out;
+    }
+    if (n > nthreads * BAM_INDEX_PARTS_PER_THREAD)
+        n = nthreads * BAM_INDEX_PARTS_PER_THREAD;
+    if (!(fp = bgzf_open(fn, "r")) || !(h = bam_hdr_read(fp))
+        || !(parts = calloc(n, sizeof(*parts))))
+        goto out;
+    fmt = bam_index_fmt(h, &min_shift, &n_lvls);
+    start = bgzf_tell(fp);
+
+    // Cut at the first block beyond each nth of the file
+    parts[0].block = start >> 16;
+    parts[0].beg = start;
+    for (i = 1, b = 0; i < n; i++) {
+        int64_t pos = size / n * i;
+        if (pos <= b) pos = b + 1;
+        if ((b = bam_index_find_block(hf, pos, size)) <= parts[i-1].block)
+            break;
+        parts[i].block = b;
+        parts[i].beg = (uint64_t) -1;
+    }
+    n = i;
+    if (n < 2) {
+        ret = 1;
+        goto out;
+    }
+    for (i = 0; i < n; i++) {
+        parts[i].fn = fn;
+        parts[i].h = h;
+        parts[i].fmt = fmt;
+        parts[i].min_shift = min_shift;
+        parts[i].n_lvls = n_lvls;
+        parts[i].next = i + 1 < n ? parts[i+1].block : -1;
+    }
+
+    if (!(pool = hts_tpool_init(nthreads))
+        || !(q = hts_tpool_process_init(pool, n, 0)))
+        goto out;
+    for (n_sent = 0; n_sent < n; n_sent++)
+        if (hts_tpool_dispatch(pool, q, bam_index_part, &parts[n_sent]) < 0)
+            break;
+
+    // Join the parts in order.  Every part dispatched is waited for, even
+    // after a failure, so none is left running.
+    ret = n_sent == n ? 0 : -1;
+    for (i = 0; i < n_sent; i++) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(q);
+        bam_index_part_t *p = r ? hts_tpool_result_data(r) : NULL;
+        if (r) hts_tpool_delete_result(r, 0);
+        if (!p) ret = -1;
+        if (ret < 0) continue;
+
+        if (p->beg != start) { // the guess was wrong, so start again
+            hts_idx_destroy(p->idx);
+            p->idx = NULL;
+            p->beg = start;
+            bam_index_part(p);
+        }
+        if (p->ret < 0) {
+            hts_idx_destroy(p->idx);
+            ret = -1;
+        } else if (!*idx) {
+            *idx = p->idx;
+        } else if (hts_idx_append(*idx, p->idx) < 0) {
+            ret = -1;
+        }
+        p->idx = NULL;
+        start = p->end;
+    }
+    if (ret == 0) hts_idx_finish(*idx, start);
+
+ out:
+    if (q) hts_tpool_process_destroy(q);
+    if (pool) hts_tpool_destroy(pool);
+    if (parts)
+        for (i = 0; i < n_sent; i++) hts_idx_destroy(parts[i].idx);
+    if (ret != 0) {
+        hts_idx_destroy(*idx);
+        *idx = NULL;
+    }
+    free(parts);
+    bam_hdr_destroy(h);
+    if (fp) bgzf_close(fp);
+    if (hf) hclose_abruptly(hf);
+    return ret;
+}
+
+static hts_idx_t *bam_index(BGZF *fp, int min_shift)
+{
+    int n_lvls, fmt, ret;
+    int tid, beg, end, is_mapped;
+    kstring_t tmp = { 0, 0, NULL };
+    hts_idx_t *idx;
+    bam_hdr_t *h;
+    h = bam_hdr_read(fp);
+    if (h == NULL) return NULL;
+    fmt = bam_index_fmt(h, &min_shift, &n_lvls);
     idx = hts_idx_init(h->n_targets, fmt, bgzf_tell(fp), min_shift, n_lvls);
     bam_hdr_destroy(h);
-    b = bam_init1();
-    while ((ret = bam_read1(fp, b)) >= 0) {
-        ret = hts_idx_push(idx, b->core.tid, b->core.pos, bam_endpos(b), bgzf_tell(fp), !(b->core.flag&BAM_FUNMAP));
+    while ((ret = bam_index_scan1(fp, &tmp, &tid, &beg, &end, &is_mapped)) >= 0) {
+        ret = hts_idx_push(idx, tid, beg, end, bgzf_tell(fp), is_mapped);
         if (ret < 0) goto err; // unsorted
     }
     if (ret < -1) goto err; // corrupted BAM file
 
     hts_idx_finish(idx, bgzf_tell(fp));
-    bam_destroy1(b);
+    free(tmp.s);
     return idx;
 
 err:
-    bam_destroy1(b);
+    free(tmp.s);
     hts_idx_destroy(idx);
     return NULL;
 }
@@ -504,16 +929,23 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
     int ret = 0;
 
     if ((fp = hts_open(fn, "r")) == 0) return -2;
-    if (nthreads)
-        hts_set_threads(fp, nthreads);
 
     switch (fp->format.format) {
     case cram:
+        if (nthreads)
+            hts_set_threads(fp, nthreads);
         ret = cram_index_build(fp->fp.cram, fn, fnidx);
         break;
 
     case bam:
-        idx = bam_index(fp->fp.bgzf, min_shift);
+        // Split the file between the threads if possible, and otherwise
+        // use them to decompress it
+        if (nthreads == 0
+            || bam_index_parts(fn, min_shift, nthreads, &idx) > 0) {
+            if (nthreads)
+                hts_set_threads(fp, nthreads);
+            idx = bam_index(fp->fp.bgzf, min_shift);
+        }
         if (idx) {
             ret = hts_idx_save_as(idx, fn, fnidx, (min_shift > 0)? HTS_FMT_CSI : HTS_FMT_BAI);
             if (ret < 0) ret = -4;
@@ -531,6 +963,46 @@ int sam_index_build3(const char *fn, const char *fnidx, int min_shift, int nthre
     return ret;
 }
 
+int sam_idx_init(htsFile *fp, bam_hdr_t *h, int min_shift, const char *fnidx)
+{
+    int n_lvls, fmt;
+    BGZF *bfp = fp->fp.bgzf;
+
+    if (fp->format.format != bam || !fp->is_write) {
+        hts_log_error("Indexing on the fly is only supported when writing BAM");
+        return -1;
+    }
+    if (fp->idx) {
+        hts_log_error("An index is already being built for %s", fp->fn);
+        return -1;
+    }
+    if (!fnidx && strcmp(fp->fn, "-") == 0) {
+        hts_log_error("An index filename is required when writing to stdout");
+        return -1;
+    }
+
+    if (min_shift > 0) {
+        int64_t max_len = 0, s;
+        int i;
+        for (i = 0; i < h->n_targets; ++i)
+            if (max_len < h->target_len[i]) max_len = h->target_len[i];
+        max_len += 256;
+        for (n_lvls = 0, s = 1<<min_shift; max_len > s; ++n_lvls, s <<= 3);
+        fmt = HTS_FMT_CSI;
+    } else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_BAI;
+
+    // Flush the header so the offset of the first record is known
+    if (bgzf_flush(bfp) < 0) return -1;
+    if (fnidx && !(fp->fnidx = strdup(fnidx))) return -1;
+    fp->idx = hts_idx_init(h->n_targets, fmt, bgzf_tell(bfp), min_shift, n_lvls);
+    if (!fp->idx) {
+        free(fp->fnidx);
+        fp->fnidx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
 int sam_index_build2(const char *fn, const char *fnidx, int min_shift)
 {
     return sam_index_build3(fn, fnidx, min_shift, 0);
@@ -548,11 +1020,13 @@ int bam_index_build(const char *fn, int min_shift)
     return sam_index_build2(fn, NULL, min_shift);
 }
 
-static int bam_readrec(BGZF *fp, void *ignored, void *bv, int *tid, int *beg, int *end)
+static int bam_readrec(BGZF *fp, void *fpv, void *bv, int *tid, int *beg, int *end)
 {
+    htsFile *hfp = fpv;  // May be NULL if called via bam_itr_next()
     bam1_t *b = bv;
     int ret;
-    if ((ret = bam_read1(fp, b)) >= 0) {
+    if (hfp) hfp->last_offset = bgzf_tell(fp);
+    if ((ret = bam_read1_fields(fp, b, hfp? hfp->required_fields : ~0U)) >= 0) {
         *tid = b->core.tid;
         *beg = b->core.pos;
         *end = bam_endpos(b);
@@ -560,6 +1034,29 @@ static int bam_readrec(BGZF *fp, void *ignored, void *bv, int *tid, int *beg, in
     return ret;
 }
 
+// Records lying wholly within the current BGZF block are examined in place,
+// and skipped without being decoded if they end at or before qbeg on qtid
+static int bam_skiprec(BGZF *fp, void *fpv, void *bv, int *tid, int *beg, int *end, int qtid, int qbeg)
+{
+    htsFile *hfp = fpv;
+    int available = fp->block_length - fp->block_offset;
+    if (available >= 36) {
+        const uint8_t *d = (const uint8_t *) fp->uncompressed_block + fp->block_offset;
+        int32_t block_len = le_to_i32(d);
+        int r_tid, r_beg, r_end, is_mapped;
+        if (block_len >= 32 && block_len <= available - 4
+            && le_to_i32(d + 4) == qtid && le_to_i32(d + 8) < qbeg
+            && bam_raw_span(d + 4, block_len, &r_tid, &r_beg, &r_end, &is_mapped) == 0
+            && r_end <= qbeg) {
+            if (hfp) hfp->last_offset = bgzf_tell(fp);
+            if (bgzf_skip(fp, 4 + block_len) != 4 + block_len) return -4;
+            *tid = r_tid; *beg = r_beg; *end = r_end;
+            return 4 + block_len;
+        }
+    }
+    return bam_readrec(fp, fpv, bv, tid, beg, end);
+}
+
 // This is used only with read_rest=1 iterators, so need not set tid/beg/end.
 static int cram_readrec(BGZF *ignored, void *fpv, void *bv, int *tid, int *beg, int *end)
 {
@@ -577,7 +1074,9 @@ static int sam_bam_cram_readrec(BGZF *bgzfp, void *fpv, void *bv, int *tid, int
     htsFile *fp = fpv;
     bam1_t *b = bv;
     switch (fp->format.format) {
-    case bam:   return bam_read1(bgzfp, b);
+    case bam:
+        fp->last_offset = bgzf_tell(bgzfp);
+        return bam_read1_fields(bgzfp, b, fp->required_fields);
     case cram: {
         int ret = cram_get_bam_seq(fp->fp.cram, &b);
         return ret >= 0
@@ -591,11 +1090,11 @@ static int sam_bam_cram_readrec(BGZF *bgzfp, void *fpv, void *bv, int *tid, int
     }
 }
 
-hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx)
+hts_idx_t *sam_index_load3(htsFile *fp, const char *fn, const char *fnidx, int flags)
 {
     switch (fp->format.format) {
     case bam:
-        return fnidx? hts_idx_load2(fn, fnidx) : hts_idx_load(fn, HTS_FMT_BAI);
+        return hts_idx_load3(fn, fnidx, HTS_FMT_BAI, flags);
 
     case cram: {
         if (cram_index_load(fp->fp.cram, fn, fnidx) < 0) return NULL;
@@ -612,30 +1111,28 @@ hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx)
     }
 }
 
+hts_idx_t *sam_index_load2(htsFile *fp, const char *fn, const char *fnidx)
+{
+    return sam_index_load3(fp, fn, fnidx, 0);
+}
+
 hts_idx_t *sam_index_load(htsFile *fp, const char *fn)
 {
     return sam_index_load2(fp, fn, NULL);
 }
 
-static hts_itr_t *cram_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec)
+// Points a CRAM iterator at tid:beg-end, by setting the range on the file
+static int cram_itr_requery(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end)
 {
     const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
-    hts_itr_t *iter = (hts_itr_t *) calloc(1, sizeof(hts_itr_t));
-    if (iter == NULL) return NULL;
-
-    // Cons up a dummy iterator for which hts_itr_next() will simply invoke
-    // the readrec function:
-    iter->is_cram = 1;
-    iter->read_rest = 1;
-    iter->off = NULL;
-    iter->bins.a = NULL;
-    iter->readrec = readrec;
+    if (iter == NULL) return -1;
+    iter->finished = 0;
+    iter->curr_off = 0;
 
     if (tid >= 0 || tid == HTS_IDX_NOCOOR) {
         cram_range r = { tid == HTS_IDX_NOCOOR ? -1 : tid, beg+1, end };
         int ret = cram_set_option(cidx->cram, CRAM_OPT_RANGE, &r);
 
-        iter->curr_off = 0;
         // The following fields are not required by hts_itr_next(), but are
         // filled in in case user code wants to look at them.
         iter->tid = tid;
@@ -653,24 +1150,42 @@ static hts_itr_t *cram_itr_query(const hts_idx_t *idx, int tid, int beg, int end
             break;
 
         default:
-            free(iter);
-            return NULL;
+            iter->finished = 1;
+            return -1;
         }
     }
     else switch (tid) {
     case HTS_IDX_REST:
-        iter->curr_off = 0;
         break;
     case HTS_IDX_NONE:
-        iter->curr_off = 0;
         iter->finished = 1;
         break;
     default:
         hts_log_error("Query with tid=%d not implemented for CRAM files", tid);
-        abort();
-        break;
+        iter->finished = 1;
+        return -1;
     }
 
+    return 0;
+}
+
+static hts_itr_t *cram_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec)
+{
+    hts_itr_t *iter = (hts_itr_t *) calloc(1, sizeof(hts_itr_t));
+    if (iter == NULL) return NULL;
+
+    // Cons up a dummy iterator for which hts_itr_next() will simply invoke
+    // the readrec function:
+    iter->is_cram = 1;
+    iter->read_rest = 1;
+    iter->off = NULL;
+    iter->bins.a = NULL;
+    iter->readrec = readrec;
+
+    if (cram_itr_requery(idx, iter, tid, beg, end) < 0) {
+        free(iter);
+        return NULL;
+    }
     return iter;
 }
 
@@ -682,7 +1197,26 @@ hts_itr_t *sam_itr_queryi(const hts_idx_t *idx, int tid, int beg, int end)
     else if (cidx->fmt == HTS_FMT_CRAI)
         return cram_itr_query(idx, tid, beg, end, cram_readrec);
     else
-        return hts_itr_query(idx, tid, beg, end, bam_readrec);
+        return hts_itr_set_skiprec(hts_itr_query(idx, tid, beg, end, bam_readrec), bam_skiprec);
+}
+
+int sam_itr_requeryi(const hts_idx_t *idx, hts_itr_t *iter, int tid, int beg, int end)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    if (idx && cidx->fmt == HTS_FMT_CRAI)
+        return cram_itr_requery(idx, iter, tid, beg, end);
+    else
+        return hts_itr_requery(idx, iter, tid, beg, end);
+}
+
+hts_itr_t *sam_itr_off(const hts_idx_t *idx, uint64_t beg, uint64_t end)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    if (cidx && cidx->fmt == HTS_FMT_CRAI) {
+        hts_log_error("Virtual offset iterators are not supported for CRAM files");
+        return NULL;
+    }
+    return hts_itr_off(beg, end, bam_readrec);
 }
 
 static int cram_name2id(void *fdv, const char *ref)
@@ -697,7 +1231,38 @@ hts_itr_t *sam_itr_querys(const hts_idx_t *idx, bam_hdr_t *hdr, const char *regi
     if (cidx->fmt == HTS_FMT_CRAI)
         return hts_itr_querys(idx, region, cram_name2id, cidx->cram, cram_itr_query, cram_readrec);
     else
-        return hts_itr_querys(idx, region, (hts_name2id_f)(bam_name2id), hdr, hts_itr_query, bam_readrec);
+        return hts_itr_set_skiprec(hts_itr_querys(idx, region, (hts_name2id_f)(bam_name2id), hdr, hts_itr_query, bam_readrec), bam_skiprec);
+}
+
+int sam_itr_requerys(const hts_idx_t *idx, bam_hdr_t *hdr, hts_itr_t *iter, const char *region)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    if (idx && cidx->fmt == HTS_FMT_CRAI)
+        return hts_itr_requerys(idx, iter, region, cram_name2id, cidx->cram, cram_itr_requery);
+    else
+        return hts_itr_requerys(idx, iter, region, (hts_name2id_f)(bam_name2id), hdr, hts_itr_requery);
+}
+
+static const hts_idx_t *multi_itr_idx(const hts_idx_t *idx)
+{
+    const hts_cram_idx_t *cidx = (const hts_cram_idx_t *) idx;
+    if (cidx && cidx->fmt == HTS_FMT_CRAI) {
+        hts_log_error("Multi-region iterators are not implemented for CRAM files");
+        return NULL;
+    }
+    return idx;
+}
+
+hts_itr_multi_t *sam_itr_regions(const hts_idx_t *idx, bam_hdr_t *hdr, const char **regs, int n_regs)
+{
+    if (!multi_itr_idx(idx)) return NULL;
+    return hts_itr_multi_set_skiprec(hts_itr_multi_querys(idx, regs, n_regs, (hts_name2id_f)(bam_name2id), hdr, bam_readrec), bam_skiprec);
+}
+
+hts_itr_multi_t *sam_itr_regidx(const hts_idx_t *idx, bam_hdr_t *hdr, struct _regidx_t *regidx)
+{
+    if (!multi_itr_idx(idx)) return NULL;
+    return hts_itr_multi_set_skiprec(hts_itr_multi_regidx(idx, regidx, (hts_name2id_f)(bam_name2id), hdr, bam_readrec), bam_skiprec);
 }
 
 /**********************
@@ -929,6 +1494,100 @@ int sam_hdr_write(htsFile *fp, const bam_hdr_t *h)
  *** SAM record I/O ***
  **********************/
 
+/* SSSE3 SEQ packing is compiled in when the compiler can target it on a
+ * per-function basis, and is then selected at run time via CPU detection.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) \
+    && (HTS_GCC_AT_LEAST(4,9) || HTS_COMPILER_HAS(__target__))
+#define HTS_SAM_SSSE3 1
+#include <tmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Pack SEQ characters into 4-bit codes, two bases per byte.
+static void sam_pack_seq_scalar(uint8_t *t, const char *q, int len)
+{
+    int i;
+    for (i = 0; i + 1 < len; i += 2)
+        t[i>>1] = seq_nt16_table[(unsigned char) q[i]] << 4
+                | seq_nt16_table[(unsigned char) q[i+1]];
+    if (i < len)
+        t[i>>1] = seq_nt16_table[(unsigned char) q[i]] << 4;
+}
+
+#ifdef HTS_SAM_SSSE3
+/*
+ * The bases A, C, G, T, N and '=' (in either case) all have distinct low
+ * nibbles, so a 16-entry shuffle table indexed by the low nibble converts
+ * them to their 4-bit codes.  Two more tables holding the upper and lower
+ * case character for each nibble validate the input; any 16-byte group
+ * containing something else (IUPAC ambiguity codes, '.', etc.) falls back
+ * to the scalar seq_nt16_table lookup.
+ */
+__attribute__((target("ssse3")))
+static void sam_pack_seq_ssse3(uint8_t *t, const char *q, int len)
+{
+    const __m128i codes = _mm_setr_epi8(0, 1, 0, 2, 8, 0, 0, 4,
+                                        0, 0, 0, 0, 0, 0, 15, 0);
+    const __m128i upper = _mm_setr_epi8(0, 'A', 0, 'C', 'T', 0, 0, 'G',
+                                        0, 0, 0, 0, 0, '=', 'N', 0);
+    const __m128i lower = _mm_setr_epi8(0, 'a', 0, 'c', 't', 0, 0, 'g',
+                                        0, 0, 0, 0, 0, '=', 'n', 0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i lo_byte = _mm_set1_epi16(0x00ff);
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i c  = _mm_loadu_si128((const __m128i *) (q + i));
+        __m128i lo = _mm_and_si128(c, nibble);
+        __m128i ok = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_shuffle_epi8(upper, lo)),
+                                  _mm_cmpeq_epi8(c, _mm_shuffle_epi8(lower, lo)));
+        if (_mm_movemask_epi8(ok) != 0xffff) {
+            sam_pack_seq_scalar(t + (i>>1), q + i, 16);
+            continue;
+        }
+
+        // Each 16-bit lane holds an even base in its low byte and the
+        // following odd base in its high byte; merge them into one nibble
+        // pair and narrow back to bytes.
+        __m128i v = _mm_shuffle_epi8(codes, lo);
+        __m128i w = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, lo_byte), 4),
+                                 _mm_srli_epi16(v, 8));
+        _mm_storel_epi64((__m128i *) (t + (i>>1)), _mm_packus_epi16(w, w));
+    }
+    sam_pack_seq_scalar(t + (i>>1), q + i, len - i);
+}
+#endif
+
+static inline void sam_pack_seq(uint8_t *t, const char *q, int len)
+{
+#ifdef HTS_SAM_SSSE3
+    static int have_ssse3 = -1;
+    if (have_ssse3 < 0) have_ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    if (have_ssse3) {
+        sam_pack_seq_ssse3(t, q, len);
+        return;
+    }
+#endif
+    sam_pack_seq_scalar(t, q, len);
+}
+
+// Convert Phred+33 QUAL characters to raw quality values.
+static inline void sam_unpack_qual(uint8_t *t, const char *q, int len)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i offset = _mm_set1_epi8(33);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (q + i));
+        _mm_storeu_si128((__m128i *) (t + i), _mm_sub_epi8(v, offset));
+    }
+#endif
+    for (; i < len; ++i) t[i] = q[i] - 33;
+}
+
 int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
 {
 #define _read_token(_p) (_p); for (; *(_p) && *(_p) != '\t'; ++(_p)); if (*(_p) != '\t') goto err_ret; *(_p)++ = 0
@@ -995,11 +1654,12 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
         c->n_cigar = n_cigar;
         _get_mem(uint32_t, &cigar, &str, c->n_cigar * sizeof(uint32_t));
         for (i = 0; i < c->n_cigar; ++i, ++q) {
+            uint32_t len = 0;
             int op;
-            cigar[i] = strtol(q, &q, 10)<<BAM_CIGAR_SHIFT;
+            while (isdigit_c(*q)) len = len * 10 + (*q++ - '0');
             op = (uint8_t)*q >= 128? -1 : h->cigar_tab[(int)*q];
             _parse_err(op < 0, "unrecognized CIGAR operator");
-            cigar[i] |= op;
+            cigar[i] = len<<BAM_CIGAR_SHIFT | op;
         }
         // can't use bam_endpos() directly as some fields not yet set up
         i = (!(c->flag&BAM_FUNMAP))? bam_cigar2rlen(c->n_cigar, cigar) : 1;
@@ -1038,16 +1698,14 @@ int sam_parse1(kstring_t *s, bam_hdr_t *h, bam1_t *b)
         _parse_err(c->n_cigar && i != c->l_qseq, "CIGAR and query sequence are of different length");
         i = (c->l_qseq + 1) >> 1;
         _get_mem(uint8_t, &t, &str, i);
-        memset(t, 0, i);
-        for (i = 0; i < c->l_qseq; ++i)
-            t[i>>1] |= seq_nt16_table[(int)q[i]] << ((~i&1)<<2);
+        sam_pack_seq(t, q, c->l_qseq);
     } else c->l_qseq = 0;
     // qual
     q = _read_token_aux(p);
     _get_mem(uint8_t, &t, &str, c->l_qseq);
     if (strcmp(q, "*")) {
         _parse_err(p - q - 1 != c->l_qseq, "SEQ and QUAL are of different length");
-        for (i = 0; i < c->l_qseq; ++i) t[i] = q[i] - 33;
+        sam_unpack_qual(t, q, c->l_qseq);
     } else memset(t, 0xff, c->l_qseq);
     // aux
     while (p < s->s + s->l) {
@@ -1168,7 +1826,9 @@ int sam_read1(htsFile *fp, bam_hdr_t *h, bam1_t *b)
 {
     switch (fp->format.format) {
     case bam: {
-        int r = bam_read1(fp->fp.bgzf, b);
+        int r;
+        fp->last_offset = bgzf_tell(fp->fp.bgzf);
+        r = bam_read1_fields(fp->fp.bgzf, b, fp->required_fields);
         if (r >= 0) {
             if (b->core.tid  >= h->n_targets || b->core.tid  < -1 ||
                 b->core.mtid >= h->n_targets || b->core.mtid < -1)
@@ -1340,6 +2000,30 @@ int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
     return -1;
 }
 
+int sam_fill1(htsFile *fp, bam1_t *b)
+{
+    BGZF *bfp;
+    int64_t here;
+    int ret;
+
+    if (bam_fields_complete(fp->required_fields)) return 0;
+    if (fp->format.format != bam) {
+        hts_log_error("Deferred field loading is only supported for BAM files");
+        return -2;
+    }
+    if (fp->last_offset < 0) {
+        hts_log_error("No record has been read yet");
+        return -2;
+    }
+
+    bfp = fp->fp.bgzf;
+    here = bgzf_tell(bfp);
+    if (bgzf_seek(bfp, fp->last_offset, SEEK_SET) < 0) return -2;
+    ret = bam_read1(bfp, b);
+    if (bgzf_seek(bfp, here, SEEK_SET) < 0) return -2;
+    return ret;
+}
+
 int sam_write1(htsFile *fp, const bam_hdr_t *h, const bam1_t *b)
 {
     switch (fp->format.format) {
@@ -1347,8 +2031,16 @@ int sam_write1(htsFile *fp, const bam_hdr_t *h, const bam1_t *b)
         fp->format.category = sequence_data;
         fp->format.format = bam;
         /* fall-through */
-    case bam:
-        return bam_write1(fp->fp.bgzf, b);
+    case bam: {
+        int ret = bam_write1(fp->fp.bgzf, b);
+        if (ret >= 0 && fp->idx
+            && bgzf_idx_push(fp->fp.bgzf, fp->idx, b->core.tid, b->core.pos,
+                             bam_endpos(b), !(b->core.flag & BAM_FUNMAP)) < 0) {
+            hts_log_error("Failed to add record \"%s\" to the index", bam_get_qname(b));
+            return -1;
+        }
+        return ret;
+    }
 
     case cram:
         return cram_put_bam_seq(fp->fp.cram, (bam1_t *)b);
@@ -1465,8 +2157,8 @@ static inline uint8_t *skip_aux(uint8_t *s, uint8_t *end)
     switch (size) {
     case 'Z':
     case 'H':
-        while (*s && s < end) ++s;
-        return s < end ? s + 1 : end;
+        s = memchr(s, '\0', end - s);
+        return s ? s + 1 : end;
     case 'B':
         if (end - s < 5) return NULL;
         size = aux_type2size(*s); ++s;
@@ -1514,6 +2206,52 @@ uint8_t *bam_aux_get(const bam1_t *b, const char tag[2])
     errno = EINVAL;
     return NULL;
 }
+
+int bam_aux_get_multi(const bam1_t *b, const char *tags, uint8_t **vals)
+{
+    uint16_t keys_a[32], *keys = keys_a;
+    uint8_t *s, *end;
+    int i, n, found = 0;
+
+    n = strlen(tags) / 2;
+    if (n > sizeof(keys_a) / sizeof(keys_a[0])) {
+        keys = malloc(n * sizeof(*keys));
+        if (!keys) return -1;
+    }
+    for (i = 0; i < n; i++) {
+        keys[i] = (uint16_t) (uint8_t) tags[2*i]<<8 | (uint8_t) tags[2*i+1];
+        vals[i] = NULL;
+    }
+
+    s = bam_get_aux(b);
+    end = b->data + b->l_data;
+    while (found < n && s != NULL && end - s >= 3) {
+        uint16_t x = (uint16_t) s[0]<<8 | s[1];
+        uint8_t *e;
+        s += 2;
+        e = skip_aux(s, end);
+        if (e == NULL || ((*s == 'Z' || *s == 'H') && *(e - 1) != '\0'))
+            goto bad_aux;
+        for (i = 0; i < n; i++) {
+            if (keys[i] == x && !vals[i]) {
+                vals[i] = s;
+                found++;
+                // The same tag may be requested more than once
+            }
+        }
+        s = e;
+    }
+    if (s == NULL) goto bad_aux;
+    if (keys != keys_a) free(keys);
+    return found;
+
+ bad_aux:
+    if (keys != keys_a) free(keys);
+    hts_log_error("Corrupted aux data for read %s", bam_get_qname(b));
+    errno = EINVAL;
+    return -1;
+}
+
 // s MUST BE returned by bam_aux_get()
 int bam_aux_del(bam1_t *b, uint8_t *s)
 {
@@ -1779,6 +2517,269 @@ char *bam_flag2str(int flag)
 }
 
 
+/*
+ * Aux editor: collects several tag changes for a record, then rebuilds its
+ * aux block once in bam_aux_edit_apply() instead of each change doing its
+ * own realloc and memmove.
+ */
+
+enum { AUX_EDIT_SET, AUX_EDIT_DEL };
+
+typedef struct {
+    char tag[2];
+    int op;
+    size_t off, len;  // Type byte and value, in bam_aux_edit_t::vals
+    int done;
+} bam_aux_edit1_t;
+
+// Bit used for a tag in bam_aux_edit_t::filter
+#define AUX_EDIT_BIT(t0, t1) (1ULL << (((uint8_t) (t0) * 7 + (uint8_t) (t1)) & 63))
+
+struct bam_aux_edit_t {
+    size_t n, m;
+    bam_aux_edit1_t *edits;
+    uint64_t filter; // AUX_EDIT_BIT()s of all edited tags, for quick rejection
+    kstring_t vals;  // Encoded type + value for each AUX_EDIT_SET
+    kstring_t aux;   // Scratch space for the rebuilt aux block
+};
+
+bam_aux_edit_t *bam_aux_edit_init(void)
+{
+    return calloc(1, sizeof(bam_aux_edit_t));
+}
+
+void bam_aux_edit_destroy(bam_aux_edit_t *e)
+{
+    if (!e) return;
+    free(e->edits);
+    free(e->vals.s);
+    free(e->aux.s);
+    free(e);
+}
+
+void bam_aux_edit_clear(bam_aux_edit_t *e)
+{
+    e->n = 0;
+    e->filter = 0;
+    e->vals.l = 0;
+}
+
+// Returns the edit for tag, adding a new one if there isn't one already
+static bam_aux_edit1_t *aux_edit_get(bam_aux_edit_t *e, const char tag[2])
+{
+    size_t i;
+    for (i = 0; i < e->n; i++)
+        if (e->edits[i].tag[0] == tag[0] && e->edits[i].tag[1] == tag[1])
+            return &e->edits[i];
+
+    if (e->n == e->m) {
+        size_t new_m = e->m ? e->m * 2 : 8;
+        bam_aux_edit1_t *new_edits = realloc(e->edits, new_m * sizeof(*new_edits));
+        if (!new_edits) return NULL;
+        e->edits = new_edits;
+        e->m = new_m;
+    }
+    e->edits[e->n].tag[0] = tag[0];
+    e->edits[e->n].tag[1] = tag[1];
+    e->filter |= AUX_EDIT_BIT(tag[0], tag[1]);
+    return &e->edits[e->n++];
+}
+
+// Queues setting tag to the given already little-endian type and value
+static int aux_edit_set_le(bam_aux_edit_t *e, const char tag[2], char type,
+                           size_t len, const uint8_t *data)
+{
+    bam_aux_edit1_t *ed = aux_edit_get(e, tag);
+    if (!ed || ks_resize(&e->vals, e->vals.l + len + 1) < 0) goto nomem;
+    ed->op = AUX_EDIT_SET;
+    ed->off = e->vals.l;
+    ed->len = len + 1;
+    e->vals.s[e->vals.l] = type;
+    memcpy(e->vals.s + e->vals.l + 1, data, len);
+    e->vals.l += len + 1;
+    return 0;
+
+ nomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+int bam_aux_edit_set(bam_aux_edit_t *e, const char tag[2], char type,
+                     int len, const uint8_t *data)
+{
+#ifdef HTS_LITTLE_ENDIAN
+    return aux_edit_set_le(e, tag, type, len, data);
+#else
+    uint8_t *tmp = malloc(len);
+    int ret;
+    if (!tmp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (aux_to_le(type, tmp, data, len) != 0) {
+        free(tmp);
+        errno = EINVAL;
+        return -1;
+    }
+    ret = aux_edit_set_le(e, tag, type, len, tmp);
+    free(tmp);
+    return ret;
+#endif
+}
+
+int bam_aux_edit_set_str(bam_aux_edit_t *e, const char tag[2], const char *str)
+{
+    return aux_edit_set_le(e, tag, 'Z', strlen(str) + 1, (const uint8_t *) str);
+}
+
+int bam_aux_edit_set_int(bam_aux_edit_t *e, const char tag[2], int64_t val)
+{
+    uint8_t buf[4];
+    char type;
+    size_t len;
+
+    if (val < INT32_MIN || val > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (val < 0) {
+        if (val >= INT8_MIN) {
+            type = 'c'; len = 1; buf[0] = (uint8_t) (int8_t) val;
+        } else if (val >= INT16_MIN) {
+            type = 's'; len = 2; i16_to_le(val, buf);
+        } else {
+            type = 'i'; len = 4; i32_to_le(val, buf);
+        }
+    } else {
+        if (val <= UINT8_MAX) {
+            type = 'C'; len = 1; buf[0] = val;
+        } else if (val <= UINT16_MAX) {
+            type = 'S'; len = 2; u16_to_le(val, buf);
+        } else {
+            type = 'I'; len = 4; u32_to_le(val, buf);
+        }
+    }
+    return aux_edit_set_le(e, tag, type, len, buf);
+}
+
+int bam_aux_edit_set_float(bam_aux_edit_t *e, const char tag[2], float val)
+{
+    uint8_t buf[4];
+    float_to_le(val, buf);
+    return aux_edit_set_le(e, tag, 'f', 4, buf);
+}
+
+int bam_aux_edit_del(bam_aux_edit_t *e, const char tag[2])
+{
+    bam_aux_edit1_t *ed = aux_edit_get(e, tag);
+    if (!ed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ed->op = AUX_EDIT_DEL;
+    return 0;
+}
+
+int bam_aux_edit_apply(bam_aux_edit_t *e, bam1_t *b)
+{
+    uint8_t *s, *end, *run, *out, *aux = bam_get_aux(b);
+    size_t i, aux_off = aux - b->data, l_aux = b->l_data - aux_off;
+    size_t n_done = 0, keep;
+    uint32_t new_len;
+
+    if (e->n == 0) return 0;
+
+    // The new aux block can be no longer than the old one plus every queued
+    // value, so size the scratch buffer once and copy into it directly
+    if (ks_resize(&e->aux, l_aux + e->vals.l + 2 * e->n) < 0) goto nomem;
+    out = (uint8_t *) e->aux.s;
+    for (i = 0; i < e->n; i++) e->edits[i].done = 0;
+
+    // Tags before the first edited one stay where they are.  From there on,
+    // copy runs of unchanged tags, replacing or dropping the first copy of
+    // any being edited.  Once all have been seen the rest is copied as-is.
+    s = aux;
+    run = NULL;
+    end = b->data + b->l_data;
+    while (n_done < e->n && end - s >= 3) {
+        uint8_t *next = skip_aux(s + 2, end);
+        bam_aux_edit1_t *ed = NULL;
+        if (next == NULL) goto bad_aux;
+        if (!(e->filter & AUX_EDIT_BIT(s[0], s[1]))) {
+            s = next;
+            continue;
+        }
+        for (i = 0; i < e->n; i++) {
+            if (e->edits[i].tag[0] == s[0] && e->edits[i].tag[1] == s[1]) {
+                if (!e->edits[i].done) ed = &e->edits[i];
+                break;
+            }
+        }
+        if (ed) {
+            if (run == NULL) {
+                run = s;
+                keep = s - aux;
+            }
+            memcpy(out, run, s - run);
+            out += s - run;
+            if (ed->op == AUX_EDIT_SET) {
+                *out++ = s[0];
+                *out++ = s[1];
+                memcpy(out, e->vals.s + ed->off, ed->len);
+                out += ed->len;
+            }
+            ed->done = 1;
+            n_done++;
+            run = next;
+        }
+        s = next;
+    }
+    if (n_done < e->n && s != end) goto bad_aux;
+    if (run == NULL) {
+        run = end;
+        keep = l_aux;
+    }
+    memcpy(out, run, end - run);
+    out += end - run;
+
+    // Add new tags at the end, in the order they were set
+    for (i = 0; i < e->n; i++) {
+        bam_aux_edit1_t *ed = &e->edits[i];
+        if (ed->op != AUX_EDIT_SET || ed->done) continue;
+        *out++ = ed->tag[0];
+        *out++ = ed->tag[1];
+        memcpy(out, e->vals.s + ed->off, ed->len);
+        out += ed->len;
+    }
+    e->aux.l = out - (uint8_t *) e->aux.s;
+
+    if (aux_off + keep + e->aux.l > INT32_MAX) goto nomem;
+    new_len = aux_off + keep + e->aux.l;
+    if (b->m_data < new_len) {
+        uint32_t new_size = new_len;
+        uint8_t *new_data;
+        kroundup32(new_size);
+        new_data = realloc(b->data, new_size);
+        if (new_data == NULL) goto nomem;
+        b->m_data = new_size;
+        b->data = new_data;
+    }
+    memcpy(b->data + aux_off + keep, e->aux.s, e->aux.l);
+    b->l_data = new_len;
+    bam_aux_edit_clear(e);
+    return 0;
+
+ nomem:
+    errno = ENOMEM;
+    return -1;
+
+ bad_aux:
+    hts_log_error("Corrupted aux data for read %s", bam_get_qname(b));
+    errno = EINVAL;
+    return -1;
+}
+
 /**************************
  *** Pileup and Mpileup ***
  **************************/
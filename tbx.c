@@ -177,6 +177,35 @@ int tbx_readrec(BGZF *fp, void *tbxv, void *sv, int *tid, int *beg, int *end)
     return ret;
 }
 
+int tbx_skiprec(BGZF *fp, void *tbxv, void *sv, int *tid, int *beg, int *end, int qtid, int qbeg)
+{
+    tbx_t *tbx = (tbx_t *) tbxv;
+    char *line = (char *) fp->uncompressed_block + fp->block_offset;
+    char *nl = fp->block_offset < fp->block_length
+        ? memchr(line, '\n', fp->block_length - fp->block_offset) : NULL;
+    if (nl) {
+        // Parse the line in place, NUL-terminating it temporarily
+        int len = nl - line, skipped = 0;
+        tbx_intv_t intv;
+        char c;
+        if (len > 0 && line[len - 1] == '\r') --len;
+        c = line[len];
+        line[len] = '\0';
+        if (tbx_parse1(&tbx->conf, len, line, &intv) == 0) {
+            int c2 = *intv.se;
+            *intv.se = '\0'; intv.tid = get_tid(tbx, intv.ss, 0); *intv.se = c2;
+            skipped = intv.tid == qtid && intv.end <= qbeg;
+        }
+        line[len] = c;
+        if (skipped) {
+            if (bgzf_skip(fp, nl + 1 - line) != nl + 1 - line) return -2;
+            *tid = intv.tid; *beg = intv.beg; *end = intv.end;
+            return len;
+        }
+    }
+    return tbx_readrec(fp, tbxv, sv, tid, beg, end);
+}
+
 void tbx_set_meta(tbx_t *tbx)
 {
     int i, l = 0, l_nm;
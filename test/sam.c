@@ -31,6 +31,10 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdint.h>
 #include <inttypes.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <pthread.h>
 
 // Suppress message for faidx_fetch_nseq(), which we're intentionally testing
 #include "htslib/hts_defs.h"
@@ -38,7 +42,10 @@ DEALINGS IN THE SOFTWARE.  */
 #define HTS_DEPRECATED(message)
 
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
 #include "htslib/faidx.h"
+#include "htslib/hfile.h"
+#include "htslib/hts_endian.h"
 #include "htslib/kstring.h"
 
 int status;
@@ -220,6 +227,21 @@ static int aux_fields1(void)
         if ((p = bam_aux_get(aln, "Y8")) && bam_aux2i(p) != 4294967295LL)
             fail("Y8 field is %"PRId64", expected 2^32-1", bam_aux2i(p));
 
+        {
+            static const char *multi_tags = "ZZXiQQXZXi";
+            uint8_t *vals[5];
+            int n = bam_aux_get_multi(aln, multi_tags, vals);
+            if (n != 4)
+                fail("bam_aux_get_multi() found %d tags, expected 4", n);
+            for (i = 0; i < 5; i++) {
+                const char *tag = multi_tags + 2 * i;
+                uint8_t *expected = (i == 2)? NULL : bam_aux_get(aln, tag);
+                if (vals[i] != expected)
+                    fail("bam_aux_get_multi() returned wrong pointer for %.2s",
+                         tag);
+            }
+        }
+
         // Try appending some new tags
         if (bam_aux_append(aln, "N0", 'i', sizeof(ival), (uint8_t *) &ival) != 0)
             fail("Failed to append N0:i tag");
@@ -250,6 +272,63 @@ static int aux_fields1(void)
     return 1;
 }
 
+static void aux_edit1(void)
+{
+    static const char sam[] = "data:,"
+"@SQ\tSN:one\tLN:1000\n"
+"r1\t0\tone\t500\t20\t4M\t*\t0\t0\tATGC\tqqqq\tNM:i:3\tXA:Z:old\tMD:Z:4\tXB:i:70000\n";
+
+    static const char expected[] = "r1\t0\tone\t500\t20\t4M\t*\t0\t0\tATGC\tqqqq\tNM:i:-200\tXA:Z:a longer string\tXB:i:5\tXf:f:1.5\tCB:Z:ACGT";
+
+    samFile *in = sam_open(sam, "r");
+    bam_hdr_t *header = sam_hdr_read(in);
+    bam1_t *aln = bam_init1();
+    bam_aux_edit_t *e = bam_aux_edit_init();
+    kstring_t ks = { 0, 0, NULL };
+    uint8_t *p;
+
+    if (!e) { fail("bam_aux_edit_init() failed"); goto cleanup; }
+    if (sam_read1(in, header, aln) < 0) { fail("can't read record"); goto cleanup; }
+
+    if (bam_aux_edit_set_int(e, "NM", -200) < 0
+        || bam_aux_edit_set_str(e, "XA", "a longer string") < 0
+        || bam_aux_edit_del(e, "MD") < 0
+        || bam_aux_edit_set_int(e, "XB", 1000) < 0
+        || bam_aux_edit_set_int(e, "XB", 5) < 0
+        || bam_aux_edit_set_float(e, "Xf", 1.5) < 0
+        || bam_aux_edit_set_str(e, "CB", "ACGT") < 0
+        || bam_aux_edit_del(e, "ZZ") < 0)
+        fail("can't queue aux edits");
+
+    if (bam_aux_edit_set_int(e, "XX", 5000000000LL) == 0)
+        fail("bam_aux_edit_set_int() accepted out of range value");
+
+    if (bam_aux_edit_apply(e, aln) < 0) fail("bam_aux_edit_apply() failed");
+
+    if ((p = check_bam_aux_get(aln, "NM", 's')) && bam_aux2i(p) != -200)
+        fail("NM field is %"PRId64", expected -200", bam_aux2i(p));
+    if ((p = check_bam_aux_get(aln, "XB", 'C')) && bam_aux2i(p) != 5)
+        fail("XB field is %"PRId64", expected 5", bam_aux2i(p));
+
+    if (sam_format1(header, aln, &ks) < 0)
+        fail("can't format record");
+    else if (strcmp(ks.s, expected) != 0)
+        fail("aux edited record formatted incorrectly: \"%s\"", ks.s);
+
+    // Applying again with nothing queued leaves the record alone
+    if (bam_aux_edit_apply(e, aln) < 0) fail("empty bam_aux_edit_apply() failed");
+    ks.l = 0;
+    if (sam_format1(header, aln, &ks) < 0 || strcmp(ks.s, expected) != 0)
+        fail("empty bam_aux_edit_apply() changed the record");
+
+ cleanup:
+    free(ks.s);
+    bam_aux_edit_destroy(e);
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+    sam_close(in);
+}
+
 static void iterators1(void)
 {
     hts_itr_destroy(sam_itr_queryi(NULL, HTS_IDX_REST, 0, 0));
@@ -320,6 +399,1073 @@ static void samrecord_layout(void)
                          "test/sam_alignment.tmp.sam_", "w", NULL);
 }
 
+static void sam_parse_seq1(void)
+{
+    // Long enough to exercise both the 16-base vector path and the tail,
+    // with mixed case, '=' and IUPAC codes that force the scalar fallback
+    static const char seq[] =
+        "ACGTNacgtn=ACGTACGTTGCAtgcaNNNN=acgACGTRYKMSWBDHVNacgtACGTAc.";
+    bam_hdr_t *header = bam_hdr_init();
+    bam1_t *aln = bam_init1();
+    kstring_t ks = { 0, 0, NULL };
+    int i, len = sizeof seq - 1;
+    uint8_t *s, *q;
+
+    header->n_targets = 1;
+    header->target_len = malloc(sizeof (uint32_t));
+    header->target_name = malloc(sizeof (char *));
+    header->target_len[0] = 1000;
+    header->target_name[0] = strdup("chr1");
+
+    ksprintf(&ks, "r1\t0\tchr1\t10\t30\t%dM\t*\t0\t0\t%s\t", len, seq);
+    for (i = 0; i < len; i++) kputc(33 + (i * 7) % 94, &ks);
+
+    if (sam_parse1(&ks, header, aln) < 0) {
+        fail("sam_parse1() failed on sequence test record");
+        goto cleanup;
+    }
+
+    if (aln->core.l_qseq != len || aln->core.n_cigar != 1
+        || bam_cigar_oplen(bam_get_cigar(aln)[0]) != len)
+        fail("sam_parse1() got l_qseq %d, expected %d", aln->core.l_qseq, len);
+
+    s = bam_get_seq(aln);
+    q = bam_get_qual(aln);
+    for (i = 0; i < len; i++) {
+        if (bam_seqi(s, i) != seq_nt16_table[(unsigned char) seq[i]])
+            fail("sam_parse1() SEQ position %d: got %d, expected %d", i,
+                 bam_seqi(s, i), seq_nt16_table[(unsigned char) seq[i]]);
+        if (q[i] != (i * 7) % 94)
+            fail("sam_parse1() QUAL position %d: got %d, expected %d", i,
+                 q[i], (i * 7) % 94);
+    }
+    if (len & 1 && (s[len/2] & 0x0f) != 0)
+        fail("sam_parse1() left junk in final SEQ nibble");
+
+ cleanup:
+    free(ks.s);
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+}
+
+static void bam_required_fields1(void)
+{
+    static const char sam_text[] = "data:,"
+"@SQ\tSN:CHROMOSOME_II\tLN:5000\n"
+"r1\t0\tCHROMOSOME_II\t100\t10\t4M\t*\t0\t0\tATGC\tqqqq\tNM:i:1\tXA:Z:hello\n"
+"read2\t16\tCHROMOSOME_II\t200\t20\t2M1I2M\t*\t0\t0\tACGTA\t!!!!!\n"
+"r3\t4\t*\t0\t0\t*\t*\t0\t0\tAC\t*\tRG:Z:grp1\n";
+    static const char *names[] = { "r1", "read2", "r3" };
+    static const int lengths[] = { 4, 5, 2 };
+    const char *fname = "test/sam_fields.tmp.bam";
+    samFile *in, *out;
+    bam_hdr_t *header;
+    bam1_t *aln = bam_init1();
+    int n = 0, r;
+
+    copy_check_alignment(sam_text, "SAM", fname, "wb", NULL);
+
+    in = sam_open(fname, "r");
+    if (!in) { fail("can't reopen %s", fname); goto cleanup; }
+    header = sam_hdr_read(in);
+    if (hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG|SAM_POS) < 0)
+        fail("can't set required fields on %s", fname);
+
+    while ((r = sam_read1(in, header, aln)) >= 0 && n < 3) {
+        if (strcmp(bam_get_qname(aln), "?") != 0)
+            fail("record %d: unrequested QNAME \"%s\" was loaded",
+                 n, bam_get_qname(aln));
+        if (aln->core.l_qseq != 0 || bam_get_l_aux(aln) != 0)
+            fail("record %d: unrequested SEQ or aux data was loaded", n);
+        if (n == 1 && (aln->core.flag != 16 || aln->core.pos != 199
+                       || bam_endpos(aln) != 203))
+            fail("record 1: core fields are wrong");
+
+        if (sam_fill1(in, aln) < 0) {
+            fail("sam_fill1() failed for record %d", n);
+        } else {
+            if (strcmp(bam_get_qname(aln), names[n]) != 0)
+                fail("record %d: sam_fill1() QNAME is \"%s\", expected \"%s\"",
+                     n, bam_get_qname(aln), names[n]);
+            if (aln->core.l_qseq != lengths[n])
+                fail("record %d: sam_fill1() l_qseq is %d, expected %d",
+                     n, aln->core.l_qseq, lengths[n]);
+            if (n != 1 && bam_get_l_aux(aln) == 0)
+                fail("record %d: sam_fill1() did not load aux data", n);
+        }
+        n++;
+    }
+    if (r < -1) fail("error reading %s with required fields", fname);
+    if (n != 3) fail("read %d records from %s, expected 3", n, fname);
+
+    // SEQ without QUAL keeps the bases but not the qualities
+    if (sam_close(in) < 0) fail("closing %s", fname);
+    in = sam_open(fname, "r");
+    bam_hdr_destroy(header);
+    header = sam_hdr_read(in);
+    if (hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, SAM_QNAME|SAM_SEQ) < 0)
+        fail("can't set required fields on %s", fname);
+    if (sam_read1(in, header, aln) < 0) {
+        fail("can't read first record of %s", fname);
+    } else {
+        if (strcmp(bam_get_qname(aln), "r1") != 0 || aln->core.l_qseq != 4
+            || bam_seqi(bam_get_seq(aln), 3) != seq_nt16_table['C']
+            || bam_get_qual(aln)[0] != 0xff)
+            fail("SAM_QNAME|SAM_SEQ record is wrong");
+    }
+
+    out = sam_open("test/sam_fields.tmp.sam_", "w");
+    if (sam_hdr_write(out, header) < 0 || sam_write1(out, header, aln) < 0)
+        fail("can't write record read with required fields");
+    sam_close(out);
+
+    bam_hdr_destroy(header);
+    sam_close(in);
+ cleanup:
+    bam_destroy1(aln);
+}
+
+#define SKIP_TEST_RECS 400
+#define SKIP_TEST_LEN 300
+
+// Writes an uncompressed CRAM file of unmapped reads, whose quality values
+// count up from 0 to 39 over and over
+static int write_skip_test_cram(const char *fname)
+{
+    static const char hdr_text[] = "@HD\tVN:1.4\n";
+    bam_hdr_t *header = sam_hdr_parse(sizeof hdr_text - 1, hdr_text);
+    samFile *out = sam_open(fname, "wc0");
+    kstring_t ks = { 0, 0, NULL };
+    bam1_t *aln = bam_init1();
+    int i, k, ret = -1;
+
+    if (!header || !out) goto cleanup;
+    header->l_text = sizeof hdr_text - 1;
+    if (!(header->text = strdup(hdr_text))) goto cleanup;
+    if (sam_hdr_write(out, header) < 0) goto cleanup;
+    for (i = 0; i < SKIP_TEST_RECS; i++) {
+        ks.l = 0;
+        ksprintf(&ks, "s%d\t4\t*\t0\t0\t*\t*\t0\t0\t", i);
+        for (k = 0; k < SKIP_TEST_LEN; k++) kputc("ACGT"[(i * 7 + k * k) & 3], &ks);
+        kputc('\t', &ks);
+        for (k = 0; k < SKIP_TEST_LEN; k++) kputc('!' + k % 40, &ks);
+        if (sam_parse1(&ks, header, aln) < 0 || sam_write1(out, header, aln) < 0)
+            goto cleanup;
+    }
+    ret = 0;
+
+ cleanup:
+    if (out && sam_close(out) < 0) ret = -1;
+    bam_hdr_destroy(header);
+    bam_destroy1(aln);
+    free(ks.s);
+    return ret;
+}
+
+// Changes one quality value in an uncompressed CRAM file
+static int corrupt_skip_test_cram(const char *fname)
+{
+    FILE *fp = fopen(fname, "r+b");
+    unsigned char buf[8192];
+    long pos = 0;
+    size_t n, i, run = 0;
+    int ret = -1;
+
+    if (!fp) return -1;
+    while ((n = fread(buf, 1, sizeof buf, fp)) > 0) {
+        for (i = 0; i < n; i++) {
+            run = buf[i] == run % 40 ? run + 1 : buf[i] == 0;
+            if (run == 80) {
+                if (fseek(fp, pos + i, SEEK_SET) == 0 && fputc(99, fp) == 99)
+                    ret = 0;
+                goto done;
+            }
+        }
+        pos += n;
+    }
+ done:
+    if (fclose(fp) != 0) ret = -1;
+    return ret;
+}
+
+struct pipe_feed {
+    const char *fname;
+    int fd;
+};
+
+// Copies a file into the write end of a pipe
+static void *feed_pipe(void *arg)
+{
+    struct pipe_feed *feed = (struct pipe_feed *) arg;
+    FILE *fp = fopen(feed->fname, "rb");
+    char buf[8192];
+    size_t n;
+
+    if (fp) {
+        while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+            if (write(feed->fd, buf, n) != n) break;
+        fclose(fp);
+    }
+    close(feed->fd);
+    return NULL;
+}
+
+// Reads fname with only FLAG and POS required, either directly or through
+// a pipe, returning the number of records or -1 on error
+static int read_skip_test_cram(const char *fname, int use_pipe)
+{
+    struct pipe_feed feed = { fname, -1 };
+    pthread_t feeder;
+    int fds[2], n = 0, r, ret;
+    samFile *in = NULL;
+    bam_hdr_t *header = NULL;
+    bam1_t *aln = bam_init1();
+
+    if (use_pipe) {
+        hFILE *hfp;
+        if (pipe(fds) < 0) return -1;
+        feed.fd = fds[1];
+        if (pthread_create(&feeder, NULL, feed_pipe, &feed) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        if ((hfp = hdopen(fds[0], "r")) != NULL
+            && (in = hts_hopen(hfp, fname, "r")) == NULL)
+            hclose_abruptly(hfp);
+    } else {
+        in = sam_open(fname, "r");
+    }
+
+    if (in && (header = sam_hdr_read(in)) != NULL
+        && hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG|SAM_POS) == 0) {
+        while ((r = sam_read1(in, header, aln)) >= 0) n++;
+        if (r < -1) n = -1;
+    } else {
+        n = -1;
+    }
+
+    ret = in ? sam_close(in) : -1;
+    if (ret < 0) n = -1;
+    if (use_pipe) pthread_join(feeder, NULL);
+    bam_hdr_destroy(header);
+    bam_destroy1(aln);
+    return n;
+}
+
+// Checks that unwanted blocks really are skipped, by damaging one that a
+// full read would notice, and that skipping works on a stream that can't
+// seek.  The blocks are bigger than the input buffer, so skipping them
+// needs a seek or a read from the underlying stream.
+static void cram_skip_blocks1(void)
+{
+    const char *fname = "test/sam_skip.tmp.cram";
+    samFile *in;
+    bam_hdr_t *header = NULL;
+    bam1_t *aln = bam_init1();
+    int n, r;
+
+    if (write_skip_test_cram(fname) < 0) {
+        fail("can't write %s", fname);
+        goto cleanup;
+    }
+    if ((n = read_skip_test_cram(fname, 1)) != SKIP_TEST_RECS)
+        fail("read %d records from %s through a pipe, expected %d",
+             n, fname, SKIP_TEST_RECS);
+
+    if (corrupt_skip_test_cram(fname) < 0) {
+        fail("can't find quality values in %s", fname);
+        goto cleanup;
+    }
+    if ((in = sam_open(fname, "r")) == NULL
+        || (header = sam_hdr_read(in)) == NULL) {
+        fail("can't reopen %s", fname);
+    } else {
+        enum htsLogLevel level = hts_get_log_level();
+        hts_set_log_level(HTS_LOG_OFF);
+        while ((r = sam_read1(in, header, aln)) >= 0) {}
+        hts_set_log_level(level);
+        if (r == -1)
+            fail("damaged quality block in %s was not noticed", fname);
+    }
+    if (in) sam_close(in);
+
+    if ((n = read_skip_test_cram(fname, 0)) != SKIP_TEST_RECS)
+        fail("read %d records from damaged %s, expected %d",
+             n, fname, SKIP_TEST_RECS);
+    if ((n = read_skip_test_cram(fname, 1)) != SKIP_TEST_RECS)
+        fail("read %d records from damaged %s through a pipe, expected %d",
+             n, fname, SKIP_TEST_RECS);
+
+ cleanup:
+    bam_hdr_destroy(header);
+    bam_destroy1(aln);
+}
+
+static void cram_required_fields1(void)
+{
+    static const char sam_text[] = "data:,"
+"@SQ\tSN:CHROMOSOME_II\tLN:5000\n"
+"r1\t0\tCHROMOSOME_II\t100\t10\t4M\t*\t0\t0\tATGC\tqqqq\tNM:i:1\tXA:Z:hello\n"
+"read2\t16\tCHROMOSOME_II\t200\t20\t2M1I2M\t*\t0\t0\tACGTA\t!!!!!\n"
+"r3\t4\t*\t0\t0\t*\t*\t0\t0\tAC\t*\tRG:Z:grp1\n";
+    static const char *names[] = { "r1", "read2", "r3" };
+    static const int flags[] = { 0, 16, 4 }, mapqs[] = { 10, 20, 0 };
+    static const int fields[] = { SAM_FLAG|SAM_POS, SAM_QNAME|SAM_MAPQ };
+    const char *fname = "test/sam_fields.tmp.cram";
+    samFile *in;
+    bam_hdr_t *header;
+    bam1_t *aln = bam_init1();
+    int f, n, r;
+
+    copy_check_alignment(sam_text, "SAM", fname, "wc", "test/ce.fa");
+
+    // Blocks holding other data series are skipped rather than decoded
+    for (f = 0; f < 2; f++) {
+        in = sam_open(fname, "r");
+        if (!in) { fail("can't reopen %s", fname); break; }
+        header = sam_hdr_read(in);
+        if (hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, fields[f]) < 0)
+            fail("can't set required fields on %s", fname);
+
+        for (n = 0; (r = sam_read1(in, header, aln)) >= 0 && n < 3; n++) {
+            if ((fields[f] & SAM_FLAG) && aln->core.flag != flags[n])
+                fail("record %d: FLAG is %d, expected %d",
+                     n, aln->core.flag, flags[n]);
+            if ((fields[f] & SAM_POS) && n == 1 && aln->core.pos != 199)
+                fail("record %d: POS is %d, expected 199",
+                     n, aln->core.pos);
+            if ((fields[f] & SAM_QNAME)
+                && strcmp(bam_get_qname(aln), names[n]) != 0)
+                fail("record %d: QNAME is \"%s\", expected \"%s\"",
+                     n, bam_get_qname(aln), names[n]);
+            if ((fields[f] & SAM_MAPQ) && aln->core.qual != mapqs[n])
+                fail("record %d: MAPQ is %d, expected %d",
+                     n, aln->core.qual, mapqs[n]);
+        }
+        if (r < -1) fail("error reading %s with required fields", fname);
+        if (n != 3) fail("read %d records from %s, expected 3", n, fname);
+
+        bam_hdr_destroy(header);
+        sam_close(in);
+    }
+
+    bam_destroy1(aln);
+    cram_skip_blocks1();
+}
+
+#define INDEX_TEST_RECS 20000
+
+// Position and length of the i'th synthetic record used by index tests
+static void index_test_rec(int i, int *tid, int *pos, int *len)
+{
+    *tid = i < INDEX_TEST_RECS / 2 ? 0 : 1;
+    *pos = (i % (INDEX_TEST_RECS / 2)) * 37;
+    *len = (i % 97 == 0) ? 20000 + i % 1000 : 50 + i % 100;
+}
+
+// Writes a coordinate-sorted BAM file with records that span many BGZF
+// blocks, including a few long ones, and some unmapped reads at the end.
+// If fnidx is given, the file is indexed as it is written.
+static int write_index_test_bam(const char *fname, const char *fnidx,
+                                int min_shift, int nthreads,
+                                bam_hdr_t **header_ret)
+{
+    static const char hdr_text[] =
+        "@SQ\tSN:ref1\tLN:1000000\n@SQ\tSN:ref2\tLN:1000000\n";
+    bam_hdr_t *header = sam_hdr_parse(sizeof hdr_text - 1, hdr_text);
+    samFile *out = sam_open(fname, "wb");
+    kstring_t ks = { 0, 0, NULL };
+    bam1_t *aln = bam_init1();
+    int i, ret = -1;
+
+    if (!header || !out) goto cleanup;
+    if (nthreads > 0 && hts_set_threads(out, nthreads) < 0) goto cleanup;
+    header->l_text = sizeof hdr_text - 1;
+    header->text = strdup(hdr_text);
+    if (!header->text || sam_hdr_write(out, header) < 0) goto cleanup;
+    if (fnidx && sam_idx_init(out, header, min_shift, fnidx) < 0) goto cleanup;
+
+    for (i = 0; i < INDEX_TEST_RECS + 10; i++) {
+        ks.l = 0;
+        if (i < INDEX_TEST_RECS) {
+            int tid, pos, len;
+            index_test_rec(i, &tid, &pos, &len);
+            ksprintf(&ks, "r%d\t0\tref%d\t%d\t30\t10M%dD10M\t*\t0\t0\t"
+                     "ACGTACGTACGTACGTACGT\t*\tRG:Z:x", i, tid + 1, pos + 1,
+                     len - 20);
+        } else {
+            ksprintf(&ks, "u%d\t4\t*\t0\t0\t*\t*\t0\t0\tACGT\t*", i);
+        }
+        if (sam_parse1(&ks, header, aln) < 0 || sam_write1(out, header, aln) < 0)
+            goto cleanup;
+    }
+    ret = 0;
+
+ cleanup:
+    if (out && sam_close(out) < 0) ret = -1;
+    free(ks.s);
+    bam_destroy1(aln);
+    if (ret == 0 && header_ret) *header_ret = header;
+    else bam_hdr_destroy(header);
+    return ret;
+}
+
+// Counts records overlapping tid:beg-end by brute force
+static int index_test_expected(int qtid, int beg, int end)
+{
+    int i, n = 0;
+    for (i = 0; i < INDEX_TEST_RECS; i++) {
+        int tid, pos, len;
+        index_test_rec(i, &tid, &pos, &len);
+        if (tid == qtid && pos < end && pos + len > beg) n++;
+    }
+    return n;
+}
+
+// Checks a multi-region iterator against brute force: every record
+// overlapping any region must be returned exactly once, with its hits
+static void index_multi_query1(samFile *in, const hts_idx_t *idx,
+                               bam_hdr_t *header, const char *fnidx)
+{
+    static const char *regs[] = {
+        "ref1:1-100", "ref1:5001-5100", "ref1:4901-5050", "ref1:5001-5100",
+        "ref1:100001-160000", "nosuchref:1-1000", "ref2:1-1",
+        "ref2:369901-370000", "ref1:150001-150100", "ref2:500000"
+    };
+    const int n_regs = sizeof regs / sizeof regs[0];
+    int beg[sizeof regs / sizeof regs[0]], end[sizeof regs / sizeof regs[0]];
+    int tid[sizeof regs / sizeof regs[0]];
+    char *seen = calloc(INDEX_TEST_RECS, 1);
+    bam1_t *aln = bam_init1();
+    hts_itr_multi_t *iter = sam_itr_regions(idx, header, regs, n_regs);
+    int i, r, n = 0, expected = 0;
+
+    if (!seen || !iter) {
+        fail("%s: can't create multi-region iterator", fnidx);
+        goto cleanup;
+    }
+
+    for (i = 0; i < n_regs; i++) {
+        char name[64];
+        const char *colon = hts_parse_reg(regs[i], &beg[i], &end[i]);
+        snprintf(name, sizeof name, "%.*s", (int) (colon - regs[i]), regs[i]);
+        tid[i] = bam_name2id(header, name);
+    }
+
+    while ((r = sam_itr_multi_next(in, iter, aln)) >= 0) {
+        int rec = atoi(bam_get_qname(aln) + 1), rtid, pos, len, j, k;
+        index_test_rec(rec, &rtid, &pos, &len);
+        if (seen[rec]++) fail("%s: record %d returned twice", fnidx, rec);
+        for (j = k = 0; j < n_regs; j++) {
+            int hit = 0, h;
+            for (h = 0; h < iter->hits.n; h++)
+                if (iter->hits.a[h] == j) hit = 1;
+            if (hit != (tid[j] == rtid && pos < end[j] && pos + len > beg[j]))
+                fail("%s: record %d hit for %s is wrong", fnidx, rec, regs[j]);
+            k += hit;
+        }
+        if (k != iter->hits.n)
+            fail("%s: record %d has %d hits, expected %d", fnidx, rec, iter->hits.n, k);
+        n++;
+    }
+    if (r < -1) fail("%s: multi-region iterator error", fnidx);
+
+    for (i = 0; i < INDEX_TEST_RECS; i++) {
+        int rtid, pos, len, j;
+        index_test_rec(i, &rtid, &pos, &len);
+        for (j = 0; j < n_regs; j++)
+            if (tid[j] == rtid && pos < end[j] && pos + len > beg[j]) break;
+        if (j < n_regs) expected++;
+    }
+    if (n != expected)
+        fail("%s: multi-region query returned %d records, expected %d",
+             fnidx, n, expected);
+
+ cleanup:
+    hts_itr_multi_destroy(iter);
+    bam_destroy1(aln);
+    free(seen);
+}
+
+// Reads every piece from hts_idx_shards(), checking that between them they
+// return each record once and in file order
+static void index_shards1(samFile *in, const hts_idx_t *idx, const char *fnidx)
+{
+    static const int n_wanted[] = { 1, 2, 5, 1000 };
+    bam1_t *aln = bam_init1();
+    int w;
+
+    for (w = 0; w < sizeof n_wanted / sizeof n_wanted[0]; w++) {
+        hts_pair64_t *shards;
+        int n = hts_idx_shards(idx, n_wanted[w], &shards), i, r, k = 0;
+        if (n < 1 || n > n_wanted[w]) {
+            fail("%s: hts_idx_shards(%d) returned %d", fnidx, n_wanted[w], n);
+            continue;
+        }
+        if (n_wanted[w] > 1 && n < 2)
+            fail("%s: hts_idx_shards(%d) didn't split the file", fnidx, n_wanted[w]);
+        for (i = 0; i < n; i++) {
+            hts_itr_t *iter = sam_itr_off(idx, shards[i].u, shards[i].v);
+            while ((r = sam_itr_next(in, iter, aln)) >= 0) {
+                char expected[16];
+                snprintf(expected, sizeof expected, "%c%d",
+                         k < INDEX_TEST_RECS ? 'r' : 'u', k);
+                if (strcmp(bam_get_qname(aln), expected) != 0) {
+                    fail("%s: piece %d of %d returned %s, expected %s",
+                         fnidx, i, n, bam_get_qname(aln), expected);
+                    break;
+                }
+                k++;
+            }
+            if (r < -1) fail("%s: error reading piece %d of %d", fnidx, i, n);
+            hts_itr_destroy(iter);
+        }
+        if (k != INDEX_TEST_RECS + 10)
+            fail("%s: %d pieces held %d records, expected %d",
+                 fnidx, n, k, INDEX_TEST_RECS + 10);
+        free(shards);
+    }
+
+    bam_destroy1(aln);
+}
+
+// Checks hts_idx_reg_stats() against brute force, for regions aligned to
+// its windows, where it should be exact
+static void index_stats1(const hts_idx_t *idx, const char *fnidx, int has_stats)
+{
+    static const int regions[][3] = {
+        { 0, 0, 1000000 }, { 0, 8192, 65536 }, { 1, 122880, 126976 },
+        { 1, 4096, 4096 }, { 1, 0, 1 << 30 }
+    };
+    int i, j;
+
+    for (i = 0; i < sizeof regions / sizeof regions[0]; i++) {
+        int qtid = regions[i][0], beg = regions[i][1], end = regions[i][2];
+        uint64_t n_records, n_bases, exp_records = 0, exp_bases = 0;
+        int r = hts_idx_reg_stats(idx, qtid, beg, end, &n_records, &n_bases);
+        if (!has_stats) {
+            if (r == 0) fail("%s: unexpected statistics", fnidx);
+            return;
+        }
+        if (r < 0) {
+            fail("%s: no statistics for %d:%d-%d", fnidx, qtid, beg, end);
+            continue;
+        }
+        for (j = 0; j < INDEX_TEST_RECS; j++) {
+            int tid, pos, len;
+            index_test_rec(j, &tid, &pos, &len);
+            if (tid != qtid) continue;
+            if (pos >= beg && pos < end) exp_records++;
+            if (pos < end && pos + len > beg)
+                exp_bases += (pos + len < end ? pos + len : end)
+                    - (pos > beg ? pos : beg);
+        }
+        if (n_records != exp_records || n_bases != exp_bases)
+            fail("%s: %d:%d-%d has %"PRIu64" records covering %"PRIu64
+                 " bases, expected %"PRIu64" and %"PRIu64, fnidx, qtid, beg,
+                 end, n_records, n_bases, exp_records, exp_bases);
+    }
+}
+
+// Queries starting at the ends of records, where bam_skiprec() has to tell
+// those that just reach the region from those that don't, must find the
+// same records with the skipping turned off, and match brute force
+static void index_skip_query1(samFile *in, const hts_idx_t *idx,
+                              const char *fnidx)
+{
+    kstring_t want = { 0, 0, NULL }, got = { 0, 0, NULL };
+    bam1_t *aln = bam_init1();
+    int q, k;
+
+    for (q = 0; q < 300; q++) {
+        int tid, pos, len, beg, end, n[2] = { 0, 0 }, r = 0, expected;
+        index_test_rec((q * 7919) % INDEX_TEST_RECS, &tid, &pos, &len);
+        beg = pos + len - 1 + q % 3;
+        end = beg + 1 + q % 200;
+        expected = index_test_expected(tid, beg, end);
+        for (k = 0; k < 2; k++) {
+            kstring_t *ks = k ? &got : &want;
+            hts_itr_t *iter = sam_itr_queryi(idx, tid, beg, end);
+            if (!iter) break;
+            if (!k) hts_itr_set_skiprec(iter, NULL);
+            ks->l = 0;
+            while ((r = sam_itr_next(in, iter, aln)) >= 0) {
+                kputs(bam_get_qname(aln), ks);
+                kputc(' ', ks);
+                n[k]++;
+            }
+            hts_itr_destroy(iter);
+            if (r < -1) break;
+        }
+        if (k < 2 || n[0] != expected || n[1] != expected
+            || strcmp(want.s ? want.s : "", got.s ? got.s : "") != 0) {
+            fail("%s: query %d:%d-%d returned %d records reading all and %d "
+                 "skipping, expected %d", fnidx, tid, beg, end, n[0], n[1],
+                 expected);
+            break;
+        }
+    }
+
+    bam_destroy1(aln);
+    free(want.s);
+    free(got.s);
+}
+
+static void index_query1(void)
+{
+    static const int regions[][3] = {
+        { 0, 0, 100 }, { 0, 5000, 5100 }, { 0, 100000, 160000 },
+        { 1, 0, 1 }, { 1, 369900, 370000 }, { 1, 200000, 200001 },
+        { 0, 900000, 1000000 }, { 1, 0, 1000000 }
+    };
+    // min_shift, whether to index while writing, writer threads, index
+    // load flags, and whether to query via a converted .hmi index (1) or
+    // one written directly, which includes the end index (2)
+    static const int modes[][5] = {
+        { 0, 0, 0, 0, 0 }, { 14, 0, 0, 0, 0 }, { 0, 1, 0, 0, 0 },
+        { 14, 1, 0, 0, 0 }, { 0, 1, 2, 0, 0 }, { 0, 0, 0, HTS_IDX_LAZY, 0 },
+        { 14, 0, 0, HTS_IDX_LAZY, 0 }, { 0, 0, 0, 0, 1 }, { 14, 0, 0, 0, 1 },
+        { 0, 0, 0, 0, 2 }, { 12, 0, 0, 0, 2 }, { 0, 1, 2, 0, 2 }
+    };
+    const char *fname = "test/sam_index.tmp.bam";
+    const char *fnhmi = "test/sam_index.tmp.bam.hmi";
+    bam1_t *aln = bam_init1();
+    int m, i;
+
+    for (m = 0; m < sizeof modes / sizeof modes[0]; m++) {
+        int min_shift = modes[m][0], otf = modes[m][1], nthreads = modes[m][2];
+        int flags = modes[m][3], hmi = modes[m][4];
+        const char *fnidx = hmi == 2 ? fnhmi
+                          : min_shift ? "test/sam_index.tmp.bam.csi"
+                          : "test/sam_index.tmp.bam.bai";
+        bam_hdr_t *header = NULL;
+        samFile *in;
+        hts_idx_t *idx;
+        hts_itr_t *reuse;
+
+        if (write_index_test_bam(fname, otf ? fnidx : NULL, min_shift,
+                                 nthreads, &header) < 0) {
+            fail("can't write %s", fname);
+            continue;
+        }
+
+        if (!otf && sam_index_build3(fname, fnidx, min_shift, 0) < 0) {
+            fail("can't index %s with min_shift %d", fname, min_shift);
+            bam_hdr_destroy(header);
+            continue;
+        }
+
+        in = sam_open(fname, "r");
+        idx = in ? sam_index_load3(in, fname, fnidx, flags) : NULL;
+        if (!idx) {
+            fail("can't load index %s", fnidx);
+            if (in) sam_close(in);
+            bam_hdr_destroy(header);
+            continue;
+        }
+
+        if (hmi == 1) {
+            if (hts_idx_save_as(idx, fname, fnhmi, HTS_FMT_HMI) < 0)
+                fail("can't save %s", fnhmi);
+            hts_idx_destroy(idx);
+            idx = sam_index_load3(in, fname, fnhmi, 0);
+            if (!idx) {
+                fail("can't load index %s", fnhmi);
+                sam_close(in);
+                bam_hdr_destroy(header);
+                continue;
+            }
+            fnidx = fnhmi;
+        }
+
+        for (i = 0; i < sizeof regions / sizeof regions[0]; i++) {
+            int tid = regions[i][0], beg = regions[i][1], end = regions[i][2];
+            int n = 0, r, expected = index_test_expected(tid, beg, end);
+            hts_itr_t *iter = sam_itr_queryi(idx, tid, beg, end);
+            while ((r = sam_itr_next(in, iter, aln)) >= 0) n++;
+            if (r < -1) fail("iterator error for %d:%d-%d", tid, beg, end);
+            if (n != expected)
+                fail("%s (mode %d): query %d:%d-%d returned %d records, "
+                     "expected %d", fnidx, m, tid, beg, end, n, expected);
+            hts_itr_destroy(iter);
+        }
+
+        // Reuse one iterator for every region, twice over so that the
+        // second pass comes from its cache
+        reuse = sam_itr_queryi(idx, HTS_IDX_NONE, 0, 0);
+        for (i = 0; i < 2 * (sizeof regions / sizeof regions[0]); i++) {
+            int j = i % (sizeof regions / sizeof regions[0]);
+            int tid = regions[j][0], beg = regions[j][1], end = regions[j][2];
+            int n = 0, r, expected = index_test_expected(tid, beg, end);
+            if (sam_itr_requeryi(idx, reuse, tid, beg, end) < 0) {
+                fail("%s: can't requery %d:%d-%d", fnidx, tid, beg, end);
+                continue;
+            }
+            while ((r = sam_itr_next(in, reuse, aln)) >= 0) n++;
+            if (r < -1) fail("iterator error for %d:%d-%d", tid, beg, end);
+            if (n != expected)
+                fail("%s (mode %d): requery %d:%d-%d returned %d records, "
+                     "expected %d", fnidx, m, tid, beg, end, n, expected);
+        }
+        if (sam_itr_requerys(idx, header, reuse, "ref2:370001-370100") < 0
+            || sam_itr_next(in, reuse, aln) < 0
+            || sam_itr_requerys(idx, header, reuse, "nosuchref") == 0
+            || sam_itr_next(in, reuse, aln) != -1)
+            fail("%s: requery by region string failed", fnidx);
+        if (sam_itr_requerys(NULL, header, reuse, ".") == 0
+            || sam_itr_requerys(NULL, header, reuse, "*") == 0
+            || sam_itr_requeryi(NULL, reuse, HTS_IDX_START, 0, 0) == 0
+            || sam_itr_next(in, reuse, aln) != -1)
+            fail("%s: requery without an index succeeded", fnidx);
+        hts_itr_destroy(reuse);
+
+        index_multi_query1(in, idx, header, fnidx);
+        index_skip_query1(in, idx, fnidx);
+        index_shards1(in, idx, fnidx);
+        index_stats1(idx, fnidx, hmi == 2);
+
+        if ((flags & HTS_IDX_LAZY) && min_shift) {
+            // Converting the partly loaded index mustn't change any results
+            if (hts_idx_freeze(idx) < 0) fail("can't freeze %s", fnidx);
+            else index_multi_query1(in, idx, header, fnidx);
+        }
+
+        hts_idx_destroy(idx);
+        sam_close(in);
+        bam_hdr_destroy(header);
+    }
+
+    bam_destroy1(aln);
+    unlink(fnhmi);
+}
+
+// Writes len bytes of buf to fn, in BGZF blocks if compress is set.  These
+// are stored uncompressed, so the file is longer than the original.
+static int write_hmi_copy(const char *fn, const uint8_t *buf, size_t len,
+                          int compress)
+{
+    BGZF *fp = bgzf_open(fn, compress ? "w0" : "wu");
+    if (!fp) return -1;
+    if (bgzf_write(fp, buf, len) != len) {
+        bgzf_close(fp);
+        return -1;
+    }
+    return bgzf_close(fp);
+}
+
+// Reads the whole of fn into a malloc'd buffer
+static uint8_t *read_whole_file(const char *fn, size_t *len)
+{
+    uint8_t *buf = NULL;
+    long r;
+    FILE *fp = fopen(fn, "rb");
+    if (!fp) return NULL;
+    if (fseek(fp, 0, SEEK_END) == 0 && (r = ftell(fp)) > 0
+        && fseek(fp, 0, SEEK_SET) == 0 && (buf = malloc(r)) != NULL) {
+        if (fread(buf, 1, r, fp) == r) *len = r;
+        else free(buf), buf = NULL;
+    }
+    fclose(fp);
+    return buf;
+}
+
+static int set_mtime(const char *fn, time_t t)
+{
+    struct utimbuf times;
+    times.actime = times.modtime = t;
+    return utime(fn, &times);
+}
+
+static void index_hmi1(void)
+{
+    const char *fname = "test/sam_index.tmp.bam";
+    const char *fnbai = "test/sam_index.tmp.bam.bai";
+    const char *fnhmi = "test/sam_index.tmp.bam.hmi";
+    const char *fncopy = "test/sam_index_copy.tmp.hmi";
+    bam_hdr_t *header = NULL;
+    samFile *in = NULL;
+    hts_idx_t *idx;
+    hts_itr_t *iter;
+    bam1_t *aln = bam_init1();
+    uint8_t *buf = NULL, *p;
+    size_t len = 0, chunk_beg, bin, ends, first;
+    uint64_t n_bin, n_chunk, n_ref, n_lvls, n_win;
+    uint32_t tmp;
+    time_t now = time(NULL);
+    int n = 0, r, expected = index_test_expected(1, 369900, 370000);
+
+    // Leave the .bai as the only other index
+    unlink("test/sam_index.tmp.bam.csi");
+    if (write_index_test_bam(fname, NULL, 0, 0, &header) < 0
+        || sam_index_build3(fname, fnbai, 0, 0) < 0
+        || (in = sam_open(fname, "r")) == NULL
+        || (idx = sam_index_load3(in, fname, fnbai, 0)) == NULL) {
+        fail("can't make %s and its index", fname);
+        goto cleanup;
+    }
+    r = hts_idx_save_as(idx, fname, fnhmi, HTS_FMT_HMI);
+    hts_idx_destroy(idx);
+    if (r < 0) {
+        fail("can't save %s", fnhmi);
+        goto cleanup;
+    }
+
+    if ((buf = read_whole_file(fnhmi, &len)) == NULL || len <= 64) {
+        fail("can't read %s", fnhmi);
+        goto cleanup;
+    }
+
+    // Find the chunk_beg and bin arrays, as laid out in hts.c
+    n_lvls = le_to_u32(buf + 12);
+    n_ref = le_to_u32(buf + 16);
+    n_bin = le_to_u64(buf + 32);
+    n_chunk = le_to_u64(buf + 40);
+    chunk_beg = 64 + n_chunk * 16;
+    bin = chunk_beg + (n_bin + 1) * 8 + n_bin * 8 + (n_ref + 1) * 4
+        + n_ref * (n_lvls + 2) * 4;
+    if (n_bin < 3 || le_to_u32(buf + chunk_beg + (n_bin + 1) * 8
+                               + n_bin * 8 + 4) < 2
+        || bin + n_bin * 4 > len) {
+        fail("unexpected layout in %s", fnhmi);
+        goto cleanup;
+    }
+
+    // Chunk lists that run backwards must be rejected
+    p = buf + chunk_beg + 8;
+    tmp = le_to_u32(p);
+    u32_to_le(n_chunk, p);
+    if (write_hmi_copy(fncopy, buf, len, 0) < 0
+        || (idx = sam_index_load3(in, fname, fncopy, 0)) != NULL) {
+        fail("%s with decreasing chunk_beg was accepted", fncopy);
+        hts_idx_destroy(idx);
+    }
+    u32_to_le(tmp, p);
+
+    // So must unsorted bins, which the bin searches rely on
+    p = buf + bin;
+    tmp = le_to_u32(p);
+    memcpy(p, p + 4, 4);
+    u32_to_le(tmp, p + 4);
+    if (write_hmi_copy(fncopy, buf, len, 0) < 0
+        || (idx = sam_index_load3(in, fname, fncopy, 0)) != NULL) {
+        fail("%s with unsorted bins was accepted", fncopy);
+        hts_idx_destroy(idx);
+    }
+    memcpy(p + 4, p, 4);
+    u32_to_le(tmp, p);
+
+    // A BGZF-compressed .hmi file can't be mapped, but should still load
+    if (write_hmi_copy(fncopy, buf, len, 1) < 0
+        || (idx = sam_index_load3(in, fname, fncopy, 0)) == NULL) {
+        fail("can't load compressed %s", fncopy);
+    } else {
+        iter = sam_itr_queryi(idx, 1, 369900, 370000);
+        while ((r = sam_itr_next(in, iter, aln)) >= 0) n++;
+        if (r < -1 || n != expected)
+            fail("compressed %s: query returned %d records, expected %d",
+                 fncopy, n, expected);
+        hts_itr_destroy(iter);
+        hts_idx_destroy(idx);
+    }
+
+    // An .hmi file older than the .bai is ignored, as it may be stale.  Make
+    // it unloadable to tell which one was used.
+    memset(buf + 4, 0xff, 4);
+    if (write_hmi_copy(fnhmi, buf, len, 0) < 0
+        || set_mtime(fnbai, now) < 0 || set_mtime(fnhmi, now - 100) < 0) {
+        fail("can't update %s", fnhmi);
+        goto cleanup;
+    }
+    if ((idx = sam_index_load(in, fname)) == NULL)
+        fail("stale %s was preferred to %s", fnhmi, fnbai);
+    hts_idx_destroy(idx);
+    if (set_mtime(fnhmi, now) < 0) fail("can't update %s", fnhmi);
+    if ((idx = sam_index_load(in, fname)) != NULL)
+        fail("%s was not preferred to %s", fnhmi, fnbai);
+    hts_idx_destroy(idx);
+
+    // An end index must only send queries back to earlier windows of the
+    // same reference.  Build one directly, and point its first window on
+    // past itself.
+    free(buf);
+    buf = NULL;
+    if (sam_index_build3(fname, fncopy, 0, 0) < 0
+        || (buf = read_whole_file(fncopy, &len)) == NULL || len <= 64) {
+        fail("can't make %s", fncopy);
+        goto cleanup;
+    }
+    n_lvls = le_to_u32(buf + 12);
+    n_ref = le_to_u32(buf + 16);
+    n_bin = le_to_u64(buf + 32);
+    n_chunk = le_to_u64(buf + 40);
+    n_win = le_to_u64(buf + 48);
+    ends = 64 + n_chunk * 16 + (n_bin + 1) * 8 + n_bin * 8 + (n_ref + 1) * 4
+        + n_ref * (n_lvls + 2) * 4 + n_bin * 4;
+    ends += (8 - ends % 8) % 8;
+    first = ends + (n_ref + 1) * 8 + n_win * 12;
+    if (n_win < 2 || le_to_u64(buf + ends + 8) < 2
+        || le_to_u32(buf + first) != 0 || first + n_win * 4 > len) {
+        fail("unexpected end index layout in %s", fncopy);
+        goto cleanup;
+    }
+    u32_to_le(1, buf + first);
+    if (write_hmi_copy(fncopy, buf, len, 0) < 0
+        || (idx = sam_index_load3(in, fname, fncopy, 0)) != NULL) {
+        fail("%s with a forward end index link was accepted", fncopy);
+        hts_idx_destroy(idx);
+    }
+
+ cleanup:
+    if (in) sam_close(in);
+    bam_hdr_destroy(header);
+    bam_destroy1(aln);
+    free(buf);
+    unlink(fnhmi);
+    unlink(fncopy);
+}
+
+// Writes the index test records as uncompressed BAM, with longer sequences
+// so that the file is big enough to be indexed in parts.  If out_of_order
+// is set, the first thousand records go after the rest, splitting ref1.
+static int write_index_parts_bam(const char *fname, int out_of_order)
+{
+    static const char hdr_text[] =
+        "@SQ\tSN:ref1\tLN:1000000\n@SQ\tSN:ref2\tLN:1000000\n";
+    bam_hdr_t *header = sam_hdr_parse(sizeof hdr_text - 1, hdr_text);
+    samFile *out = sam_open(fname, "wbu");
+    kstring_t ks = { 0, 0, NULL };
+    bam1_t *aln = bam_init1();
+    int i, j, k, ret = -1;
+
+    if (!header || !out) goto cleanup;
+    header->l_text = sizeof hdr_text - 1;
+    header->text = strdup(hdr_text);
+    if (!header->text || sam_hdr_write(out, header) < 0) goto cleanup;
+
+    for (j = 0; j < INDEX_TEST_RECS + 10; j++) {
+        ks.l = 0;
+        if (j < INDEX_TEST_RECS) {
+            int tid, pos, len;
+            i = out_of_order ? (j + 1000) % INDEX_TEST_RECS : j;
+            index_test_rec(i, &tid, &pos, &len);
+            ksprintf(&ks, "r%d\t0\tref%d\t%d\t30\t100S10M%dD10M180S\t*\t0\t0\t",
+                     i, tid + 1, pos + 1, len - 20);
+            for (k = 0; k < 300; k++) kputc("ACGT"[(i * 7 + k * k) & 3], &ks);
+            kputs("\t*", &ks);
+        } else {
+            ksprintf(&ks, "u%d\t4\t*\t0\t0\t*\t*\t0\t0\tACGT\t*", j);
+        }
+        if (sam_parse1(&ks, header, aln) < 0 || sam_write1(out, header, aln) < 0)
+            goto cleanup;
+    }
+    ret = 0;
+
+ cleanup:
+    if (out && sam_close(out) < 0) ret = -1;
+    free(ks.s);
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+    return ret;
+}
+
+// Makes a BGZF copy of the BAM written by write_index_parts_bam(), with
+// records running across block boundaries
+static int write_index_parts_copy(const char *fname, const char *fncopy,
+                                  int out_of_order)
+{
+    uint8_t *buf;
+    size_t len;
+    int ret;
+
+    if (write_index_parts_bam(fname, out_of_order) < 0
+        || (buf = read_whole_file(fname, &len)) == NULL)
+        return -1;
+    ret = write_hmi_copy(fncopy, buf, len, 1);
+    free(buf);
+    return ret;
+}
+
+// Indexing with threads splits the file into parts, and must give the same
+// index as reading it straight through
+static void index_parts1(void)
+{
+    static const struct { int min_shift; const char *ext; } fmts[] = {
+        { 0, "bai" }, { 14, "csi" }, { 0, "hmi" }
+    };
+    const char *fname = "test/sam_index_parts.tmp.ubam";
+    const char *fncopy = "test/sam_index_parts.tmp.bam";
+    char fnidx[64], fnserial[64];
+    enum htsLogLevel level;
+    int i, r0, r1;
+
+    if (write_index_parts_copy(fname, fncopy, 0) < 0) {
+        fail("can't write %s", fncopy);
+        goto cleanup;
+    }
+
+    for (i = 0; i < sizeof fmts / sizeof fmts[0]; i++) {
+        uint8_t *serial = NULL, *parts = NULL;
+        size_t serial_len = 0, parts_len = 0;
+        bam_hdr_t *header;
+        hts_idx_t *idx;
+        samFile *in;
+
+        sprintf(fnidx, "%s.%s", fncopy, fmts[i].ext);
+        sprintf(fnserial, "%s.serial.%s", fncopy, fmts[i].ext);
+        if (sam_index_build3(fncopy, fnserial, fmts[i].min_shift, 0) < 0
+            || sam_index_build3(fncopy, fnidx, fmts[i].min_shift, 2) < 0) {
+            fail("can't index %s as %s", fncopy, fmts[i].ext);
+            continue;
+        }
+        if ((serial = read_whole_file(fnserial, &serial_len)) == NULL
+            || (parts = read_whole_file(fnidx, &parts_len)) == NULL
+            || serial_len != parts_len
+            || memcmp(serial, parts, serial_len) != 0)
+            fail("%s built with threads differs from %s", fnidx, fnserial);
+        free(serial);
+        free(parts);
+
+        if ((in = sam_open(fncopy, "r")) == NULL
+            || (header = sam_hdr_read(in)) == NULL) {
+            fail("can't read %s", fncopy);
+        } else {
+            if ((idx = sam_index_load2(in, fncopy, fnidx)) == NULL) {
+                fail("can't load %s", fnidx);
+            } else {
+                index_multi_query1(in, idx, header, fnidx);
+                index_skip_query1(in, idx, fnidx);
+                hts_idx_destroy(idx);
+            }
+            bam_hdr_destroy(header);
+        }
+        if (in) sam_close(in);
+        unlink(fnidx);
+        unlink(fnserial);
+    }
+
+    // Records out of order across the parts must be noticed, as they are
+    // when read straight through
+    sprintf(fnidx, "%s.bai", fncopy);
+    if (write_index_parts_copy(fname, fncopy, 1) < 0) {
+        fail("can't write %s", fncopy);
+        goto cleanup;
+    }
+    level = hts_get_log_level();
+    hts_set_log_level(HTS_LOG_OFF);
+    r0 = sam_index_build3(fncopy, fnidx, 0, 0);
+    r1 = sam_index_build3(fncopy, fnidx, 0, 2);
+    hts_set_log_level(level);
+    if (r0 >= 0 || r1 >= 0)
+        fail("unsorted %s was indexed without threads (%d) or with (%d)",
+             fncopy, r0, r1);
+
+ cleanup:
+    unlink(fname);
+    unlink(fncopy);
+    unlink(fnidx);
+}
+
 static void faidx1(const char *filename)
 {
     int n, n_exp = 0;
@@ -369,8 +1515,15 @@ int main(int argc, char **argv)
     status = EXIT_SUCCESS;
 
     aux_fields1();
+    aux_edit1();
     iterators1();
     samrecord_layout();
+    sam_parse_seq1();
+    bam_required_fields1();
+    cram_required_fields1();
+    index_query1();
+    index_hmi1();
+    index_parts1();
     check_enum1();
     for (i = 1; i < argc; i++) faidx1(argv[i]);
 
@@ -0,0 +1,466 @@
+/*  test/test-vcf-index.c -- BCF and tabix index and region query tests.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+#include "htslib/tbx.h"
+#include "htslib/vcf.h"
+
+#define TMP_BCF "test/test-vcf-index.tmp.bcf"
+#define TMP_VCF "test/test-vcf-index.tmp.vcf.gz"
+
+#define N_REF 3
+#define REF_LEN 1000000
+
+static int status = EXIT_SUCCESS;
+
+static void fail(const char *what) {
+    fprintf(stderr, "Failed: %s\n", what);
+    status = EXIT_FAILURE;
+}
+
+// One record's position, with end exclusive as the iterators use it
+typedef struct {
+    int tid, beg, end;
+} rec_t;
+
+typedef struct {
+    rec_t *r;
+    int n, m;
+    kstring_t text;   // the records, as VCF lines ending in \r\n
+} recs_t;
+
+/*
+ * Generates records for N_REF references.  INFO carries a random string of
+ * up to 1kb, so that many records straddle BGZF blocks, and one in twenty
+ * is a deletion of up to 3kb, reaching past the ones after it.
+ */
+static void make_recs(recs_t *rs) {
+    int t, i;
+
+    rs->n = 0;
+    rs->text.l = 0;
+    for (t = 0; t < N_REF; t++) {
+        int pos = 1 + random() % 100;
+        while (pos < REF_LEN - 5000) {
+            int ref_len = random() % 20 ? 1 : 50 + random() % 3000;
+            int xs_len = random() % 1000;
+            if (rs->n == rs->m) {
+                rs->m = rs->m ? rs->m * 2 : 1024;
+                if (!(rs->r = realloc(rs->r, rs->m * sizeof(*rs->r)))) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            rs->r[rs->n].tid = t;
+            rs->r[rs->n].beg = pos - 1;
+            rs->r[rs->n].end = pos - 1 + ref_len;
+            rs->n++;
+
+            ksprintf(&rs->text, "chr%d\t%d\t.\t", t + 1, pos);
+            for (i = 0; i < ref_len; i++)
+                kputc("ACGT"[random() & 3], &rs->text);
+            ksprintf(&rs->text, "\tN\t.\tPASS\tDP=%d;XS=", (int) (random() % 100));
+            for (i = 0; i < xs_len; i++)
+                kputc("ACGT"[random() & 3], &rs->text);
+            kputs("\r\n", &rs->text);
+            pos += random() % 600;
+        }
+    }
+}
+
+static const char *header_lines[] = {
+    "##fileformat=VCFv4.2",
+    "##contig=<ID=chr1,length=1000000>",
+    "##contig=<ID=chr2,length=1000000>",
+    "##contig=<ID=chr3,length=1000000>",
+    "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">",
+    "##INFO=<ID=XS,Number=1,Type=String,Description=\"Padding\">",
+    "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO"
+};
+
+// Writes the records as bgzipped VCF with \r\n line endings, and indexes it
+static int write_vcf(const recs_t *rs) {
+    BGZF *fp = bgzf_open(TMP_VCF, "w");
+    kstring_t ks = { 0, 0, NULL };
+    int i, ret;
+
+    if (!fp)
+        return -1;
+    for (i = 0; i < sizeof(header_lines) / sizeof(*header_lines); i++)
+        ksprintf(&ks, "%s\r\n", header_lines[i]);
+    ret = bgzf_write(fp, ks.s, ks.l) == ks.l
+        && bgzf_write(fp, rs->text.s, rs->text.l) == rs->text.l ? 0 : -1;
+    free(ks.s);
+    if (bgzf_close(fp) < 0 || ret < 0)
+        return -1;
+    return tbx_index_build(TMP_VCF, 0, &tbx_conf_vcf);
+}
+
+static bcf_hdr_t *make_header(void) {
+    bcf_hdr_t *hdr = bcf_hdr_init("w");
+    int i;
+
+    if (!hdr)
+        return NULL;
+    // The first line is made by bcf_hdr_init(), and the last by the sync
+    for (i = 1; i + 1 < sizeof(header_lines) / sizeof(*header_lines); i++)
+        if (bcf_hdr_append(hdr, header_lines[i]) < 0)
+            goto fail;
+    if (bcf_hdr_sync(hdr) < 0)
+        goto fail;
+    return hdr;
+
+ fail:
+    bcf_hdr_destroy(hdr);
+    return NULL;
+}
+
+/*
+ * Writes the records through the VCF API as BCF, or bgzipped VCF with \n
+ * line endings, and indexes the file.  If otf is set the index is built
+ * while writing, otherwise from the finished file.
+ */
+static int write_api(const recs_t *rs, int is_bcf, int nthreads, int otf) {
+    const char *fn = is_bcf ? TMP_BCF : TMP_VCF;
+    htsFile *fp = hts_open(fn, is_bcf ? "wb" : "wz");
+    bcf_hdr_t *hdr = make_header();
+    bcf1_t *rec = bcf_init1();
+    kstring_t line = { 0, 0, NULL };
+    size_t pos = 0;
+    int ret = -1;
+
+    if (!fp || !hdr || !rec
+        || (nthreads && hts_set_threads(fp, nthreads) < 0)
+        || bcf_hdr_write(fp, hdr) < 0
+        || (otf && bcf_idx_init(fp, hdr, is_bcf ? 14 : 0, NULL) < 0))
+        goto out;
+    while (pos < rs->text.l) {
+        const char *eol = strchr(rs->text.s + pos, '\r');
+        line.l = 0;
+        kputsn(rs->text.s + pos, eol - (rs->text.s + pos), &line);
+        if (vcf_parse(&line, hdr, rec) < 0 || bcf_write(fp, hdr, rec) < 0)
+            goto out;
+        pos = eol + 2 - rs->text.s;
+    }
+    ret = 0;
+
+ out:
+    if (fp && hts_close(fp) < 0)
+        ret = -1;
+    bcf_hdr_destroy(hdr);
+    bcf_destroy(rec);
+    free(line.s);
+    if (ret < 0 || otf)
+        return ret;
+    return is_bcf ? bcf_index_build(fn, 14)
+                  : tbx_index_build(fn, 0, &tbx_conf_vcf);
+}
+
+/*
+ * Counts the records that start in one BGZF block and end in another, as
+ * the skip functions handle these differently.
+ */
+static int count_straddling(int is_bcf) {
+    htsFile *fp = hts_open(is_bcf ? TMP_BCF : TMP_VCF, "r");
+    BGZF *bgzf = fp ? hts_get_bgzfp(fp) : NULL;
+    bcf_hdr_t *hdr = NULL;
+    bcf1_t *rec = bcf_init1();
+    kstring_t ks = { 0, 0, NULL };
+    int n = 0;
+
+    if (!bgzf || !rec)
+        n = -1;
+    else if (is_bcf && !(hdr = bcf_hdr_read(fp)))
+        n = -1;
+    while (n >= 0) {
+        int64_t off0 = bgzf_tell(bgzf), off1;
+        if ((is_bcf ? bcf_read(fp, hdr, rec) : bgzf_getline(bgzf, '\n', &ks)) < 0)
+            break;
+        off1 = bgzf_tell(bgzf);
+        if (off0 >> 16 != off1 >> 16 && (off1 & 0xffff) != 0)
+            n++;
+    }
+
+    if (fp)
+        hts_close(fp);
+    bcf_hdr_destroy(hdr);
+    bcf_destroy(rec);
+    free(ks.s);
+    return n;
+}
+
+static int expected(const recs_t *rs, int tid, int beg, int end) {
+    int i, n = 0;
+    for (i = 0; i < rs->n; i++)
+        if (rs->r[i].tid == tid && rs->r[i].beg < end && rs->r[i].end > beg)
+            n++;
+    return n;
+}
+
+/*
+ * Reads the records of a single region query into out, one line each, and
+ * returns how many there were.  If skip is not set, the iterator's
+ * skiprec function is removed so that every record is fully read.
+ */
+static int query_bcf(htsFile *fp, bcf_hdr_t *hdr, hts_idx_t *idx, bcf1_t *rec,
+                     int tid, int beg, int end, int skip, kstring_t *out) {
+    hts_itr_t *iter = bcf_itr_queryi(idx, tid, beg, end);
+    int n = 0, r;
+
+    if (!iter)
+        return -1;
+    if (!skip)
+        hts_itr_set_skiprec(iter, NULL);
+    out->l = 0;
+    while ((r = bcf_itr_next(fp, iter, rec)) >= 0) {
+        if (vcf_format(hdr, rec, out) < 0) {
+            r = -2;
+            break;
+        }
+        n++;
+    }
+    bcf_itr_destroy(iter);
+    return r < -1 ? -1 : n;
+}
+
+static int query_tbx(htsFile *fp, tbx_t *tbx, kstring_t *line, int tid,
+                     int beg, int end, int skip, kstring_t *out) {
+    hts_itr_t *iter = tbx_itr_queryi(tbx, tid, beg, end);
+    int n = 0, r;
+
+    if (!iter)
+        return -1;
+    if (!skip)
+        hts_itr_set_skiprec(iter, NULL);
+    out->l = 0;
+    while ((r = tbx_itr_next(fp, tbx, iter, line)) >= 0) {
+        kputsn(line->s, line->l, out);
+        kputc('\n', out);
+        n++;
+    }
+    tbx_itr_destroy(iter);
+    return r < -1 ? -1 : n;
+}
+
+// As the single region queries, for a multi-region iterator
+static int query_regions(htsFile *fp, bcf_hdr_t *hdr, hts_idx_t *idx,
+                         bcf1_t *rec, tbx_t *tbx, kstring_t *line,
+                         const char **regs, int n_regs, int skip,
+                         kstring_t *out) {
+    hts_itr_multi_t *iter = tbx ? tbx_itr_regions(tbx, regs, n_regs)
+                                : bcf_itr_regions(idx, hdr, regs, n_regs);
+    int n = 0, r;
+
+    if (!iter)
+        return -1;
+    if (!skip)
+        hts_itr_multi_set_skiprec(iter, NULL);
+    out->l = 0;
+    while ((r = tbx ? tbx_itr_multi_next(fp, tbx, iter, line)
+                    : bcf_itr_multi_next(fp, iter, rec)) >= 0) {
+        if (tbx) {
+            kputsn(line->s, line->l, out);
+            kputc('\n', out);
+        } else if (vcf_format(hdr, rec, out) < 0) {
+            r = -2;
+            break;
+        }
+        n++;
+    }
+    hts_itr_multi_destroy(iter);
+    return r < -1 ? -1 : n;
+}
+
+/*
+ * Region queries must return the same records whether or not the
+ * iterators skip over the ones before the region, and these must be the
+ * records that overlap it.
+ */
+static void test_queries(const recs_t *rs, int is_bcf, int nquery) {
+    const char *fn = is_bcf ? TMP_BCF : TMP_VCF;
+    htsFile *fp = hts_open(fn, "r");
+    bcf_hdr_t *hdr = NULL;
+    hts_idx_t *idx = NULL;
+    tbx_t *tbx = NULL;
+    bcf1_t *rec = bcf_init1();
+    kstring_t line = { 0, 0, NULL }, want = { 0, 0, NULL };
+    kstring_t got = { 0, 0, NULL };
+    int i, failed = 0;
+
+    if (!fp || !rec
+        || (is_bcf && (!(hdr = bcf_hdr_read(fp)) || !(idx = bcf_index_load(fn))))
+        || (!is_bcf && !(tbx = tbx_index_load(fn)))) {
+        fprintf(stderr, "Failed: can't open %s and its index\n", fn);
+        status = EXIT_FAILURE;
+        goto out;
+    }
+
+    for (i = 0; i < nquery && !failed; i++) {
+        int tid = random() % N_REF, beg = random() % REF_LEN;
+        int end = beg + 1 + random() % 20000, n0, n1;
+        int exp = expected(rs, tid, beg, end);
+
+        if (is_bcf) {
+            n0 = query_bcf(fp, hdr, idx, rec, tid, beg, end, 0, &want);
+            n1 = query_bcf(fp, hdr, idx, rec, tid, beg, end, 1, &got);
+        } else {
+            n0 = query_tbx(fp, tbx, &line, tid, beg, end, 0, &want);
+            n1 = query_tbx(fp, tbx, &line, tid, beg, end, 1, &got);
+        }
+        if (n0 != exp || n1 != exp || want.l != got.l
+            || (want.l && memcmp(want.s, got.s, want.l) != 0)) {
+            fprintf(stderr, "Failed: %s query %d:%d-%d returned %d records "
+                    "reading all and %d skipping, expected %d\n",
+                    fn, tid, beg, end, n0, n1, exp);
+            failed = 1;
+        }
+
+        if (i % 10 == 0) {
+            char buf[3][64];
+            const char *regs[3] = { buf[0], buf[1], buf[2] };
+            int k;
+            for (k = 0; k < 3; k++) {
+                int b = random() % REF_LEN;
+                sprintf(buf[k], "chr%d:%d-%d", tid + 1, b + 1,
+                        b + 1 + (int) (random() % 5000));
+            }
+            n0 = query_regions(fp, hdr, idx, rec, tbx, &line, regs, 3, 0,
+                               &want);
+            n1 = query_regions(fp, hdr, idx, rec, tbx, &line, regs, 3, 1,
+                               &got);
+            if (n0 < 0 || n0 != n1 || want.l != got.l
+                || (want.l && memcmp(want.s, got.s, want.l) != 0)) {
+                fprintf(stderr, "Failed: %s regions %s %s %s returned %d "
+                        "records reading all and %d skipping\n",
+                        fn, regs[0], regs[1], regs[2], n0, n1);
+                failed = 1;
+            }
+        }
+    }
+    if (failed)
+        status = EXIT_FAILURE;
+
+ out:
+    if (fp)
+        hts_close(fp);
+    bcf_hdr_destroy(hdr);
+    hts_idx_destroy(idx);
+    if (tbx)
+        tbx_destroy(tbx);
+    bcf_destroy(rec);
+    free(line.s);
+    free(want.s);
+    free(got.s);
+}
+
+// Reads the decompressed contents of an index file
+static int read_index(const char *fn, kstring_t *ks) {
+    BGZF *fp = bgzf_open(fn, "r");
+    char buf[65536];
+    ssize_t len;
+
+    if (!fp)
+        return -1;
+    ks->l = 0;
+    while ((len = bgzf_read(fp, buf, sizeof(buf))) > 0)
+        kputsn(buf, len, ks);
+    if (bgzf_close(fp) < 0 || len < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * An index built while writing, with or without threads, must be the same
+ * as one built from the finished file, and answer queries correctly.
+ */
+static void test_otf(const recs_t *rs, int is_bcf, int nthreads) {
+    const char *fn = is_bcf ? TMP_BCF : TMP_VCF;
+    const char *fnidx = is_bcf ? TMP_BCF ".csi" : TMP_VCF ".tbi";
+    const char *fnbuilt = is_bcf ? TMP_BCF ".built.csi" : TMP_VCF ".built.tbi";
+    kstring_t want = { 0, 0, NULL }, got = { 0, 0, NULL };
+
+    if (write_api(rs, is_bcf, nthreads, 1) < 0) {
+        fprintf(stderr, "Failed: writing %s with %d threads and an index\n",
+                fn, nthreads);
+        status = EXIT_FAILURE;
+        return;
+    }
+    test_queries(rs, is_bcf, 100);
+
+    if ((is_bcf ? bcf_index_build3(fn, fnbuilt, 14, nthreads)
+                : tbx_index_build3(fn, fnbuilt, 0, nthreads, &tbx_conf_vcf)) < 0
+        || read_index(fnbuilt, &want) < 0 || read_index(fnidx, &got) < 0) {
+        fprintf(stderr, "Failed: can't compare %s with %s\n", fnidx, fnbuilt);
+        status = EXIT_FAILURE;
+    } else if (want.l != got.l || memcmp(want.s, got.s, want.l) != 0) {
+        fprintf(stderr, "Failed: %s written with %d threads differs from %s\n",
+                fnidx, nthreads, fnbuilt);
+        status = EXIT_FAILURE;
+    }
+
+    unlink(fnbuilt);
+    free(want.s);
+    free(got.s);
+}
+
+int main(int argc, char **argv)
+{
+    recs_t rs = { NULL, 0, 0, { 0, 0, NULL } };
+
+    srandom(15);
+    make_recs(&rs);
+
+    if (write_api(&rs, 1, 0, 0) < 0)
+        fail("writing and indexing " TMP_BCF);
+    else if (count_straddling(1) < 10)
+        fail("too few records straddle BGZF blocks in " TMP_BCF);
+    else
+        test_queries(&rs, 1, 500);
+
+    if (write_vcf(&rs) < 0)
+        fail("writing and indexing " TMP_VCF);
+    else if (count_straddling(0) < 10)
+        fail("too few records straddle BGZF blocks in " TMP_VCF);
+    else
+        test_queries(&rs, 0, 500);
+
+    test_otf(&rs, 1, 0);
+    test_otf(&rs, 1, 2);
+    test_otf(&rs, 0, 0);
+    test_otf(&rs, 0, 2);
+
+    unlink(TMP_BCF);
+    unlink(TMP_BCF ".csi");
+    unlink(TMP_VCF);
+    unlink(TMP_VCF ".tbi");
+    free(rs.r);
+    free(rs.text.s);
+    return status;
+}
@@ -35,6 +35,7 @@ my $opts = parse_params();
 
 test_view($opts,0);
 test_view($opts,4);
+test_ref_cache($opts);
 
 test_vcf_api($opts,out=>'test-vcf-api.out');
 test_vcf_sweep($opts,out=>'test-vcf-sweep.out');
@@ -288,6 +289,21 @@ sub test_view
         testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
         testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
 
+        # SAM -> CRAM3 (32-way rANS) -> SAM
+        testv $opts, "./test_view $tv_args -t $ref -S -C -o VERSION=3.0 -o USE_RANS32=1 $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+
+        # SAM -> CRAM3 (name tokeniser) -> SAM
+        testv $opts, "./test_view $tv_args -t $ref -S -C -o VERSION=3.0 -o USE_TOK=1 $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+
+        # SAM -> CRAM3 (several slices per container) -> SAM
+        testv $opts, "./test_view $tv_args -t $ref -S -C -o VERSION=3.0 -o SEQS_PER_SLICE=7 -o SLICES_PER_CONTAINER=5 $sam > $cram";
+        testv $opts, "./test_view $tv_args -D $cram > $cram.sam_";
+        testv $opts, "./compare_sam.pl $md $sam $cram.sam_";
+
         # BAM -> CRAM3 -> BAM -> SAM
         $cram = "$bam.cram";
         testv $opts, "./test_view $tv_args -t $ref -C -o VERSION=3.0 $bam > $cram";
@@ -323,6 +339,56 @@ sub test_view
     }
 }
 
+# Decodes CRAM with REF_CACHE set, first with the FASTA file, which should
+# fill the cache, and then from the cache alone once the FASTA is removed.
+sub test_ref_cache
+{
+    my ($opts) = @_;
+    my $sam = "ce#5b.sam";
+    my $dir = "$$opts{tmp}/ref_cache";
+    my $fa = "$dir/ce.fa";
+    my $cram = "$dir/ce#5b.tmp.cram";
+
+    print "test_ref_cache testing $sam:\n";
+    $test_view_failures = 0;
+
+    cmd("mkdir -p $dir && cp ce.fa $fa");
+    testv $opts, "./test_view -t $fa -S -C '$sam' > '$cram'";
+
+    foreach my $nthreads (0, 4) {
+        my $tv_args = $nthreads ? "-\@$nthreads" : "";
+        my $cache = "REF_PATH=: REF_CACHE=$dir/cache$nthreads/%2s/%s";
+
+        # Every reference used is written to the cache, and then used from
+        # there while the FASTA file is still present
+        testv $opts, "$cache ./test_view $tv_args -i reference=$fa '$cram' > '$cram.sam_'";
+        testv $opts, "./compare_sam.pl -nomd '$sam' '$cram.sam_'";
+        testv $opts, "test `find $dir/cache$nthreads -type f | wc -l` -eq 5";
+        testv $opts, "$cache ./test_view $tv_args -i reference=$fa '$cram' > '$cram.sam_'";
+        testv $opts, "./compare_sam.pl -nomd '$sam' '$cram.sam_'";
+    }
+
+    cmd("rm -f $fa $fa.fai");
+    foreach my $nthreads (0, 4) {
+        my $tv_args = $nthreads ? "-\@$nthreads" : "";
+        my $cache = "REF_PATH=: REF_CACHE=$dir/cache$nthreads/%2s/%s";
+        testv $opts, "$cache ./test_view $tv_args '$cram' > '$cram.sam_'";
+        testv $opts, "./compare_sam.pl -nomd '$sam' '$cram.sam_'";
+    }
+
+    # Without the cache there is nowhere left to find the references
+    testv $opts, "! REF_PATH=: REF_CACHE=$dir/empty/%2s/%s ./test_view '$cram' > /dev/null 2>&1";
+
+    if ($test_view_failures == 0)
+    {
+        passed($opts, "$sam with REF_CACHE");
+    }
+    else
+    {
+        failed($opts, "$sam with REF_CACHE", "$test_view_failures subtests failed");
+    }
+}
+
 sub test_vcf_api
 {
     my ($opts,%args) = @_;
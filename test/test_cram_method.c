@@ -0,0 +1,263 @@
+/*  test/test_cram_method.c -- CRAM block compression method choice tests.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include "htslib/sam.h"
+#include "cram/cram.h"
+
+#define TMP_CRAM "test/test_cram_method.tmp.cram"
+
+#define TRIAL_SIZE 100000
+
+static int status = EXIT_SUCCESS;
+
+static const char *method_name[] = {
+    "raw", "gzip", "bzip2", "lzma", "rans0", "", "", "", "", "", "rans1",
+    "gzip_rle"
+};
+
+// Fills buf with one of several kinds of test data.
+static void make_data(unsigned char *buf, int size, int kind)
+{
+    int i;
+    switch (kind) {
+    case 0: // heavily skewed, like binned quality values
+        for (i = 0; i < size; i++) {
+            int r = random() & 0xffff, c = 0;
+            while (r & 1 && c < 40) r >>= 1, c++;
+            buf[i] = '!' + c;
+        }
+        break;
+    case 1: // slowly drifting, like unbinned quality values
+        for (i = 0; i < size; i++) {
+            int q = (i ? buf[i-1] : '5') + random() % 5 - 2;
+            buf[i] = q < '!' ? '!' : q > 'J' ? 'J' : q;
+        }
+        break;
+    default: // random bases, in lines
+        for (i = 0; i < size; i++)
+            buf[i] = i % 100 == 99 ? '\n' : "ACGT"[random() & 3];
+        break;
+    }
+}
+
+static cram_block *make_block(const unsigned char *data, int size)
+{
+    cram_block *b = cram_new_block(EXTERNAL, 1);
+    if (!b || cram_block_append(b, (void *) data, size) < 0) {
+        fprintf(stderr, "Failed to make block\n");
+        exit(EXIT_FAILURE);
+    }
+    cram_block_update_size(b);
+    return b;
+}
+
+/*
+ * Runs blocks of data through the compression trials, restricted to the
+ * methods in mask, until the metrics settle on a method, which is
+ * returned.  GZIP_RLE is reported as itself rather than as GZIP.  Each
+ * block must also decompress to its input.  Returns -1 on failure.
+ */
+static int choose_method(cram_fd *fd, int kind, int mask)
+{
+    cram_metrics *m = cram_new_metrics();
+    unsigned char *data = malloc(TRIAL_SIZE);
+    int method = -1;
+
+    if (!m || !data)
+        goto out;
+
+    do {
+        cram_block *b;
+
+        make_data(data, TRIAL_SIZE, kind);
+        b = make_block(data, TRIAL_SIZE);
+        if (cram_compress_block(fd, b, m, mask, -1) < 0
+            || cram_uncompress_block(b) < 0
+            || b->uncomp_size != TRIAL_SIZE
+            || memcmp(b->data, data, TRIAL_SIZE) != 0) {
+            fprintf(stderr, "Failed: block round trip for data type %d, "
+                    "methods %#x\n", kind, mask);
+            cram_free_block(b);
+            goto out;
+        }
+        cram_free_block(b);
+    } while (m->trial > 0);
+
+    method = m->method == GZIP && m->strat == Z_RLE ? GZIP_RLE : m->method;
+
+ out:
+    free(data);
+    free(m);
+    return method;
+}
+
+/*
+ * Checks the method chosen for data type kind from those in mask, without
+ * and then with favour_read_speed set.
+ */
+static void test_choice(cram_fd *fd, int kind, int mask,
+                        int want_size, int want_speed)
+{
+    int want[2] = { want_size, want_speed }, speed;
+
+    for (speed = 0; speed <= 1; speed++) {
+        int got;
+        srandom(kind + 1);
+        cram_set_option(fd, CRAM_OPT_FAVOUR_READ_SPEED, speed);
+        got = choose_method(fd, kind, mask);
+        if (got != want[speed]) {
+            fprintf(stderr, "Failed: data type %d with favour_read_speed=%d "
+                    "chose %s, expected %s\n", kind, speed,
+                    got < 0 ? "nothing" : method_name[got],
+                    method_name[want[speed]]);
+            status = EXIT_FAILURE;
+        }
+    }
+    cram_set_option(fd, CRAM_OPT_FAVOUR_READ_SPEED, 0);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Prints the compressed size and decode time per byte of each method on
+ * each kind of data.  These are the figures behind the favour_read_speed
+ * penalties in cram_compress_block().
+ */
+static int benchmark(cram_fd *fd, int size)
+{
+    static const int methods[] = { RANS0, RANS1, GZIP, GZIP_RLE, BZIP2, LZMA };
+    unsigned char *data = malloc(size);
+    int kind, i;
+
+    if (!data)
+        return EXIT_FAILURE;
+
+    for (kind = 0; kind <= 2; kind++) {
+        printf("Data type %d\n", kind);
+        srandom(kind + 1);
+        make_data(data, size, kind);
+        for (i = 0; i < sizeof(methods) / sizeof(*methods); i++) {
+            cram_metrics *m = cram_new_metrics();
+            cram_block *b = make_block(data, size);
+            int comp_size, method, n = 0;
+            void *comp;
+            double t;
+
+            if (!m || cram_compress_block(fd, b, m, 1 << methods[i], -1) < 0
+                || !(comp = malloc(b->comp_size))) {
+                fprintf(stderr, "Failed to compress by %s\n",
+                        method_name[methods[i]]);
+                return EXIT_FAILURE;
+            }
+            free(m);
+            comp_size = b->comp_size;
+            method = b->method;
+            memcpy(comp, b->data, comp_size);
+
+            t = now();
+            do {
+                free(b->data);
+                if (!(b->data = malloc(comp_size)))
+                    return EXIT_FAILURE;
+                memcpy(b->data, comp, comp_size);
+                b->alloc = b->comp_size = comp_size;
+                b->uncomp_size = size;
+                b->method = method;
+                if (cram_uncompress_block(b) < 0) {
+                    fprintf(stderr, "Failed to uncompress by %s\n",
+                            method_name[methods[i]]);
+                    return EXIT_FAILURE;
+                }
+                n++;
+            } while (now() - t < 0.5);
+            t = now() - t;
+
+            printf("  %-9s %9d bytes  %6.3f of input  %6.2f ns/byte\n",
+                   method_name[methods[i]], comp_size,
+                   (double) comp_size / size, t / n / size * 1e9);
+            free(comp);
+            cram_free_block(b);
+        }
+    }
+
+    free(data);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    samFile *out;
+    cram_fd *fd;
+    int c, bench = 0, size = 1 << 20;
+
+    while ((c = getopt(argc, argv, "bs:")) >= 0) {
+        switch (c) {
+        case 'b': bench = 1; break;
+        case 's': size = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: test_cram_method [-b [-s size]]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!(out = sam_open(TMP_CRAM, "wc")) || !(fd = out->fp.cram)) {
+        fprintf(stderr, "Failed to open %s\n", TMP_CRAM);
+        return EXIT_FAILURE;
+    }
+
+    if (bench) {
+        status = benchmark(fd, size);
+    } else {
+        // xz wins on size by a few percent, not enough to pay for
+        // decoding five times slower than gzip.
+        test_choice(fd, 0, 1<<GZIP | 1<<LZMA, LZMA, GZIP);
+
+        // bzip2 is so much smaller than gzip here that it is worth
+        // its slower decoding.
+        test_choice(fd, 1, 1<<GZIP | 1<<BZIP2, BZIP2, BZIP2);
+
+        // rANS order-1 is so much smaller than order-0 that it keeps
+        // winning despite decoding more slowly.
+        test_choice(fd, 1, 1<<RANS0 | 1<<RANS1, RANS1, RANS1);
+    }
+
+    if (sam_close(out) < 0) {
+        fprintf(stderr, "Failed to close %s\n", TMP_CRAM);
+        status = EXIT_FAILURE;
+    }
+    unlink(TMP_CRAM);
+    return status;
+}
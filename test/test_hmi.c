@@ -0,0 +1,300 @@
+/*  test/test_hmi.c -- End index query tests and long-read benchmark.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+
+#define TMP_BAM "test/test_hmi.tmp.bam"
+#define TMP_BAI "test/test_hmi.tmp.bam.bai"
+#define TMP_HMI "test/test_hmi.tmp.bam.hmi"
+
+static int status = EXIT_SUCCESS;
+
+// Records read by the iterators, whether returned or not
+static long n_decoded;
+static hts_readrec_func *bam_readrec;
+static hts_skiprec_func *bam_skiprec;
+
+static int count_readrec(BGZF *fp, void *data, void *r, int *tid, int *beg,
+                         int *end) {
+    n_decoded++;
+    return bam_readrec(fp, data, r, tid, beg, end);
+}
+
+static int count_skiprec(BGZF *fp, void *data, void *r, int *tid, int *beg,
+                         int *end, int qtid, int qbeg) {
+    n_decoded++;
+    return bam_skiprec(fp, data, r, tid, beg, end, qtid, qbeg);
+}
+
+/*
+ * Writes nrec long reads, evenly spaced over len bases of one reference.
+ * One in ten is 100-500kb long and the rest 1-30kb.  SEQ is 100 bases, or
+ * a tenth of the span if long_seq is set, with the rest of the span made
+ * up by a deletion.
+ */
+static int write_bam(const char *fn, int nrec, int len, int long_seq) {
+    samFile *out = sam_open(fn, "wb");
+    bam_hdr_t *h;
+    bam1_t *b = bam_init1();
+    kstring_t ks = { 0, 0, NULL };
+    int i, j, ret = -1;
+
+    ksprintf(&ks, "@SQ\tSN:chr1\tLN:%d\n", len + 1000000);
+    h = sam_hdr_parse(ks.l, ks.s);
+    if (!out || !h || !b)
+        goto out;
+    h->l_text = ks.l;
+    h->text = ks.s;
+    ks.s = NULL;
+    ks.l = ks.m = 0;
+    if (sam_hdr_write(out, h) < 0)
+        goto out;
+
+    for (i = 0; i < nrec; i++) {
+        int pos = (int)((double) i / nrec * len);
+        int span = random() % 10 ? 1000 + random() % 29000
+                                 : 100000 + random() % 400000;
+        int l_seq = long_seq ? span / 10 : 100;
+
+        ks.l = 0;
+        ksprintf(&ks, "r%d\t0\tchr1\t%d\t30\t%dM%dD\t*\t0\t0\t",
+                 i, pos + 1, l_seq, span - l_seq);
+        for (j = 0; j < l_seq; j++)
+            kputc("ACGT"[random() & 3], &ks);
+        kputs("\t*", &ks);
+        if (sam_parse1(&ks, h, b) < 0 || sam_write1(out, h, b) < 0)
+            goto out;
+    }
+    ret = 0;
+
+ out:
+    if (out && sam_close(out) < 0)
+        ret = -1;
+    bam_hdr_destroy(h);
+    bam_destroy1(b);
+    free(ks.s);
+    return ret;
+}
+
+/*
+ * Runs the query, appending the names of the records found to names if it
+ * is not NULL.  Returns the number found, or -1 on error.
+ */
+static long query(samFile *in, const hts_idx_t *idx, int beg, int end,
+                  bam1_t *b, kstring_t *names) {
+    hts_itr_t *iter = sam_itr_queryi(idx, 0, beg, end);
+    long n = 0;
+    int r;
+
+    if (!iter)
+        return -1;
+    bam_readrec = iter->readrec;
+    iter->readrec = count_readrec;
+    if (iter->skiprec) {
+        bam_skiprec = iter->skiprec;
+        iter->skiprec = count_skiprec;
+    }
+    while ((r = sam_itr_next(in, iter, b)) >= 0) {
+        if (names) {
+            kputs(bam_get_qname(b), names);
+            kputc(' ', names);
+        }
+        n++;
+    }
+    hts_itr_destroy(iter);
+    return r < -1 ? -1 : n;
+}
+
+static hts_idx_t *load_index(samFile *in, const char *fnidx) {
+    hts_idx_t *idx = sam_index_load2(in, TMP_BAM, fnidx);
+    if (!idx)
+        fprintf(stderr, "Failed to load %s\n", fnidx);
+    return idx;
+}
+
+static int build_indexes(const char *fn, const char *fnbai,
+                         const char *fnhmi) {
+    if (sam_index_build3(fn, fnbai, 0, 0) < 0
+        || sam_index_build3(fn, fnhmi, 0, 0) < 0) {
+        fprintf(stderr, "Failed to index %s\n", fn);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Queries via the .hmi index must find the same records as the .bai, while
+ * decoding fewer of them.
+ */
+static void test_queries(int nrec, int len, int nquery) {
+    samFile *in = NULL;
+    hts_idx_t *bai = NULL, *hmi = NULL;
+    bam1_t *b = bam_init1();
+    kstring_t want = { 0, 0, NULL }, got = { 0, 0, NULL };
+    long decoded_bai = 0, decoded_hmi = 0;
+    int i;
+
+    if (write_bam(TMP_BAM, nrec, len, 0) < 0) {
+        fprintf(stderr, "Failed to write %s\n", TMP_BAM);
+        status = EXIT_FAILURE;
+        goto out;
+    }
+    if (build_indexes(TMP_BAM, TMP_BAI, TMP_HMI) < 0
+        || !(in = sam_open(TMP_BAM, "r"))
+        || !(bai = load_index(in, TMP_BAI))
+        || !(hmi = load_index(in, TMP_HMI))) {
+        status = EXIT_FAILURE;
+        goto out;
+    }
+
+    for (i = 0; i < nquery; i++) {
+        int beg = random() % (len + 600000), end = beg + 1 + random() % 5000;
+        long n0, n1;
+
+        want.l = got.l = 0;
+        n_decoded = 0;
+        n0 = query(in, bai, beg, end, b, &want);
+        decoded_bai += n_decoded;
+        n_decoded = 0;
+        n1 = query(in, hmi, beg, end, b, &got);
+        decoded_hmi += n_decoded;
+        if (n0 < 0 || n1 < 0 || n0 != n1
+            || (want.l && strcmp(want.s, got.s) != 0)) {
+            fprintf(stderr, "Failed: query chr1:%d-%d found %ld records "
+                    "with %s and %ld with %s\n",
+                    beg, end, n0, TMP_BAI, n1, TMP_HMI);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    if (status == EXIT_SUCCESS && decoded_hmi >= decoded_bai) {
+        fprintf(stderr, "Failed: %s decoded %ld records, %s %ld\n",
+                TMP_HMI, decoded_hmi, TMP_BAI, decoded_bai);
+        status = EXIT_FAILURE;
+    }
+
+ out:
+    hts_idx_destroy(bai);
+    hts_idx_destroy(hmi);
+    if (in)
+        sam_close(in);
+    bam_destroy1(b);
+    free(want.s);
+    free(got.s);
+    unlink(TMP_BAM);
+    unlink(TMP_BAI);
+    unlink(TMP_HMI);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Times nquery random 1kb queries with each index, and counts the records
+ * they return and decode.
+ */
+static int benchmark(int len, int nquery) {
+    const char *fnidx[] = { TMP_BAI, TMP_HMI };
+    samFile *in = sam_open(TMP_BAM, "r");
+    bam1_t *b = bam_init1();
+    int i, k;
+
+    if (!in)
+        return EXIT_FAILURE;
+
+    for (k = 0; k < 2; k++) {
+        hts_idx_t *idx = load_index(in, fnidx[k]);
+        long n = 0, r;
+        double t;
+
+        if (!idx)
+            return EXIT_FAILURE;
+        srandom(2);
+        n_decoded = 0;
+        t = now();
+        for (i = 0; i < nquery; i++) {
+            int beg = random() % len;
+            if ((r = query(in, idx, beg, beg + 1000, b, NULL)) < 0) {
+                fprintf(stderr, "Query failed with %s\n", fnidx[k]);
+                return EXIT_FAILURE;
+            }
+            n += r;
+        }
+        printf("%-26s %7.3f s  %8ld records returned  %8ld decoded\n",
+               fnidx[k], now() - t, n, n_decoded);
+        hts_idx_destroy(idx);
+    }
+
+    bam_destroy1(b);
+    sam_close(in);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    int c, bench = 0, long_seq = 0, nrec = 200000, nquery = 1000;
+
+    while ((c = getopt(argc, argv, "bln:q:")) >= 0) {
+        switch (c) {
+        case 'b': bench = 1; break;
+        case 'l': long_seq = 1; break;
+        case 'n': nrec = atoi(optarg); break;
+        case 'q': nquery = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: test_hmi [-b [-l] [-n records] "
+                    "[-q queries]]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    srandom(1);
+
+    if (bench) {
+        // Keep the depth the same, whatever the number of records
+        int len = nrec * 500;
+        int ret = EXIT_FAILURE;
+        if (write_bam(TMP_BAM, nrec, len, long_seq) == 0
+            && build_indexes(TMP_BAM, TMP_BAI, TMP_HMI) == 0)
+            ret = benchmark(len, nquery);
+        unlink(TMP_BAM);
+        unlink(TMP_BAI);
+        unlink(TMP_HMI);
+        return ret;
+    }
+
+    test_queries(2000, 1000000, 500);
+    return status;
+}
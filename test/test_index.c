@@ -0,0 +1,499 @@
+/*  test/test_index.c -- CRAM index building, loading and query tests.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+#include "cram/cram.h"
+
+#define TMP_IDX "test/test_index.tmp.crai"
+#define TMP_CRAM "test/test_index.tmp.cram"
+
+static int status = EXIT_SUCCESS;
+
+// One .crai line, with end inclusive.
+typedef struct {
+    int refid, start, end, slice, len;
+    int64_t offset;
+} entry;
+
+typedef struct {
+    entry *e;
+    int n, m;
+} entries;
+
+static void add_entry(entries *es, int refid, int start, int end,
+                      int64_t offset, int slice) {
+    if (es->n == es->m) {
+        es->m = es->m ? es->m * 2 : 1024;
+        if (!(es->e = realloc(es->e, es->m * sizeof(*es->e)))) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    es->e[es->n].refid = refid;
+    es->e[es->n].start = start;
+    es->e[es->n].end = end;
+    es->e[es->n].offset = offset;
+    es->e[es->n].slice = slice;
+    es->e[es->n].len = 1000;
+    es->n++;
+}
+
+/*
+ * Generates the slices of nref references, leaving reference 2 empty.
+ * Slices overlap their neighbours and occasionally contain several of
+ * the following ones.  Unmapped slices come last.
+ */
+static void make_entries(entries *es, int nref, int nslice) {
+    int64_t offset = 0;
+    int r, i;
+
+    es->n = 0;
+    for (r = 0; r < nref; r++) {
+        int pos = 1 + random() % 100;
+        if (r == 2)
+            continue;
+        for (i = 0; i < nslice; i++) {
+            int span = random() % 50 ? 100 + random() % 1000 : 20000;
+            add_entry(es, r, pos, pos + span - 1, offset, (i % 3) * 100);
+            pos += random() % 400;
+            if (i % 3 == 2)
+                offset += 10000 + random() % 10000;
+        }
+        offset += 10000;
+    }
+    for (i = 0; i < 5; i++, offset += 1000)
+        add_entry(es, -1, 0, -1, offset, 0);
+}
+
+static void write_entry(BGZF *fp, const entry *e) {
+    char buf[256];
+    int len = sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
+                      e->refid, e->start, e->end - e->start + 1,
+                      e->offset, e->slice, e->len);
+    if (bgzf_write(fp, buf, len) != len) {
+        fprintf(stderr, "Failed to write %s\n", TMP_IDX);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Writes the entries as a .crai file.  If split is set, the first half
+ * of reference 1 is moved before reference 0, so a reference's lines
+ * are no longer contiguous.
+ */
+static void write_index(const entries *es, const char *mode, int split) {
+    BGZF *fp = bgzf_open(TMP_IDX, mode);
+    int i, k, n1 = 0;
+
+    if (!fp) {
+        perror(TMP_IDX);
+        exit(EXIT_FAILURE);
+    }
+
+    if (split) {
+        for (i = 0; i < es->n; i++)
+            if (es->e[i].refid == 1)
+                n1++;
+        n1 /= 2;
+        for (i = k = 0; i < es->n && k < n1; i++)
+            if (es->e[i].refid == 1)
+                write_entry(fp, &es->e[i]), k++;
+    }
+
+    for (i = k = 0; i < es->n; i++) {
+        if (es->e[i].refid == 1 && k < n1)
+            k++;
+        else
+            write_entry(fp, &es->e[i]);
+    }
+
+    if (bgzf_close(fp) < 0) {
+        fprintf(stderr, "Failed to close %s\n", TMP_IDX);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * The slice cram_index_query() should return: the first one (in file
+ * order) ending at or after pos, else the one reaching furthest.
+ */
+static const entry *expected(const entries *es, int refid, int pos) {
+    const entry *best = NULL;
+    int i;
+
+    for (i = 0; i < es->n; i++) {
+        const entry *e = &es->e[i];
+        if (e->refid != refid)
+            continue;
+        if (e->end >= pos)
+            return e;
+        if (!best || e->end > best->end)
+            best = e;
+    }
+
+    return best;
+}
+
+static void check_queries(cram_fd *fd, const entries *es, int nref,
+                          int nquery, const char *what) {
+    int i;
+
+    for (i = 0; i < nquery; i++) {
+        int refid = (int)(random() % (nref + 2)) - 1;
+        int pos = random() % 500000;
+        const entry *want = expected(es, refid, pos);
+        cram_index *got = cram_index_query(fd, refid, pos, NULL);
+
+        if (!want != !got ||
+            (want && (want->offset != got->offset ||
+                      want->slice != got->slice))) {
+            fprintf(stderr, "Failed: %s query %d:%d gave %"PRId64"/%d, "
+                    "expected %"PRId64"/%d\n", what, refid, pos,
+                    got ? got->offset : -1, got ? got->slice : -1,
+                    want ? want->offset : -1, want ? want->slice : -1);
+            status = EXIT_FAILURE;
+            return;
+        }
+    }
+}
+
+static void test_load(const entries *es, int nref, const char *mode,
+                      int split, const char *what) {
+    cram_fd *fd = calloc(1, sizeof(*fd));
+
+    if (!fd) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    write_index(es, mode, split);
+    if (cram_index_load(fd, NULL, TMP_IDX) < 0) {
+        fprintf(stderr, "Failed: %s cram_index_load\n", what);
+        status = EXIT_FAILURE;
+    } else {
+        check_queries(fd, es, nref, 2000, what);
+    }
+
+    cram_index_free(fd);
+    free(fd);
+}
+
+/*
+ * Puts a bad line among the slices of reference 3.  The load only scans
+ * for reference ids, but it should still reject the file rather than
+ * leave the query on that reference to come up empty.
+ */
+static void test_malformed(const entries *es, const char *bad) {
+    cram_fd *fd = calloc(1, sizeof(*fd));
+    BGZF *fp = bgzf_open(TMP_IDX, "wu");
+    int i, done = 0, len = strlen(bad);
+
+    if (!fd || !fp) {
+        perror(TMP_IDX);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < es->n; i++) {
+        if (es->e[i].refid == 3 && i > 0 && es->e[i-1].refid == 3
+            && !done++ && bgzf_write(fp, bad, len) != len) {
+            fprintf(stderr, "Failed to write %s\n", TMP_IDX);
+            exit(EXIT_FAILURE);
+        }
+        write_entry(fp, &es->e[i]);
+    }
+    if (bgzf_close(fp) < 0) {
+        fprintf(stderr, "Failed to close %s\n", TMP_IDX);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cram_index_load(fd, NULL, TMP_IDX) == 0) {
+        fprintf(stderr, "Failed: cram_index_load accepted line \"%.*s\"\n",
+                len - 1, bad);
+        status = EXIT_FAILURE;
+    }
+
+    cram_index_free(fd);
+    free(fd);
+}
+
+/*
+ * Writes a CRAM file with nref references and no reference sequence,
+ * optionally putting several references in each slice.
+ */
+static int write_cram(int nref, int multi_seq) {
+    samFile *out = sam_open(TMP_CRAM, "wc");
+    bam_hdr_t *h = NULL;
+    bam1_t *b = bam_init1();
+    kstring_t ks = { 0, 0, NULL };
+    int r, i, ret = -1;
+
+    if (!out || !b)
+        goto out;
+    if (hts_set_opt(out, CRAM_OPT_NO_REF, 1) < 0 ||
+        hts_set_opt(out, CRAM_OPT_SEQS_PER_SLICE, 100) < 0 ||
+        hts_set_opt(out, CRAM_OPT_SLICES_PER_CONTAINER, 2) < 0 ||
+        (multi_seq && hts_set_opt(out, CRAM_OPT_MULTI_SEQ_PER_SLICE, 1) < 0))
+        goto out;
+
+    kputs("@HD\tVN:1.4\tSO:coordinate\n", &ks);
+    for (r = 0; r < nref; r++)
+        ksprintf(&ks, "@SQ\tSN:ref%d\tLN:1000000\n", r);
+    if (!(h = sam_hdr_parse(ks.l, ks.s)))
+        goto out;
+    h->l_text = ks.l;
+    h->text = ks.s;
+    ks.s = NULL;
+    ks.l = ks.m = 0;
+    if (sam_hdr_write(out, h) < 0)
+        goto out;
+
+    for (r = -1; r < nref; r++) {
+        int n = r < 0 ? 0 : 1 + random() % 60, pos = 1;
+        if (r == nref - 1)
+            n = 30; // unmapped reads follow
+        for (i = 0; i < n; i++) {
+            int k;
+            pos += random() % 500;
+            ks.l = 0;
+            if (r == nref - 1 && i >= n / 2)
+                ksprintf(&ks, "u%d\t4\t*\t0\t0\t*\t*\t0\t0\t", i);
+            else
+                ksprintf(&ks, "r%d_%d\t0\tref%d\t%d\t40\t50M\t*\t0\t0\t",
+                         r, i, r, pos);
+            for (k = 0; k < 50; k++)
+                kputc("ACGT"[random() & 3], &ks);
+            kputs("\t*", &ks);
+            if (sam_parse1(&ks, h, b) < 0 || sam_write1(out, h, b) < 0)
+                goto out;
+        }
+    }
+    ret = 0;
+
+ out:
+    if (out && sam_close(out) < 0)
+        ret = -1;
+    if (h)
+        bam_hdr_destroy(h);
+    bam_destroy1(b);
+    free(ks.s);
+    return ret;
+}
+
+// Reads a whole (compressed) index into ks.
+static int read_index(const char *fn, kstring_t *ks) {
+    BGZF *fp = bgzf_open(fn, "r");
+    char buf[8192];
+    ssize_t len;
+
+    ks->l = 0;
+    if (!fp)
+        return -1;
+    while ((len = bgzf_read(fp, buf, sizeof(buf))) > 0)
+        kputsn(buf, len, ks);
+    return (bgzf_close(fp) < 0 || len < 0) ? -1 : 0;
+}
+
+/*
+ * Indexes a CRAM file with and without threads.  The .crai files should be
+ * identical and, as every reference has reads, cover all of them.
+ */
+static void test_build(int nref, int multi_seq) {
+    static const int threads[] = { 0, 1, 2, 4 };
+    kstring_t want = { 0, 0, NULL }, got = { 0, 0, NULL };
+    char *what = multi_seq ? "multi-ref" : "single-ref";
+    int i, r;
+
+    if (write_cram(nref, multi_seq) < 0) {
+        fprintf(stderr, "Failed: %s writing %s\n", what, TMP_CRAM);
+        status = EXIT_FAILURE;
+        return;
+    }
+
+    for (i = 0; i < sizeof(threads) / sizeof(*threads); i++) {
+        kstring_t *ks = i ? &got : &want;
+        if (sam_index_build3(TMP_CRAM, TMP_IDX, 0, threads[i]) < 0 ||
+            read_index(TMP_IDX, ks) < 0) {
+            fprintf(stderr, "Failed: %s index build with %d threads\n",
+                    what, threads[i]);
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (i && (got.l != want.l || memcmp(got.s, want.s, got.l) != 0)) {
+            fprintf(stderr, "Failed: %s index differs with %d threads\n",
+                    what, threads[i]);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    for (r = -1; r < nref && status == EXIT_SUCCESS; r++) {
+        char line[20];
+        int len = sprintf(line, "%d\t", r);
+        size_t k;
+        for (k = 0; k < want.l; k++)
+            if ((k == 0 || want.s[k-1] == '\n')
+                && strncmp(want.s + k, line, len) == 0)
+                break;
+        if (k == want.l) {
+            fprintf(stderr, "Failed: %s index lacks reference %d\n",
+                    what, r);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    unlink(TMP_CRAM);
+    free(want.s);
+    free(got.s);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Times loading fn, loading it and making a single query as a region
+ * lookup would, and a run of random queries.
+ */
+static int benchmark(const char *fn, int iter, int nquery) {
+    cram_fd *fd = calloc(1, sizeof(*fd));
+    double t0, t1, t2, t3;
+    int i, nref = 0, maxpos = 1, first = -1;
+
+    if (!fd)
+        return EXIT_FAILURE;
+
+    t0 = now();
+    for (i = 0; i < iter; i++) {
+        if (cram_index_load(fd, NULL, fn) < 0) {
+            fprintf(stderr, "Failed to load %s\n", fn);
+            return EXIT_FAILURE;
+        }
+        cram_index_free(fd);
+    }
+    t1 = now();
+
+    // Where the data starts, for a typical region lookup
+    if (cram_index_load(fd, NULL, fn) < 0)
+        return EXIT_FAILURE;
+    for (i = 0; first < 0 && i + 1 < fd->index_sz; i++)
+        if (cram_index_query(fd, i, 1, NULL))
+            first = i;
+    cram_index_free(fd);
+
+    t2 = now();
+    for (i = 0; i < iter; i++) {
+        if (cram_index_load(fd, NULL, fn) < 0)
+            return EXIT_FAILURE;
+        cram_index_query(fd, first, 1000000, NULL);
+        cram_index_free(fd);
+    }
+    t2 = now() - t2;
+
+    // Touch every reference once so the random queries exclude parsing.
+    if (cram_index_load(fd, NULL, fn) < 0)
+        return EXIT_FAILURE;
+    for (i = 0; i + 1 < fd->index_sz; i++) {
+        cram_index *e = cram_index_query(fd, i, INT_MAX, NULL);
+        if (e) {
+            nref = i + 1;
+            if (maxpos <= e->end)
+                maxpos = e->end + 1;
+        }
+    }
+
+    t3 = now();
+    for (i = 0; i < nquery && nref; i++)
+        cram_index_query(fd, random() % nref, random() % maxpos, NULL);
+    t3 = now() - t3;
+
+    printf("%s: load %.2f ms, load+query %.2f ms, %.0f queries/s\n", fn,
+           (t1 - t0) * 1000 / iter, t2 * 1000 / iter,
+           t3 > 0 ? nquery / t3 : 0.0);
+
+    cram_index_free(fd);
+    free(fd);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    entries es = { NULL, 0, 0 };
+    int c, bench = 0, iter = 10, nslice = 100000;
+
+    while ((c = getopt(argc, argv, "bn:s:")) >= 0) {
+        switch (c) {
+        case 'b': bench = 1; break;
+        case 'n': iter = atoi(optarg); break;
+        case 's': nslice = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: test_index [-b [-n iterations] "
+                    "[-s slices_per_ref] [file.crai]]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    srandom(15);
+
+    if (bench) {
+        int ret;
+        if (optind < argc)
+            return benchmark(argv[optind], iter, 1000000);
+        make_entries(&es, 25, nslice);
+        write_index(&es, "wg", 0);
+        ret = benchmark(TMP_IDX, iter, 1000000);
+        unlink(TMP_IDX);
+        free(es.e);
+        return ret;
+    }
+
+    make_entries(&es, 6, 1000);
+    test_load(&es, 6, "wg", 0, "gzipped");
+    test_load(&es, 6, "wu", 0, "uncompressed");
+    test_load(&es, 6, "wg", 1, "non-contiguous");
+
+    test_malformed(&es, "3\t100\t200\t5000\t0\n");
+    test_malformed(&es, "3\t100\tx\t5000\t0\t1000\n");
+    test_malformed(&es, "3\t100\t200\t5000\t0\t\n");
+
+    make_entries(&es, 3, 1);
+    test_load(&es, 3, "wg", 0, "one slice per ref");
+
+    test_build(40, 0);
+    test_build(40, 1);
+
+    unlink(TMP_IDX);
+    free(es.e);
+    return status;
+}
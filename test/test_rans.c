@@ -0,0 +1,275 @@
+/*  test/test_rans.c -- rANS codec round-trip tests and benchmark.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "cram/rANS_static.h"
+#include "cram/rANS_static32x16.h"
+
+static int status = EXIT_SUCCESS;
+
+static void fail(const char *what, int kind, unsigned int size, int order)
+{
+    fprintf(stderr, "Failed: %s for data type %d, size %u, order %d\n",
+            what, kind, size, order);
+    status = EXIT_FAILURE;
+}
+
+// Fills buf with one of several kinds of test data.
+static void make_data(unsigned char *buf, unsigned int size, int kind)
+{
+    unsigned int i;
+    switch (kind) {
+    case 0: // uniform over all byte values
+        for (i = 0; i < size; i++) buf[i] = random();
+        break;
+    case 1: // heavily skewed, like quality values
+        for (i = 0; i < size; i++) {
+            int r = random() & 0xffff, c = 0;
+            while (r & 1 && c < 40) r >>= 1, c++;
+            buf[i] = '!' + c;
+        }
+        break;
+    case 2: // a single symbol
+        memset(buf, 'A' + (random() & 7), size);
+        break;
+    case 3: // runs over a small alphabet, like bases
+        for (i = 0; i < size; ) {
+            unsigned int n = 1 + (random() & 15);
+            unsigned char c = "ACGTN"[random() % 5];
+            while (n-- && i < size) buf[i++] = c;
+        }
+        break;
+    default: // one rare symbol amongst many common ones
+        for (i = 0; i < size; i++)
+            buf[i] = (random() & 0x3ff) ? 'a' + (random() & 1) : 0xff;
+        break;
+    }
+}
+
+static void round_trip(const unsigned char *in, unsigned int size,
+                       int kind, int order)
+{
+    unsigned int csize, usize, clen;
+    unsigned char *comp, *uncomp;
+    int level;
+
+    comp = rans_compress_32x16((unsigned char *) in, size, &csize, order);
+    if (!comp) {
+        fail("rans_compress_32x16", kind, size, order);
+        return;
+    }
+
+    for (level = 0; level <= 2; level++) {
+        rans_set_simd_32x16(level);
+        uncomp = rans_uncompress_32x16(comp, csize, &usize);
+        if (!uncomp || usize != size || memcmp(in, uncomp, size) != 0)
+            fail(level ? "SIMD rans_uncompress_32x16" : "rans_uncompress_32x16",
+                 kind, size, order);
+        free(uncomp);
+    }
+
+    // Truncated and corrupted streams must be rejected or decode to
+    // something, but never read or write out of bounds.
+    for (level = 0; level <= 2; level++) {
+        rans_set_simd_32x16(level);
+        free(rans_uncompress_32x16(comp, csize - 1, &usize));
+        if (csize > 9) {
+            unsigned int i;
+            for (i = 0; i < 8; i++) {
+                unsigned int pos = 9 + random() % (csize - 9);
+                unsigned char orig = comp[pos];
+                comp[pos] ^= 1 + (random() % 255);
+                free(rans_uncompress_32x16(comp, csize, &usize));
+                comp[pos] = orig;
+            }
+
+            // Keep the header consistent with a shortened stream
+            clen = 9 + (csize - 9) / 2;
+            comp[1] = (clen - 9);       comp[2] = (clen - 9) >> 8;
+            comp[3] = (clen - 9) >> 16; comp[4] = (clen - 9) >> 24;
+            free(rans_uncompress_32x16(comp, clen, &usize));
+            comp[1] = (csize - 9);       comp[2] = (csize - 9) >> 8;
+            comp[3] = (csize - 9) >> 16; comp[4] = (csize - 9) >> 24;
+        }
+
+        // An implausibly large output size must be refused, not allocated
+        if (csize >= 9) {
+            unsigned char osz[4];
+            memcpy(osz, comp + 5, 4);
+            memset(comp + 5, 0xff, 4);
+            if ((uncomp = rans_uncompress_32x16(comp, csize, &usize))) {
+                fail("rans_uncompress_32x16 accepted huge size",
+                     kind, size, order);
+                free(uncomp);
+            }
+            memcpy(comp + 5, osz, 4);
+        }
+    }
+    rans_set_simd_32x16(-1);
+
+    free(comp);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+typedef unsigned char *compress_func(unsigned char *, unsigned int,
+                                     unsigned int *, int);
+typedef unsigned char *uncompress_func(unsigned char *, unsigned int,
+                                       unsigned int *);
+
+static void bench1(const char *name, compress_func *comp,
+                   uncompress_func *uncomp, unsigned char *in,
+                   unsigned int size, int order, int iter)
+{
+    unsigned int csize = 0, usize;
+    unsigned char *c = NULL, *u;
+    double t0, t1, t2;
+    int i;
+
+    t0 = now();
+    for (i = 0; i < iter; i++) {
+        free(c);
+        c = comp(in, size, &csize, order);
+    }
+    t1 = now();
+    for (i = 0; i < iter; i++) {
+        u = uncomp(c, csize, &usize);
+        if (!u || usize != size || memcmp(u, in, size) != 0)
+            fprintf(stderr, "%s: round trip failed\n", name);
+        free(u);
+    }
+    t2 = now();
+
+    printf("%-12s O%d %10u -> %10u  %8.1f MB/s enc  %8.1f MB/s dec\n",
+           name, order, size, csize,
+           (double) size * iter / (t1 - t0) / 1e6,
+           (double) size * iter / (t2 - t1) / 1e6);
+    free(c);
+}
+
+static void benchmark(unsigned char *in, unsigned int size, int iter)
+{
+    int order;
+    for (order = 0; order <= 1; order++) {
+        bench1("rans4x8", rans_compress, rans_uncompress,
+               in, size, order, iter);
+        rans_set_simd_32x16(0);
+        bench1("rans32x16", rans_compress_32x16, rans_uncompress_32x16,
+               in, size, order, iter);
+        rans_set_simd_32x16(1);
+        bench1("rans32x16-2", rans_compress_32x16, rans_uncompress_32x16,
+               in, size, order, iter);
+        rans_set_simd_32x16(2);
+        bench1("rans32x16-5", rans_compress_32x16, rans_uncompress_32x16,
+               in, size, order, iter);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned int sizes[] = {
+        1, 2, 31, 32, 33, 63, 64, 65, 100, 1023, 1024, 1025, 4097,
+        65536, 100003, 1 << 20
+    };
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    unsigned char *buf;
+    int c, bench = 0, iter = 10, i, kind, order;
+
+    while ((c = getopt(argc, argv, "bn:")) >= 0) {
+        switch (c) {
+        case 'b': bench = 1; break;
+        case 'n': iter = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: test_rans [-b [-n iterations] [file]]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    srandom(15);
+
+    if (bench) {
+        unsigned int size = 1 << 20;
+        if (optind < argc) {
+            FILE *fp = fopen(argv[optind], "rb");
+            long len;
+            if (!fp || fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) <= 0) {
+                perror(argv[optind]);
+                return EXIT_FAILURE;
+            }
+            size = len;
+            rewind(fp);
+            if (!(buf = malloc(size)) || fread(buf, 1, size, fp) != size) {
+                perror(argv[optind]);
+                return EXIT_FAILURE;
+            }
+            fclose(fp);
+            benchmark(buf, size, iter);
+        } else {
+            if (!(buf = malloc(size)))
+                return EXIT_FAILURE;
+            for (kind = 0; kind <= 4; kind++) {
+                printf("Data type %d\n", kind);
+                make_data(buf, size, kind);
+                benchmark(buf, size, iter);
+            }
+        }
+        free(buf);
+        return EXIT_SUCCESS;
+    }
+
+    if (!(buf = malloc(sizes[nsizes-1])))
+        return EXIT_FAILURE;
+
+    for (kind = 0; kind <= 4; kind++) {
+        for (order = 0; order <= 1; order++) {
+            for (i = 0; i < nsizes; i++) {
+                make_data(buf, sizes[i], kind);
+                round_trip(buf, sizes[i], kind, order);
+            }
+            // and a spread of random small sizes
+            for (i = 0; i < 50; i++) {
+                unsigned int size = random() % 3000;
+                make_data(buf, size, kind);
+                round_trip(buf, size, kind, order);
+            }
+        }
+    }
+
+    // The empty input
+    round_trip(buf, 0, 0, 0);
+    round_trip(buf, 0, 0, 1);
+
+    free(buf);
+    return status;
+}
@@ -0,0 +1,171 @@
+/*  test/test_tok.c -- read name tokeniser round-trip and robustness tests.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cram/tokenise_name.h"
+
+static int status = EXIT_SUCCESS;
+
+static void fail(const char *what, int kind, int n)
+{
+    fprintf(stderr, "Failed: %s for name type %d, %d names\n", what, kind, n);
+    status = EXIT_FAILURE;
+}
+
+/*
+ * Fills buf with n NUL-terminated names of one of several styles, returning
+ * the total length.  buf must hold at least n * 64 bytes.
+ */
+static unsigned int make_names(char *buf, int n, int kind)
+{
+    static const char alpha[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_:";
+    unsigned int l = 0, prev = 0;
+    int i, x = 1000, y = 2000;
+
+    for (i = 0; i < n; i++) {
+        unsigned int start = l;
+        int k, len;
+        switch (kind) {
+        case 0: // Illumina style, with pairs sharing a name
+            if (i && random() % 2) {
+                len = strlen(buf + prev) + 1;
+                memcpy(buf + l, buf + prev, len);
+                l += len;
+                break;
+            }
+            x += random() % 300;
+            y += random() % 3 ? 0 : 1;
+            l += sprintf(buf + l, "HS25_%d:%d:%d:%d:%d", 7, 1 + (i / 1000),
+                         y, x, (int)(random() % 20000)) + 1;
+            break;
+        case 1: // unstructured
+            len = 1 + random() % 30;
+            for (k = 0; k < len; k++)
+                buf[l++] = alpha[random() % 64];
+            buf[l++] = 0;
+            break;
+        case 2: // incrementing numbers, sometimes wrapping or jumping
+            x = random() % 10 ? x + 1 : (int)(random() & 0x7fffffff);
+            l += sprintf(buf + l, "read.%d/%d", x, 1 + (i & 1)) + 1;
+            break;
+        default: // runs of duplicates and empty names
+            if (random() % 4 == 0)
+                buf[l++] = 0;
+            else
+                l += sprintf(buf + l, "r%d", (int)(i / 5)) + 1;
+            break;
+        }
+        prev = start;
+    }
+
+    return l;
+}
+
+static void test_names(unsigned char *in, unsigned int size, int kind, int n)
+{
+    unsigned int csize, usize, i;
+    unsigned char *comp, *uncomp;
+
+    comp = tok_encode_names(in, size, &csize);
+    if (!comp) {
+        fail("tok_encode_names", kind, n);
+        return;
+    }
+
+    uncomp = tok_decode_names(comp, csize, &usize);
+    if (!uncomp || usize != size || memcmp(in, uncomp, size) != 0)
+        fail("tok_decode_names", kind, n);
+    free(uncomp);
+
+    // Truncated and corrupted streams must be rejected or decode to
+    // something, but never read or write out of bounds.
+    for (i = 0; i < csize; i += csize > 300 ? 1 + random() % (csize / 50) : 1)
+        free(tok_decode_names(comp, i, &usize));
+
+    if (csize > 9) {
+        for (i = 0; i < (csize > 10000 ? 20 : 200); i++) {
+            unsigned int pos = 9 + random() % (csize - 9);
+            unsigned char orig = comp[pos];
+            comp[pos] ^= 1 + (random() % 255);
+            free(tok_decode_names(comp, csize, &usize));
+            comp[pos] = orig;
+        }
+    }
+
+    // A shrunken output size must not be overrun.
+    if (size > 1 && csize >= 4) {
+        unsigned int sz = size / 2;
+        comp[0] = sz; comp[1] = sz >> 8; comp[2] = sz >> 16; comp[3] = sz >> 24;
+        free(tok_decode_names(comp, csize, &usize));
+    }
+
+    free(comp);
+}
+
+int main(void)
+{
+    static const int counts[] = { 1, 2, 3, 10, 100, 1000, 10000 };
+    const int ncounts = sizeof(counts) / sizeof(counts[0]);
+    unsigned int csize, size, i;
+    unsigned char *buf, *comp, junk[2000];
+    int kind, c;
+
+    srandom(15);
+
+    if (!(buf = malloc(counts[ncounts-1] * 64)))
+        return EXIT_FAILURE;
+
+    for (kind = 0; kind <= 3; kind++) {
+        for (c = 0; c < ncounts; c++) {
+            size = make_names((char *) buf, counts[c], kind);
+            test_names(buf, size, kind, counts[c]);
+        }
+    }
+
+    // Input that is not NUL-terminated is refused.
+    memcpy(buf, "abc", 3);
+    if ((comp = tok_encode_names(buf, 3, &csize)) != NULL) {
+        fail("tok_encode_names accepted unterminated input", -1, 1);
+        free(comp);
+    }
+
+    // Random garbage, with a plausible header, must not crash.
+    for (c = 0; c < 200; c++) {
+        unsigned int len = 9 + random() % (sizeof(junk) - 9), sz;
+        for (i = 0; i < len; i++)
+            junk[i] = random();
+        sz = 1 + random() % 10000;
+        junk[0] = sz; junk[1] = sz >> 8; junk[2] = junk[3] = 0;
+        junk[4] = random() % 100; junk[5] = junk[6] = junk[7] = 0;
+        junk[8] = random() % 8;
+        free(tok_decode_names(junk, len, &size));
+    }
+
+    free(buf);
+    return status;
+}
@@ -1011,14 +1011,21 @@ void bcf_destroy(bcf1_t *v)
     free(v);
 }
 
-static inline int bcf_read1_core(BGZF *fp, bcf1_t *v)
+// Reads the fixed-length part of a BCF record: its two block lengths and the
+// six 32-bit integers that start the shared data
+static inline int bcf_read1_fixed(BGZF *fp, uint32_t x[8])
 {
-    uint32_t x[8];
     ssize_t ret;
     if ((ret = bgzf_read(fp, x, 32)) != 32) {
         if (ret == 0) return -1;
         return -2;
     }
+    return 0;
+}
+
+// Reads the remainder of a record whose fixed-length part x has been read
+static inline int bcf_read1_rest(BGZF *fp, bcf1_t *v, uint32_t x[8])
+{
     bcf_clear1(v);
     x[0] -= 24; // to exclude six 32-bit integers
     if (ks_resize(&v->shared, x[0]) != 0) return -2;
@@ -1035,6 +1042,14 @@ static inline int bcf_read1_core(BGZF *fp, bcf1_t *v)
     return 0;
 }
 
+static inline int bcf_read1_core(BGZF *fp, bcf1_t *v)
+{
+    uint32_t x[8];
+    int ret;
+    if ((ret = bcf_read1_fixed(fp, x)) < 0) return ret;
+    return bcf_read1_rest(fp, v, x);
+}
+
 #define bit_array_size(n) ((n)/8+1)
 #define bit_array_set(a,i)   ((a)[(i)/8] |=   1 << ((i)%8))
 #define bit_array_clear(a,i) ((a)[(i)/8] &= ~(1 << ((i)%8)))
@@ -1276,6 +1291,25 @@ int bcf_readrec(BGZF *fp, void *null, void *vv, int *tid, int *beg, int *end)
     return ret;
 }
 
+int bcf_skiprec(BGZF *fp, void *null, void *vv, int *tid, int *beg, int *end, int qtid, int qbeg)
+{
+    uint32_t x[8];
+    int32_t rid, pos, rlen;
+    int ret;
+    if ((ret = bcf_read1_fixed(fp, x)) < 0) return ret;
+    rid = x[2], pos = x[3], rlen = x[4];
+    if (rid == qtid && (int64_t) pos + rlen <= qbeg && x[0] >= 24) {
+        // Only the position is needed, so pass over the rest undecoded
+        size_t len = (size_t) x[0] - 24 + x[1];
+        if (bgzf_skip(fp, len) != len) return -2;
+        *tid = rid, *beg = pos, *end = pos + rlen;
+        return 0;
+    }
+    if ((ret = bcf_read1_rest(fp, (bcf1_t *) vv, x)) >= 0)
+        *tid = rid, *beg = pos, *end = pos + rlen;
+    return ret;
+}
+
 static inline void bcf1_sync_id(bcf1_t *line, kstring_t *str)
 {
     // single typed string
@@ -1524,6 +1558,11 @@ int bcf_write(htsFile *hfp, bcf_hdr_t *h, bcf1_t *v)
     if ( bgzf_write(fp, x, 32) != 32 ) return -1;
     if ( bgzf_write(fp, v->shared.s, v->shared.l) != v->shared.l ) return -1;
     if ( bgzf_write(fp, v->indiv.s, v->indiv.l) != v->indiv.l ) return -1;
+    if ( hfp->idx )
+    {
+        if ( bgzf_idx_push(fp, hfp->idx, v->rid, v->pos, v->pos + v->rlen, 1) < 0 )
+            return -1;
+    }
     return 0;
 }
 
@@ -2610,6 +2649,11 @@ int vcf_write(htsFile *fp, const bcf_hdr_t *h, bcf1_t *v)
         ret = bgzf_write(fp->fp.bgzf, fp->line.s, fp->line.l);
     else
         ret = hwrite(fp->fp.hfile, fp->line.s, fp->line.l);
+    if ( ret==fp->line.l && fp->idx )
+    {
+        if ( bgzf_idx_push(fp->fp.bgzf, fp->idx, v->rid, v->pos, v->pos + v->rlen, 1) < 0 )
+            return -1;
+    }
     return ret==fp->line.l ? 0 : -1;
 }
 
@@ -2677,6 +2721,81 @@ hts_idx_t *bcf_index_load2(const char *fn, const char *fnidx)
     return fnidx? hts_idx_load2(fn, fnidx) : bcf_index_load(fn);
 }
 
+// Sets the tabix meta-data of an index of a VCF file whose tids are the
+// header's contig ids, as tbx_set_meta() does for indexes built by tabix
+static int vcf_idx_set_meta(hts_idx_t *idx, const bcf_hdr_t *h)
+{
+    int i, n = h->n[BCF_DT_CTG];
+    size_t l_nm = 0, l;
+    uint8_t *meta;
+    uint32_t x[7];
+
+    for (i = 0; i < n; ++i)
+        l_nm += strlen(bcf_hdr_id2name(h, i)) + 1;
+    if (l_nm > INT32_MAX - 28) return -1;
+    memcpy(x, &tbx_conf_vcf, 24);
+    x[6] = l_nm;
+    if (!(meta = (uint8_t*)malloc(l_nm + 28))) return -1;
+    for (i = 0; i < 7; ++i)
+        u32_to_le(x[i], meta + 4 * i);
+    for (l = 28, i = 0; i < n; ++i) {
+        const char *name = bcf_hdr_id2name(h, i);
+        size_t len = strlen(name) + 1;
+        memcpy(meta + l, name, len);
+        l += len;
+    }
+    return hts_idx_set_meta(idx, l, meta, 0);
+}
+
+int bcf_idx_init(htsFile *fp, bcf_hdr_t *h, int min_shift, const char *fnidx)
+{
+    int n_lvls, fmt, is_vcf;
+    BGZF *bfp = fp->fp.bgzf;
+
+    is_vcf = fp->format.format == vcf || fp->format.format == text_format;
+    if (!fp->is_write || fp->format.compression != bgzf
+        || !(is_vcf || fp->format.format == bcf || fp->format.format == binary_format)) {
+        hts_log_error("Indexing on the fly is only supported when writing BCF or bgzipped VCF");
+        return -1;
+    }
+    if (fp->idx) {
+        hts_log_error("An index is already being built for %s", fp->fn);
+        return -1;
+    }
+    if (!fnidx && strcmp(fp->fn, "-") == 0) {
+        hts_log_error("An index filename is required when writing to stdout");
+        return -1;
+    }
+
+    if (is_vcf) {
+        if (min_shift > 0) n_lvls = (TBX_MAX_SHIFT - min_shift + 2) / 3, fmt = HTS_FMT_CSI;
+        else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_TBI;
+    } else {
+        int64_t max_len = 0, s;
+        int i;
+        if (min_shift <= 0) min_shift = 14; // BCF is always indexed by CSI
+        for (i = 0; i < h->n[BCF_DT_CTG]; ++i)
+            if (h->id[BCF_DT_CTG][i].val && max_len < h->id[BCF_DT_CTG][i].val->info[0])
+                max_len = h->id[BCF_DT_CTG][i].val->info[0];
+        if ( !max_len ) max_len = ((int64_t)1<<31) - 1;  // In case contig line is broken.
+        max_len += 256;
+        for (n_lvls = 0, s = 1<<min_shift; max_len > s; ++n_lvls, s <<= 3);
+        fmt = HTS_FMT_CSI;
+    }
+
+    // Flush the header so the offset of the first record is known
+    if (bgzf_flush(bfp) < 0) return -1;
+    fp->idx = hts_idx_init(h->n[BCF_DT_CTG], fmt, bgzf_tell(bfp), min_shift, n_lvls);
+    if (!fp->idx) return -1;
+    if ((is_vcf && vcf_idx_set_meta(fp->idx, h) < 0)
+        || (fnidx && !(fp->fnidx = strdup(fnidx)))) {
+        hts_idx_destroy(fp->idx);
+        fp->idx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
 int bcf_index_build3(const char *fn, const char *fnidx, int min_shift, int n_threads)
 {
     htsFile *fp;
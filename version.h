@@ -0,0 +1 @@
+#define HTS_VERSION "a440089-dirty"